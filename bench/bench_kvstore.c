@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include "kvstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+/* Benchmark driver. For every key count and value size it runs each
+ * workload against a fresh database and prints one JSON object per line:
+ * workload, engine, keys, value_size, ops, seconds, ops_per_sec and the
+ * p50/p99/p999/max latency in microseconds. Progress goes to stderr, so
+ * stdout can be kept and compared between versions. */
+
+#define ZIPF_THETA 0.99
+
+static const char *usage =
+    "usage: bench_kvstore [-k keys,...] [-v sizes,...] [-e engine] [-d dir]\n"
+    "  -k  key counts (default 1000000)\n"
+    "  -v  value sizes in bytes (default 100)\n"
+    "  -e  pages, mmap, ordered, direct or log (default pages)\n"
+    "  -d  directory for the database files (default .)\n";
+
+static const struct {
+    const char *name;
+    int flags;
+} engines[] = {
+    { "pages", 0 },
+    { "mmap", DB_OPEN_MMAP },
+    { "ordered", DB_OPEN_ORDERED },
+    { "direct", DB_OPEN_DIRECT },
+    { "log", DB_OPEN_LOG },
+};
+
+struct bench {
+    const char *engine;
+    int flags;
+    char path[4096];
+    uint64_t keys;
+    uint32_t value_size;
+    uint8_t *val;
+    uint64_t rng;
+    uint64_t *ns;
+    size_t nsamples;
+};
+
+/* Zipfian ranks as in YCSB (Gray et al., "Quickly generating billion-record
+ * synthetic databases"). Ranks are scrambled over the key space so the hot
+ * keys are not also neighbours on disk. */
+struct zipf {
+    uint64_t n;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+static void die(const char *what) {
+    fprintf(stderr, "bench_kvstore: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_rand(struct bench *b) {
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    return b->rng * 0x2545f4914f6cdd1dull;
+}
+
+static double rand_unit(struct bench *b) {
+    return (double)(next_rand(b) >> 11) / (double)(1ull << 53);
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    return x ^ (x >> 33);
+}
+
+static void zipf_init(struct zipf *z, uint64_t n) {
+    z->n = n;
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double)i, ZIPF_THETA);
+    }
+    double zeta2 = 1.0 + pow(0.5, ZIPF_THETA);
+    z->alpha = 1.0 / (1.0 - ZIPF_THETA);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - ZIPF_THETA)) /
+             (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(struct bench *b, const struct zipf *z) {
+    double u = rand_unit(b);
+    double uz = u * z->zetan;
+    uint64_t rank;
+    if (uz < 1.0) {
+        rank = 0;
+    } else if (uz < 1.0 + pow(0.5, ZIPF_THETA)) {
+        rank = 1;
+    } else {
+        rank = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    }
+    if (rank >= z->n) {
+        rank = z->n - 1;
+    }
+    return mix64(rank) % z->n;
+}
+
+static int make_key(uint8_t *buf, uint64_t i) {
+    return snprintf((char *)buf, 24, "key%016llx", (unsigned long long)i);
+}
+
+static void unlink_db(const char *path) {
+    static const char *suffixes[] = { "", ".idx", ".idx.tmp", ".wal" };
+    char buf[4200];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(buf, sizeof(buf), "%s%s", path, suffixes[i]);
+        unlink(buf);
+    }
+    for (unsigned id = 0;; id++) {
+        snprintf(buf, sizeof(buf), "%s.seg.%u", path, id);
+        if (unlink(buf) != 0 && id > 0) {
+            break;
+        }
+    }
+}
+
+static struct db *open_db(struct bench *b) {
+    struct db *db = db_open_flags(b->path, b->flags);
+    if (!db) {
+        die("db_open");
+    }
+    return db;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double q) {
+    size_t i = (size_t)(q * (double)n);
+    return (double)sorted[i < n ? i : n - 1] / 1000.0;
+}
+
+static void start(struct bench *b, const char *workload) {
+    fprintf(stderr, "%s keys=%llu value_size=%u %s...\n", b->engine,
+            (unsigned long long)b->keys, b->value_size, workload);
+    b->nsamples = 0;
+}
+
+static void record(struct bench *b, uint64_t t0) {
+    b->ns[b->nsamples++] = now_ns() - t0;
+}
+
+static void report(struct bench *b, const char *workload, uint64_t t0) {
+    double seconds = (double)(now_ns() - t0) / 1e9;
+    size_t n = b->nsamples;
+    qsort(b->ns, n, sizeof(*b->ns), compare_u64);
+    printf("{\"workload\":\"%s\",\"engine\":\"%s\",\"keys\":%llu,"
+           "\"value_size\":%u,\"ops\":%zu,\"seconds\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+           "\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+           workload, b->engine, (unsigned long long)b->keys, b->value_size, n,
+           seconds, seconds > 0 ? (double)n / seconds : 0.0,
+           percentile_us(b->ns, n, 0.50), percentile_us(b->ns, n, 0.99),
+           percentile_us(b->ns, n, 0.999), (double)b->ns[n - 1] / 1000.0);
+    fflush(stdout);
+}
+
+static void put_keys(struct bench *b, struct db *db, const char *workload,
+                     const uint32_t *order) {
+    uint8_t key[24];
+    start(b, workload);
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < b->keys; i++) {
+        uint64_t k = order ? order[i] : i;
+        int klen = make_key(key, k);
+        uint64_t t = now_ns();
+        if (db_put(db, key, klen, b->val, b->value_size) != 0) {
+            die("db_put");
+        }
+        record(b, t);
+    }
+    report(b, workload, t0);
+}
+
+static void get_keys(struct bench *b, struct db *db, const char *workload,
+                     const struct zipf *z) {
+    uint8_t key[24];
+    start(b, workload);
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < b->keys; i++) {
+        uint64_t k = z ? zipf_next(b, z) : next_rand(b) % b->keys;
+        int klen = make_key(key, k);
+        uint64_t t = now_ns();
+        if (db_get_into(db, key, klen, b->val, b->value_size) != b->value_size) {
+            die("db_get_into");
+        }
+        record(b, t);
+    }
+    report(b, workload, t0);
+}
+
+/* Nine overwrites of a zipfian key for every get. */
+static void overwrite_mix(struct bench *b, struct db *db, const struct zipf *z) {
+    uint8_t key[24];
+    start(b, "mix_overwrite");
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < b->keys; i++) {
+        int klen = make_key(key, zipf_next(b, z));
+        uint64_t t = now_ns();
+        if (i % 10 == 9) {
+            if (db_get_into(db, key, klen, b->val, b->value_size) < 0) {
+                die("db_get_into");
+            }
+        } else if (db_put(db, key, klen, b->val, b->value_size) != 0) {
+            die("db_put");
+        }
+        record(b, t);
+    }
+    report(b, "mix_overwrite", t0);
+}
+
+/* Deletes the first half of a random permutation of the keys. */
+static void delete_keys(struct bench *b, struct db *db, const uint32_t *order) {
+    uint8_t key[24];
+    start(b, "delete_random");
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < b->keys / 2; i++) {
+        int klen = make_key(key, order[i]);
+        uint64_t t = now_ns();
+        if (db_delete(db, key, klen) != 0) {
+            die("db_delete");
+        }
+        record(b, t);
+    }
+    report(b, "delete_random", t0);
+}
+
+static void time_open(struct bench *b, const char *workload) {
+    start(b, workload);
+    uint64_t t0 = now_ns();
+    struct db *db = open_db(b);
+    record(b, t0);
+    report(b, workload, t0);
+    db_close(db);
+}
+
+static void run(struct bench *b) {
+    uint32_t *order = malloc(b->keys * sizeof(*order));
+    b->ns = malloc(b->keys * sizeof(*b->ns));
+    b->val = malloc(b->value_size ? b->value_size : 1);
+    if (!order || !b->ns || !b->val) {
+        die("malloc");
+    }
+    for (uint32_t i = 0; i < b->value_size; i++) {
+        b->val[i] = (uint8_t)(i * 31 + 7);
+    }
+    for (uint64_t i = 0; i < b->keys; i++) {
+        order[i] = (uint32_t)i;
+    }
+    for (uint64_t i = b->keys; i > 1; i--) {
+        uint64_t j = next_rand(b) % i;
+        uint32_t t = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = t;
+    }
+    struct zipf z;
+    zipf_init(&z, b->keys);
+
+    unlink_db(b->path);
+    struct db *db = open_db(b);
+    put_keys(b, db, "put_seq", NULL);
+    get_keys(b, db, "get_uniform", NULL);
+    get_keys(b, db, "get_zipf", &z);
+    overwrite_mix(b, db, &z);
+    delete_keys(b, db, order);
+    db_close(db);
+
+    /* A clean reopen loads the index snapshot; without it the file is
+     * scanned. */
+    time_open(b, "open_snapshot");
+    char idx[4200];
+    snprintf(idx, sizeof(idx), "%s.idx", b->path);
+    unlink(idx);
+    time_open(b, "open_scan");
+
+    unlink_db(b->path);
+    db = open_db(b);
+    put_keys(b, db, "put_random", order);
+    db_close(db);
+    unlink_db(b->path);
+
+    free(b->val);
+    free(b->ns);
+    free(order);
+}
+
+/* Parses a comma-separated list of positive numbers. */
+static size_t parse_list(const char *arg, uint64_t *out, size_t max) {
+    size_t n = 0;
+    char *end;
+    while (*arg && n < max) {
+        errno = 0;
+        unsigned long long v = strtoull(arg, &end, 10);
+        if (errno || end == arg || v == 0 || (*end && *end != ',')) {
+            return 0;
+        }
+        out[n++] = v;
+        arg = *end ? end + 1 : end;
+    }
+    return *arg ? 0 : n;
+}
+
+int main(int argc, char **argv) {
+    uint64_t keys[16] = { 1000000 }, sizes[16] = { 100 };
+    size_t nkeys = 1, nsizes = 1;
+    const char *dir = ".";
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.engine = "pages";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "k:v:e:d:")) != -1) {
+        switch (opt) {
+        case 'k':
+            nkeys = parse_list(optarg, keys, 16);
+            break;
+        case 'v':
+            nsizes = parse_list(optarg, sizes, 16);
+            break;
+        case 'e':
+            b.engine = NULL;
+            for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+                if (strcmp(optarg, engines[i].name) == 0) {
+                    b.engine = engines[i].name;
+                    b.flags = engines[i].flags;
+                }
+            }
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fputs(usage, stderr);
+            return 2;
+        }
+    }
+    if (optind != argc || nkeys == 0 || nsizes == 0 || !b.engine) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    for (size_t i = 0; i < nkeys; i++) {
+        if (keys[i] > UINT32_MAX) {
+            fputs("bench_kvstore: at most 2^32 - 1 keys\n", stderr);
+            return 2;
+        }
+    }
+    for (size_t i = 0; i < nsizes; i++) {
+        if (sizes[i] > MAX_VALUE_SIZE) {
+            fputs("bench_kvstore: value size too large\n", stderr);
+            return 2;
+        }
+    }
+
+    snprintf(b.path, sizeof(b.path), "%s/bench.db", dir);
+    b.rng = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < nkeys; i++) {
+        for (size_t j = 0; j < nsizes; j++) {
+            b.keys = keys[i];
+            b.value_size = (uint32_t)sizes[j];
+            run(&b);
+        }
+    }
+    return 0;
+}
@@ -3,16 +3,31 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-#define PAGE_SIZE 4096
+/* A file's page size is chosen when it is created (db_open_opts) and kept
+ * in its header: a power of two from MIN_PAGE_SIZE to MAX_PAGE_SIZE. Page
+ * offsets are 16 bits, which caps it at 32K. */
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE     4096
+#define MAX_PAGE_SIZE     32768
 #define MAGIC 0xDB01
-#define VERSION 1
+#define VERSION 2
 
 #define PAGE_TYPE_EMPTY   0
 #define PAGE_TYPE_DATA    1
 #define PAGE_TYPE_DELETED 2
+#define PAGE_TYPE_OVERFLOW 3
+#define PAGE_TYPE_BTREE_LEAF  4
+#define PAGE_TYPE_BTREE_INNER 5
+#define PAGE_TYPE_FREEMAP     6
 
-/* On-disk structures (__attribute__((packed)) = no compiler padding) */
+#define ENGINE_PAGES 0
+#define ENGINE_LOG   1
+
+/* On-disk structures (__attribute__((packed)) = no compiler padding). The
+ * header fills MIN_PAGE_SIZE bytes at the start of page 0. */
 
 struct db_header {
     uint32_t magic;
@@ -20,51 +35,970 @@ struct db_header {
     uint32_t page_size;
     uint32_t num_pages;
     uint64_t next_free_page;
-    uint64_t free_list_head;
-    uint8_t reserved[4064];
+    uint64_t free_map_page;
+    uint64_t generation;
+    uint64_t index_generation;
+    uint64_t checkpoint_lsn;
+    uint64_t btree_root;
+    uint64_t btree_generation;
+    uint32_t engine;
+    uint32_t log_next_segment;
+    uint64_t free_map_generation;
+    uint32_t free_map_pages;
+    uint64_t dict_page;
+    uint32_t dict_len;
+    uint32_t dict_id;
+    uint64_t hash_seed;
+    uint8_t reserved[3980];
 } __attribute__((packed));
 
+/* checksum is the page's CRC32C, taken with the field itself as zero; 0
+ * marks a page that was never stamped. */
 struct page_header {
     uint32_t page_type;
     uint32_t checksum;
     uint64_t reserved;
 } __attribute__((packed));
 
-/* Hash table for in-memory indexing */
+/* Data pages are slotted: the slot directory grows up from just after the
+ * headers and record bytes are packed down from the end of the page. A slot
+ * with offset 0 is unused. Each record is key_len, key, val_len, val. */
 
-#define HASH_TABLE_SIZE 1024
+struct data_page_header {
+    uint16_t num_slots;
+    uint16_t data_start;
+    uint16_t free_bytes;
+    uint16_t unused;
+} __attribute__((packed));
 
-struct hash_entry {
-    uint8_t *key;
+struct slot {
+    uint16_t offset;
+    uint16_t length;
+} __attribute__((packed));
+
+#define DATA_PAGE_HEADERS (sizeof(struct page_header) + \
+                           sizeof(struct data_page_header))
+#define MAX_RECORD_SIZE(page_size) \
+    ((page_size) - DATA_PAGE_HEADERS - sizeof(struct slot))
+
+/* Values whose record would not fit in a data page live in an extent of
+ * contiguous overflow pages, each starting with a page_header, and the
+ * record holds an overflow_ref in place of the value. Such a record's
+ * val_len is the value's full length with VAL_OVERFLOW set. */
+
+#define VAL_OVERFLOW       0x80000000u
+#define MAX_VALUE_SIZE     (VAL_OVERFLOW - 1)
+
+/* An inline value stored LZ4-compressed has VAL_COMPRESSED set in val_len,
+ * which is then the value's raw length, and VAL_DICT if it was compressed
+ * against the file's dictionary. The compressed bytes fill the rest of the
+ * record. Neither bit is set together with VAL_OVERFLOW. */
+#define VAL_COMPRESSED     0x40000000u
+#define VAL_DICT           0x20000000u
+
+/* A record written by db_put_ttl has KEY_EXPIRES set in key_len, and its
+ * last 8 bytes are when the key expires, in milliseconds since the Unix
+ * epoch. */
+#define KEY_EXPIRES        0x80000000u
+#define OVERFLOW_PAGE_DATA(page_size) ((page_size) - sizeof(struct page_header))
+
+struct overflow_ref {
+    uint64_t first_page;
+    uint32_t num_pages;
+} __attribute__((packed));
+
+/* B+tree pages, for DB_OPEN_ORDERED. The node header is followed by
+ * num_keys cell offsets in key order, and cells are packed down from the end
+ * of the page. A leaf cell is key_len (u16) then the key. An internal cell is
+ * a child page number, key_len and key; the child holds keys >= that key,
+ * and keys below the first cell live under first_child. Leaves are chained
+ * through next in key order. The tree is only trusted while btree_generation
+ * matches the header's generation; otherwise it is rebuilt from the index. */
+
+#define BTREE_MAX_KEY 1024
+
+struct btree_node {
+    uint16_t num_keys;
+    uint16_t data_start;
+    uint16_t level;
+    uint16_t unused;
+    uint64_t next;
+    uint64_t first_child;
+} __attribute__((packed));
+
+#define BTREE_HEADERS (sizeof(struct page_header) + sizeof(struct btree_node))
+
+/* Free pages are tracked in memory (struct free_map) and saved at each
+ * checkpoint to an extent of free_map_pages pages starting at free_map_page:
+ * after its page_header, page i holds bits [i * FREE_MAP_BITS, ...) of the
+ * set, one per page of the file, 1 meaning free. Like the index snapshot it
+ * is only trusted while free_map_generation matches the header's
+ * generation; otherwise free pages are found by the page scan. */
+
+#define FREE_MAP_BITS(page_size) (((page_size) - sizeof(struct page_header)) * 8)
+
+/* Index snapshot, kept next to the data file as "<path>.idx". It holds the
+ * free bytes of every page followed by one entry + key per indexed record,
+ * and is only trusted when its generation matches both header fields. A
+ * compact index writes key_len INDEX_NO_KEY and the key's hash instead.
+ * Last come the timer wheel's timers: a u64 count, then each one's hash
+ * and expiry. */
+
+#define INDEX_MAGIC  0x1DB1
+#define INDEX_NO_KEY UINT32_MAX
+
+struct index_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    uint64_t num_entries;
+    uint64_t num_pages;
+} __attribute__((packed));
+
+struct index_snapshot_entry {
     uint32_t key_len;
     uint64_t page_num;
-    struct hash_entry *next;
+    uint16_t slot;
+} __attribute__((packed));
+
+/* Write-ahead log, kept next to the data file as "<path>.wal". Every put
+ * and delete is appended as a record and made durable before any data page
+ * changes; db_open replays records newer than header.checkpoint_lsn. The
+ * checksum covers the rest of the header and the payload (key, then value)
+ * and marks where a torn tail begins. */
+
+#define WAL_PUT     1
+#define WAL_DELETE  2
+#define WAL_PUT_TTL 3       /* a put whose value starts with its expiry */
+#define WAL_MORE    0x100   /* set on every record of a batch but the last */
+
+struct wal_record_header {
+    uint32_t checksum;
+    uint32_t type;
+    uint64_t lsn;
+    uint32_t key_len;
+    uint32_t val_len;
+} __attribute__((packed));
+
+/* Hash table for in-memory indexing: open addressing with Robin Hood
+ * probing. meta[] packs each bucket's probe distance (0 = empty) with an
+ * 8-bit tag from the hash, so a probe walks a dense array and only touches
+ * entries whose tag matches. An entry keeps the key's full 64-bit hash, so
+ * only keys whose hashes match are compared and growing never rehashes a
+ * key. Short keys are stored inline in the entry.
+ * Growing allocates a table twice the size and drains the old one a few
+ * buckets per insert/remove instead of rehashing everything at once. */
+
+#define HASH_TABLE_INITIAL 1024
+#define HASH_INLINE_KEY    16
+
+struct hash_entry {
+    uint64_t hash;
+    uint64_t page_num;
+    uint32_t key_len;
+    uint16_t slot;
+    union {
+        uint8_t bytes[HASH_INLINE_KEY];
+        uint8_t *ptr;
+    } key;
+};
+
+struct hash_tab {
+    uint32_t *meta;
+    struct hash_entry *entries;
+    uint64_t mask;
+    uint64_t count;
+};
+
+/* Keys too long to inline live in their table's arena: ARENA_BLOCK-sized
+ * blocks carved into slots rounded up to ARENA_ALIGN bytes, with a free
+ * list per slot size so a removed key's slot goes to the next key of that
+ * size. Keys over ARENA_MAX_KEY are malloc'd on their own, counted in large.
+ * The blocks are only freed, all at once, with the table. */
+
+#define ARENA_BLOCK   (64 * 1024)
+#define ARENA_ALIGN   16
+#define ARENA_MAX_KEY 1024
+
+struct arena_block;
+
+struct key_arena {
+    struct arena_block *blocks;
+    uint8_t *next;
+    size_t left;
+    uint64_t large;
+    void *free[ARENA_MAX_KEY / ARENA_ALIGN + 1];
 };
 
 struct hash_table {
-    struct hash_entry *buckets[HASH_TABLE_SIZE];
+    struct hash_tab cur;
+    struct hash_tab old;
+    uint64_t migrate_pos;
+    struct key_arena arena;
+};
+
+/* With DB_OPEN_COMPACT_INDEX a table keeps no keys, only each key's full
+ * hash and location, in the same Robin Hood layout, for 18 bytes a bucket
+ * whatever the key length. Keys that share a hash are told apart by the
+ * key in their records. */
+
+struct fp_entry {
+    uint64_t hash;
+    uint32_t page_num;
+    uint16_t slot;
+} __attribute__((packed));
+
+struct fp_tab {
+    uint32_t *meta;
+    struct fp_entry *entries;
+    uint64_t mask;
+    uint64_t count;
+};
+
+struct fp_table {
+    struct fp_tab cur;
+    struct fp_tab old;
+    uint64_t migrate_pos;
+};
+
+/* The index is split into INDEX_SHARDS tables by key hash. Readers take the
+ * shard's rwlock shared just long enough to copy a location out; writers to
+ * a shard serialize on write_lock for the whole operation and take the
+ * rwlock exclusively only while changing the table. */
+
+#define INDEX_SHARD_BITS 4
+#define INDEX_SHARDS (1 << INDEX_SHARD_BITS)
+
+struct index_shard {
+    pthread_rwlock_t lock;
+    pthread_mutex_t write_lock;
+    struct hash_table *table;
+    struct fp_table *fps;
+};
+
+/* Free space per data page, kept as a max-tree so the first page with room
+ * for a record is found in O(log n). Leaf i holds the free bytes of page i. */
+
+struct space_map {
+    uint16_t *tree;
+    uint64_t leaves;
+};
+
+/* Group commit: writers append to buf under lock and wait for their LSN to
+ * become durable. Whoever finds no flush in progress becomes the leader,
+ * swaps buf with spare, and writes and syncs everything appended so far with
+ * one write() and one fdatasync() while later writers keep appending. */
+
+struct wal {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    uint8_t *spare;
+    size_t spare_cap;
+    uint64_t next_lsn;
+    uint64_t durable_lsn;
+    uint64_t size;
+    uint64_t tail;         /* file offset of the next record appended */
+    int sync;              /* DB_SYNC_* */
+    int flushing;
+    int err;
+    uint64_t writes;       /* for db_stats, updated under lock */
+    uint64_t written;
+    uint64_t syncs;
+};
+
+/* Buffer pool of page-sized frames in front of the data file. Frames are
+ * pinned while in use and written back when evicted or flushed. Eviction is
+ * 2Q: pages seen once sit in the a1in FIFO, and only pages touched again
+ * after leaving it (remembered by number in the ghost ring) are promoted to
+ * the am LRU, so a one-off sweep cannot flush the hot set.
+ *
+ * The pool is split into POOL_SHARDS by page number, each with its own lock
+ * over the lists, pins and dirty bits. A frame's latch guards its contents:
+ * shared to read a record, exclusive to change the page. refs counts
+ * outstanding db_refs; while it is non-zero the page is never compacted or
+ * freed, so referenced bytes stay put. With DB_OPEN_DIRECT each shard also
+ * has an aligned staging page, under stage_lock, that write-back stamps a
+ * frame's checksum into on its way to the file. */
+
+#ifndef BUFFER_POOL_PAGES
+#define BUFFER_POOL_PAGES 1024
+#endif
+#define POOL_MIN_PAGES 64   /* a smaller cache_size is raised to this */
+
+#define POOL_SHARD_BITS 3
+#define POOL_SHARDS (1 << POOL_SHARD_BITS)
+
+#define FRAME_FREE 0
+#define FRAME_A1IN 1
+#define FRAME_AM   2
+
+/* A frame being read in is pinned and cached with loading set and its
+ * latch held exclusive by the loader, so pinners of its page wait on the
+ * latch rather than the pool's lock. If the read fails the frame leaves
+ * the page map with load_err set, for its waiters to return; the last of
+ * them frees it. */
+struct frame {
+    uint64_t page_num;
+    uint32_t pins;
+    uint8_t dirty;
+    uint8_t queue;
+    uint8_t loading;
+    int load_err;
+    struct frame *prev;
+    struct frame *next;
+    uint8_t *data;
+    pthread_rwlock_t latch;
+    _Atomic uint32_t refs;
+};
+
+struct frame_list {
+    struct frame *head;
+    struct frame *tail;
+    size_t len;
+};
+
+struct page_map {
+    uint64_t *keys;
+    uint32_t *vals;
+    size_t mask;
+};
+
+struct buffer_pool {
+    pthread_mutex_t lock;
+    struct frame *frames;
+    uint8_t *memory;
+    size_t nframes;
+    size_t a1in_max;
+    struct page_map table;
+    struct frame_list free;
+    struct frame_list a1in;
+    struct frame_list am;
+    uint64_t *ghosts;
+    size_t ghost_cap;
+    size_t ghost_head;
+    size_t ghost_len;
+    struct page_map ghost_set;
+    uint8_t *stage;
+    pthread_mutex_t stage_lock;
+};
+
+/* With DB_OPEN_DIRECT, extents are written and read through aligned buffers
+ * of OVERFLOW_STAGE_PAGES pages, made at open. A transfer waits for one of
+ * the OVERFLOW_STAGE_BUFS to be free. */
+#define OVERFLOW_STAGE_PAGES 64
+#define OVERFLOW_STAGE_BUFS  4
+
+struct stage_set {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    uint8_t *memory;
+    uint8_t *free[OVERFLOW_STAGE_BUFS];
+    int nfree;
 };
 
 /* Runtime handle */
 
+/* Read-only view of the data file for DB_OPEN_MMAP. Growing the view maps
+ * a larger region and keeps the old ones until close, so a reader still
+ * using one is never left with a dangling pointer. Only the first
+ * valid_pages pages are backed by the file; the rest is headroom for later
+ * growth. cur is published before valid_pages, so a reader that loads them
+ * in the opposite order never indexes past the region it sees. */
+
+struct map_region {
+    uint8_t *base;
+    size_t size;
+    struct map_region *next;
+};
+
+struct file_map {
+    pthread_mutex_t lock;
+    struct map_region *_Atomic cur;
+    _Atomic uint64_t valid_pages;
+};
+
+/* The free-page set: bit n of bits is set while page n is free. It always
+ * covers every page below header.next_free_page. A single page is taken
+ * next-fit from hint, so pages allocated in a row tend to be adjacent;
+ * extents take the first free run long enough. */
+
+struct free_map {
+    uint64_t *bits;
+    uint64_t words;
+    uint64_t count;
+    uint64_t hint;
+};
+
+/* Ordered index for DB_OPEN_ORDERED. lock is taken shared to walk the tree
+ * and exclusively to change it; version counts changes, so an iterator can
+ * tell whether the leaf chain it stopped in is still current. */
+
+struct btree {
+    pthread_rwlock_t lock;
+    uint64_t version;
+};
+
+/* Log-structured engine for DB_OPEN_LOG. Records are appended, in the WAL
+ * record format, to segment files "<path>.seg.<id>", and the index maps each
+ * key to (segment id << LOG_OFFSET_BITS | offset). db->wal appends to the
+ * active (last) segment with group commit. lock guards the segment array:
+ * shared to read through a segment or count its records, exclusive to add or
+ * drop one. A background thread copies the live records of mostly-dead
+ * sealed segments to the active one and deletes them. */
+
+#ifndef LOG_SEGMENT_SIZE
+#define LOG_SEGMENT_SIZE (16u << 20)
+#endif
+#define LOG_OFFSET_BITS 40
+
+struct log_segment {
+    uint32_t id;
+    int fd;
+    _Atomic uint64_t records;
+    _Atomic uint64_t dead;
+};
+
+struct log_engine {
+    pthread_rwlock_t lock;
+    struct log_segment *segs;
+    size_t nsegs;
+    size_t cap;
+    pthread_mutex_t compact_lock;
+    pthread_cond_t compact_cond;
+    pthread_t compactor;
+    uint32_t active;
+    int compactor_running;
+    int stop;
+};
+
+/* Runtime statistics. Each thread adds to one of STATS_STRIPES
+ * cache-line-aligned stripes with relaxed atomics, so counting on a hot path
+ * rarely touches a line another thread is using; db_stats sums the stripes.
+ * hist[op][i] counts ops that took a time of bit length i in nanoseconds,
+ * i.e. [2^(i-1), 2^i) ns. */
+
+#define STATS_STRIPES   16
+#define DB_HIST_BUCKETS 64
+
+#define DB_OP_GET        0
+#define DB_OP_PUT        1
+#define DB_OP_DELETE     2
+#define DB_OP_ALLOC_PAGE 3
+#define DB_OP_FREE_PAGE  4
+#define DB_OPS           5
+
+#define STAT_READS       0
+#define STAT_READ_BYTES  1
+#define STAT_WRITES      2
+#define STAT_WRITE_BYTES 3
+#define STAT_POOL_HITS   4
+#define STAT_POOL_MISSES 5
+#define STAT_COUNTERS    6
+
+struct stats_stripe {
+    _Atomic uint64_t counters[STAT_COUNTERS];
+    _Atomic uint64_t ops[DB_OPS];
+    _Atomic uint64_t total_ns[DB_OPS];
+    _Atomic uint64_t hist[DB_OPS][DB_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct db_trace_event;
+typedef void (*db_trace_fn)(void *ctx, const struct db_trace_event *ev);
+
+struct db_stats_state {
+    struct stats_stripe *stripes;
+    uint64_t open_ns;
+    uint64_t recovery_ns;
+    int recovery_scanned;
+    uint64_t recovery_bad_pages;
+    _Atomic(db_trace_fn) trace;
+    void *trace_ctx;
+};
+
+/* The compression dictionary, loaded at open and set once. table is the
+ * LZ4 match table primed with data, read for matches into it as each value
+ * is compressed. */
+#define DICT_MAX_SIZE   65536
+#define LZ4_HASH_LOG    12
+
+struct value_dict {
+    uint32_t len;
+    uint32_t id;
+    uint32_t table[1 << LZ4_HASH_LOG];
+    uint8_t data[];
+};
+
+/* Old values kept for snapshots (db_snapshot_create). While one is open, a
+ * write first copies the value it replaces or deletes (or notes that the
+ * key was absent) into a version tagged with the write's seq; a snapshot
+ * taken at seq s reads a key's oldest version with a later seq if there is
+ * one, and the current value otherwise. Writers push versions onto bucket
+ * chains with CAS and readers walk them without locks. Versions no open
+ * snapshot needs are unlinked under the db lock held exclusively, then,
+ * with the lock dropped, freed once every reader counted in readers[] when
+ * the epoch was bumped has left. reclaim_lock makes those waits take turns,
+ * so each starts after the last has seen its parity drain. */
+#define VERSION_BUCKETS (1 << 14)
+
+struct version {
+    struct version *_Atomic next;
+    uint64_t hash;
+    uint64_t seq;
+    uint32_t key_len;
+    uint32_t val_len;
+    int absent;
+    uint64_t expires;          /* as the record's, or 0 */
+    struct version *retired;   /* while waiting to be freed */
+    uint8_t data[];            /* key, then value */
+};
+
+struct db_snapshot;
+
+struct version_store {
+    struct version *_Atomic *buckets;
+    struct db_snapshot *snapshots;   /* open ones, newest first */
+    _Atomic uint64_t open;
+    _Atomic uint64_t seq;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t epoch;
+    _Atomic uint64_t readers[2];
+    pthread_mutex_t reclaim_lock;
+};
+
+/* Online backup (db_backup). While one runs, each write of a page of the
+ * file first copies the page's old image to the backup, unless it has been
+ * copied already, so the backup ends up as the file stood when it began.
+ * copied has a bit per page below pages. lock guards it and the copying
+ * and is taken after every other lock. */
+
+struct backup_state {
+    pthread_mutex_t lock;
+    _Atomic int active;
+    int fd;
+    int err;
+    uint64_t pages;
+    uint64_t *copied;
+};
+
+/* Keys that expire (db_put_ttl), filed by expiry in a hierarchical timer
+ * wheel of TTL_LEVELS levels of TTL_SLOTS slots, where a slot of level l
+ * spans TTL_SLOTS^l ticks. A timer sits in the lowest level whose slot for
+ * it is still ahead, and as the wheel turns to a slot of a higher level
+ * its timers are cascaded down. A timer only names its key by hash and may
+ * be stale; db_expire checks the record. Timers come in blocks and go back
+ * to a free list. lock guards the wheel and is taken after every other
+ * lock. */
+#define TTL_TICK_MS   16
+#define TTL_SLOT_BITS 6
+#define TTL_SLOTS     (1 << TTL_SLOT_BITS)
+#define TTL_LEVELS    6
+
+struct ttl_timer {
+    uint64_t hash;
+    uint64_t expires;
+    struct ttl_timer *next;
+};
+
+struct ttl_block;
+
+struct ttl_wheel {
+    pthread_mutex_t lock;
+    uint64_t tick;                 /* turned to, in ticks since the epoch */
+    uint64_t pending;              /* timers in slots */
+    struct ttl_timer *slots[TTL_LEVELS][TTL_SLOTS];
+    struct ttl_timer *due;         /* expired, for db_expire */
+    struct ttl_timer *free;
+    struct ttl_block *blocks;
+};
+
+typedef void (*db_change_fn)(void *ctx, const void *records, size_t len);
+
+/* Locking, outermost first: lock (shared by writers, exclusive for
+ * checkpoints, snapshots and vacuum steps), an index shard's write_lock,
+ * btree.lock, a frame latch, header_lock (header, space map and free map),
+ * then a pool shard's lock.
+ * Readers take neither lock nor write_lock. writebacks_started/done
+ * bracket every write of a cached page to the file, which tells mapped
+ * readers their view was stable. */
+
 struct db {
     int fd;
+    int flags;
+    uint32_t page_size;
+    pthread_rwlock_t lock;
+    pthread_mutex_t header_lock;
     struct db_header header;
     char *filepath;
-    struct hash_table *index;
+    struct index_shard index[INDEX_SHARDS];
+    struct space_map space;
+    struct free_map free;
+    int snapshot_valid;
+    struct wal wal;
+    struct buffer_pool pool[POOL_SHARDS];
+    struct stage_set stage;
+    _Atomic uint64_t writebacks_started;
+    _Atomic uint64_t writebacks_done;
+    struct file_map map;
+    struct btree btree;
+    struct log_engine log;
+    struct db_stats_state stats;
+    struct value_dict *_Atomic dict;
+    struct version_store versions;
+    struct backup_state backup;
+    struct ttl_wheel ttl;
+    _Atomic(db_change_fn) change_fn;
+    void *change_ctx;
 };
 
 /* API */
 
+/* A handle may be shared between threads: every call but db_close is safe
+ * to make concurrently. Readers never wait for writers of other pages. */
+
+/* db_open_flags flags. DB_OPEN_MMAP serves reads of pages that are not in
+ * the buffer pool straight from a shared mapping of the data file instead of
+ * pread. Writes still go through the pool, so the mapping never sees a page
+ * the pool has not written back. */
+#define DB_OPEN_MMAP 0x1
+
+/* DB_OPEN_ORDERED also keeps every key in an on-disk B+tree, for the
+ * iterator below. Keys are then limited to BTREE_MAX_KEY bytes. */
+#define DB_OPEN_ORDERED 0x2
+
+/* DB_OPEN_LOG selects the log-structured engine: writes append to segment
+ * files instead of updating pages in place, and dead records are reclaimed
+ * in the background. A file keeps the engine it was created with. It cannot
+ * be combined with DB_OPEN_MMAP or DB_OPEN_ORDERED, and db_get_ref fails
+ * with ENOTSUP. */
+#define DB_OPEN_LOG 0x4
+
+/* DB_OPEN_DIRECT opens the data file with O_DIRECT (F_NOCACHE on macOS), so
+ * its pages are cached once, in the buffer pool, and not again by the
+ * kernel. Every transfer is then whole, aligned pages. The WAL and index
+ * snapshot are still buffered. It cannot be combined with DB_OPEN_MMAP or
+ * DB_OPEN_LOG. */
+#define DB_OPEN_DIRECT 0x8
+
+/* DB_OPEN_COMPRESS stores values of COMPRESS_MIN_VALUE to COMPRESS_MAX_VALUE
+ * bytes LZ4-compressed when that saves at least an eighth, so more records
+ * fit a page and large values can stay inline. Reads decompress whether or
+ * not the flag is given. It cannot be combined with DB_OPEN_LOG. */
+#define DB_OPEN_COMPRESS 0x10
+#define COMPRESS_MIN_VALUE 32
+#define COMPRESS_MAX_VALUE 65536
+
+/* DB_OPEN_COMPACT_INDEX keeps only a hash and location per key in memory
+ * instead of a copy of every key, and checks the key against its record
+ * on a hit. A miss is still answered from memory unless another key has
+ * the same 64-bit hash. The index snapshot it writes holds no keys. It
+ * cannot be combined with DB_OPEN_LOG or DB_OPEN_ORDERED. */
+#define DB_OPEN_COMPACT_INDEX 0x20
+
+/* How a commit is made durable. DB_SYNC_DATA fdatasyncs the WAL and
+ * DB_SYNC_FULL fsyncs it, metadata and all. DB_SYNC_NONE only writes it,
+ * so a commit survives the process crashing but may be lost with the
+ * machine; checkpoints still sync the data file. */
+#define DB_SYNC_DATA 0
+#define DB_SYNC_FULL 1
+#define DB_SYNC_NONE 2
+
+/* Options for db_open_opts; a zeroed struct opens as db_open does. flags
+ * are the DB_OPEN_* flags, which pick the engine and I/O path. page_size
+ * applies to a file being created (0 for DEFAULT_PAGE_SIZE); an existing
+ * file keeps its own, and opening it with a different nonzero page_size
+ * fails with EINVAL. cache_size is the buffer pool's size in bytes (0 for
+ * BUFFER_POOL_PAGES pages), rounded down to whole pages and to no fewer
+ * than POOL_MIN_PAGES. */
+struct db_options {
+    int flags;
+    uint32_t page_size;
+    size_t cache_size;
+    int sync;
+};
+
 struct db *db_open(const char *path);
+struct db *db_open_flags(const char *path, int flags);
+struct db *db_open_opts(const char *path, const struct db_options *opts);
 void db_close(struct db *db);
 
+/* Flushes the data file and writes the index snapshot so the next db_open
+ * can skip the page scan. db_close does this implicitly. */
+int db_checkpoint(struct db *db);
+
+/* Shrinks the file after deletes by moving what is in use at its end into
+ * free pages nearer the front and cutting off the free pages left at the
+ * end (ENOTSUP with DB_OPEN_LOG). Data pages move whole, overflow values
+ * and the dictionary by extent, and an ordered handle's B+tree is rebuilt
+ * in the lowest free pages with its leaves in key order. It runs in steps
+ * of a few dozen pages, each holding off writers (not readers) while it
+ * runs, moving at most max_pages pages in all and no more than
+ * pages_per_sec a second (0 for no limit on either), and stops early at a
+ * page a db_ref points into. Every move is durable before its source is
+ * given up. With DB_OPEN_MMAP the file keeps its length and only the pages
+ * in use shrink. Returns the number of pages cut off, or -1 with errno
+ * set. */
+int64_t db_vacuum(struct db *db, uint64_t max_pages, unsigned pages_per_sec);
+
+/* Reads every page of the file and checks it against its CRC32C, using
+ * several threads. Returns the number of damaged pages, or -1 with errno
+ * set (ENOTSUP with DB_OPEN_LOG). Safe alongside other calls: a page being
+ * written meanwhile is read again once the write is done. Reads check the
+ * same checksums and fail with EIO on a damaged page. */
+int64_t db_verify(struct db *db);
+
+/* Sets the file's compression dictionary: up to DICT_MAX_SIZE bytes of
+ * sample data that values from then on, compressed with DB_OPEN_COMPRESS,
+ * may refer back into. Small values that look alike compress much better.
+ * It is written to the file and kept for good, so it can only be set once
+ * (EEXIST after that; ENOTSUP with DB_OPEN_LOG). */
+int db_set_dictionary(struct db *db, const void *dict, uint32_t len);
+
+/* Snapshots. db_get_at reads a key as it was when the snapshot was taken,
+ * like db_get_into otherwise, however long the snapshot stays open and
+ * whatever is written meanwhile; a batch is seen whole or not at all. It
+ * takes no lock, so it never waits for writers. Taking and releasing a
+ * snapshot wait for the writes in flight. While any snapshot is open, each
+ * write keeps a copy of the value it replaces in memory until no open
+ * snapshot is older than the write (version_bytes in db_stats). Release
+ * every snapshot before db_close. ENOTSUP with DB_OPEN_LOG. */
+struct db_snapshot *db_snapshot_create(struct db *db);
+int64_t db_get_at(const struct db_snapshot *snap, const uint8_t *key,
+                  uint32_t key_len, uint8_t *buf, uint32_t cap);
+void db_snapshot_release(struct db_snapshot *snap);
+
+/* Replication, for the page engine (ENOTSUP with DB_OPEN_LOG).
+ *
+ * db_backup writes a consistent copy of the data file to path while writes
+ * go on, and sets *lsn to the last WAL LSN the copy holds. The copy is
+ * reflinked where the file system can, and otherwise copied with
+ * copy_file_range; writes wait only while a page they overwrite is copied
+ * first. It opens like a file whose index snapshot was lost: by a scan.
+ * One backup runs at a time (EBUSY).
+ *
+ * The change hook is called after each put, delete and batch is durable,
+ * on the writing thread with the key's lock held, so the calls for one key
+ * come in commit order. records is the change in WAL record format
+ * (struct wal_record_header, key, value; a batch is one call with
+ * WAL_MORE on all records but its last). A hook set before db_backup sees
+ * every change the copy lacks, and only those have an LSN above *lsn; a
+ * follower opens the copy and passes them to db_apply_changes, which
+ * applies them (a batch atomically) through its own WAL. Keys that expire
+ * are not passed on as deletes: the follower's copy of the put expires on
+ * its own. Like the trace hook it must be quick, must not call back into
+ * the store, and is set while no other thread uses the handle; NULL
+ * removes it. */
+int db_backup(struct db *db, const char *path, uint64_t *lsn);
+int db_set_change_hook(struct db *db, db_change_fn fn, void *ctx);
+int db_apply_changes(struct db *db, const void *records, size_t len);
+
+/* Counters since db_open. reads and writes count the calls that moved data
+ * to or from the data file or log segments (one preadv is one read), and
+ * the wal_ fields the WAL's group-commit writes and syncs. pool_misses are
+ * pages the pool had to read. keys, file_pages and free_pages are the
+ * current values, and index_probe_total / keys is the mean number of extra
+ * buckets a lookup walks past its home bucket, index_max_probe the worst.
+ * index_bytes is the memory the index tables and their inline and arena
+ * keys take; snapshots are those open and version_bytes the old values
+ * kept for them.
+ * recovery_ns is the part of open_ns spent rebuilding the index (by loading
+ * the snapshot, or by scanning the file if recovery_scanned) and replaying
+ * the WAL. recovery_bad_pages are pages that scan found damaged and left
+ * alone, neither indexed nor reused, for db_verify to report. latency[op] is
+ * indexed by DB_OP_*: gets are db_get, db_get_into, db_get_range and
+ * db_get_ref (and the gets db_multi_get and db_aio make), puts db_put and
+ * deletes db_delete; alloc_page and free_page time the free map, once per
+ * page or extent. */
+
+struct db_histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t buckets[DB_HIST_BUCKETS];
+};
+
+struct db_stats {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t wal_writes;
+    uint64_t wal_write_bytes;
+    uint64_t wal_syncs;
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+    uint64_t keys;
+    uint64_t file_pages;
+    uint64_t free_pages;
+    uint64_t index_probe_total;
+    uint64_t index_max_probe;
+    uint64_t index_bytes;
+    uint64_t snapshots;
+    uint64_t version_bytes;
+    uint64_t open_ns;
+    uint64_t recovery_ns;
+    int recovery_scanned;
+    uint64_t recovery_bad_pages;
+    struct db_histogram latency[DB_OPS];
+};
+
+int db_stats(struct db *db, struct db_stats *out);
+
+/* Trace hook, called after every op that db_stats times, on the thread
+ * that made it. Alloc and free events arrive with internal locks held, so
+ * the hook must be quick and must not call back into the store. err is 0
+ * or the errno the op failed with. Unlike other calls, db_set_trace must
+ * not run while other threads use the handle; pass NULL to remove it. */
+
+struct db_trace_event {
+    int op;
+    uint64_t latency_ns;
+    uint32_t key_len;
+    int err;
+};
+
+void db_set_trace(struct db *db, db_trace_fn fn, void *ctx);
+
 int db_put(struct db *db, const uint8_t *key, uint32_t key_len,
            const uint8_t *val, uint32_t val_len);
 
 uint8_t *db_get(struct db *db, const uint8_t *key, uint32_t key_len,
                 uint32_t *val_len_out);
 
+/* Copies the value into buf without allocating. Returns the full value
+ * length, copying at most cap bytes (so a return value > cap means buf holds
+ * a truncated value), or -1 with errno set. */
+int64_t db_get_into(struct db *db, const uint8_t *key, uint32_t key_len,
+                    uint8_t *buf, uint32_t cap);
+
+/* Copies up to len bytes of the value starting at offset into buf. Returns
+ * the number of bytes copied, which is short (or 0) past the end of the
+ * value, or -1 with errno set. Only the overflow pages spanning the range
+ * are read. */
+int64_t db_get_range(struct db *db, const uint8_t *key, uint32_t key_len,
+                     uint64_t offset, uint8_t *buf, uint32_t len);
+
+/* Looks up count keys in one call. The data pages they live on are read
+ * first, in page order with one preadv per run of adjacent pages, and the
+ * values are then packed one after another into buf in key order.
+ * results[i].val points at key i's value in buf and val_len is its length;
+ * err is 0, ENOENT for a missing key, ENOBUFS if the value did not fit in
+ * what was left of buf (val_len still gives its length), or the errno a
+ * db_get of that key would have failed with. Returns the number of values
+ * copied, or -1 with errno set. */
+
+struct db_key {
+    const uint8_t *key;
+    uint32_t key_len;
+};
+
+struct db_get_result {
+    const uint8_t *val;
+    uint32_t val_len;
+    int err;
+};
+
+int64_t db_multi_get(struct db *db, const struct db_key *keys, size_t count,
+                     uint8_t *buf, size_t cap, struct db_get_result *results);
+
+/* Asynchronous requests, for one thread to keep many reads in flight. A
+ * db_aio queue is used by one thread at a time and holds up to depth
+ * requests, counting completions not yet collected; a request past that
+ * fails with EBUSY. Keys, values and buffers must stay valid until their
+ * completion is collected, and requests are not ordered against each
+ * other. Gets of pages not in the pool are read through io_uring into
+ * registered buffers; without io_uring, or with DB_OPEN_LOG, gets complete
+ * as they are made. Puts are held until db_aio_wait and then committed
+ * together as one batch, so they share a WAL sync.
+ *
+ * db_aio_wait submits what is queued and stores up to max completions in
+ * out, waiting until at least min are ready or nothing is left in flight.
+ * result is what db_get_into would have returned for a get (the value
+ * length, which may exceed cap) and 0 for a put, or -1 with err set.
+ * Returns the number stored, or -1 with errno set. db_aio_close waits for
+ * reads still in flight, commits puts still held and drops completions that
+ * were not collected. */
+
+struct db_aio;
+
+struct db_completion {
+    void *user;
+    int64_t result;
+    int err;
+};
+
+struct db_aio *db_aio_open(struct db *db, unsigned depth);
+int db_get_async(struct db_aio *q, const uint8_t *key, uint32_t key_len,
+                 uint8_t *buf, uint32_t cap, void *user);
+int db_put_async(struct db_aio *q, const uint8_t *key, uint32_t key_len,
+                 const uint8_t *val, uint32_t val_len, void *user);
+int db_aio_wait(struct db_aio *q, struct db_completion *out, unsigned max,
+                unsigned min);
+void db_aio_close(struct db_aio *q);
+
+/* Pinned view of a value inside the buffer pool. ref->val stays valid until
+ * db_release(), which unpins the frame; nothing is allocated on the way.
+ * Fails with ENOBUFS once every frame in the pool is pinned, and with EFBIG
+ * for values kept in overflow pages or compressed, which have no in-page
+ * copy to point at; read those with db_get_into or db_get_range. */
+
+struct db_ref {
+    const uint8_t *val;
+    uint32_t val_len;
+    void *page;
+};
+
+int db_get_ref(struct db *db, const uint8_t *key, uint32_t key_len,
+               struct db_ref *ref);
+void db_release(struct db *db, struct db_ref *ref);
+
 int db_delete(struct db *db, const uint8_t *key, uint32_t key_len);
 
+/* Keys that expire. db_put_ttl is db_put for a key that expires ttl_ms
+ * from now by the wall clock (never if 0); the expiry is kept in the
+ * record. From then on reads treat the key as absent, and db_expire
+ * deletes it: it turns the timer wheel to now, takes up to max due timers
+ * (0 for all) and returns how many keys it deleted, so its cost follows the
+ * keys that expired rather than the size of the store. Pages this empties
+ * go back to the free map. Both fail with ENOTSUP with DB_OPEN_LOG. */
+int db_put_ttl(struct db *db, const uint8_t *key, uint32_t key_len,
+               const uint8_t *val, uint32_t val_len, uint64_t ttl_ms);
+int64_t db_expire(struct db *db, size_t max);
+
+/* Batched writes. The ops are logged as one unit with a single sync, and
+ * the pages they dirty are then written back in page order with vectored
+ * writes. Ops apply in array order; deleting a missing key is not an
+ * error. Nothing is applied if any op fails validation. */
+
+#define DB_BATCH_PUT    1
+#define DB_BATCH_DELETE 2
+
+struct db_batch_op {
+    int type;
+    const uint8_t *key;
+    uint32_t key_len;
+    const uint8_t *val;
+    uint32_t val_len;
+};
+
+int db_write_batch(struct db *db, const struct db_batch_op *ops, size_t count);
+
+/* Ordered iteration (DB_OPEN_ORDERED only; ENOTSUP otherwise).
+ * db_iter_seek positions before the first key >= key (a NULL key starts at
+ * the beginning), so iterating a prefix is seeking to it and stopping at the
+ * first key that does not start with it. db_iter_next returns 1 with the
+ * next key and value, 0 at the end, or -1 with errno set; both stay valid
+ * until the next call. Keys are in memcmp order, shorter first on ties.
+ * The iterator sees every key present for its whole lifetime; keys written
+ * meanwhile may or may not show up. */
+
+struct db_iter;
+
+struct db_iter *db_iter_seek(struct db *db, const uint8_t *key, uint32_t key_len);
+int db_iter_next(struct db_iter *it, const uint8_t **key, uint32_t *key_len,
+                 const uint8_t **val, uint32_t *val_len);
+void db_iter_close(struct db_iter *it);
+
 #endif
@@ -0,0 +1,956 @@
+#define _GNU_SOURCE
+#include "kvstore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Network server (Linux). It serves one store, split by key hash into a
+ * shard per core, each a database file of its own ("<path>.<i>") with its
+ * own WAL, over TCP or a Unix socket. One worker thread per core, pinned to
+ * it, runs an epoll loop over the connections it accepted, and owns shards
+ * i, i + threads, ... of them: only it calls into those, so no two cores
+ * contend for a shard's locks or pages. A worker splits each run of
+ * requests by owner, hands the other workers their parts through their
+ * mailboxes, serves its own part meanwhile, and answers the run in order
+ * once every part is back.
+ *
+ * The protocol is binary and pipelined: a client may send any number of
+ * requests without waiting, and gets one response per request, in order.
+ * A request is a struct request then key_len bytes of key, then for
+ * REQ_PUT val_len bytes of value (val_len is 0 otherwise). A response is a
+ * struct response then val_len bytes: the value for a found REQ_GET,
+ * nothing otherwise. Integers are in host byte order. A frame over
+ * MAX_FRAME bytes or with an unknown op closes the connection.
+ *
+ * Pipelined requests of one kind are served together: a run of up to
+ * RUN_MAX gets goes to db_multi_get, one call per shard, and a run of puts
+ * to db_write_batch, one batch (and one sync) per shard. A client wanting a
+ * multi-get sends its gets back to back. A connection has one run in
+ * flight; the next is read once it is answered. */
+
+#define REQ_GET    1
+#define REQ_PUT    2
+#define REQ_DELETE 3
+
+#define ST_OK        0
+#define ST_NOT_FOUND 1
+#define ST_TOO_BIG   2   /* key or value over the store's limits */
+#define ST_ERROR     3
+
+struct request {
+    uint32_t op;
+    uint32_t key_len;
+    uint32_t val_len;
+} __attribute__((packed));
+
+struct response {
+    uint32_t status;
+    uint32_t val_len;
+} __attribute__((packed));
+
+#define MAX_FRAME   (64u << 20)
+#define READ_CHUNK  (64u << 10)
+#define WRITE_HIGH  (4u << 20)    /* unsent bytes past which requests wait */
+#define RUN_MAX     128           /* requests served by one call */
+#define MGET_BUF    (4u << 20)
+#define MAX_EVENTS  256
+#define ACCEPT_MAX  16            /* per wakeup, so workers share new clients */
+
+static const char *usage =
+    "usage: kvstore_server -d path [-l address] [-t threads] [-s shards] [-e engine]\n"
+    "                      [-p page-size] [-c cache-mb] [-y sync]\n"
+    "  -d  database path; shard i is <path>.<i>\n"
+    "  -l  host:port, or a Unix socket path containing '/' (default 127.0.0.1:7379)\n"
+    "  -t  worker threads (default one per online CPU)\n"
+    "  -s  shards (default one per thread); must match what the files were made with\n"
+    "  -e  pages, mmap, ordered, direct or log (default pages)\n"
+    "  -p  page size of new shard files, 4096 to 32768 (default 4096)\n"
+    "  -c  buffer pool megabytes, split between the shards (default 4 per shard)\n"
+    "  -y  data, full or none: how commits are synced (default data)\n";
+
+static const struct {
+    const char *name;
+    int sync;
+} syncs[] = {
+    { "data", DB_SYNC_DATA },
+    { "full", DB_SYNC_FULL },
+    { "none", DB_SYNC_NONE },
+};
+
+static const struct {
+    const char *name;
+    int flags;
+} engines[] = {
+    { "pages", 0 },
+    { "mmap", DB_OPEN_MMAP },
+    { "ordered", DB_OPEN_ORDERED },
+    { "direct", DB_OPEN_DIRECT },
+    { "log", DB_OPEN_LOG },
+};
+
+/* Bytes [start, len) of data are pending. */
+struct buf {
+    uint8_t *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+};
+
+struct job;
+
+/* A request parsed out of a connection's input, pointing into it. Once
+ * served, a found value is found_len bytes at found_off in its job's vals. */
+struct req_frame {
+    const uint8_t *key;
+    uint32_t key_len;
+    const uint8_t *val;
+    uint32_t val_len;
+    unsigned shard;
+    uint32_t status;
+    struct job *job;
+    size_t found_off;
+    uint32_t found_len;
+};
+
+/* The frames of a run (index[0, n) into its conn's run) whose shards one
+ * worker owns. A job for another worker goes to that worker's mailbox and
+ * comes back in its origin's once served; values it found are copied into
+ * vals, as the owner's buffers are reused for the next job. */
+struct job {
+    struct job *next;       /* in a mailbox */
+    struct job *sibling;    /* the run's other jobs */
+    struct conn *conn;
+    struct worker *origin;
+    unsigned owner;
+    int served;
+    size_t n;
+    unsigned index[RUN_MAX];
+    struct buf vals;
+};
+
+/* A connection has one run in flight: frames run[0, run_len), all of op
+ * run_op, ending at run_end in the input. The input is not read while jobs
+ * of it are pending, so the frames' pointers stay put. */
+struct conn {
+    int fd;
+    uint32_t events;      /* what epoll waits for */
+    int eof;
+    int dead;             /* closed once no job is pending */
+    struct buf in;
+    struct buf out;
+    struct conn *prev;
+    struct conn *next;
+    uint32_t run_op;
+    size_t run_len;
+    size_t run_end;
+    unsigned pending;
+    struct job *jobs;
+    struct req_frame run[RUN_MAX];
+};
+
+struct worker;
+
+struct server {
+    struct db **shards;
+    unsigned nshards;
+    struct worker *workers;
+    unsigned nworkers;
+    int listen_fd;
+    int tcp;
+};
+
+/* mail is the FIFO of jobs handed to this worker, to serve or back from
+ * serving; mail_fd is written when it stops being empty. keys through index
+ * are scratch for serving one shard's part of a job. */
+struct worker {
+    struct server *srv;
+    unsigned id;
+    int ep;
+    pthread_t thread;
+    struct conn *conns;
+    int mail_fd;
+    pthread_mutex_t mail_lock;
+    struct job *mail;
+    struct job *mail_tail;
+    uint8_t *mget_buf;
+    struct db_key keys[RUN_MAX];
+    struct db_get_result results[RUN_MAX];
+    struct db_batch_op ops[RUN_MAX];
+    unsigned index[RUN_MAX];
+};
+
+/* Wakes every worker's epoll at once: it is never read, so it stays
+ * readable once written. */
+static int stop_fd = -1;
+
+static void die(const char *what) {
+    fprintf(stderr, "kvstore_server: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    uint64_t one = 1;
+    ssize_t n = write(stop_fd, &one, sizeof(one));
+    (void)n;
+}
+
+/* FNV-1a; the store hashes keys with a seed of its own per file. */
+static unsigned shard_of(const struct server *srv, const uint8_t *key,
+                         uint32_t key_len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < key_len; i++) {
+        h ^= key[i];
+        h *= 0x100000001b3ull;
+    }
+    return (unsigned)(h % srv->nshards);
+}
+
+static uint32_t status_of(int err) {
+    switch (err) {
+    case 0:
+        return ST_OK;
+    case ENOENT:
+        return ST_NOT_FOUND;
+    case EFBIG:
+        return ST_TOO_BIG;
+    default:
+        return ST_ERROR;
+    }
+}
+
+static int buf_reserve(struct buf *b, size_t n) {
+    if (b->start == b->len) {
+        b->start = b->len = 0;
+    }
+    if (b->cap - b->len >= n) {
+        return 0;
+    }
+    /* Slide what is pending down before growing. */
+    if (b->start > 0) {
+        memmove(b->data, b->data + b->start, b->len - b->start);
+        b->len -= b->start;
+        b->start = 0;
+        if (b->cap - b->len >= n) {
+            return 0;
+        }
+    }
+    size_t cap = b->cap ? b->cap : READ_CHUNK;
+    while (cap - b->len < n) {
+        cap *= 2;
+    }
+    uint8_t *data = realloc(b->data, cap);
+    if (!data) {
+        return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int respond(struct conn *c, uint32_t status, const uint8_t *val,
+                   uint32_t val_len) {
+    struct response r = { status, val_len };
+    if (buf_reserve(&c->out, sizeof(r) + val_len) != 0) {
+        return -1;
+    }
+    memcpy(c->out.data + c->out.len, &r, sizeof(r));
+    if (val_len) {
+        memcpy(c->out.data + c->out.len + sizeof(r), val, val_len);
+    }
+    c->out.len += sizeof(r) + val_len;
+    return 0;
+}
+
+static unsigned owner_of(const struct server *srv, unsigned shard) {
+    return shard % srv->nworkers;
+}
+
+/* Copies a value the job found into its vals. */
+static int job_keep(struct job *j, struct req_frame *f, const uint8_t *val,
+                    uint32_t len) {
+    if (buf_reserve(&j->vals, len) != 0) {
+        return -1;
+    }
+    memcpy(j->vals.data + j->vals.len, val, len);
+    f->found_off = j->vals.len;
+    f->found_len = len;
+    j->vals.len += len;
+    return 0;
+}
+
+/* Looks up the job's keys, one db_multi_get per shard. A value too big for
+ * the worker's buffer is got on its own. */
+static void serve_gets(struct worker *w, struct job *j) {
+    struct server *srv = w->srv;
+    struct conn *c = j->conn;
+    for (unsigned s = w->id; s < srv->nshards; s += srv->nworkers) {
+        size_t m = 0;
+        for (size_t i = 0; i < j->n; i++) {
+            struct req_frame *f = &c->run[j->index[i]];
+            if (f->shard == s) {
+                w->keys[m].key = f->key;
+                w->keys[m].key_len = f->key_len;
+                w->index[m++] = j->index[i];
+            }
+        }
+        if (m == 0) {
+            continue;
+        }
+
+        int64_t got = db_multi_get(srv->shards[s], w->keys, m, w->mget_buf, MGET_BUF,
+                                   w->results);
+        int mget_err = got < 0 ? errno : 0;
+        for (size_t k = 0; k < m; k++) {
+            struct req_frame *f = &c->run[w->index[k]];
+            int err = mget_err ? mget_err : w->results[k].err;
+            if (err == 0 &&
+                job_keep(j, f, w->results[k].val, w->results[k].val_len) != 0) {
+                err = ENOMEM;
+            } else if (err == ENOBUFS) {
+                uint32_t len;
+                uint8_t *val = db_get(srv->shards[s], f->key, f->key_len, &len);
+                err = val ? 0 : errno;
+                if (val && job_keep(j, f, val, len) != 0) {
+                    err = ENOMEM;
+                }
+                free(val);
+            }
+            f->status = status_of(err);
+        }
+    }
+}
+
+/* Writes the job's puts as one batch per shard. A batch the store turns
+ * down as a whole, for one bad op, is retried a put at a time so the
+ * others still go in and the bad one gets its own status. */
+static void serve_puts(struct worker *w, struct job *j) {
+    struct server *srv = w->srv;
+    struct conn *c = j->conn;
+    for (unsigned s = w->id; s < srv->nshards; s += srv->nworkers) {
+        size_t m = 0;
+        for (size_t i = 0; i < j->n; i++) {
+            struct req_frame *f = &c->run[j->index[i]];
+            if (f->shard == s) {
+                w->ops[m] = (struct db_batch_op){ DB_BATCH_PUT, f->key, f->key_len,
+                                                  f->val, f->val_len };
+                w->index[m++] = j->index[i];
+            }
+        }
+        if (m == 0) {
+            continue;
+        }
+
+        int err = db_write_batch(srv->shards[s], w->ops, m) == 0 ? 0 : errno;
+        for (size_t k = 0; k < m; k++) {
+            struct req_frame *f = &c->run[w->index[k]];
+            if (err == EFBIG || err == EINVAL) {
+                f->status = status_of(db_put(srv->shards[s], f->key, f->key_len,
+                                             f->val, f->val_len) == 0 ? 0 : errno);
+            } else {
+                f->status = status_of(err);
+            }
+        }
+    }
+}
+
+/* Runs on the job's owner, the only worker that touches its shards. */
+static void serve_job(struct worker *w, struct job *j) {
+    struct conn *c = j->conn;
+    if (c->run_op == REQ_GET) {
+        serve_gets(w, j);
+    } else if (c->run_op == REQ_PUT) {
+        serve_puts(w, j);
+    } else {
+        for (size_t i = 0; i < j->n; i++) {
+            struct req_frame *f = &c->run[j->index[i]];
+            f->status = status_of(db_delete(w->srv->shards[f->shard], f->key,
+                                            f->key_len) == 0 ? 0 : errno);
+        }
+    }
+    j->served = 1;
+}
+
+static void mail_post(struct worker *to, struct job *j) {
+    j->next = NULL;
+    pthread_mutex_lock(&to->mail_lock);
+    int wake = to->mail == NULL;
+    if (to->mail_tail) {
+        to->mail_tail->next = j;
+    } else {
+        to->mail = j;
+    }
+    to->mail_tail = j;
+    pthread_mutex_unlock(&to->mail_lock);
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t n = write(to->mail_fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+static void jobs_free(struct conn *c) {
+    while (c->jobs) {
+        struct job *next = c->jobs->sibling;
+        free(c->jobs->vals.data);
+        free(c->jobs);
+        c->jobs = next;
+    }
+}
+
+/* Splits the run into a job per worker owning some of its shards, hands the
+ * other workers theirs and serves its own meanwhile. */
+static int run_start(struct worker *w, struct conn *c) {
+    struct server *srv = w->srv;
+    for (size_t i = 0; i < c->run_len; i++) {
+        struct req_frame *f = &c->run[i];
+        unsigned owner = owner_of(srv, f->shard);
+        struct job *j = c->jobs;
+        while (j && j->owner != owner) {
+            j = j->sibling;
+        }
+        if (!j) {
+            j = calloc(1, sizeof(*j));
+            if (!j) {
+                return -1;
+            }
+            j->conn = c;
+            j->origin = w;
+            j->owner = owner;
+            j->sibling = c->jobs;
+            c->jobs = j;
+        }
+        j->index[j->n++] = (unsigned)i;
+        f->job = j;
+    }
+
+    struct job *local = NULL;
+    for (struct job *j = c->jobs; j; j = j->sibling) {
+        if (j->owner == w->id) {
+            local = j;
+        } else {
+            c->pending++;
+            mail_post(&srv->workers[j->owner], j);
+        }
+    }
+    if (local) {
+        serve_job(w, local);
+    }
+    return 0;
+}
+
+/* Answers the run, every job of which is back, in request order. */
+static int run_finish(struct conn *c) {
+    int ret = 0;
+    for (size_t i = 0; i < c->run_len && ret == 0; i++) {
+        struct req_frame *f = &c->run[i];
+        ret = respond(c, f->status,
+                      f->found_len ? f->job->vals.data + f->found_off : NULL,
+                      f->found_len);
+    }
+    c->in.start = c->run_end;
+    c->run_len = 0;
+    jobs_free(c);
+    return ret;
+}
+
+/* Serves the complete requests in c's input, a run of one op at a time,
+ * while the unsent output stays under WRITE_HIGH and no run is away. */
+static int conn_process(struct worker *w, struct conn *c) {
+    while (!c->pending && c->out.len - c->out.start < WRITE_HIGH) {
+        size_t pos = c->in.start, n = 0;
+        uint32_t op = 0;
+        while (n < RUN_MAX) {
+            struct request h;
+            size_t avail = c->in.len - pos;
+            if (avail < sizeof(h)) {
+                break;
+            }
+            memcpy(&h, c->in.data + pos, sizeof(h));
+            if (h.op < REQ_GET || h.op > REQ_DELETE ||
+                (h.op != REQ_PUT && h.val_len != 0) ||
+                (uint64_t)h.key_len + h.val_len > MAX_FRAME) {
+                return -1;
+            }
+            if (n > 0 && h.op != op) {
+                break;
+            }
+            if (avail - sizeof(h) < (uint64_t)h.key_len + h.val_len) {
+                /* Make room for the rest of the frame. */
+                if (n == 0 && buf_reserve(&c->in, sizeof(h) + h.key_len + h.val_len) != 0) {
+                    return -1;
+                }
+                break;
+            }
+
+            const uint8_t *key = c->in.data + pos + sizeof(h);
+            struct req_frame *f = &c->run[n++];
+            f->key = key;
+            f->key_len = h.key_len;
+            f->val = key + h.key_len;
+            f->val_len = h.val_len;
+            f->shard = shard_of(w->srv, key, h.key_len);
+            f->found_len = 0;
+            op = h.op;
+            pos += sizeof(h) + h.key_len + h.val_len;
+        }
+        if (n == 0) {
+            break;
+        }
+        c->run_op = op;
+        c->run_len = n;
+        c->run_end = pos;
+        if (run_start(w, c) != 0 || (!c->pending && run_finish(c) != 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Returns 0, or -1 once the connection is to be closed. */
+static int conn_read(struct conn *c) {
+    if (buf_reserve(&c->in, READ_CHUNK) != 0) {
+        return -1;
+    }
+    ssize_t n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+    if (n > 0) {
+        c->in.len += (size_t)n;
+    } else if (n == 0) {
+        c->eof = 1;
+    } else if (errno != EAGAIN && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
+static int conn_flush(struct conn *c) {
+    while (c->out.start < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out.start,
+                         c->out.len - c->out.start, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        c->out.start += (size_t)n;
+    }
+    if (c->out.start == c->out.len) {
+        c->out.start = c->out.len = 0;
+    }
+    return 0;
+}
+
+/* Waits for output room while there is unsent output, and for requests
+ * while that is under WRITE_HIGH, no run is away and the client has not
+ * hung up. */
+static int conn_update(struct worker *w, struct conn *c) {
+    size_t unsent = c->out.len - c->out.start;
+    uint32_t events = (unsent ? EPOLLOUT : 0) |
+                      (unsent < WRITE_HIGH && !c->eof && !c->pending ? EPOLLIN : 0);
+    if (events == c->events) {
+        return 0;
+    }
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(w->ep, EPOLL_CTL_MOD, c->fd, &ev) != 0) {
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+static void conn_close(struct worker *w, struct conn *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    close(c->fd);
+    jobs_free(c);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+/* Serves what c has sent and sends what is answered; a broken or finished
+ * connection is closed, or if jobs of it are away, taken out of epoll and
+ * closed once they are back. */
+static void conn_settle(struct worker *w, struct conn *c, int ok) {
+    ok = ok && conn_process(w, c) == 0 && conn_flush(c) == 0;
+    /* Once the client has hung up, what it sent in full is answered. */
+    if (ok && c->eof && !c->pending && c->out.start == c->out.len) {
+        ok = 0;
+    }
+    if (ok && conn_update(w, c) == 0) {
+        return;
+    }
+    if (c->pending) {
+        epoll_ctl(w->ep, EPOLL_CTL_DEL, c->fd, NULL);
+        c->dead = 1;
+    } else {
+        conn_close(w, c);
+    }
+}
+
+static void conn_event(struct worker *w, struct conn *c, uint32_t events) {
+    if (c->dead) {
+        return;
+    }
+    int ok = !(events & EPOLLERR) && !(c->pending && (events & EPOLLHUP));
+    if (ok && (events & (EPOLLIN | EPOLLHUP)) && !c->eof && !c->pending) {
+        ok = conn_read(c) == 0;
+    }
+    conn_settle(w, c, ok);
+}
+
+/* Serves the jobs other workers handed over and sends them back, and
+ * finishes the runs whose last job came back. */
+static void mail_deliver(struct worker *w) {
+    uint64_t count;
+    ssize_t n = read(w->mail_fd, &count, sizeof(count));
+    (void)n;
+    pthread_mutex_lock(&w->mail_lock);
+    struct job *j = w->mail;
+    w->mail = w->mail_tail = NULL;
+    pthread_mutex_unlock(&w->mail_lock);
+
+    while (j) {
+        struct job *next = j->next;
+        if (!j->served) {
+            serve_job(w, j);
+            mail_post(j->origin, j);
+        } else {
+            struct conn *c = j->conn;
+            if (--c->pending == 0) {
+                if (c->dead) {
+                    conn_close(w, c);
+                } else {
+                    conn_settle(w, c, run_finish(c) == 0);
+                }
+            }
+        }
+        j = next;
+    }
+}
+
+static void accept_conns(struct worker *w) {
+    for (int i = 0; i < ACCEPT_MAX; i++) {
+        int fd = accept4(w->srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                perror("kvstore_server: accept");
+            }
+            return;
+        }
+        if (w->srv->tcp) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        struct conn *c = calloc(1, sizeof(*c));
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (!c || epoll_ctl(w->ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        c->next = w->conns;
+        if (w->conns) {
+            w->conns->prev = c;
+        }
+        w->conns = c;
+    }
+}
+
+/* Mail is handled after the other events, as finishing a run may close a
+ * connection a later event in the same batch is for. Connections are closed
+ * by main once every worker has stopped, as others may still be serving
+ * their jobs. */
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->id % (unsigned)cpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(w->ep, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("kvstore_server: epoll_wait");
+            break;
+        }
+        int mail = 0;
+        for (int i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            if (p == &stop_fd) {
+                return NULL;
+            }
+            if (p == &w->srv->listen_fd) {
+                accept_conns(w);
+            } else if (p == &w->mail_fd) {
+                mail = 1;
+            } else {
+                conn_event(w, p, events[i].events);
+            }
+        }
+        if (mail) {
+            mail_deliver(w);
+        }
+    }
+    return NULL;
+}
+
+/* A Unix socket if address has a '/', else host:port. */
+static int listen_on(struct server *srv, const char *address) {
+    int fd;
+    if (strchr(address, '/')) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, address);
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+            return -1;
+        }
+        srv->tcp = 0;
+    } else {
+        const char *colon = strrchr(address, ':');
+        if (!colon) {
+            errno = EINVAL;
+            return -1;
+        }
+        char host[256];
+        size_t host_len = (size_t)(colon - address);
+        if (host_len >= sizeof(host)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(host, address, host_len);
+        host[host_len] = '\0';
+
+        struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_socktype = SOCK_STREAM };
+        struct addrinfo *ai;
+        int rc = getaddrinfo(host_len ? host : NULL, colon + 1, &hints, &ai);
+        if (rc != 0) {
+            fprintf(stderr, "kvstore_server: %s: %s\n", address, gai_strerror(rc));
+            exit(1);
+        }
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        int one = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            freeaddrinfo(ai);
+            return -1;
+        }
+        freeaddrinfo(ai);
+        srv->tcp = 1;
+    }
+    if (listen(fd, SOMAXCONN) != 0) {
+        return -1;
+    }
+    srv->listen_fd = fd;
+    return 0;
+}
+
+static int file_exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+/* Keys are routed by shard count, so the files must have been made with
+ * the same one: either none exist yet or exactly these do. */
+static void open_shards(struct server *srv, const char *path,
+                        const struct db_options *opts) {
+    char name[4200];
+    int existing = 0;
+    for (unsigned i = 0; i < srv->nshards; i++) {
+        snprintf(name, sizeof(name), "%s.%u", path, i);
+        existing += file_exists(name);
+    }
+    snprintf(name, sizeof(name), "%s.%u", path, srv->nshards);
+    if ((existing != 0 && existing != (int)srv->nshards) || file_exists(name)) {
+        fprintf(stderr, "kvstore_server: %s.* was made with another shard count\n", path);
+        exit(1);
+    }
+
+    srv->shards = calloc(srv->nshards, sizeof(*srv->shards));
+    if (!srv->shards) {
+        die("calloc");
+    }
+    for (unsigned i = 0; i < srv->nshards; i++) {
+        snprintf(name, sizeof(name), "%s.%u", path, i);
+        srv->shards[i] = db_open_opts(name, opts);
+        if (!srv->shards[i]) {
+            die(name);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL, *address = "127.0.0.1:7379";
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = cpus > 0 ? (unsigned)cpus : 1, shards = 0;
+    struct db_options opts = { 0 };
+    size_t cache_mb = 0;
+    int engine_ok = 1, sync_ok = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:l:t:s:e:p:c:y:")) != -1) {
+        switch (opt) {
+        case 'd':
+            path = optarg;
+            break;
+        case 'l':
+            address = optarg;
+            break;
+        case 't':
+            threads = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            shards = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'e':
+            engine_ok = 0;
+            for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+                if (strcmp(optarg, engines[i].name) == 0) {
+                    opts.flags = engines[i].flags;
+                    engine_ok = 1;
+                }
+            }
+            break;
+        case 'p':
+            opts.page_size = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'y':
+            sync_ok = 0;
+            for (size_t i = 0; i < sizeof(syncs) / sizeof(syncs[0]); i++) {
+                if (strcmp(optarg, syncs[i].name) == 0) {
+                    opts.sync = syncs[i].sync;
+                    sync_ok = 1;
+                }
+            }
+            break;
+        default:
+            fputs(usage, stderr);
+            return 2;
+        }
+    }
+    if (optind != argc || !path || !engine_ok || !sync_ok || threads == 0 ||
+        threads > 1024 || shards > 1024) {
+        fputs(usage, stderr);
+        return 2;
+    }
+
+    struct server srv = { .nshards = shards ? shards : threads, .listen_fd = -1 };
+    opts.cache_size = (cache_mb << 20) / srv.nshards;
+    open_shards(&srv, path, &opts);
+    if (listen_on(&srv, address) != 0) {
+        die(address);
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd < 0) {
+        die("eventfd");
+    }
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Every worker waits on the one listening socket; EPOLLEXCLUSIVE wakes
+     * only one of them per connection. All mailboxes exist before any
+     * worker can post to one. */
+    struct worker *workers = calloc(threads, sizeof(*workers));
+    if (!workers) {
+        die("calloc");
+    }
+    srv.workers = workers;
+    srv.nworkers = threads;
+    for (unsigned i = 0; i < threads; i++) {
+        struct worker *w = &workers[i];
+        w->srv = &srv;
+        w->id = i;
+        w->ep = epoll_create1(EPOLL_CLOEXEC);
+        w->mail_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        w->mget_buf = malloc(MGET_BUF);
+        pthread_mutex_init(&w->mail_lock, NULL);
+        struct epoll_event lev = { .events = EPOLLIN | EPOLLEXCLUSIVE,
+                                   .data.ptr = &srv.listen_fd };
+        struct epoll_event sev = { .events = EPOLLIN, .data.ptr = &stop_fd };
+        struct epoll_event mev = { .events = EPOLLIN, .data.ptr = &w->mail_fd };
+        if (w->ep < 0 || w->mail_fd < 0 || !w->mget_buf ||
+            epoll_ctl(w->ep, EPOLL_CTL_ADD, srv.listen_fd, &lev) != 0 ||
+            epoll_ctl(w->ep, EPOLL_CTL_ADD, stop_fd, &sev) != 0 ||
+            epoll_ctl(w->ep, EPOLL_CTL_ADD, w->mail_fd, &mev) != 0) {
+            die("epoll");
+        }
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            die("pthread_create");
+        }
+    }
+    fprintf(stderr, "kvstore_server: serving %s on %s, %u threads, %u shards\n",
+            path, address, threads, srv.nshards);
+
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        struct worker *w = &workers[i];
+        while (w->conns) {
+            conn_close(w, w->conns);
+        }
+        close(w->ep);
+        close(w->mail_fd);
+        pthread_mutex_destroy(&w->mail_lock);
+        free(w->mget_buf);
+    }
+    close(srv.listen_fd);
+    if (!srv.tcp) {
+        unlink(address);
+    }
+    for (unsigned i = 0; i < srv.nshards; i++) {
+        db_close(srv.shards[i]);
+    }
+    free(srv.shards);
+    free(workers);
+    return 0;
+}
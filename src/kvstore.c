@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "kvstore.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,21 +8,118 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 static int file_exists(const char *path) {
     struct stat st;
     return stat(path, &st) == 0;
 }
 
-static int init_new_db(int fd) {
-    struct db_header header;
+/* Statistics. A thread is given a stripe the first time it counts
+ * anything and keeps it for every handle. */
+
+static _Atomic unsigned stats_next_stripe;
+static _Thread_local unsigned stats_stripe_id;   /* 1-based, 0 = none yet */
+
+static struct stats_stripe *stats_stripe(struct db *db) {
+    if (stats_stripe_id == 0) {
+        stats_stripe_id = atomic_fetch_add(&stats_next_stripe, 1) % STATS_STRIPES + 1;
+    }
+    return &db->stats.stripes[stats_stripe_id - 1];
+}
+
+static void stats_add(struct db *db, int counter, uint64_t n) {
+    atomic_fetch_add_explicit(&stats_stripe(db)->counters[counter], n,
+                              memory_order_relaxed);
+}
+
+/* Counts a read (STAT_READS) or write (STAT_WRITES) call, and the bytes it
+ * moved in the counter after it. */
+static void stats_io(struct db *db, int counter, ssize_t bytes) {
+    struct stats_stripe *s = stats_stripe(db);
+    atomic_fetch_add_explicit(&s->counters[counter], 1, memory_order_relaxed);
+    if (bytes > 0) {
+        atomic_fetch_add_explicit(&s->counters[counter + 1], (uint64_t)bytes,
+                                  memory_order_relaxed);
+    }
+}
+
+static uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Records an op that started at t0 and passes it to the trace hook. failed
+ * means errno holds why, and errno is left as it was. */
+static void stats_op(struct db *db, int op, uint64_t t0, uint32_t key_len,
+                     int failed) {
+    if (!db) {
+        return;
+    }
+    int saved_errno = errno;
+    uint64_t ns = stats_clock() - t0;
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= DB_HIST_BUCKETS) {
+        bucket = DB_HIST_BUCKETS - 1;
+    }
+
+    struct stats_stripe *s = stats_stripe(db);
+    atomic_fetch_add_explicit(&s->ops[op], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->total_ns[op], ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->hist[op][bucket], 1, memory_order_relaxed);
+
+    db_trace_fn trace = atomic_load_explicit(&db->stats.trace, memory_order_relaxed);
+    if (trace) {
+        struct db_trace_event ev = {
+            .op = op,
+            .latency_ns = ns,
+            .key_len = key_len,
+            .err = failed ? saved_errno : 0,
+        };
+        trace(db->stats.trace_ctx, &ev);
+    }
+    errno = saved_errno;
+}
+
+/* The header is read and written through an aligned copy, as a file opened
+ * with DB_OPEN_DIRECT requires of every buffer. */
+static int init_new_db(int fd, uint32_t engine, uint32_t page_size) {
+    _Alignas(MIN_PAGE_SIZE) struct db_header header;
     memset(&header, 0, sizeof(header));
     header.magic = MAGIC;
     header.version = VERSION;
-    header.page_size = PAGE_SIZE;
+    header.page_size = page_size;
     header.num_pages = 1;
     header.next_free_page = 1;
-    header.free_list_head = 0;
+    header.free_map_page = 0;
+    header.engine = engine;
+    /* Without entropy the seed still differs by time and process. */
+    if (getentropy(&header.hash_seed, sizeof(header.hash_seed)) != 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        header.hash_seed = (uint64_t)ts.tv_sec * 1000000007u ^ (uint64_t)ts.tv_nsec ^
+                           (uint64_t)getpid() << 32;
+    }
 
     ssize_t written = pwrite(fd, &header, sizeof(header), 0);
     if (written != sizeof(header)) {
@@ -35,12 +134,14 @@ static int init_new_db(int fd) {
 }
 
 static int read_header(int fd, struct db_header *header) {
-    ssize_t bytes_read = pread(fd, header, sizeof(*header), 0);
+    _Alignas(MIN_PAGE_SIZE) struct db_header copy;
+    ssize_t bytes_read = pread(fd, &copy, sizeof(copy), 0);
 
-    if (bytes_read != sizeof(*header)) {
+    if (bytes_read != sizeof(copy)) {
         errno = EIO;
         return -1;
     }
+    *header = copy;
 
     if (header->magic != MAGIC) {
         errno = EINVAL;
@@ -52,7 +153,8 @@ static int read_header(int fd, struct db_header *header) {
         return -1;
     }
 
-    if (header->page_size != PAGE_SIZE) {
+    uint32_t ps = header->page_size;
+    if (ps < MIN_PAGE_SIZE || ps > MAX_PAGE_SIZE || (ps & (ps - 1))) {
         errno = EINVAL;
         return -1;
     }
@@ -60,346 +162,8975 @@ static int read_header(int fd, struct db_header *header) {
     return 0;
 }
 
-static uint64_t alloc_page(struct db *db) {
-    if (db->header.free_list_head != 0) {
-        uint64_t page_num = db->header.free_list_head;
+static int write_header(struct db *db) {
+    _Alignas(MIN_PAGE_SIZE) struct db_header copy = db->header;
+    ssize_t written = pwrite(db->fd, &copy, sizeof(copy), 0);
+    stats_io(db, STAT_WRITES, written);
+    if (written != sizeof(copy)) {
+        errno = EIO;
+        return -1;
+    }
+    return fsync(db->fd);
+}
 
-        uint8_t page_buf[PAGE_SIZE];
-        off_t offset = page_num * PAGE_SIZE;
-        ssize_t bytes_read = pread(db->fd, page_buf, PAGE_SIZE, offset);
+/* Page checksums. Every page written to the file carries a CRC32C of its
+ * image, taken with the checksum field as zero, and is checked whenever it
+ * is read back. A stored 0 means the page was never stamped (a hole, or a
+ * file from before checksums) and is accepted, so a sum that comes out as 0
+ * is stored as 1. The CRC uses the SSE4.2 or ARMv8 instruction when the CPU
+ * has one and a slicing-by-8 table otherwise. */
 
-        if (bytes_read != PAGE_SIZE) {
-            return 0;
-        }
+static const uint8_t zero_page[MAX_PAGE_SIZE];
 
-        struct page_header *ph = (struct page_header *)page_buf;
-        db->header.free_list_head = ph->reserved;
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
 
-        return page_num;
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint32_t (*t)[256] = crc32c_table;
+    while (len >= 8) {
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+               (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+              t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
     }
+    return crc;
+}
 
-    uint64_t page_num = db->header.next_free_page;
-    db->header.next_free_page++;
-    db->header.num_pages++;
-    return page_num;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = __builtin_ia32_crc32di(c, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        crc = __crc32cd(crc, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
 }
+#endif
 
-static int free_page(struct db *db, uint64_t page_num) {
-    uint8_t page_buf[PAGE_SIZE];
-    memset(page_buf, 0, PAGE_SIZE);
+static void crc32c_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+        return;
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_impl = crc32c_hw;
+    return;
+#endif
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+    crc32c_impl = crc32c_sw;
+}
 
-    struct page_header *ph = (struct page_header *)page_buf;
-    ph->page_type = PAGE_TYPE_DELETED;
-    ph->checksum = 0;
-    ph->reserved = db->header.free_list_head;
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, data, len);
+}
 
-    off_t offset = page_num * PAGE_SIZE;
-    ssize_t written = pwrite(db->fd, page_buf, PAGE_SIZE, offset);
+#define CHECKSUM_AT offsetof(struct page_header, checksum)
 
-    if (written != PAGE_SIZE) {
-        errno = EIO;
-        return -1;
-    }
+/* CRC state after a page header, with its checksum field taken as zero.
+ * The checksum of a page is then checksum_finish of this continued over
+ * the rest of the page after the header. */
+static uint32_t checksum_start(const uint8_t *head) {
+    uint32_t crc = crc32c(~0u, head, CHECKSUM_AT);
+    crc = crc32c(crc, zero_page, sizeof(uint32_t));
+    return crc32c(crc, head + CHECKSUM_AT + sizeof(uint32_t),
+                  sizeof(struct page_header) - CHECKSUM_AT - sizeof(uint32_t));
+}
 
-    db->header.free_list_head = page_num;
-    return 0;
+static uint32_t checksum_finish(uint32_t crc) {
+    crc = ~crc;
+    return crc ? crc : 1;
 }
 
-static uint32_t hash_key(const uint8_t *key, uint32_t key_len) {
-    uint32_t hash = 5381;
-    for (uint32_t i = 0; i < key_len; i++) {
-        hash = ((hash << 5) + hash) + key[i];
-    }
-    return hash % HASH_TABLE_SIZE;
+static uint32_t page_checksum(const uint8_t *page, uint32_t page_size) {
+    uint32_t crc = checksum_start(page);
+    return checksum_finish(crc32c(crc, page + sizeof(struct page_header),
+                                  OVERFLOW_PAGE_DATA(page_size)));
 }
 
-static struct hash_table *hash_table_create(void) {
-    struct hash_table *ht = calloc(1, sizeof(*ht));
-    return ht;
+static int sum_matches(uint32_t stored, uint32_t sum) {
+    return stored == 0 || stored == sum;
 }
 
-static void hash_table_insert(struct hash_table *ht, const uint8_t *key,
-                              uint32_t key_len, uint64_t page_num) {
-    if (!ht) return;
+static int page_intact(const uint8_t *page, uint32_t page_size) {
+    const struct page_header *ph = (const struct page_header *)page;
+    return sum_matches(ph->checksum, page_checksum(page, page_size));
+}
 
-    uint32_t bucket = hash_key(key, key_len);
+/* Points three iovecs at a page image with its checksum field replaced by
+ * *sum, so a cached frame is stamped on its way out without changing it
+ * under its readers. */
+static void page_iov(const uint8_t *page, uint32_t page_size, uint32_t *sum,
+                     struct iovec *iov) {
+    *sum = page_checksum(page, page_size);
+    iov[0].iov_base = (void *)page;
+    iov[0].iov_len = CHECKSUM_AT;
+    iov[1].iov_base = sum;
+    iov[1].iov_len = sizeof(*sum);
+    iov[2].iov_base = (void *)(page + CHECKSUM_AT + sizeof(*sum));
+    iov[2].iov_len = page_size - CHECKSUM_AT - sizeof(*sum);
+}
 
-    struct hash_entry *entry = malloc(sizeof(*entry));
-    if (!entry) return;
+/* Copies a page image with its checksum stamped. With DB_OPEN_DIRECT every
+ * buffer has to be aligned, so a write is staged rather than pieced together
+ * from page_iov's iovecs. */
+static void stage_page(uint8_t *dst, const uint8_t *page, uint32_t page_size) {
+    memcpy(dst, page, page_size);
+    ((struct page_header *)dst)->checksum = page_checksum(page, page_size);
+}
 
-    entry->key = malloc(key_len);
-    if (!entry->key) {
-        free(entry);
-        return;
+/* Allocates page-aligned buffers, which direct I/O needs. */
+static uint8_t *page_alloc(struct db *db, size_t pages) {
+    void *p;
+    if (posix_memalign(&p, db->page_size, pages * db->page_size) != 0) {
+        errno = ENOMEM;
+        return NULL;
     }
-
-    memcpy(entry->key, key, key_len);
-    entry->key_len = key_len;
-    entry->page_num = page_num;
-    entry->next = ht->buckets[bucket];
-    ht->buckets[bucket] = entry;
+    return p;
 }
 
-static uint64_t hash_table_lookup(struct hash_table *ht, const uint8_t *key,
-                                   uint32_t key_len) {
-    if (!ht) return 0;
+/* Backup copying. Pages are copied in the kernel with copy_file_range
+ * where it works, and otherwise through a buffer (which DB_OPEN_DIRECT may
+ * need). A backup reads what is in the file, so nothing past its end is
+ * copied and the backup is left with a hole there. */
 
-    uint32_t bucket = hash_key(key, key_len);
-    struct hash_entry *entry = ht->buckets[bucket];
+#define BACKUP_CHUNK_PAGES 256
 
-    while (entry) {
-        if (entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
-            return entry->page_num;
+static int copy_pages_buffered(struct db *db, int fd, uint64_t first, uint64_t n) {
+    uint8_t *buf = page_alloc(db, BACKUP_CHUNK_PAGES);
+    if (!buf) {
+        return -1;
+    }
+    int ret = 0;
+    while (n > 0 && ret == 0) {
+        uint64_t run = n < BACKUP_CHUNK_PAGES ? n : BACKUP_CHUNK_PAGES;
+        ssize_t got = pread(db->fd, buf, run * db->page_size, first * db->page_size);
+        stats_io(db, STAT_READS, got);
+        if (got < 0) {
+            ret = -1;
+            break;
+        }
+        ssize_t put = got > 0 ? pwrite(fd, buf, (size_t)got, first * db->page_size) : 0;
+        if (put != got) {
+            if (put >= 0) {
+                errno = EIO;
+            }
+            ret = -1;
         }
-        entry = entry->next;
+        if ((uint64_t)got < run * db->page_size) {
+            break;
+        }
+        first += run;
+        n -= run;
     }
-
-    return 0;
+    free(buf);
+    return ret;
 }
 
-static void hash_table_remove(struct hash_table *ht, const uint8_t *key,
-                               uint32_t key_len) {
-    if (!ht) return;
-
-    uint32_t bucket = hash_key(key, key_len);
-    struct hash_entry **entry_ptr = &ht->buckets[bucket];
-
-    while (*entry_ptr) {
-        struct hash_entry *entry = *entry_ptr;
-        if (entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
-            *entry_ptr = entry->next;
-            free(entry->key);
-            free(entry);
-            return;
+static int copy_pages(struct db *db, int fd, uint64_t first, uint64_t n) {
+#ifdef __linux__
+    if (!(db->flags & DB_OPEN_DIRECT)) {
+        off_t in = (off_t)(first * db->page_size), out = in;
+        size_t left = n * db->page_size;
+        while (left > 0) {
+            ssize_t got = copy_file_range(db->fd, &in, fd, &out, left, 0);
+            if (got == 0) {
+                return 0;
+            }
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                    errno != EOPNOTSUPP) {
+                    return -1;
+                }
+                break;
+            }
+            left -= (size_t)got;
+        }
+        if (left == 0) {
+            return 0;
         }
-        entry_ptr = &entry->next;
+        uint64_t done = n - left / db->page_size;
+        first += done;
+        n -= done;
     }
+#endif
+    return copy_pages_buffered(db, fd, first, n);
 }
 
-static void hash_table_destroy(struct hash_table *ht) {
-    if (!ht) return;
-
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        struct hash_entry *entry = ht->buckets[i];
-        while (entry) {
-            struct hash_entry *next = entry->next;
-            free(entry->key);
-            free(entry);
-            entry = next;
+/* Copies the pages of [first, first + n) the running backup has not yet
+ * got. Called with backup.lock held; a failure ends the backup, not the
+ * write that led here. */
+static void backup_copy(struct db *db, uint64_t first, uint64_t n) {
+    struct backup_state *b = &db->backup;
+    uint64_t end = first + n < b->pages ? first + n : b->pages;
+    for (uint64_t p = first; p < end && !b->err;) {
+        if (b->copied[p / 64] & (1ull << (p % 64))) {
+            p++;
+            continue;
         }
+        uint64_t run = 1;
+        while (p + run < end && !(b->copied[(p + run) / 64] & (1ull << ((p + run) % 64)))) {
+            run++;
+        }
+        if (copy_pages(db, b->fd, p, run) != 0) {
+            b->err = errno ? errno : EIO;
+        }
+        for (uint64_t i = p; i < p + run; i++) {
+            b->copied[i / 64] |= 1ull << (i % 64);
+        }
+        p += run;
     }
+}
 
-    free(ht);
+/* Called before pages [first, first + n) of the file are overwritten. */
+static void backup_preserve(struct db *db, uint64_t first, uint64_t n) {
+    struct backup_state *b = &db->backup;
+    if (!atomic_load(&b->active)) {
+        return;
+    }
+    pthread_mutex_lock(&b->lock);
+    if (atomic_load(&b->active)) {
+        backup_copy(db, first, n);
+    }
+    pthread_mutex_unlock(&b->lock);
 }
 
-struct db *db_open(const char *path) {
-    if (!path) {
-        errno = EINVAL;
-        return NULL;
+static struct buffer_pool *pool_shard(struct db *db, uint64_t page_num) {
+    return &db->pool[(page_num * 0x9E3779B97F4A7C15ull) >> (64 - POOL_SHARD_BITS)];
+}
+
+/* buf must come from page_alloc or the pool. */
+static int read_page(struct db *db, uint64_t page_num, uint8_t *buf) {
+    off_t offset = page_num * db->page_size;
+    ssize_t bytes_read = pread(db->fd, buf, db->page_size, offset);
+    stats_io(db, STAT_READS, bytes_read);
+
+    if (bytes_read != db->page_size || !page_intact(buf, db->page_size)) {
+        errno = EIO;
+        return -1;
     }
 
-    struct db *db = malloc(sizeof(*db));
-    if (!db) {
-        return NULL;
+    return 0;
+}
+
+static int write_page(struct db *db, uint64_t page_num, const uint8_t *buf) {
+    off_t offset = page_num * db->page_size;
+    backup_preserve(db, page_num, 1);
+    ssize_t written;
+    if (db->flags & DB_OPEN_DIRECT) {
+        struct buffer_pool *bp = pool_shard(db, page_num);
+        pthread_mutex_lock(&bp->stage_lock);
+        stage_page(bp->stage, buf, db->page_size);
+        written = pwrite(db->fd, bp->stage, db->page_size, offset);
+        pthread_mutex_unlock(&bp->stage_lock);
+    } else {
+        uint32_t sum;
+        struct iovec iov[3];
+        page_iov(buf, db->page_size, &sum, iov);
+        written = pwritev(db->fd, iov, 3, offset);
     }
+    stats_io(db, STAT_WRITES, written);
 
-    db->filepath = strdup(path);
-    if (!db->filepath) {
-        free(db);
-        return NULL;
+    if (written != db->page_size) {
+        errno = EIO;
+        return -1;
     }
 
-    int is_new = !file_exists(path);
-    int flags = O_RDWR | O_CREAT;
-    mode_t mode = 0644;
+    return 0;
+}
 
-    db->fd = open(path, flags, mode);
-    if (db->fd < 0) {
-        free(db->filepath);
-        free(db);
-        return NULL;
+/* Page map: page number -> frame index, linear probing. Page 0 is the
+ * header and never cached, so key 0 marks an empty bucket. */
+
+static int page_map_init(struct page_map *m, size_t entries) {
+    size_t size = 16;
+    while (size < entries * 2) {
+        size *= 2;
+    }
+    m->keys = calloc(size, sizeof(*m->keys));
+    m->vals = calloc(size, sizeof(*m->vals));
+    m->mask = size - 1;
+    if (!m->keys || !m->vals) {
+        free(m->keys);
+        free(m->vals);
+        m->keys = NULL;
+        m->vals = NULL;
+        return -1;
     }
+    return 0;
+}
 
-    if (is_new) {
-        if (init_new_db(db->fd) != 0) {
-            int saved_errno = errno;
-            close(db->fd);
-            free(db->filepath);
-            free(db);
-            errno = saved_errno;
-            return NULL;
+static void page_map_destroy(struct page_map *m) {
+    free(m->keys);
+    free(m->vals);
+}
+
+static size_t page_map_home(const struct page_map *m, uint64_t page_num) {
+    return (size_t)((page_num * 0x9E3779B97F4A7C15ull) >> 32) & m->mask;
+}
+
+static int page_map_get(const struct page_map *m, uint64_t page_num,
+                        uint32_t *val) {
+    for (size_t i = page_map_home(m, page_num); m->keys[i] != 0;
+         i = (i + 1) & m->mask) {
+        if (m->keys[i] == page_num) {
+            *val = m->vals[i];
+            return 1;
         }
     }
+    return 0;
+}
 
-    if (read_header(db->fd, &db->header) != 0) {
-        int saved_errno = errno;
-        close(db->fd);
-        free(db->filepath);
-        free(db);
-        errno = saved_errno;
-        return NULL;
+static void page_map_put(struct page_map *m, uint64_t page_num, uint32_t val) {
+    size_t i = page_map_home(m, page_num);
+    while (m->keys[i] != 0 && m->keys[i] != page_num) {
+        i = (i + 1) & m->mask;
     }
+    m->keys[i] = page_num;
+    m->vals[i] = val;
+}
 
-    db->index = hash_table_create();
-    if (!db->index) {
-        close(db->fd);
-        free(db->filepath);
-        free(db);
-        return NULL;
+static void page_map_del(struct page_map *m, uint64_t page_num) {
+    size_t i = page_map_home(m, page_num);
+    while (m->keys[i] != page_num) {
+        if (m->keys[i] == 0) return;
+        i = (i + 1) & m->mask;
     }
 
-    uint8_t page_buf[PAGE_SIZE];
-    for (uint64_t page_num = 1; page_num < db->header.next_free_page; page_num++) {
-        off_t offset = page_num * PAGE_SIZE;
-        ssize_t bytes_read = pread(db->fd, page_buf, PAGE_SIZE, offset);
-
-        if (bytes_read != PAGE_SIZE) {
-            continue;
+    /* Backward-shift so later probes never see a hole in their run. */
+    for (size_t j = (i + 1) & m->mask; m->keys[j] != 0; j = (j + 1) & m->mask) {
+        size_t home = page_map_home(m, m->keys[j]);
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->keys[i] = m->keys[j];
+            m->vals[i] = m->vals[j];
+            i = j;
         }
+    }
+    m->keys[i] = 0;
+}
 
-        struct page_header *ph = (struct page_header *)page_buf;
-        if (ph->page_type != PAGE_TYPE_DATA) {
-            continue;
-        }
+/* Buffer pool */
 
-        uint8_t *p = page_buf + sizeof(struct page_header);
-        uint32_t key_len;
-        memcpy(&key_len, p, sizeof(uint32_t));
-        p += sizeof(uint32_t);
+static void list_push_head(struct frame_list *l, struct frame *f) {
+    f->prev = NULL;
+    f->next = l->head;
+    if (l->head) {
+        l->head->prev = f;
+    } else {
+        l->tail = f;
+    }
+    l->head = f;
+    l->len++;
+}
 
-        hash_table_insert(db->index, p, key_len, page_num);
+static void list_remove(struct frame_list *l, struct frame *f) {
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        l->head = f->next;
     }
+    if (f->next) {
+        f->next->prev = f->prev;
+    } else {
+        l->tail = f->prev;
+    }
+    f->prev = f->next = NULL;
+    l->len--;
+}
 
-    return db;
+static struct frame_list *frame_queue(struct buffer_pool *bp, struct frame *f) {
+    switch (f->queue) {
+    case FRAME_A1IN: return &bp->a1in;
+    case FRAME_AM:   return &bp->am;
+    default:         return &bp->free;
+    }
 }
 
-void db_close(struct db *db) {
-    if (!db) {
-        return;
+/* stage asks for the DB_OPEN_DIRECT staging page, carved from the end of
+ * the frames' memory. */
+static int pool_init(struct buffer_pool *bp, size_t nframes, uint32_t page_size,
+                     int stage) {
+    memset(bp, 0, sizeof(*bp));
+
+    /* 2Q's recommended split: a1in holds a quarter of the frames and the
+     * ghost ring remembers half as many pages as the pool holds. */
+    bp->nframes = nframes;
+    bp->a1in_max = nframes / 4 ? nframes / 4 : 1;
+    bp->ghost_cap = nframes / 2 ? nframes / 2 : 1;
+
+    bp->frames = calloc(nframes, sizeof(*bp->frames));
+    bp->ghosts = calloc(bp->ghost_cap, sizeof(*bp->ghosts));
+    if (!bp->frames || !bp->ghosts ||
+        posix_memalign((void **)&bp->memory, page_size,
+                       (nframes + (stage ? 1 : 0)) * page_size) != 0) {
+        bp->memory = NULL;
+        goto fail;
+    }
+    if (page_map_init(&bp->table, nframes) != 0 ||
+        page_map_init(&bp->ghost_set, bp->ghost_cap) != 0) {
+        goto fail;
     }
 
-    pwrite(db->fd, &db->header, sizeof(db->header), 0);
-    fsync(db->fd);
-    close(db->fd);
-    hash_table_destroy(db->index);
-    free(db->filepath);
-    free(db);
+    for (size_t i = nframes; i-- > 0;) {
+        bp->frames[i].data = bp->memory + i * page_size;
+        pthread_rwlock_init(&bp->frames[i].latch, NULL);
+        list_push_head(&bp->free, &bp->frames[i]);
+    }
+    bp->stage = stage ? bp->memory + nframes * page_size : NULL;
+    pthread_mutex_init(&bp->lock, NULL);
+    pthread_mutex_init(&bp->stage_lock, NULL);
+    return 0;
+
+fail:
+    free(bp->frames);
+    free(bp->ghosts);
+    free(bp->memory);
+    page_map_destroy(&bp->table);
+    page_map_destroy(&bp->ghost_set);
+    memset(bp, 0, sizeof(*bp));
+    errno = ENOMEM;
+    return -1;
 }
 
-int db_put(struct db *db, const uint8_t *key, uint32_t key_len,
-           const uint8_t *val, uint32_t val_len) {
-    if (!db || !key || !val) {
-        errno = EINVAL;
-        return -1;
+static void pool_destroy(struct buffer_pool *bp) {
+    if (!bp->frames) {
+        return;
     }
 
-    uint32_t required = sizeof(struct page_header) +
-                        sizeof(uint32_t) + key_len +
-                        sizeof(uint32_t) + val_len;
-    if (required > PAGE_SIZE) {
-        errno = EFBIG;
-        return -1;
+    for (size_t i = 0; i < bp->nframes; i++) {
+        pthread_rwlock_destroy(&bp->frames[i].latch);
     }
+    pthread_mutex_destroy(&bp->lock);
+    pthread_mutex_destroy(&bp->stage_lock);
+    free(bp->frames);
+    free(bp->ghosts);
+    free(bp->memory);
+    page_map_destroy(&bp->table);
+    page_map_destroy(&bp->ghost_set);
+    memset(bp, 0, sizeof(*bp));
+}
 
-    uint64_t old_page_num = hash_table_lookup(db->index, key, key_len);
-
-    uint64_t new_page_num = alloc_page(db);
-    if (new_page_num == 0) {
-        errno = EIO;
-        return -1;
+static void ghost_add(struct buffer_pool *bp, uint64_t page_num) {
+    if (bp->ghost_len == bp->ghost_cap) {
+        size_t oldest = (bp->ghost_head + bp->ghost_cap - bp->ghost_len) % bp->ghost_cap;
+        page_map_del(&bp->ghost_set, bp->ghosts[oldest]);
+        bp->ghost_len--;
     }
+    bp->ghosts[bp->ghost_head] = page_num;
+    bp->ghost_head = (bp->ghost_head + 1) % bp->ghost_cap;
+    bp->ghost_len++;
+    page_map_put(&bp->ghost_set, page_num, 0);
+}
 
-    if (old_page_num != 0) {
-        hash_table_remove(db->index, key, key_len);
-        free_page(db, old_page_num);
+static struct frame *oldest_unpinned(struct frame_list *l) {
+    struct frame *f = l->tail;
+    while (f && f->pins > 0) {
+        f = f->prev;
     }
+    return f;
+}
 
-    uint8_t page_buf[PAGE_SIZE];
-    memset(page_buf, 0, PAGE_SIZE);
+/* Writes a cached page image to the file, bracketed for mapped readers. */
+static int write_back(struct db *db, uint64_t page_num, const uint8_t *buf) {
+    atomic_fetch_add(&db->writebacks_started, 1);
+    int ret = write_page(db, page_num, buf);
+    atomic_fetch_add(&db->writebacks_done, 1);
+    return ret;
+}
 
-    struct page_header *ph = (struct page_header *)page_buf;
-    ph->page_type = PAGE_TYPE_DATA;
-    ph->checksum = 0;
-    ph->reserved = 0;
+/* Writes back f, cached, unpinned and dirty, with bp->lock dropped for the
+ * write. f stays cached meanwhile, pinned and latched shared, so it can be
+ * pinned and read but not changed. Returns with bp->lock held again;
+ * whoever pinned f meanwhile still holds it. */
+static int frame_write_back(struct db *db, struct buffer_pool *bp, struct frame *f) {
+    f->pins++;
+    f->dirty = 0;
+    pthread_rwlock_rdlock(&f->latch);
+    pthread_mutex_unlock(&bp->lock);
+    int ret = write_back(db, f->page_num, f->data);
+    int err = errno;
+    pthread_mutex_lock(&bp->lock);
+    pthread_rwlock_unlock(&f->latch);
+    f->pins--;
+    if (ret != 0) {
+        f->dirty = 1;
+        errno = err;
+    }
+    return ret;
+}
 
-    uint8_t *p = page_buf + sizeof(struct page_header);
-    memcpy(p, &key_len, sizeof(uint32_t));
-    p += sizeof(uint32_t);
-    memcpy(p, key, key_len);
-    p += key_len;
-    memcpy(p, &val_len, sizeof(uint32_t));
-    p += sizeof(uint32_t);
-    memcpy(p, val, val_len);
+/* Frees up a frame in bp, writing it back first if it is dirty. a1in gives
+ * up its oldest page while over its share; otherwise am's least recently
+ * used page goes, and a victim pinned while it was written back is passed
+ * over. Called with bp->lock held, which the write-back drops. */
+static struct frame *pool_evict(struct db *db, struct buffer_pool *bp) {
+    for (;;) {
+        if (bp->free.head) {
+            struct frame *f = bp->free.head;
+            list_remove(&bp->free, f);
+            return f;
+        }
+
+        struct frame *f = NULL;
+        if (bp->a1in.len > bp->a1in_max) {
+            f = oldest_unpinned(&bp->a1in);
+        }
+        if (!f) {
+            f = oldest_unpinned(&bp->am);
+        }
+        if (!f) {
+            f = oldest_unpinned(&bp->a1in);
+        }
+        if (!f) {
+            errno = ENOBUFS;
+            return NULL;
+        }
 
-    off_t offset = new_page_num * PAGE_SIZE;
-    ssize_t written = pwrite(db->fd, page_buf, PAGE_SIZE, offset);
+        if (f->dirty) {
+            if (frame_write_back(db, bp, f) != 0) {
+                return NULL;
+            }
+            if (f->pins > 0 || f->dirty) {
+                continue;
+            }
+        }
 
-    if (written != PAGE_SIZE) {
-        errno = EIO;
-        return -1;
+        if (f->queue == FRAME_A1IN) {
+            ghost_add(bp, f->page_num);
+        }
+        list_remove(frame_queue(bp, f), f);
+        page_map_del(&bp->table, f->page_num);
+        f->page_num = 0;
+        f->dirty = 0;
+        f->queue = FRAME_FREE;
+        return f;
     }
+}
 
-    hash_table_insert(db->index, key, key_len, new_page_num);
+/* Caches an evicted frame, now holding page_num, with pins pins. A page
+ * remembered as a ghost goes straight to am. Called with bp->lock held. */
+static void pool_install(struct buffer_pool *bp, struct frame *f,
+                         uint64_t page_num, uint32_t pins) {
+    f->page_num = page_num;
+    f->pins = pins;
+    f->dirty = 0;
 
-    return 0;
+    uint32_t unused;
+    if (page_map_get(&bp->ghost_set, page_num, &unused)) {
+        page_map_del(&bp->ghost_set, page_num);
+        f->queue = FRAME_AM;
+        list_push_head(&bp->am, f);
+    } else {
+        f->queue = FRAME_A1IN;
+        list_push_head(&bp->a1in, f);
+    }
+    page_map_put(&bp->table, page_num, (uint32_t)(f - bp->frames));
 }
 
-uint8_t *db_get(struct db *db, const uint8_t *key, uint32_t key_len,
-                uint32_t *val_len_out) {
-    if (!db || !key || !val_len_out) {
-        errno = EINVAL;
-        return NULL;
+/* Drops a pin on f, whose load failed, freeing it with the last pin.
+ * Called with bp->lock held. */
+static void frame_drop_failed(struct buffer_pool *bp, struct frame *f) {
+    if (--f->pins == 0) {
+        f->page_num = 0;
+        f->load_err = 0;
+        list_push_head(&bp->free, f);
     }
+}
 
-    uint64_t page_num = hash_table_lookup(db->index, key, key_len);
-    if (page_num == 0) {
-        errno = ENOENT;
+/* Waits for another thread's load of f, which the caller has pinned, to
+ * finish. Called with bp->lock held; returns with it dropped. */
+static struct frame *pool_wait_load(struct buffer_pool *bp, struct frame *f) {
+    pthread_mutex_unlock(&bp->lock);
+    pthread_rwlock_rdlock(&f->latch);
+    pthread_rwlock_unlock(&f->latch);
+
+    pthread_mutex_lock(&bp->lock);
+    int err = f->load_err;
+    if (err) {
+        frame_drop_failed(bp, f);
+    }
+    pthread_mutex_unlock(&bp->lock);
+    if (err) {
+        errno = err;
         return NULL;
     }
+    return f;
+}
 
-    uint8_t page_buf[PAGE_SIZE];
-    off_t offset = page_num * PAGE_SIZE;
-    ssize_t bytes_read = pread(db->fd, page_buf, PAGE_SIZE, offset);
+/* Pins page_num in the pool. With load == 0 the caller is about to
+ * overwrite the whole page, so a miss skips the read. The pin keeps the
+ * frame resident; its contents still need the latch. A miss is read with
+ * bp->lock dropped, the frame already cached and latched (see struct
+ * frame), so hits on other pages never wait for it. */
+static struct frame *pool_pin(struct db *db, uint64_t page_num, int load) {
+    struct buffer_pool *bp = pool_shard(db, page_num);
+    pthread_mutex_lock(&bp->lock);
 
-    if (bytes_read != PAGE_SIZE) {
-        errno = EIO;
-        return NULL;
+    struct frame *f = NULL;
+    while (!f) {
+        uint32_t idx;
+        if (page_map_get(&bp->table, page_num, &idx)) {
+            f = &bp->frames[idx];
+            if (f->queue == FRAME_AM) {
+                list_remove(&bp->am, f);
+                list_push_head(&bp->am, f);
+            }
+            f->pins++;
+            stats_add(db, STAT_POOL_HITS, 1);
+            if (f->loading) {
+                return pool_wait_load(bp, f);
+            }
+            pthread_mutex_unlock(&bp->lock);
+            return f;
+        }
+
+        f = pool_evict(db, bp);
+        if (!f) {
+            pthread_mutex_unlock(&bp->lock);
+            return NULL;
+        }
+        /* Writing back a victim drops the lock; the page may be in now. */
+        if (page_map_get(&bp->table, page_num, &idx)) {
+            list_push_head(&bp->free, f);
+            f = NULL;
+        }
     }
 
-    uint8_t *p = page_buf + sizeof(struct page_header) + sizeof(uint32_t);
-    p += key_len;
+    pool_install(bp, f, page_num, 1);
+    if (!load) {
+        pthread_mutex_unlock(&bp->lock);
+        return f;
+    }
 
-    uint32_t val_len;
-    memcpy(&val_len, p, sizeof(uint32_t));
-    p += sizeof(uint32_t);
+    stats_add(db, STAT_POOL_MISSES, 1);
+    f->loading = 1;
+    pthread_rwlock_wrlock(&f->latch);
+    pthread_mutex_unlock(&bp->lock);
+    int ret = read_page(db, page_num, f->data);
+    int err = errno;
 
-    uint8_t *val = malloc(val_len);
-    if (!val) {
+    pthread_mutex_lock(&bp->lock);
+    f->loading = 0;
+    if (ret != 0) {
+        list_remove(frame_queue(bp, f), f);
+        page_map_del(&bp->table, page_num);
+        f->queue = FRAME_FREE;
+        f->load_err = err;
+    }
+    pthread_rwlock_unlock(&f->latch);
+    if (ret != 0) {
+        frame_drop_failed(bp, f);
+    }
+    pthread_mutex_unlock(&bp->lock);
+    if (ret != 0) {
+        errno = err;
         return NULL;
     }
+    return f;
+}
 
-    memcpy(val, p, val_len);
-    *val_len_out = val_len;
-    return val;
+static void pool_unpin(struct db *db, struct frame *f, int dirty) {
+    struct buffer_pool *bp = pool_shard(db, f->page_num);
+    pthread_mutex_lock(&bp->lock);
+    if (dirty) {
+        f->dirty = 1;
+    }
+    f->pins--;
+    pthread_mutex_unlock(&bp->lock);
 }
 
-int db_delete(struct db *db, const uint8_t *key, uint32_t key_len) {
-    if (!db || !key) {
-        errno = EINVAL;
-        return -1;
+static int pool_cached(struct db *db, uint64_t page_num) {
+    struct buffer_pool *bp = pool_shard(db, page_num);
+    uint32_t unused;
+    pthread_mutex_lock(&bp->lock);
+    int cached = page_map_get(&bp->table, page_num, &unused);
+    pthread_mutex_unlock(&bp->lock);
+    return cached;
+}
+
+/* Drops page_num from the pool before the page is written directly, so a
+ * stale frame is never written back over it. A dirty frame is written back
+ * first, so the file holds what the pool made of the page (a freed page's
+ * DELETED image, say) for anyone who loads it meanwhile. Fails if the frame
+ * is pinned, or was pinned while it was written back. */
+static int pool_forget(struct db *db, uint64_t page_num) {
+    struct buffer_pool *bp = pool_shard(db, page_num);
+    pthread_mutex_lock(&bp->lock);
+
+    int ret = 0;
+    uint32_t idx;
+    if (page_map_get(&bp->table, page_num, &idx)) {
+        struct frame *f = &bp->frames[idx];
+        if (f->pins == 0 && f->dirty && frame_write_back(db, bp, f) != 0) {
+            ret = -1;
+        } else if (f->pins > 0 || f->dirty) {
+            ret = -1;
+        } else {
+            list_remove(frame_queue(bp, f), f);
+            page_map_del(&bp->table, page_num);
+            f->page_num = 0;
+            f->dirty = 0;
+            f->queue = FRAME_FREE;
+            list_push_head(&bp->free, f);
+        }
     }
+    pthread_mutex_unlock(&bp->lock);
+    return ret;
+}
 
-    uint64_t page_num = hash_table_lookup(db->index, key, key_len);
-    if (page_num == 0) {
-        errno = ENOENT;
-        return -1;
+#define PREFETCH_IOV_MAX 64
+
+/* Loads the pages of pages[0, n), sorted and distinct, that the pool does
+ * not hold, with one preadv per run of adjacent pages, and caches them
+ * unpinned. As with a mapped read, the images are only current if nothing
+ * was written back while they were read, so otherwise they are dropped and
+ * the pages are loaded again on demand. Best effort: a page that cannot be
+ * prefetched is simply loaded later by whoever pins it. */
+static void pool_prefetch(struct db *db, const uint64_t *pages, size_t n) {
+    struct frame *frames[PREFETCH_IOV_MAX];
+    struct iovec iov[PREFETCH_IOV_MAX];
+
+    for (size_t i = 0; i < n;) {
+        /* Take frames for the run first: evicting one may write it back. */
+        size_t run = 0;
+        int cached = 0, out_of_frames = 0;
+        while (i + run < n && run < PREFETCH_IOV_MAX &&
+               pages[i + run] == pages[i] + run) {
+            struct buffer_pool *bp = pool_shard(db, pages[i + run]);
+            uint32_t unused;
+            pthread_mutex_lock(&bp->lock);
+            struct frame *f = NULL;
+            cached = page_map_get(&bp->table, pages[i + run], &unused);
+            if (!cached) {
+                f = pool_evict(db, bp);
+                out_of_frames = f == NULL;
+            }
+            pthread_mutex_unlock(&bp->lock);
+            if (!f) {
+                break;
+            }
+            frames[run] = f;
+            iov[run].iov_base = f->data;
+            iov[run].iov_len = db->page_size;
+            run++;
+        }
+
+        uint64_t seq = atomic_load(&db->writebacks_started);
+        size_t got = 0;
+        if (run > 0 && atomic_load(&db->writebacks_done) == seq) {
+            ssize_t bytes = preadv(db->fd, iov, (int)run, pages[i] * db->page_size);
+            stats_io(db, STAT_READS, bytes);
+            if (bytes > 0 && atomic_load(&db->writebacks_started) == seq) {
+                got = (size_t)bytes / db->page_size;
+            }
+        }
+
+        for (size_t j = 0; j < run; j++) {
+            struct frame *f = frames[j];
+            struct buffer_pool *bp = pool_shard(db, pages[i + j]);
+            uint32_t unused;
+            pthread_mutex_lock(&bp->lock);
+            if (j < got && page_intact(f->data, db->page_size) &&
+                !page_map_get(&bp->table, pages[i + j], &unused)) {
+                pool_install(bp, f, pages[i + j], 0);
+            } else {
+                list_push_head(&bp->free, f);
+            }
+            pthread_mutex_unlock(&bp->lock);
+        }
+
+        if (out_of_frames) {
+            return;
+        }
+        /* A cached page that ended the run needs no read either. */
+        i += run + cached;
+    }
+}
+
+/* Memory-mapped reads */
+
+#define MAP_MIN_SIZE (1u << 20)
+
+static void file_map_init(struct file_map *m) {
+    pthread_mutex_init(&m->lock, NULL);
+    atomic_init(&m->cur, NULL);
+    atomic_init(&m->valid_pages, 0);
+}
+
+static void file_map_destroy(struct file_map *m) {
+    struct map_region *r = atomic_load(&m->cur);
+    while (r) {
+        struct map_region *next = r->next;
+        munmap(r->base, r->size);
+        free(r);
+        r = next;
     }
+    pthread_mutex_destroy(&m->lock);
+}
 
-    if (free_page(db, page_num) != 0) {
+/* Brings the mapping up to the current file size. A new region is at least
+ * twice the old one so remaps stay rare as the file grows. */
+static int file_map_refresh(struct db *db) {
+    struct file_map *m = &db->map;
+    pthread_mutex_lock(&m->lock);
+
+    struct stat st;
+    if (fstat(db->fd, &st) != 0) {
+        pthread_mutex_unlock(&m->lock);
         return -1;
     }
+    size_t file_size = (size_t)st.st_size;
 
-    hash_table_remove(db->index, key, key_len);
+    struct map_region *cur = atomic_load(&m->cur);
+    if (!cur || file_size > cur->size) {
+        size_t size = cur ? cur->size * 2 : MAP_MIN_SIZE;
+        while (size < file_size) {
+            size *= 2;
+        }
+
+        struct map_region *r = malloc(sizeof(*r));
+        void *base = r ? mmap(NULL, size, PROT_READ, MAP_SHARED, db->fd, 0)
+                       : MAP_FAILED;
+        if (base == MAP_FAILED) {
+            free(r);
+            pthread_mutex_unlock(&m->lock);
+            return -1;
+        }
+        r->base = base;
+        r->size = size;
+        r->next = cur;
+        atomic_store(&m->cur, r);
+    }
 
+    atomic_store(&m->valid_pages, file_size / db->page_size);
+    pthread_mutex_unlock(&m->lock);
     return 0;
 }
+
+/* Returns a pointer to page_num inside the mapping, or NULL if the page is
+ * past the end of the file. */
+static const uint8_t *file_map_page(struct db *db, uint64_t page_num) {
+    if (page_num >= atomic_load(&db->map.valid_pages) &&
+        (file_map_refresh(db) != 0 ||
+         page_num >= atomic_load(&db->map.valid_pages))) {
+        return NULL;
+    }
+
+    return atomic_load(&db->map.cur)->base + page_num * db->page_size;
+}
+
+static int compare_frames(const void *a, const void *b) {
+    uint64_t x = (*(struct frame *const *)a)->page_num;
+    uint64_t y = (*(struct frame *const *)b)->page_num;
+    return x < y ? -1 : x > y;
+}
+
+#define FLUSH_IOV_MAX 64
+
+static void pool_set_dirty(struct db *db, struct frame *f, int dirty) {
+    struct buffer_pool *bp = pool_shard(db, f->page_num);
+    pthread_mutex_lock(&bp->lock);
+    f->dirty = dirty;
+    pthread_mutex_unlock(&bp->lock);
+}
+
+/* Writes back every dirty frame in page order, with one pwritev per run of
+ * adjacent pages. Frames are pinned while being written and latched shared
+ * so no writer changes them mid-write. A frame's dirty bit is cleared before
+ * the write, so a change made after the latch drops marks it again. */
+static int pool_flush(struct db *db) {
+    size_t nframes = 0;
+    for (int s = 0; s < POOL_SHARDS; s++) {
+        nframes += db->pool[s].nframes;
+    }
+
+    struct frame **dirty = malloc(nframes * sizeof(*dirty));
+    uint8_t *staged = NULL;
+    if (dirty && (db->flags & DB_OPEN_DIRECT)) {
+        staged = page_alloc(db, FLUSH_IOV_MAX);
+    }
+    if (!dirty || ((db->flags & DB_OPEN_DIRECT) && !staged)) {
+        free(dirty);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t n = 0;
+    for (int s = 0; s < POOL_SHARDS; s++) {
+        struct buffer_pool *bp = &db->pool[s];
+        pthread_mutex_lock(&bp->lock);
+        for (size_t i = 0; i < bp->nframes; i++) {
+            if (bp->frames[i].dirty) {
+                bp->frames[i].pins++;
+                dirty[n++] = &bp->frames[i];
+            }
+        }
+        pthread_mutex_unlock(&bp->lock);
+    }
+    qsort(dirty, n, sizeof(*dirty), compare_frames);
+
+    int ret = 0;
+    struct iovec iov[FLUSH_IOV_MAX * 3];
+    uint32_t sums[FLUSH_IOV_MAX];
+    for (size_t i = 0; i < n;) {
+        size_t run = 0;
+        while (i + run < n && run < FLUSH_IOV_MAX &&
+               dirty[i + run]->page_num == dirty[i]->page_num + run) {
+            struct frame *f = dirty[i + run];
+            pthread_rwlock_rdlock(&f->latch);
+            pool_set_dirty(db, f, 0);
+            if (staged) {
+                stage_page(staged + run * db->page_size, f->data, db->page_size);
+            } else {
+                page_iov(f->data, db->page_size, &sums[run], &iov[run * 3]);
+            }
+            run++;
+        }
+
+        if (ret == 0) {
+            off_t offset = dirty[i]->page_num * db->page_size;
+            backup_preserve(db, dirty[i]->page_num, run);
+            atomic_fetch_add(&db->writebacks_started, 1);
+            ssize_t written = staged
+                              ? pwrite(db->fd, staged, run * db->page_size, offset)
+                              : pwritev(db->fd, iov, (int)run * 3, offset);
+            atomic_fetch_add(&db->writebacks_done, 1);
+            stats_io(db, STAT_WRITES, written);
+            if (written != (ssize_t)(run * db->page_size)) {
+                errno = EIO;
+                ret = -1;
+            }
+        }
+        for (size_t j = 0; j < run; j++) {
+            struct frame *f = dirty[i + j];
+            pthread_rwlock_unlock(&f->latch);
+            pool_unpin(db, f, ret != 0);
+        }
+        i += run;
+    }
+
+    free(staged);
+    free(dirty);
+    return ret;
+}
+
+/* Space map */
+
+static int space_map_grow(struct space_map *sm, uint64_t page_num) {
+    uint64_t leaves = sm->leaves ? sm->leaves : 64;
+    while (leaves <= page_num) {
+        leaves *= 2;
+    }
+
+    uint16_t *tree = calloc(2 * leaves, sizeof(*tree));
+    if (!tree) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < sm->leaves; i++) {
+        tree[leaves + i] = sm->tree[sm->leaves + i];
+    }
+    for (uint64_t i = leaves - 1; i > 0; i--) {
+        uint16_t l = tree[2 * i], r = tree[2 * i + 1];
+        tree[i] = l > r ? l : r;
+    }
+
+    free(sm->tree);
+    sm->tree = tree;
+    sm->leaves = leaves;
+    return 0;
+}
+
+static int space_map_set(struct space_map *sm, uint64_t page_num,
+                         uint16_t free_bytes) {
+    if (page_num >= sm->leaves && space_map_grow(sm, page_num) != 0) {
+        return -1;
+    }
+
+    uint64_t i = sm->leaves + page_num;
+    sm->tree[i] = free_bytes;
+    for (i /= 2; i > 0; i /= 2) {
+        uint16_t l = sm->tree[2 * i], r = sm->tree[2 * i + 1];
+        uint16_t m = l > r ? l : r;
+        if (sm->tree[i] == m) {
+            break;
+        }
+        sm->tree[i] = m;
+    }
+
+    return 0;
+}
+
+/* Lowest-numbered page with at least `needed` free bytes, or 0. */
+static uint64_t space_map_find(const struct space_map *sm, uint16_t needed) {
+    if (!sm->tree || sm->tree[1] < needed) {
+        return 0;
+    }
+
+    uint64_t i = 1;
+    while (i < sm->leaves) {
+        i = sm->tree[2 * i] >= needed ? 2 * i : 2 * i + 1;
+    }
+    return i - sm->leaves;
+}
+
+/* Bulk-loads free bytes for pages [0, n) and rebuilds the tree once. */
+static int space_map_load(struct space_map *sm, const uint16_t *free_bytes,
+                          uint64_t n) {
+    if (n > 0 && n - 1 >= sm->leaves && space_map_grow(sm, n - 1) != 0) {
+        return -1;
+    }
+
+    memcpy(sm->tree + sm->leaves, free_bytes, n * sizeof(*free_bytes));
+    for (uint64_t i = sm->leaves - 1; i > 0; i--) {
+        uint16_t l = sm->tree[2 * i], r = sm->tree[2 * i + 1];
+        sm->tree[i] = l > r ? l : r;
+    }
+    return 0;
+}
+
+static void space_map_destroy(struct space_map *sm) {
+    free(sm->tree);
+    sm->tree = NULL;
+    sm->leaves = 0;
+}
+
+/* Free map */
+
+/* Makes the set cover pages [0, pages). */
+static int free_map_grow(struct free_map *fm, uint64_t pages) {
+    uint64_t words = (pages + 63) / 64;
+    if (words <= fm->words) {
+        return 0;
+    }
+
+    uint64_t cap = fm->words ? fm->words : 64;
+    while (cap < words) {
+        cap *= 2;
+    }
+    uint64_t *bits = realloc(fm->bits, cap * sizeof(*bits));
+    if (!bits) {
+        return -1;
+    }
+    memset(bits + fm->words, 0, (cap - fm->words) * sizeof(*bits));
+    fm->bits = bits;
+    fm->words = cap;
+    return 0;
+}
+
+static void free_map_set(struct free_map *fm, uint64_t page_num, int is_free) {
+    uint64_t *w = &fm->bits[page_num / 64];
+    uint64_t bit = 1ull << (page_num % 64);
+    if (is_free && !(*w & bit)) {
+        *w |= bit;
+        fm->count++;
+    } else if (!is_free && (*w & bit)) {
+        *w &= ~bit;
+        fm->count--;
+    }
+}
+
+static int free_map_test(const struct free_map *fm, uint64_t page_num) {
+    return (fm->bits[page_num / 64] >> (page_num % 64)) & 1;
+}
+
+/* First free page at or after hint, wrapping around, or 0. */
+static uint64_t free_map_next(const struct free_map *fm) {
+    if (fm->count == 0) {
+        return 0;
+    }
+
+    uint64_t hint = fm->hint % (fm->words * 64);
+    uint64_t start = hint / 64;
+    for (uint64_t i = 0; i <= fm->words; i++) {
+        uint64_t wi = (start + i) % fm->words;
+        uint64_t w = fm->bits[wi];
+        if (i == 0) {
+            w &= ~0ull << (hint % 64);
+        } else if (i == fm->words) {
+            w &= ~(~0ull << (hint % 64));
+        }
+        if (w) {
+            return wi * 64 + (uint64_t)__builtin_ctzll(w);
+        }
+    }
+    return 0;
+}
+
+/* First run of n free pages, or 0. Whole words are skipped at once. */
+static uint64_t free_map_find_run(const struct free_map *fm, uint64_t n) {
+    if (fm->count < n) {
+        return 0;
+    }
+
+    uint64_t start = 0, run = 0;
+    for (uint64_t wi = 0; wi < fm->words; wi++) {
+        uint64_t w = fm->bits[wi];
+        if (w == 0) {
+            run = 0;
+            continue;
+        }
+        if (w == ~0ull) {
+            if (run == 0) {
+                start = wi * 64;
+            }
+            run += 64;
+            if (run >= n) {
+                return start;
+            }
+            continue;
+        }
+        for (int b = 0; b < 64; b++) {
+            if (!(w >> b & 1)) {
+                run = 0;
+                continue;
+            }
+            if (run == 0) {
+                start = wi * 64 + (uint64_t)b;
+            }
+            if (++run >= n) {
+                return start;
+            }
+        }
+    }
+    return 0;
+}
+
+static void free_map_clear(struct free_map *fm) {
+    if (fm->bits) {
+        memset(fm->bits, 0, fm->words * sizeof(*fm->bits));
+    }
+    fm->count = 0;
+    fm->hint = 0;
+}
+
+static void free_map_destroy(struct free_map *fm) {
+    free(fm->bits);
+    memset(fm, 0, sizeof(*fm));
+}
+
+/* Slotted data pages */
+
+static struct data_page_header *data_page_hdr(uint8_t *page) {
+    return (struct data_page_header *)(page + sizeof(struct page_header));
+}
+
+static struct slot *data_page_slots(uint8_t *page) {
+    return (struct slot *)(page + DATA_PAGE_HEADERS);
+}
+
+static void data_page_init(uint8_t *page, uint32_t page_size) {
+    memset(page, 0, page_size);
+
+    struct page_header *ph = (struct page_header *)page;
+    ph->page_type = PAGE_TYPE_DATA;
+
+    struct data_page_header *dh = data_page_hdr(page);
+    dh->num_slots = 0;
+    dh->data_start = page_size;
+    dh->free_bytes = page_size - DATA_PAGE_HEADERS;
+}
+
+/* Free bytes a new record can count on, including the space for a new slot. */
+static uint16_t data_page_usable(uint8_t *page) {
+    struct data_page_header *dh = data_page_hdr(page);
+    if (dh->free_bytes < sizeof(struct slot)) {
+        return 0;
+    }
+    return dh->free_bytes - sizeof(struct slot);
+}
+
+/* Data pages and B+tree nodes are compacted through a copy in a page of
+ * the calling thread's own, so no compaction waits on another. Aligned for
+ * the node header btree_compact reads from it. */
+static _Thread_local _Alignas(16) uint8_t compact_scratch[MAX_PAGE_SIZE];
+
+/* Slide live records back to the end of the page so all free space is
+ * contiguous between the slot directory and the record area. */
+static void data_page_compact(uint8_t *page, uint32_t page_size) {
+    struct data_page_header *dh = data_page_hdr(page);
+    struct slot *slots = data_page_slots(page);
+    uint16_t top = page_size;
+
+    uint8_t *tmp = compact_scratch;
+    for (uint16_t i = 0; i < dh->num_slots; i++) {
+        if (slots[i].offset == 0) {
+            continue;
+        }
+        top -= slots[i].length;
+        memcpy(tmp + top, page + slots[i].offset, slots[i].length);
+        slots[i].offset = top;
+    }
+
+    memcpy(page + top, tmp + top, page_size - top);
+    dh->data_start = top;
+}
+
+/* Free bytes a new record can count on without compacting the page. */
+static uint16_t data_page_contiguous(uint8_t *page) {
+    struct data_page_header *dh = data_page_hdr(page);
+    uint32_t dir_end = DATA_PAGE_HEADERS +
+                       (dh->num_slots + 1) * sizeof(struct slot);
+    return dh->data_start > dir_end ? dh->data_start - dir_end : 0;
+}
+
+/* What the space map should advertise for a page: everything when it may be
+ * compacted, otherwise only the gap in the middle. */
+static uint16_t data_page_room(uint8_t *page, int may_compact) {
+    return may_compact ? data_page_usable(page) : data_page_contiguous(page);
+}
+
+/* Reserves `len` bytes for a record and returns a pointer to them, or NULL
+ * if the page does not have room (without compacting, unless may_compact). */
+static uint8_t *data_page_alloc(uint8_t *page, uint32_t page_size, uint16_t len,
+                                uint16_t *slot_out, int may_compact) {
+    struct data_page_header *dh = data_page_hdr(page);
+    struct slot *slots = data_page_slots(page);
+
+    uint16_t slot = dh->num_slots;
+    for (uint16_t i = 0; i < dh->num_slots; i++) {
+        if (slots[i].offset == 0) {
+            slot = i;
+            break;
+        }
+    }
+
+    uint16_t slot_cost = slot == dh->num_slots ? sizeof(struct slot) : 0;
+    if ((uint32_t)len + slot_cost > dh->free_bytes) {
+        return NULL;
+    }
+
+    uint32_t dir_end = DATA_PAGE_HEADERS +
+                       (dh->num_slots + (slot_cost ? 1 : 0)) * sizeof(struct slot);
+    if (dir_end + len > dh->data_start) {
+        if (!may_compact) {
+            return NULL;
+        }
+        data_page_compact(page, page_size);
+    }
+
+    if (slot == dh->num_slots) {
+        dh->num_slots++;
+    }
+
+    dh->data_start -= len;
+    slots[slot].offset = dh->data_start;
+    slots[slot].length = len;
+    dh->free_bytes -= len + slot_cost;
+
+    *slot_out = slot;
+    return page + dh->data_start;
+}
+
+static void data_page_kill(uint8_t *page, uint16_t slot) {
+    struct data_page_header *dh = data_page_hdr(page);
+    struct slot *slots = data_page_slots(page);
+
+    if (slot >= dh->num_slots || slots[slot].offset == 0) {
+        return;
+    }
+
+    if (slots[slot].offset == dh->data_start) {
+        dh->data_start += slots[slot].length;
+    }
+    dh->free_bytes += slots[slot].length;
+    slots[slot].offset = 0;
+    slots[slot].length = 0;
+
+    while (dh->num_slots > 0 && slots[dh->num_slots - 1].offset == 0) {
+        dh->num_slots--;
+        dh->free_bytes += sizeof(struct slot);
+    }
+}
+
+static const uint8_t *data_page_record(uint8_t *page, uint32_t page_size,
+                                       uint16_t slot) {
+    struct data_page_header *dh = data_page_hdr(page);
+    struct slot *slots = data_page_slots(page);
+
+    if (slot >= dh->num_slots || slots[slot].offset == 0 ||
+        (uint32_t)slots[slot].offset + slots[slot].length > page_size) {
+        return NULL;
+    }
+    return page + slots[slot].offset;
+}
+
+/* How a record holds its value, from record_value. */
+#define VALUE_RAW      0
+#define VALUE_OVERFLOW 1
+#define VALUE_LZ4      2
+#define VALUE_LZ4_DICT 3
+
+/* A value found for a reader. It lives either in a pinned frame whose latch
+ * is held shared, or (with DB_OPEN_MMAP) in the file mapping, in which case
+ * frame is NULL and seq is the write-back count the view was taken at. */
+struct value_view {
+    const uint8_t *val;
+    uint32_t val_len;
+    int form;
+    uint32_t stored_len;
+    uint64_t expires;          /* 0, or when the key expires */
+    struct frame *frame;
+    uint64_t seq;
+};
+
+/* Milliseconds since the Unix epoch, the clock expiries are kept in. */
+static uint64_t wall_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint32_t record_key_len(const uint8_t *rec) {
+    uint32_t key_len;
+    memcpy(&key_len, rec, sizeof(key_len));
+    return key_len & ~KEY_EXPIRES;
+}
+
+static int view_expired(const struct value_view *v) {
+    return v->expires != 0 && v->expires <= wall_clock_ms();
+}
+
+/* Finds the value of key's record in slot. A reader may hold a location
+ * that a writer has since moved, so the page type, the key and every length
+ * are checked before anything is trusted. v->val points at the stored_len
+ * bytes the record holds for the value: the value itself, its overflow_ref
+ * or its compressed form, as v->form says. v->val_len is the value's
+ * length. */
+static int record_value(const uint8_t *page, uint32_t page_size, uint16_t slot,
+                        const uint8_t *key, uint32_t key_len, struct value_view *v) {
+    uint8_t *p = (uint8_t *)page;
+    if (((const struct page_header *)page)->page_type != PAGE_TYPE_DATA) {
+        return -1;
+    }
+
+    const uint8_t *rec = data_page_record(p, page_size, slot);
+    if (!rec) {
+        return -1;
+    }
+    uint32_t length = data_page_slots(p)[slot].length;
+
+    uint32_t rec_key_len, rec_val_len;
+    memcpy(&rec_key_len, rec, sizeof(rec_key_len));
+    uint32_t tail = rec_key_len & KEY_EXPIRES ? sizeof(uint64_t) : 0;
+    rec_key_len &= ~KEY_EXPIRES;
+    if (rec_key_len != key_len ||
+        (uint64_t)2 * sizeof(uint32_t) + key_len + tail > length ||
+        memcmp(rec + sizeof(uint32_t), key, key_len) != 0) {
+        return -1;
+    }
+    memcpy(&rec_val_len, rec + sizeof(uint32_t) + key_len, sizeof(rec_val_len));
+
+    /* A compressed value takes the rest of the record. */
+    int rec_form = VALUE_RAW;
+    uint32_t payload = rec_val_len;
+    if (rec_val_len & VAL_OVERFLOW) {
+        rec_form = VALUE_OVERFLOW;
+        rec_val_len &= ~VAL_OVERFLOW;
+        payload = sizeof(struct overflow_ref);
+    } else if (rec_val_len & VAL_COMPRESSED) {
+        rec_form = rec_val_len & VAL_DICT ? VALUE_LZ4_DICT : VALUE_LZ4;
+        rec_val_len &= ~(VAL_COMPRESSED | VAL_DICT);
+        payload = length - 2 * sizeof(uint32_t) - key_len - tail;
+    }
+    if ((uint64_t)2 * sizeof(uint32_t) + key_len + payload + tail != length) {
+        return -1;
+    }
+
+    v->val = rec + 2 * sizeof(uint32_t) + key_len;
+    v->val_len = rec_val_len;
+    v->form = rec_form;
+    v->stored_len = payload;
+    v->expires = 0;
+    if (tail) {
+        memcpy(&v->expires, v->val + payload, sizeof(v->expires));
+    }
+    return 0;
+}
+
+/* Copies out the extent of the record in slot if its value is in overflow
+ * pages. */
+static int record_extent(uint8_t *page, uint32_t page_size, uint16_t slot,
+                         struct overflow_ref *ext) {
+    const uint8_t *rec = data_page_record(page, page_size, slot);
+    if (!rec) {
+        return 0;
+    }
+
+    uint32_t key_len = record_key_len(rec), val_len;
+    if ((uint64_t)2 * sizeof(uint32_t) + key_len + sizeof(*ext) >
+        data_page_slots(page)[slot].length) {
+        return 0;
+    }
+    memcpy(&val_len, rec + sizeof(uint32_t) + key_len, sizeof(val_len));
+    if (!(val_len & VAL_OVERFLOW)) {
+        return 0;
+    }
+
+    memcpy(ext, rec + 2 * sizeof(uint32_t) + key_len, sizeof(*ext));
+    return 1;
+}
+
+/* The expiry of the record in slot, or 0 if it has none. */
+static uint64_t record_expires(uint8_t *page, uint32_t page_size, uint16_t slot) {
+    const uint8_t *rec = data_page_record(page, page_size, slot);
+    if (!rec) {
+        return 0;
+    }
+
+    uint32_t key_len;
+    uint64_t expires = 0;
+    uint32_t length = data_page_slots(page)[slot].length;
+    memcpy(&key_len, rec, sizeof(key_len));
+    if ((key_len & KEY_EXPIRES) &&
+        (uint64_t)2 * sizeof(uint32_t) + (key_len & ~KEY_EXPIRES) +
+        sizeof(expires) <= length) {
+        memcpy(&expires, rec + length - sizeof(expires), sizeof(expires));
+    }
+    return expires;
+}
+
+/* Extends the file by n pages and returns the first, or 0. Called with
+ * header_lock held. */
+static uint64_t grow_file(struct db *db, uint64_t n) {
+    uint64_t first = db->header.next_free_page;
+    if (free_map_grow(&db->free, first + n) != 0) {
+        errno = ENOMEM;
+        return 0;
+    }
+    db->header.next_free_page += n;
+    db->header.num_pages += (uint32_t)n;
+    return first;
+}
+
+/* Takes a free page, or extends the file; no I/O either way. Called with
+ * header_lock held; the page is in nobody else's hands until the caller
+ * formats it: it is out of the free map and the space map shows it full. */
+static uint64_t alloc_page(struct db *db) {
+    uint64_t t0 = stats_clock();
+    uint64_t page_num = free_map_next(&db->free);
+    if (page_num == 0) {
+        page_num = grow_file(db, 1);
+    } else {
+        free_map_set(&db->free, page_num, 0);
+        db->free.hint = page_num + 1;
+    }
+    stats_op(db, DB_OP_ALLOC_PAGE, t0, 0, page_num == 0);
+    return page_num;
+}
+
+/* Takes the first run of n free pages if it starts below limit and the
+ * pool can let go of its pages, or returns 0. Called with header_lock
+ * held. */
+static uint64_t take_run(struct db *db, uint64_t n, uint64_t limit) {
+    uint64_t first = free_map_find_run(&db->free, n);
+    if (first == 0 || first >= limit) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        if (pool_forget(db, first + i) != 0) {
+            return 0;
+        }
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        free_map_set(&db->free, first + i, 0);
+    }
+    return first;
+}
+
+/* Takes n adjacent pages to be written directly, outside the pool: the
+ * first free run that long whose pages the pool can let go of, or else the
+ * end of the file. Called with header_lock held. */
+static uint64_t alloc_run(struct db *db, uint64_t n) {
+    uint64_t t0 = stats_clock();
+    uint64_t first = take_run(db, n, UINT64_MAX);
+    if (first == 0) {
+        first = grow_file(db, n);
+    }
+    stats_op(db, DB_OP_ALLOC_PAGE, t0, 0, first == 0);
+    return first;
+}
+
+/* Turns a write-latched frame into a free page. The DELETED image tells
+ * anyone who still finds the page that it holds nothing. Called with
+ * header_lock held. */
+static void free_frame(struct db *db, struct frame *f) {
+    uint64_t t0 = stats_clock();
+    memset(f->data, 0, db->page_size);
+
+    struct page_header *ph = (struct page_header *)f->data;
+    ph->page_type = PAGE_TYPE_DELETED;
+
+    space_map_set(&db->space, f->page_num, 0);
+    free_map_set(&db->free, f->page_num, 1);
+    stats_op(db, DB_OP_FREE_PAGE, t0, 0, 0);
+}
+
+static int free_page(struct db *db, uint64_t page_num) {
+    struct frame *f = pool_pin(db, page_num, 0);
+    if (!f) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&f->latch);
+    pthread_mutex_lock(&db->header_lock);
+    free_frame(db, f);
+    pthread_mutex_unlock(&db->header_lock);
+    pthread_rwlock_unlock(&f->latch);
+
+    pool_unpin(db, f, 1);
+    return 0;
+}
+
+/* Hands back a page from alloc_page that nothing was cached or written for
+ * yet, which free_page could not pin when the pool is out of frames. Called
+ * with header_lock held. */
+static void unalloc_page(struct db *db, uint64_t page_num) {
+    uint64_t t0 = stats_clock();
+    space_map_set(&db->space, page_num, 0);
+    free_map_set(&db->free, page_num, 1);
+    stats_op(db, DB_OP_FREE_PAGE, t0, 0, 0);
+}
+
+/* Records a write-latched page's free space, or frees it once it holds
+ * nothing and no db_ref points into it. */
+static void settle_page(struct db *db, struct frame *f) {
+    int referenced = atomic_load(&f->refs) > 0;
+
+    pthread_mutex_lock(&db->header_lock);
+    if (data_page_hdr(f->data)->num_slots == 0 && !referenced) {
+        free_frame(db, f);
+    } else {
+        space_map_set(&db->space, f->page_num, data_page_room(f->data, !referenced));
+    }
+    pthread_mutex_unlock(&db->header_lock);
+}
+
+/* Key hash, in the manner of wyhash: eight bytes at a time, each pair of
+ * words folded through a 64x64->128 multiply. The seed is drawn when the
+ * file is created, so which keys collide differs from file to file. */
+
+static const uint64_t hash_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __extension__ unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_bytes(uint64_t seed, const uint8_t *p, size_t len) {
+    seed ^= hash_mix(seed ^ hash_secret[0], hash_secret[1]);
+
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = hash_read32(p) << 32 | hash_read32(p + mid);
+            b = hash_read32(p + len - 4) << 32 | hash_read32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len - 1];
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = hash_mix(hash_read64(p) ^ hash_secret[1], hash_read64(p + 8) ^ seed);
+                s1 = hash_mix(hash_read64(p + 16) ^ hash_secret[2], hash_read64(p + 24) ^ s1);
+                s2 = hash_mix(hash_read64(p + 32) ^ hash_secret[3], hash_read64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ hash_secret[1], hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+
+    __extension__ unsigned __int128 r =
+        (unsigned __int128)(a ^ hash_secret[1]) * (b ^ seed);
+    return hash_mix((uint64_t)r ^ hash_secret[0] ^ len,
+                    (uint64_t)(r >> 64) ^ hash_secret[1]);
+}
+
+static uint64_t hash_key(const struct db *db, const uint8_t *key,
+                         uint32_t key_len) {
+    return hash_bytes(db->header.hash_seed, key, key_len);
+}
+
+#define HT_MIGRATE_STEP 16
+
+#define META_DIST(m) ((m) >> 8)
+#define META_TAG(m)  ((m) & 0xff)
+#define HASH_TAG(h)  ((uint32_t)((h) >> 52) & 0xff)
+
+static const uint8_t *entry_key(const struct hash_entry *e) {
+    return e->key_len <= HASH_INLINE_KEY ? e->key.bytes : e->key.ptr;
+}
+
+static int hash_tab_init(struct hash_tab *t, uint64_t size) {
+    t->meta = calloc(size, sizeof(*t->meta));
+    t->entries = malloc(size * sizeof(*t->entries));
+    if (!t->meta || !t->entries) {
+        free(t->meta);
+        free(t->entries);
+        t->meta = NULL;
+        t->entries = NULL;
+        return -1;
+    }
+    t->mask = size - 1;
+    t->count = 0;
+    return 0;
+}
+
+/* Finds key in t. Buckets below skip_below have already been migrated out
+ * of an old table and may be empty mid-chain, so they are stepped over. */
+static struct hash_entry *hash_tab_find(struct hash_tab *t, uint64_t hash,
+                                        const uint8_t *key, uint32_t key_len,
+                                        uint64_t skip_below) {
+    if (!t->meta) return NULL;
+
+    uint64_t pos = hash & t->mask;
+    for (uint32_t d = 1; d <= t->mask + 1; d++, pos = (pos + 1) & t->mask) {
+        if (pos < skip_below) {
+            continue;
+        }
+
+        uint32_t m = t->meta[pos];
+        if (META_DIST(m) < d) {
+            return NULL;
+        }
+
+        struct hash_entry *e = &t->entries[pos];
+        if (META_TAG(m) == HASH_TAG(hash) && e->hash == hash &&
+            e->key_len == key_len && memcmp(entry_key(e), key, key_len) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* Robin Hood insert of an entry known not to be in t. */
+static void hash_tab_place(struct hash_tab *t, struct hash_entry e) {
+    uint64_t pos = e.hash & t->mask;
+    uint32_t m = (1u << 8) | HASH_TAG(e.hash);
+
+    for (;;) {
+        uint32_t cur = t->meta[pos];
+        if (cur == 0) {
+            t->meta[pos] = m;
+            t->entries[pos] = e;
+            t->count++;
+            return;
+        }
+
+        if (META_DIST(cur) < META_DIST(m)) {
+            struct hash_entry tmp = t->entries[pos];
+            t->entries[pos] = e;
+            t->meta[pos] = m;
+            e = tmp;
+            m = cur;
+        }
+
+        pos = (pos + 1) & t->mask;
+        m += 1u << 8;
+    }
+}
+
+/* Backward-shift deletion: pull following entries one bucket closer to
+ * their home until an empty bucket or an entry already at home. */
+static void hash_tab_erase(struct hash_tab *t, uint64_t pos) {
+    for (;;) {
+        uint64_t next = (pos + 1) & t->mask;
+        uint32_t m = t->meta[next];
+        if (META_DIST(m) <= 1) {
+            break;
+        }
+        t->entries[pos] = t->entries[next];
+        t->meta[pos] = m - (1u << 8);
+        pos = next;
+    }
+    t->meta[pos] = 0;
+    t->count--;
+}
+
+static void hash_table_migrate(struct hash_table *ht, uint64_t steps) {
+    if (!ht->old.meta) return;
+
+    while (steps-- > 0 && ht->migrate_pos <= ht->old.mask) {
+        uint64_t pos = ht->migrate_pos++;
+        if (ht->old.meta[pos] != 0) {
+            hash_tab_place(&ht->cur, ht->old.entries[pos]);
+            ht->old.meta[pos] = 0;
+            ht->old.count--;
+        }
+    }
+
+    if (ht->migrate_pos > ht->old.mask) {
+        free(ht->old.meta);
+        free(ht->old.entries);
+        memset(&ht->old, 0, sizeof(ht->old));
+        ht->migrate_pos = 0;
+    }
+}
+
+/* Keeps the load factor of the current table at or below 7/8. */
+static int hash_table_reserve(struct hash_table *ht) {
+    uint64_t size = ht->cur.mask + 1;
+    if ((ht->cur.count + ht->old.count + 1) * 8 <= size * 7) {
+        return 0;
+    }
+
+    hash_table_migrate(ht, UINT64_MAX);
+
+    struct hash_tab bigger;
+    if (hash_tab_init(&bigger, size * 2) != 0) {
+        return -1;
+    }
+    ht->old = ht->cur;
+    ht->cur = bigger;
+    ht->migrate_pos = 0;
+    return 0;
+}
+
+/* Key arena */
+
+struct arena_block {
+    struct arena_block *next;
+    uint8_t data[];
+};
+
+static uint8_t *arena_alloc(struct key_arena *a, uint32_t len) {
+    if (len > ARENA_MAX_KEY) {
+        uint8_t *p = malloc(len);
+        a->large += p != NULL;
+        return p;
+    }
+
+    size_t cls = (len + ARENA_ALIGN - 1) / ARENA_ALIGN;
+    uint8_t *p = a->free[cls];
+    if (p) {
+        memcpy(&a->free[cls], p, sizeof(void *));
+        return p;
+    }
+
+    size_t size = cls * ARENA_ALIGN;
+    if (a->left < size) {
+        struct arena_block *b = malloc(sizeof(*b) + ARENA_BLOCK);
+        if (!b) {
+            return NULL;
+        }
+        b->next = a->blocks;
+        a->blocks = b;
+        a->next = b->data;
+        a->left = ARENA_BLOCK;
+    }
+    p = a->next;
+    a->next += size;
+    a->left -= size;
+    return p;
+}
+
+static void arena_free(struct key_arena *a, uint8_t *p, uint32_t len) {
+    if (len > ARENA_MAX_KEY) {
+        free(p);
+        a->large--;
+        return;
+    }
+    size_t cls = (len + ARENA_ALIGN - 1) / ARENA_ALIGN;
+    memcpy(p, &a->free[cls], sizeof(void *));
+    a->free[cls] = p;
+}
+
+static void arena_destroy(struct key_arena *a) {
+    while (a->blocks) {
+        struct arena_block *next = a->blocks->next;
+        free(a->blocks);
+        a->blocks = next;
+    }
+}
+
+/* expected sizes the table so that many keys load without resizing. */
+static struct hash_table *hash_table_create(uint64_t expected) {
+    struct hash_table *ht = calloc(1, sizeof(*ht));
+    if (!ht) return NULL;
+
+    uint64_t size = HASH_TABLE_INITIAL;
+    while (expected * 8 >= size * 7) {
+        size *= 2;
+    }
+
+    if (hash_tab_init(&ht->cur, size) != 0) {
+        free(ht);
+        return NULL;
+    }
+    return ht;
+}
+
+static struct hash_entry *hash_table_lookup(struct hash_table *ht,
+                                            uint64_t hash, const uint8_t *key,
+                                            uint32_t key_len) {
+    if (!ht) return NULL;
+
+    struct hash_entry *e = hash_tab_find(&ht->cur, hash, key, key_len, 0);
+    if (!e) {
+        e = hash_tab_find(&ht->old, hash, key, key_len, ht->migrate_pos);
+    }
+    return e;
+}
+
+/* Inserts key, or repoints it if it is already indexed. */
+static int hash_table_insert(struct hash_table *ht, uint64_t hash,
+                             const uint8_t *key, uint32_t key_len,
+                             uint64_t page_num, uint16_t slot) {
+    if (!ht) return -1;
+
+    struct hash_entry *e = hash_table_lookup(ht, hash, key, key_len);
+    if (e) {
+        e->page_num = page_num;
+        e->slot = slot;
+        return 0;
+    }
+
+    if (hash_table_reserve(ht) != 0) {
+        return -1;
+    }
+
+    struct hash_entry entry;
+    entry.hash = hash;
+    entry.key_len = key_len;
+    entry.page_num = page_num;
+    entry.slot = slot;
+    if (key_len <= HASH_INLINE_KEY) {
+        memcpy(entry.key.bytes, key, key_len);
+    } else {
+        entry.key.ptr = arena_alloc(&ht->arena, key_len);
+        if (!entry.key.ptr) {
+            return -1;
+        }
+        memcpy(entry.key.ptr, key, key_len);
+    }
+
+    hash_tab_place(&ht->cur, entry);
+    hash_table_migrate(ht, HT_MIGRATE_STEP);
+    return 0;
+}
+
+static void hash_table_remove(struct hash_table *ht, uint64_t hash,
+                              const uint8_t *key, uint32_t key_len) {
+    if (!ht) return;
+
+    struct hash_tab *t = &ht->cur;
+    struct hash_entry *e = hash_tab_find(t, hash, key, key_len, 0);
+    if (!e) {
+        t = &ht->old;
+        e = hash_tab_find(t, hash, key, key_len, ht->migrate_pos);
+    }
+    if (!e) return;
+
+    if (e->key_len > HASH_INLINE_KEY) {
+        arena_free(&ht->arena, e->key.ptr, e->key_len);
+    }
+    hash_tab_erase(t, (uint64_t)(e - t->entries));
+    hash_table_migrate(ht, HT_MIGRATE_STEP);
+}
+
+/* Only keys over ARENA_MAX_KEY need freeing one by one; the rest go with
+ * the arena. */
+static void hash_tab_destroy(struct hash_tab *t, struct key_arena *a) {
+    if (!t->meta) return;
+
+    for (uint64_t i = 0; a->large > 0 && i <= t->mask; i++) {
+        if (t->meta[i] != 0 && t->entries[i].key_len > ARENA_MAX_KEY) {
+            arena_free(a, t->entries[i].key.ptr, t->entries[i].key_len);
+        }
+    }
+    free(t->meta);
+    free(t->entries);
+}
+
+static void hash_table_destroy(struct hash_table *ht) {
+    if (!ht) return;
+
+    hash_tab_destroy(&ht->cur, &ht->arena);
+    hash_tab_destroy(&ht->old, &ht->arena);
+    arena_destroy(&ht->arena);
+    free(ht);
+}
+
+/* Compact tables (DB_OPEN_COMPACT_INDEX). Entries carry no key, so one
+ * hash may have several; an entry is found again by its hash and location,
+ * and the records at the locations tell the keys apart. */
+
+struct index_loc {
+    uint64_t page_num;
+    uint16_t slot;
+};
+
+/* Locations a lookup copies out on the stack; more go to the heap. */
+#define INDEX_CANDIDATES 8
+
+static int fp_tab_init(struct fp_tab *t, uint64_t size) {
+    t->meta = calloc(size, sizeof(*t->meta));
+    t->entries = malloc(size * sizeof(*t->entries));
+    if (!t->meta || !t->entries) {
+        free(t->meta);
+        free(t->entries);
+        t->meta = NULL;
+        t->entries = NULL;
+        return -1;
+    }
+    t->mask = size - 1;
+    t->count = 0;
+    return 0;
+}
+
+/* Finds the entry for hash at page_num/slot, or with page_num 0 the first
+ * one for hash at or after *pos. Buckets below skip_below are stepped over
+ * as in hash_tab_find. */
+static struct fp_entry *fp_tab_find(struct fp_tab *t, uint64_t hash,
+                                    uint64_t page_num, uint16_t slot,
+                                    uint64_t skip_below, uint32_t *from) {
+    if (!t->meta) return NULL;
+
+    uint64_t pos = (hash + *from) & t->mask;
+    for (uint32_t d = *from + 1; d <= t->mask + 1; d++, pos = (pos + 1) & t->mask) {
+        if (pos < skip_below) {
+            continue;
+        }
+
+        uint32_t m = t->meta[pos];
+        if (META_DIST(m) < d) {
+            return NULL;
+        }
+
+        struct fp_entry *e = &t->entries[pos];
+        if (META_TAG(m) == HASH_TAG(hash) && e->hash == hash &&
+            (page_num == 0 || (e->page_num == page_num && e->slot == slot))) {
+            *from = d;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static void fp_tab_place(struct fp_tab *t, struct fp_entry e) {
+    uint64_t pos = e.hash & t->mask;
+    uint32_t m = (1u << 8) | HASH_TAG(e.hash);
+
+    for (;;) {
+        uint32_t cur = t->meta[pos];
+        if (cur == 0) {
+            t->meta[pos] = m;
+            t->entries[pos] = e;
+            t->count++;
+            return;
+        }
+
+        if (META_DIST(cur) < META_DIST(m)) {
+            struct fp_entry tmp = t->entries[pos];
+            t->entries[pos] = e;
+            t->meta[pos] = m;
+            e = tmp;
+            m = cur;
+        }
+
+        pos = (pos + 1) & t->mask;
+        m += 1u << 8;
+    }
+}
+
+static void fp_tab_erase(struct fp_tab *t, uint64_t pos) {
+    for (;;) {
+        uint64_t next = (pos + 1) & t->mask;
+        uint32_t m = t->meta[next];
+        if (META_DIST(m) <= 1) {
+            break;
+        }
+        t->entries[pos] = t->entries[next];
+        t->meta[pos] = m - (1u << 8);
+        pos = next;
+    }
+    t->meta[pos] = 0;
+    t->count--;
+}
+
+static void fp_table_migrate(struct fp_table *ft, uint64_t steps) {
+    if (!ft->old.meta) return;
+
+    while (steps-- > 0 && ft->migrate_pos <= ft->old.mask) {
+        uint64_t pos = ft->migrate_pos++;
+        if (ft->old.meta[pos] != 0) {
+            fp_tab_place(&ft->cur, ft->old.entries[pos]);
+            ft->old.meta[pos] = 0;
+            ft->old.count--;
+        }
+    }
+
+    if (ft->migrate_pos > ft->old.mask) {
+        free(ft->old.meta);
+        free(ft->old.entries);
+        memset(&ft->old, 0, sizeof(ft->old));
+        ft->migrate_pos = 0;
+    }
+}
+
+static int fp_table_reserve(struct fp_table *ft) {
+    uint64_t size = ft->cur.mask + 1;
+    if ((ft->cur.count + ft->old.count + 1) * 8 <= size * 7) {
+        return 0;
+    }
+
+    fp_table_migrate(ft, UINT64_MAX);
+
+    struct fp_tab bigger;
+    if (fp_tab_init(&bigger, size * 2) != 0) {
+        return -1;
+    }
+    ft->old = ft->cur;
+    ft->cur = bigger;
+    ft->migrate_pos = 0;
+    return 0;
+}
+
+static struct fp_table *fp_table_create(uint64_t expected) {
+    struct fp_table *ft = calloc(1, sizeof(*ft));
+    if (!ft) return NULL;
+
+    uint64_t size = HASH_TABLE_INITIAL;
+    while (expected * 8 >= size * 7) {
+        size *= 2;
+    }
+
+    if (fp_tab_init(&ft->cur, size) != 0) {
+        free(ft);
+        return NULL;
+    }
+    return ft;
+}
+
+/* Copies up to max locations with hash into locs and returns how many
+ * there are in all. */
+static size_t fp_table_collect(struct fp_table *ft, uint64_t hash,
+                               struct index_loc *locs, size_t max) {
+    size_t n = 0;
+    struct fp_tab *tabs[2] = {&ft->cur, &ft->old};
+    for (int i = 0; i < 2; i++) {
+        uint64_t skip = i ? ft->migrate_pos : 0;
+        uint32_t from = 0;
+        struct fp_entry *e;
+        while ((e = fp_tab_find(tabs[i], hash, 0, 0, skip, &from)) != NULL) {
+            if (n < max) {
+                locs[n].page_num = e->page_num;
+                locs[n].slot = e->slot;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+/* The same for a full table, which db_expire uses to find a key by hash. */
+static size_t hash_table_collect(struct hash_table *ht, uint64_t hash,
+                                 struct index_loc *locs, size_t max) {
+    size_t n = 0;
+    struct hash_tab *tabs[2] = {&ht->cur, &ht->old};
+    for (int i = 0; i < 2; i++) {
+        struct hash_tab *t = tabs[i];
+        uint64_t skip = i ? ht->migrate_pos : 0;
+        if (!t->meta) continue;
+
+        uint64_t pos = hash & t->mask;
+        for (uint32_t d = 1; d <= t->mask + 1; d++, pos = (pos + 1) & t->mask) {
+            if (pos < skip) {
+                continue;
+            }
+
+            uint32_t m = t->meta[pos];
+            if (META_DIST(m) < d) {
+                break;
+            }
+
+            const struct hash_entry *e = &t->entries[pos];
+            if (META_TAG(m) == HASH_TAG(hash) && e->hash == hash) {
+                if (n < max) {
+                    locs[n].page_num = e->page_num;
+                    locs[n].slot = e->slot;
+                }
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+static struct fp_entry *fp_table_lookup(struct fp_table *ft, uint64_t hash,
+                                        const struct index_loc *loc,
+                                        struct fp_tab **tab) {
+    uint32_t from = 0;
+    *tab = &ft->cur;
+    struct fp_entry *e = fp_tab_find(&ft->cur, hash, loc->page_num, loc->slot,
+                                     0, &from);
+    if (!e) {
+        from = 0;
+        *tab = &ft->old;
+        e = fp_tab_find(&ft->old, hash, loc->page_num, loc->slot,
+                        ft->migrate_pos, &from);
+    }
+    return e;
+}
+
+/* Adds a location for hash, or moves the one at old. */
+static int fp_table_insert(struct fp_table *ft, uint64_t hash,
+                           const struct index_loc *old, uint64_t page_num,
+                           uint16_t slot) {
+    if (page_num > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    struct fp_tab *t;
+    struct fp_entry *e = old ? fp_table_lookup(ft, hash, old, &t) : NULL;
+    if (e) {
+        e->page_num = (uint32_t)page_num;
+        e->slot = slot;
+        return 0;
+    }
+
+    if (fp_table_reserve(ft) != 0) {
+        return -1;
+    }
+    struct fp_entry entry = {hash, (uint32_t)page_num, slot};
+    fp_tab_place(&ft->cur, entry);
+    fp_table_migrate(ft, HT_MIGRATE_STEP);
+    return 0;
+}
+
+static void fp_table_remove(struct fp_table *ft, uint64_t hash,
+                            const struct index_loc *loc) {
+    struct fp_tab *t;
+    struct fp_entry *e = fp_table_lookup(ft, hash, loc, &t);
+    if (!e) return;
+
+    fp_tab_erase(t, (uint64_t)(e - t->entries));
+    fp_table_migrate(ft, HT_MIGRATE_STEP);
+}
+
+static void fp_table_destroy(struct fp_table *ft) {
+    if (!ft) return;
+
+    free(ft->cur.meta);
+    free(ft->cur.entries);
+    free(ft->old.meta);
+    free(ft->old.entries);
+    free(ft);
+}
+
+/* Sharded index */
+
+static struct index_shard *index_shard(struct db *db, uint64_t hash) {
+    /* The top bits pick the shard and the bottom ones the bucket. */
+    return &db->index[hash >> (64 - INDEX_SHARD_BITS)];
+}
+
+static void index_init(struct db *db) {
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        pthread_rwlock_init(&db->index[i].lock, NULL);
+        pthread_mutex_init(&db->index[i].write_lock, NULL);
+        db->index[i].table = NULL;
+        db->index[i].fps = NULL;
+    }
+}
+
+static int index_create(struct db *db, uint64_t expected) {
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        if (db->flags & DB_OPEN_COMPACT_INDEX) {
+            db->index[i].fps = fp_table_create(expected / INDEX_SHARDS);
+            if (!db->index[i].fps) {
+                return -1;
+            }
+            continue;
+        }
+        db->index[i].table = hash_table_create(expected / INDEX_SHARDS);
+        if (!db->index[i].table) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void index_clear(struct db *db) {
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        hash_table_destroy(db->index[i].table);
+        fp_table_destroy(db->index[i].fps);
+        db->index[i].table = NULL;
+        db->index[i].fps = NULL;
+    }
+}
+
+static void index_destroy(struct db *db) {
+    index_clear(db);
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        pthread_rwlock_destroy(&db->index[i].lock);
+        pthread_mutex_destroy(&db->index[i].write_lock);
+    }
+}
+
+static uint64_t shard_count(const struct index_shard *s) {
+    if (s->fps) {
+        return s->fps->cur.count + s->fps->old.count;
+    }
+    return s->table->cur.count + s->table->old.count;
+}
+
+static uint64_t index_count(struct db *db) {
+    uint64_t count = 0;
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        count += shard_count(&db->index[i]);
+    }
+    return count;
+}
+
+/* Copies up to max locations that may hold key out of the index and
+ * returns how many there are in all: the key's own, or for a compact
+ * index every one with its hash. */
+static size_t index_candidates(struct db *db, uint64_t hash, const uint8_t *key,
+                               uint32_t key_len, struct index_loc *locs,
+                               size_t max) {
+    struct index_shard *s = index_shard(db, hash);
+    size_t n = 0;
+
+    pthread_rwlock_rdlock(&s->lock);
+    if (s->fps) {
+        n = fp_table_collect(s->fps, hash, locs, max);
+    } else {
+        struct hash_entry *e = hash_table_lookup(s->table, hash, key, key_len);
+        if (e && max > 0) {
+            locs[0].page_num = e->page_num;
+            locs[0].slot = e->slot;
+        }
+        n = e != NULL;
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return n;
+}
+
+/* Copies key's location out of the index. A compact index gives the first
+ * location with the key's hash, which the caller must check. */
+static int index_find(struct db *db, uint64_t hash, const uint8_t *key,
+                      uint32_t key_len, uint64_t *page_num, uint16_t *slot) {
+    struct index_loc loc;
+    if (index_candidates(db, hash, key, key_len, &loc, 1) == 0) {
+        return -1;
+    }
+    *page_num = loc.page_num;
+    *slot = loc.slot;
+    return 0;
+}
+
+/* Returns 1 if the record at loc is key's, 0 if not, or -1. */
+static int key_at(struct db *db, const struct index_loc *loc,
+                  const uint8_t *key, uint32_t key_len) {
+    struct frame *f = pool_pin(db, loc->page_num, 1);
+    if (!f) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&f->latch);
+    const uint8_t *rec = NULL;
+    if (((const struct page_header *)f->data)->page_type == PAGE_TYPE_DATA) {
+        rec = data_page_record(f->data, db->page_size, loc->slot);
+    }
+    int match = 0;
+    if (rec && data_page_slots(f->data)[loc->slot].length >=
+                   sizeof(uint32_t) + (uint64_t)key_len) {
+        match = record_key_len(rec) == key_len &&
+                memcmp(rec + sizeof(uint32_t), key, key_len) == 0;
+    }
+    pthread_rwlock_unlock(&f->latch);
+    pool_unpin(db, f, 0);
+    return match;
+}
+
+/* Finds key's location for a writer, which holds the shard's write_lock,
+ * so the table holds still. A compact index reads the record at each
+ * location with the key's hash. Returns 1 if found, 0 if not, or -1. */
+static int index_lookup(struct db *db, struct index_shard *s, uint64_t hash,
+                        const uint8_t *key, uint32_t key_len,
+                        struct index_loc *out) {
+    if (!s->fps) {
+        struct hash_entry *e = hash_table_lookup(s->table, hash, key, key_len);
+        if (e) {
+            out->page_num = e->page_num;
+            out->slot = e->slot;
+        }
+        return e != NULL;
+    }
+
+    struct index_loc stack[INDEX_CANDIDATES], *locs = stack;
+    size_t n = fp_table_collect(s->fps, hash, locs, INDEX_CANDIDATES);
+    if (n > INDEX_CANDIDATES) {
+        locs = malloc(n * sizeof(*locs));
+        if (!locs) {
+            return -1;
+        }
+        fp_table_collect(s->fps, hash, locs, n);
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < n && ret == 0; i++) {
+        ret = key_at(db, &locs[i], key, key_len);
+        if (ret == 1) {
+            *out = locs[i];
+        }
+    }
+    if (locs != stack) {
+        free(locs);
+    }
+    return ret;
+}
+
+/* Index updates; the caller holds the shard's write_lock. old is where
+ * index_lookup found the key, or NULL for a new key. */
+
+static int index_set(struct index_shard *s, uint64_t hash, const uint8_t *key,
+                     uint32_t key_len, const struct index_loc *old,
+                     uint64_t page_num, uint16_t slot) {
+    pthread_rwlock_wrlock(&s->lock);
+    int ret = s->fps ? fp_table_insert(s->fps, hash, old, page_num, slot)
+                     : hash_table_insert(s->table, hash, key, key_len, page_num, slot);
+    pthread_rwlock_unlock(&s->lock);
+    return ret;
+}
+
+static void index_unset(struct index_shard *s, uint64_t hash,
+                        const uint8_t *key, uint32_t key_len,
+                        const struct index_loc *loc) {
+    pthread_rwlock_wrlock(&s->lock);
+    if (s->fps) {
+        fp_table_remove(s->fps, hash, loc);
+    } else {
+        hash_table_remove(s->table, hash, key, key_len);
+    }
+    pthread_rwlock_unlock(&s->lock);
+}
+
+/* Writes a record whose val_len field is stored as-is; payload is the value,
+ * or an overflow_ref when stored_len has VAL_OVERFLOW set. A non-zero
+ * expires follows it. */
+static void write_record(uint8_t *p, const uint8_t *key, uint32_t key_len,
+                         uint32_t stored_len, const void *payload,
+                         uint32_t payload_len, uint64_t expires) {
+    uint32_t key_field = key_len | (expires ? KEY_EXPIRES : 0);
+    memcpy(p, &key_field, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, key, key_len);
+    p += key_len;
+    memcpy(p, &stored_len, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    memcpy(p, payload, payload_len);
+    if (expires) {
+        memcpy(p + payload_len, &expires, sizeof(expires));
+    }
+}
+
+/* Value compression, in the LZ4 block format: a sequence is a token (high
+ * nibble literal count, low nibble match length - 4, 15 meaning more bytes
+ * follow), the literals, then a little-endian 16-bit match distance. The
+ * last sequence is literals only. Matches may reach back into a dictionary
+ * that precedes the value. */
+
+#define LZ4_MINMATCH     4
+#define LZ4_MFLIMIT      12
+#define LZ4_LASTLITERALS 5
+#define LZ4_MAX_DISTANCE 65535
+
+static uint32_t lz4_load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_put_len(uint8_t *p, size_t n) {
+    for (; n >= 255; n -= 255) {
+        *p++ = 255;
+    }
+    *p++ = (uint8_t)n;
+    return p;
+}
+
+/* Appends one sequence, or fails if it would take dst past cap. match_len
+ * 0 ends the block. */
+static int lz4_emit(uint8_t *dst, size_t *op, size_t cap, const uint8_t *lit,
+                    size_t lit_len, size_t dist, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len;
+    if (match_len) {
+        need += 2 + (match_len - LZ4_MINMATCH) / 255 + 1;
+    }
+    if (*op + need > cap) {
+        return -1;
+    }
+
+    uint8_t *p = dst + *op;
+    uint8_t *token = p++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) {
+        p = lz4_put_len(p, lit_len - 15);
+    }
+    memcpy(p, lit, lit_len);
+    p += lit_len;
+    if (match_len) {
+        size_t m = match_len - LZ4_MINMATCH;
+        *p++ = (uint8_t)dist;
+        *p++ = (uint8_t)(dist >> 8);
+        *token |= (uint8_t)(m >= 15 ? 15 : m);
+        if (m >= 15) {
+            p = lz4_put_len(p, m - 15);
+        }
+    }
+    *op = (size_t)(p - dst);
+    return 0;
+}
+
+/* Per-thread compression scratch: the match table and the output. Table
+ * entries hold base + 1 + the position each hash of 4 bytes was last seen
+ * at in the value, so those from earlier values (at or below base) are
+ * simply stale rather than cleared for every value. */
+struct lz4_scratch {
+    uint32_t table[1 << LZ4_HASH_LOG];
+    uint32_t base;
+    uint8_t out[MAX_RECORD_SIZE(MAX_PAGE_SIZE)];
+};
+
+static _Thread_local struct lz4_scratch lz4_scratch;
+
+/* Byte pos of dict followed by src. */
+static uint8_t lz4_byte(const uint8_t *dict, size_t dict_len, const uint8_t *src,
+                        size_t pos) {
+    return pos < dict_len ? dict[pos] : src[pos - dict_len];
+}
+
+/* Compresses src[0, len) into at most cap bytes of dst, greedily. Matches
+ * may reach back into dict[0, dict_len), found through dict_table, its own
+ * primed table, which is only read; a match may run from dict into src.
+ * Returns the compressed length, or 0 if it would not fit. */
+static size_t lz4_compress(const uint8_t *src, size_t len, const uint8_t *dict,
+                           size_t dict_len, const uint32_t *dict_table,
+                           uint8_t *dst, size_t cap) {
+    struct lz4_scratch *z = &lz4_scratch;
+    if (z->base > UINT32_MAX - len - 1) {
+        memset(z->table, 0, sizeof(z->table));
+        z->base = 0;
+    }
+    uint32_t base = z->base;
+    z->base += (uint32_t)len + 1;
+
+    /* ip and anchor are in src; ref is a position in dict followed by src. */
+    size_t ip = 0, anchor = 0, op = 0;
+    while (len >= LZ4_MFLIMIT && ip <= len - LZ4_MFLIMIT) {
+        uint32_t seq = lz4_load32(src + ip);
+        uint32_t h = lz4_hash(seq);
+        uint32_t seen = z->table[h];
+        z->table[h] = base + (uint32_t)ip + 1;
+        size_t ref;
+        if (seen > base) {
+            ref = dict_len + (seen - base - 1);
+        } else if (dict_table && dict_table[h]) {
+            ref = dict_table[h] - 1;
+        } else {
+            ip++;
+            continue;
+        }
+        /* Table entries never straddle the two buffers. */
+        const uint8_t *at = ref < dict_len ? dict + ref : src + (ref - dict_len);
+        if (dict_len + ip - ref > LZ4_MAX_DISTANCE || lz4_load32(at) != seq) {
+            ip++;
+            continue;
+        }
+
+        while (ip > anchor && ref > 0 &&
+               src[ip - 1] == lz4_byte(dict, dict_len, src, ref - 1)) {
+            ip--;
+            ref--;
+        }
+        size_t n = LZ4_MINMATCH;
+        while (ip + n < len - LZ4_LASTLITERALS &&
+               src[ip + n] == lz4_byte(dict, dict_len, src, ref + n)) {
+            n++;
+        }
+        if (lz4_emit(dst, &op, cap, src + anchor, ip - anchor, dict_len + ip - ref, n) != 0) {
+            return 0;
+        }
+        ip += n;
+        anchor = ip;
+    }
+
+    if (lz4_emit(dst, &op, cap, src + anchor, len - anchor, 0, 0) != 0) {
+        return 0;
+    }
+    return op;
+}
+
+/* Decodes the block src into dst until want bytes are out, which may be
+ * short of all it holds. Fails with EIO on a block that is cut off or
+ * points outside dict and dst. */
+static int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst,
+                          size_t want, const uint8_t *dict, size_t dict_len) {
+    size_t ip = 0, op = 0;
+
+    while (op < want) {
+        if (ip >= src_len) {
+            goto bad;
+        }
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= src_len) {
+                    goto bad;
+                }
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > src_len - ip) {
+            goto bad;
+        }
+        size_t n = lit < want - op ? lit : want - op;
+        memcpy(dst + op, src + ip, n);
+        op += n;
+        ip += lit;
+        if (op == want) {
+            break;
+        }
+
+        if (src_len - ip < 2) {
+            goto bad;
+        }
+        size_t dist = (size_t)src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= src_len) {
+                    goto bad;
+                }
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ4_MINMATCH;
+        if (dist == 0 || dist > op + dict_len) {
+            goto bad;
+        }
+        if (len > want - op) {
+            len = want - op;
+        }
+
+        /* Overlapping matches repeat, so they go a byte at a time. */
+        if (dist <= op && dist >= len) {
+            memcpy(dst + op, dst + op - dist, len);
+            op += len;
+        } else {
+            for (size_t end = op + len; op < end; op++) {
+                dst[op] = op >= dist ? dst[op - dist] : dict[dict_len - (dist - op)];
+            }
+        }
+    }
+    return 0;
+
+bad:
+    errno = EIO;
+    return -1;
+}
+
+/* Builds the in-memory dictionary, with its match table primed. */
+static struct value_dict *dict_create(const uint8_t *data, uint32_t len) {
+    struct value_dict *d = calloc(1, sizeof(*d) + len);
+    if (!d) {
+        return NULL;
+    }
+    d->len = len;
+    d->id = crc32c(0, data, len);
+    memcpy(d->data, data, len);
+    for (uint32_t p = 0; p + LZ4_MINMATCH <= len; p++) {
+        d->table[lz4_hash(lz4_load32(d->data + p))] = p + 1;
+    }
+    return d;
+}
+
+/* Compresses val into at most cap bytes, against the dictionary if the
+ * file has one, and points *out at the result in the thread's scratch,
+ * good until its next call. Returns the compressed length, or 0 to store
+ * val as it is. */
+static uint32_t compress_value(struct db *db, const uint8_t *val,
+                               uint32_t val_len, uint32_t cap, const uint8_t **out,
+                               int *dict_used) {
+    const struct value_dict *d = atomic_load(&db->dict);
+    size_t n = lz4_compress(val, val_len, d ? d->data : NULL, d ? d->len : 0,
+                            d ? d->table : NULL, lz4_scratch.out, cap);
+    *out = lz4_scratch.out;
+    *dict_used = d && n != 0;
+    return (uint32_t)n;
+}
+
+/* Overflow extents. An extent is a run of pages taken from the end of the
+ * file and written and read directly, never through the pool: a value is
+ * read with one preadv whose iovecs land the data in the caller's buffer and
+ * the page headers in a scratch array, then checked page by page. */
+
+#define OVERFLOW_IOV_MAX 1024
+
+static uint32_t overflow_pages(struct db *db, uint32_t val_len) {
+    uint32_t data = OVERFLOW_PAGE_DATA(db->page_size);
+    return (uint32_t)(((uint64_t)val_len + data - 1) / data);
+}
+
+static uint64_t alloc_extent(struct db *db, uint32_t num_pages) {
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t first = alloc_run(db, num_pages);
+    pthread_mutex_unlock(&db->header_lock);
+    return first;
+}
+
+/* With DB_OPEN_DIRECT, extents are written and read through one of the
+ * handle's staging buffers instead of iovecs into the caller's buffer. */
+
+static void stage_set_init(struct stage_set *s) {
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+}
+
+static int stage_set_alloc(struct db *db, struct stage_set *s) {
+    size_t bytes = (size_t)OVERFLOW_STAGE_PAGES * db->page_size;
+    s->memory = page_alloc(db, (size_t)OVERFLOW_STAGE_BUFS * OVERFLOW_STAGE_PAGES);
+    if (!s->memory) {
+        return -1;
+    }
+    for (int i = 0; i < OVERFLOW_STAGE_BUFS; i++) {
+        s->free[i] = s->memory + i * bytes;
+    }
+    s->nfree = OVERFLOW_STAGE_BUFS;
+    return 0;
+}
+
+static void stage_set_destroy(struct stage_set *s) {
+    pthread_cond_destroy(&s->ready);
+    pthread_mutex_destroy(&s->lock);
+    free(s->memory);
+}
+
+static uint8_t *stage_take(struct stage_set *s) {
+    pthread_mutex_lock(&s->lock);
+    while (s->nfree == 0) {
+        pthread_cond_wait(&s->ready, &s->lock);
+    }
+    uint8_t *buf = s->free[--s->nfree];
+    pthread_mutex_unlock(&s->lock);
+    return buf;
+}
+
+static void stage_give(struct stage_set *s, uint8_t *buf) {
+    pthread_mutex_lock(&s->lock);
+    s->free[s->nfree++] = buf;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int write_overflow_direct(struct db *db, const struct overflow_ref *ext,
+                                 const uint8_t *val, uint32_t val_len) {
+    uint64_t data = OVERFLOW_PAGE_DATA(db->page_size);
+    uint8_t *stage = stage_take(&db->stage);
+
+    uint64_t done = 0;
+    int ret = 0;
+    atomic_fetch_add(&db->writebacks_started, 1);
+    for (uint32_t first = 0; first < ext->num_pages && ret == 0;
+         first += OVERFLOW_STAGE_PAGES) {
+        uint32_t n = ext->num_pages - first < OVERFLOW_STAGE_PAGES
+                     ? ext->num_pages - first : OVERFLOW_STAGE_PAGES;
+        for (uint32_t i = 0; i < n; i++) {
+            uint8_t *page = stage + (size_t)i * db->page_size;
+            uint64_t chunk = val_len - done < data ? val_len - done : data;
+            struct page_header *ph = (struct page_header *)page;
+            ph->page_type = PAGE_TYPE_OVERFLOW;
+            ph->checksum = 0;
+            ph->reserved = ext->first_page;
+            memcpy(page + sizeof(*ph), val + done, chunk);
+            memset(page + sizeof(*ph) + chunk, 0, data - chunk);
+            ph->checksum = page_checksum(page, db->page_size);
+            done += chunk;
+        }
+
+        ssize_t want = (ssize_t)n * db->page_size;
+        ssize_t written = pwrite(db->fd, stage, want,
+                                 (ext->first_page + first) * db->page_size);
+        stats_io(db, STAT_WRITES, written);
+        if (written != want) {
+            errno = EIO;
+            ret = -1;
+        }
+    }
+    atomic_fetch_add(&db->writebacks_done, 1);
+    stage_give(&db->stage, stage);
+    return ret;
+}
+
+static int read_overflow_direct(struct db *db, const struct overflow_ref *ext,
+                                uint64_t offset, uint8_t *buf, uint64_t len) {
+    uint64_t data = OVERFLOW_PAGE_DATA(db->page_size);
+    uint8_t *stage = stage_take(&db->stage);
+
+    uint64_t end = offset + len;
+    uint64_t first = offset / data;
+    uint64_t last = (end - 1) / data;
+    int ret = 0;
+    for (uint64_t batch = first; batch <= last && ret == 0;
+         batch += OVERFLOW_STAGE_PAGES) {
+        uint64_t n = last + 1 - batch < OVERFLOW_STAGE_PAGES
+                     ? last + 1 - batch : OVERFLOW_STAGE_PAGES;
+        ssize_t want = (ssize_t)n * db->page_size;
+        ssize_t got = pread(db->fd, stage, want,
+                            (ext->first_page + batch) * db->page_size);
+        stats_io(db, STAT_READS, got);
+        if (got != want) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+
+        for (uint64_t i = 0; i < n; i++) {
+            const uint8_t *page = stage + i * db->page_size;
+            if (!page_intact(page, db->page_size)) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+            uint64_t start = (batch + i) * data;
+            uint64_t from = start > offset ? start : offset;
+            uint64_t to = start + data < end ? start + data : end;
+            memcpy(buf + (from - offset),
+                   page + sizeof(struct page_header) + (from - start), to - from);
+        }
+    }
+    stage_give(&db->stage, stage);
+    return ret;
+}
+
+/* Each page gets its own header so it can carry the page's checksum. The
+ * write is bracketed like a write-back so db_verify does not take a page
+ * caught mid-write for a damaged one. */
+static int write_overflow(struct db *db, const struct overflow_ref *ext,
+                          const uint8_t *val, uint32_t val_len) {
+    uint64_t data = OVERFLOW_PAGE_DATA(db->page_size);
+    backup_preserve(db, ext->first_page, ext->num_pages);
+    if (db->flags & DB_OPEN_DIRECT) {
+        return write_overflow_direct(db, ext, val, val_len);
+    }
+
+    struct page_header hdrs[OVERFLOW_IOV_MAX / 2];
+    struct iovec iov[OVERFLOW_IOV_MAX];
+    uint64_t done = 0;
+    int ret = 0;
+    atomic_fetch_add(&db->writebacks_started, 1);
+    for (uint32_t page = 0; page < ext->num_pages && ret == 0;) {
+        uint32_t first = page;
+        int n = 0;
+        while (page < ext->num_pages && n + 3 <= OVERFLOW_IOV_MAX) {
+            uint64_t chunk = val_len - done < data ? val_len - done : data;
+            struct page_header *ph = &hdrs[page - first];
+            ph->page_type = PAGE_TYPE_OVERFLOW;
+            ph->checksum = 0;
+            ph->reserved = ext->first_page;
+            uint32_t crc = crc32c(checksum_start((const uint8_t *)ph),
+                                  val + done, chunk);
+
+            iov[n].iov_base = ph;
+            iov[n++].iov_len = sizeof(*ph);
+            iov[n].iov_base = (uint8_t *)val + done;
+            iov[n++].iov_len = chunk;
+            /* Pad the last page so the file stays a whole number of pages. */
+            if (chunk < data) {
+                iov[n].iov_base = (void *)zero_page;
+                iov[n++].iov_len = data - chunk;
+                crc = crc32c(crc, zero_page, data - chunk);
+            }
+            ph->checksum = checksum_finish(crc);
+            done += chunk;
+            page++;
+        }
+
+        ssize_t want = (ssize_t)(page - first) * db->page_size;
+        ssize_t written = pwritev(db->fd, iov, n,
+                                  (ext->first_page + first) * db->page_size);
+        stats_io(db, STAT_WRITES, written);
+        if (written != want) {
+            errno = EIO;
+            ret = -1;
+        }
+    }
+    atomic_fetch_add(&db->writebacks_done, 1);
+    return ret;
+}
+
+static int overflow_partial(struct db *db, uint64_t start, uint64_t offset,
+                            uint64_t end) {
+    return start < offset || start + OVERFLOW_PAGE_DATA(db->page_size) > end;
+}
+
+/* Reads len bytes of an overflow value starting at offset into buf. Whole
+ * pages are read so each can be checked: a page the range covers entirely
+ * lands in buf with its header in hdrs, and a partly covered first or last
+ * page goes through a scratch page and is copied out. */
+static int read_overflow(struct db *db, const struct overflow_ref *ext,
+                         uint64_t offset, uint8_t *buf, uint64_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (db->flags & DB_OPEN_DIRECT) {
+        return read_overflow_direct(db, ext, offset, buf, len);
+    }
+
+    struct page_header hdrs[OVERFLOW_IOV_MAX / 2];
+    uint8_t *edge = malloc(2 * (size_t)db->page_size);
+    if (!edge) {
+        return -1;
+    }
+    struct iovec iov[OVERFLOW_IOV_MAX];
+    uint64_t data = OVERFLOW_PAGE_DATA(db->page_size);
+    uint64_t end = offset + len;
+    uint64_t first = offset / data;
+    uint64_t last = (end - 1) / data;
+    int ret = 0;
+
+    for (uint64_t page = first; page <= last && ret == 0;) {
+        uint64_t batch = page;
+        int n = 0, h = 0;
+        while (page <= last && n + 2 <= OVERFLOW_IOV_MAX) {
+            uint64_t start = page * data;
+            if (overflow_partial(db, start, offset, end)) {
+                iov[n].iov_base = edge + (page != first ? db->page_size : 0);
+                iov[n++].iov_len = db->page_size;
+            } else {
+                iov[n].iov_base = &hdrs[h++];
+                iov[n++].iov_len = sizeof(hdrs[0]);
+                iov[n].iov_base = buf + (start - offset);
+                iov[n++].iov_len = data;
+            }
+            page++;
+        }
+
+        ssize_t want = (ssize_t)(page - batch) * db->page_size;
+        ssize_t got = preadv(db->fd, iov, n, (ext->first_page + batch) * db->page_size);
+        stats_io(db, STAT_READS, got);
+        if (got != want) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+
+        h = 0;
+        for (uint64_t p = batch; p < page; p++) {
+            uint64_t start = p * data;
+            if (!overflow_partial(db, start, offset, end)) {
+                const struct page_header *ph = &hdrs[h++];
+                uint32_t crc = crc32c(checksum_start((const uint8_t *)ph),
+                                      buf + (start - offset), data);
+                if (!sum_matches(ph->checksum, checksum_finish(crc))) {
+                    errno = EIO;
+                    ret = -1;
+                    break;
+                }
+                continue;
+            }
+
+            const uint8_t *e = edge + (p != first ? db->page_size : 0);
+            if (!page_intact(e, db->page_size)) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+            uint64_t from = start > offset ? start : offset;
+            uint64_t to = start + data < end ? start + data : end;
+            memcpy(buf + (from - offset),
+                   e + sizeof(struct page_header) + (from - start), to - from);
+        }
+    }
+    free(edge);
+    return ret;
+}
+
+/* Returns an extent's pages to the free map. Nothing is written: a page
+ * of a dead extent is never reached through the index, and the scan only
+ * keeps overflow pages that a live record points at. */
+static void free_extent(struct db *db, const struct overflow_ref *ext) {
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t t0 = stats_clock();
+    for (uint32_t i = 0; i < ext->num_pages; i++) {
+        free_map_set(&db->free, ext->first_page + i, 1);
+    }
+    stats_op(db, DB_OP_FREE_PAGE, t0, 0, 0);
+    pthread_mutex_unlock(&db->header_lock);
+}
+
+/* Timer wheel */
+
+#define TTL_BLOCK 256
+
+struct ttl_block {
+    struct ttl_block *next;
+    struct ttl_timer timers[TTL_BLOCK];
+};
+
+static void ttl_init(struct ttl_wheel *w) {
+    pthread_mutex_init(&w->lock, NULL);
+    w->tick = wall_clock_ms() / TTL_TICK_MS;
+}
+
+/* Drops every timer. */
+static void ttl_clear(struct ttl_wheel *w) {
+    while (w->blocks) {
+        struct ttl_block *next = w->blocks->next;
+        free(w->blocks);
+        w->blocks = next;
+    }
+    memset(w->slots, 0, sizeof(w->slots));
+    w->pending = 0;
+    w->due = NULL;
+    w->free = NULL;
+}
+
+static void ttl_destroy(struct ttl_wheel *w) {
+    ttl_clear(w);
+    pthread_mutex_destroy(&w->lock);
+}
+
+/* Files t in the lowest level where it shares its slot's parent with the
+ * current tick, so its slot there is still ahead; one due by now goes
+ * straight to the due list. The top level takes the rest. */
+static void ttl_place(struct ttl_wheel *w, struct ttl_timer *t) {
+    uint64_t at = t->expires / TTL_TICK_MS + (t->expires % TTL_TICK_MS != 0);
+    if (at <= w->tick) {
+        t->next = w->due;
+        w->due = t;
+        return;
+    }
+
+    int level = 0;
+    while (level < TTL_LEVELS - 1 &&
+           at >> (TTL_SLOT_BITS * (level + 1)) !=
+           w->tick >> (TTL_SLOT_BITS * (level + 1))) {
+        level++;
+    }
+    struct ttl_timer **slot =
+        &w->slots[level][(at >> (TTL_SLOT_BITS * level)) & (TTL_SLOTS - 1)];
+    t->next = *slot;
+    *slot = t;
+    w->pending++;
+}
+
+/* Turns the wheel to tick to. Where a tick starts a new slot on levels
+ * above the first, those slots are cascaded down, the highest first so
+ * what lands in the next level's slot is cascaded in turn. */
+static void ttl_advance(struct ttl_wheel *w, uint64_t to) {
+    while (w->tick < to) {
+        if (w->pending == 0) {
+            w->tick = to;
+            break;
+        }
+        w->tick++;
+
+        int top = 0;
+        while (top < TTL_LEVELS - 1 &&
+               (w->tick & ((1ull << (TTL_SLOT_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level >= 0; level--) {
+            struct ttl_timer **slot =
+                &w->slots[level][(w->tick >> (TTL_SLOT_BITS * level)) & (TTL_SLOTS - 1)];
+            struct ttl_timer *t = *slot;
+            *slot = NULL;
+            while (t) {
+                struct ttl_timer *next = t->next;
+                w->pending--;
+                ttl_place(w, t);
+                t = next;
+            }
+        }
+    }
+}
+
+/* Sets a timer for the key with hash. A key may have stale timers, from
+ * puts it has had since, and db_expire checks the record before it acts. */
+static int ttl_add(struct db *db, uint64_t hash, uint64_t expires) {
+    struct ttl_wheel *w = &db->ttl;
+    pthread_mutex_lock(&w->lock);
+    if (!w->free) {
+        struct ttl_block *b = malloc(sizeof(*b));
+        if (!b) {
+            pthread_mutex_unlock(&w->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        b->next = w->blocks;
+        w->blocks = b;
+        for (int i = 0; i < TTL_BLOCK; i++) {
+            b->timers[i].next = w->free;
+            w->free = &b->timers[i];
+        }
+    }
+
+    struct ttl_timer *t = w->free;
+    w->free = t->next;
+    t->hash = hash;
+    t->expires = expires;
+    ttl_place(w, t);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/* Recovery scan. The page range is split across worker threads that read
+ * it in large sequential chunks. Each worker records the free bytes of its
+ * pages and serializes the live records it finds in the snapshot entry
+ * format; the results are merged into the index once all workers finish. */
+
+#define SCAN_CHUNK_PAGES 256
+#define SCAN_MAX_THREADS 8
+
+struct entry_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint64_t count;
+};
+
+struct extent_buf {
+    struct overflow_ref *v;
+    size_t len;
+    size_t cap;
+};
+
+struct scan_worker {
+    struct db *db;
+    uint64_t first_page;
+    uint64_t end_page;
+    uint16_t *free_bytes;
+    uint8_t *in_use;
+    struct entry_buf out;
+    struct extent_buf extents;
+    uint64_t bad_pages;
+    int err;
+    pthread_t thread;
+};
+
+static int extent_buf_append(struct extent_buf *b, const struct overflow_ref *ext) {
+    if (b->len == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        struct overflow_ref *v = realloc(b->v, cap * sizeof(*v));
+        if (!v) {
+            return -1;
+        }
+        b->v = v;
+        b->cap = cap;
+    }
+    b->v[b->len++] = *ext;
+    return 0;
+}
+
+static int entry_buf_append(struct entry_buf *b, const uint8_t *key,
+                            uint32_t key_len, uint64_t page_num,
+                            uint16_t slot) {
+    size_t need = sizeof(struct index_snapshot_entry) + key_len;
+    if (b->len + need > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1 << 16;
+        while (cap < b->len + need) {
+            cap *= 2;
+        }
+        uint8_t *data = realloc(b->data, cap);
+        if (!data) {
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+
+    struct index_snapshot_entry se;
+    se.key_len = key_len;
+    se.page_num = page_num;
+    se.slot = slot;
+    memcpy(b->data + b->len, &se, sizeof(se));
+    memcpy(b->data + b->len + sizeof(se), key, key_len);
+    b->len += need;
+    b->count++;
+    return 0;
+}
+
+static int scan_data_page(struct scan_worker *w, uint64_t page_num,
+                          uint8_t *page_buf) {
+    uint32_t page_size = w->db->page_size;
+    struct data_page_header *dh = data_page_hdr(page_buf);
+
+    for (uint16_t slot = 0; slot < dh->num_slots; slot++) {
+        const uint8_t *rec = data_page_record(page_buf, page_size, slot);
+        if (!rec) {
+            continue;
+        }
+
+        uint32_t key_len = record_key_len(rec);
+        if (entry_buf_append(&w->out, rec + sizeof(uint32_t), key_len,
+                             page_num, slot) != 0) {
+            return -1;
+        }
+
+        /* The wheel has the key's timer again; a copy the merge kills
+         * leaves only a stale one. */
+        uint64_t expires = record_expires(page_buf, page_size, slot);
+        if (expires &&
+            ttl_add(w->db, hash_key(w->db, rec + sizeof(uint32_t), key_len),
+                    expires) != 0) {
+            return -1;
+        }
+
+        /* Overflow pages are in use only while a live record points at
+         * them, which may be in another worker's range. */
+        struct overflow_ref ext;
+        if (record_extent(page_buf, page_size, slot, &ext) &&
+            extent_buf_append(&w->extents, &ext) != 0) {
+            return -1;
+        }
+    }
+
+    w->free_bytes[page_num] = data_page_usable(page_buf);
+    w->in_use[page_num] = 1;
+    return 0;
+}
+
+static void *scan_worker_run(void *arg) {
+    struct scan_worker *w = arg;
+    int fd = w->db->fd;
+    uint32_t page_size = w->db->page_size;
+
+    uint8_t *chunk = page_alloc(w->db, SCAN_CHUNK_PAGES);
+    if (!chunk) {
+        w->err = ENOMEM;
+        return NULL;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, w->first_page * page_size,
+                  (w->end_page - w->first_page) * page_size,
+                  POSIX_FADV_SEQUENTIAL);
+#endif
+
+    for (uint64_t start = w->first_page; start < w->end_page;
+         start += SCAN_CHUNK_PAGES) {
+        uint64_t n = w->end_page - start;
+        if (n > SCAN_CHUNK_PAGES) {
+            n = SCAN_CHUNK_PAGES;
+        }
+
+#ifdef POSIX_FADV_WILLNEED
+        /* Have the kernel fetch the next chunk while this one is parsed. */
+        if (start + n < w->end_page) {
+            posix_fadvise(fd, (start + n) * page_size,
+                          (off_t)SCAN_CHUNK_PAGES * page_size,
+                          POSIX_FADV_WILLNEED);
+        }
+#endif
+
+        ssize_t bytes_read = pread(fd, chunk, n * page_size, start * page_size);
+        stats_io(w->db, STAT_READS, bytes_read);
+        if (bytes_read < 0) {
+            w->err = errno;
+            break;
+        }
+
+        uint64_t pages_read = (uint64_t)bytes_read / page_size;
+        for (uint64_t i = 0; i < pages_read; i++) {
+            uint8_t *page_buf = chunk + i * page_size;
+            struct page_header *ph = (struct page_header *)page_buf;
+            /* A damaged page is kept out of the free map and the index
+             * so the open succeeds and db_verify still finds it. */
+            if (!page_intact(page_buf, page_size)) {
+                w->in_use[start + i] = 1;
+                w->bad_pages++;
+                continue;
+            }
+            if (ph->page_type != PAGE_TYPE_DATA) {
+                continue;
+            }
+            if (scan_data_page(w, start + i, page_buf) != 0) {
+                w->err = ENOMEM;
+                free(chunk);
+                return NULL;
+            }
+        }
+
+        if (pages_read < n) {
+            break;
+        }
+    }
+
+    free(chunk);
+    return NULL;
+}
+
+static void mark_extent(uint8_t *in_use, uint64_t num_pages,
+                        const struct overflow_ref *ext, uint8_t used) {
+    for (uint64_t p = ext->first_page;
+         p < ext->first_page + ext->num_pages && p < num_pages; p++) {
+        in_use[p] = used;
+    }
+}
+
+/* Kills a record the recovery scan found a second copy of, leaving its
+ * overflow pages to be relinked as free unless the copy kept at (keep,
+ * keep_slot) points at them too, as a page moved by a vacuum does. */
+static int kill_duplicate(struct db *db, uint64_t page_num, uint16_t slot,
+                          uint64_t keep, uint16_t keep_slot,
+                          uint8_t *in_use, uint64_t num_pages) {
+    struct frame *f = pool_pin(db, page_num, 1);
+    if (!f) {
+        return -1;
+    }
+    struct overflow_ref ext, kept;
+    if (record_extent(f->data, db->page_size, slot, &ext)) {
+        struct frame *k = pool_pin(db, keep, 1);
+        if (!k) {
+            pool_unpin(db, f, 0);
+            return -1;
+        }
+        if (!record_extent(k->data, db->page_size, keep_slot, &kept) ||
+            kept.first_page != ext.first_page) {
+            mark_extent(in_use, num_pages, &ext, 0);
+        }
+        pool_unpin(db, k, 0);
+    }
+    data_page_kill(f->data, slot);
+    space_map_set(&db->space, page_num, data_page_usable(f->data));
+    pool_unpin(db, f, 1);
+    return 0;
+}
+
+/* Inserts count serialized index entries from *pp into the index. Pages are
+ * written back in whatever order the pool evicts them, so a crash can leave
+ * both the new and the old copy of a key on disk. That key was changed after
+ * the last checkpoint and WAL replay rewrites it, so the page scan, which
+ * passes its in_use map as dedupe, keeps either copy and kills the other. */
+static int load_entries(struct db *db, const uint8_t **pp, const uint8_t *end,
+                        uint64_t count, uint64_t num_pages, uint8_t *dedupe) {
+    const uint8_t *p = *pp;
+
+    for (uint64_t i = 0; i < count; i++) {
+        struct index_snapshot_entry se;
+        if ((size_t)(end - p) < sizeof(se)) {
+            return -1;
+        }
+        memcpy(&se, p, sizeof(se));
+        p += sizeof(se);
+
+        /* A compact index's own snapshot has hashes in place of keys. */
+        uint64_t hash;
+        size_t key_bytes = se.key_len;
+        if (se.key_len == INDEX_NO_KEY) {
+            key_bytes = sizeof(hash);
+            if (!(db->flags & DB_OPEN_COMPACT_INDEX) || dedupe ||
+                (size_t)(end - p) < key_bytes) {
+                return -1;
+            }
+            memcpy(&hash, p, sizeof(hash));
+        } else if ((size_t)(end - p) < se.key_len) {
+            return -1;
+        } else {
+            hash = hash_key(db, p, se.key_len);
+        }
+        if (se.page_num == 0 || se.page_num >= num_pages) {
+            return -1;
+        }
+
+        struct index_shard *s = index_shard(db, hash);
+        struct index_loc dup;
+        int found = dedupe ? index_lookup(db, s, hash, p, se.key_len, &dup) : 0;
+        if (found < 0 ||
+            (found && kill_duplicate(db, dup.page_num, dup.slot, se.page_num,
+                                     se.slot, dedupe, num_pages) != 0)) {
+            return -1;
+        }
+        int ret = s->fps ? fp_table_insert(s->fps, hash, found ? &dup : NULL,
+                                           se.page_num, se.slot)
+                         : hash_table_insert(s->table, hash, p, se.key_len,
+                                             se.page_num, se.slot);
+        if (ret != 0) {
+            return -1;
+        }
+        p += key_bytes;
+    }
+
+    *pp = p;
+    return 0;
+}
+
+static int scan_thread_count(uint64_t num_pages) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    /* Reads overlap even on one core, so use at least two workers. */
+    uint64_t threads = cpus > 2 ? (uint64_t)cpus : 2;
+    if (threads > SCAN_MAX_THREADS) {
+        threads = SCAN_MAX_THREADS;
+    }
+
+    uint64_t chunks = (num_pages + SCAN_CHUNK_PAGES - 1) / SCAN_CHUNK_PAGES;
+    if (threads > chunks) {
+        threads = chunks ? chunks : 1;
+    }
+    return (int)threads;
+}
+
+/* Rebuilds the index, the space map and the free map from the pages
+ * themselves. The header may predate the crash, so the whole file is
+ * scanned and next_free_page is taken from whatever is larger. */
+static int scan_pages(struct db *db) {
+    struct stat st;
+    if (fstat(db->fd, &st) != 0) {
+        return -1;
+    }
+
+    uint64_t num_pages = db->header.next_free_page;
+    if ((uint64_t)st.st_size / db->page_size > num_pages) {
+        num_pages = (uint64_t)st.st_size / db->page_size;
+    }
+    int nthreads = scan_thread_count(num_pages - 1);
+
+    uint16_t *free_bytes = calloc(num_pages, sizeof(*free_bytes));
+    uint8_t *in_use = calloc(num_pages, 1);
+    struct scan_worker *workers = calloc(nthreads, sizeof(*workers));
+    if (!free_bytes || !in_use || !workers) {
+        free(free_bytes);
+        free(in_use);
+        free(workers);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Split on chunk boundaries so every worker reads whole chunks. */
+    uint64_t chunks = (num_pages - 1 + SCAN_CHUNK_PAGES - 1) / SCAN_CHUNK_PAGES;
+    uint64_t per_worker = (chunks + nthreads - 1) / nthreads * SCAN_CHUNK_PAGES;
+    for (int i = 0; i < nthreads; i++) {
+        struct scan_worker *w = &workers[i];
+        w->db = db;
+        w->first_page = 1 + i * per_worker;
+        w->end_page = w->first_page + per_worker;
+        if (w->first_page > num_pages) {
+            w->first_page = num_pages;
+        }
+        if (w->end_page > num_pages) {
+            w->end_page = num_pages;
+        }
+        w->free_bytes = free_bytes;
+        w->in_use = in_use;
+    }
+
+    int started = 0;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, scan_worker_run,
+                           &workers[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+    scan_worker_run(&workers[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = started + 1; i < nthreads; i++) {
+        scan_worker_run(&workers[i]);
+    }
+
+    int ret = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        if (workers[i].err) {
+            errno = workers[i].err;
+            ret = -1;
+        }
+        total += workers[i].out.count;
+        db->stats.recovery_bad_pages += workers[i].bad_pages;
+        for (size_t j = 0; j < workers[i].extents.len; j++) {
+            mark_extent(in_use, num_pages, &workers[i].extents.v[j], 1);
+        }
+        free(workers[i].extents.v);
+    }
+    if (db->header.dict_page != 0) {
+        struct overflow_ref dict = {db->header.dict_page,
+                                    overflow_pages(db, db->header.dict_len)};
+        mark_extent(in_use, num_pages, &dict, 1);
+    }
+
+    if (ret == 0) {
+        if (index_create(db, total) != 0 ||
+            space_map_load(&db->space, free_bytes, num_pages) != 0) {
+            errno = ENOMEM;
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        struct entry_buf *b = &workers[i].out;
+        const uint8_t *p = b->data;
+        if (ret == 0 && load_entries(db, &p, p + b->len, b->count,
+                                     num_pages, in_use) != 0) {
+            errno = ENOMEM;
+            ret = -1;
+        }
+        free(b->data);
+    }
+
+    /* Every page without records is free, the old free-map extent
+     * included, so the next checkpoint saves the map somewhere new. */
+    if (ret == 0) {
+        db->header.next_free_page = num_pages;
+        db->header.num_pages = (uint32_t)num_pages;
+        db->header.free_map_page = 0;
+        db->header.free_map_pages = 0;
+        db->header.btree_root = 0;
+        free_map_clear(&db->free);
+        if (free_map_grow(&db->free, num_pages) != 0) {
+            errno = ENOMEM;
+            ret = -1;
+        }
+        for (uint64_t page_num = 1; ret == 0 && page_num < num_pages; page_num++) {
+            if (!in_use[page_num]) {
+                free_map_set(&db->free, page_num, 1);
+            }
+        }
+    }
+
+    free(free_bytes);
+    free(in_use);
+    free(workers);
+    return ret;
+}
+
+/* Scrub. Like the recovery scan, the file is split across threads reading
+ * large chunks, but every page is only checked against its checksum. */
+
+#define VERIFY_RETRIES 100
+
+struct verify_worker {
+    struct db *db;
+    uint64_t first_page;
+    uint64_t end_page;
+    int64_t damaged;
+    int err;
+    pthread_t thread;
+};
+
+/* Reads a page that failed its checksum again once no write is in flight,
+ * to tell a page caught mid-write from a damaged one. Returns 1 if it is
+ * damaged, 0 if not, or -1 with errno set. */
+static int verify_recheck(struct db *db, uint64_t page_num, uint8_t *buf) {
+    for (int tries = 0; tries < VERIFY_RETRIES; tries++) {
+        uint64_t seq = atomic_load(&db->writebacks_started);
+        if (atomic_load(&db->writebacks_done) != seq) {
+            sched_yield();
+            continue;
+        }
+        ssize_t n = pread(db->fd, buf, db->page_size, page_num * db->page_size);
+        stats_io(db, STAT_READS, n);
+        if (n < 0) {
+            return -1;
+        }
+        if (n < db->page_size || page_intact(buf, db->page_size)) {
+            return 0;
+        }
+        if (atomic_load(&db->writebacks_started) == seq) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+static void *verify_worker_run(void *arg) {
+    struct verify_worker *w = arg;
+    int fd = w->db->fd;
+    uint32_t page_size = w->db->page_size;
+
+    uint8_t *chunk = page_alloc(w->db, SCAN_CHUNK_PAGES);
+    if (!chunk) {
+        w->err = ENOMEM;
+        return NULL;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, w->first_page * page_size,
+                  (w->end_page - w->first_page) * page_size,
+                  POSIX_FADV_SEQUENTIAL);
+#endif
+
+    for (uint64_t start = w->first_page; start < w->end_page;
+         start += SCAN_CHUNK_PAGES) {
+        uint64_t n = w->end_page - start;
+        if (n > SCAN_CHUNK_PAGES) {
+            n = SCAN_CHUNK_PAGES;
+        }
+
+        ssize_t bytes_read = pread(fd, chunk, n * page_size, start * page_size);
+        stats_io(w->db, STAT_READS, bytes_read);
+        if (bytes_read < 0) {
+            w->err = errno;
+            break;
+        }
+
+        uint64_t pages_read = (uint64_t)bytes_read / page_size;
+        for (uint64_t i = 0; i < pages_read; i++) {
+            uint8_t *page_buf = chunk + i * page_size;
+            if (page_intact(page_buf, page_size)) {
+                continue;
+            }
+            int bad = verify_recheck(w->db, start + i, page_buf);
+            if (bad < 0) {
+                w->err = errno;
+                free(chunk);
+                return NULL;
+            }
+            w->damaged += bad;
+        }
+
+        if (pages_read < n) {
+            break;
+        }
+    }
+
+    free(chunk);
+    return NULL;
+}
+
+/* Index snapshot */
+
+static char *sidecar_path(const char *path, const char *suffix) {
+    size_t len = strlen(path);
+    char *out = malloc(len + strlen(suffix) + 1);
+    if (!out) {
+        return NULL;
+    }
+    memcpy(out, path, len);
+    strcpy(out + len, suffix);
+    return out;
+}
+
+static int fsync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path)
+                      : strdup(".");
+    if (!dir) {
+        return -1;
+    }
+
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+static int write_fp_entries(FILE *f, const struct fp_tab *t) {
+    if (!t->meta) return 0;
+
+    for (uint64_t i = 0; i <= t->mask; i++) {
+        if (t->meta[i] == 0) {
+            continue;
+        }
+
+        const struct fp_entry *e = &t->entries[i];
+        struct index_snapshot_entry se;
+        se.key_len = INDEX_NO_KEY;
+        se.page_num = e->page_num;
+        se.slot = e->slot;
+        if (fwrite(&se, sizeof(se), 1, f) != 1 ||
+            fwrite(&e->hash, sizeof(e->hash), 1, f) != 1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int write_tab_entries(FILE *f, const struct hash_tab *t) {
+    if (!t->meta) return 0;
+
+    for (uint64_t i = 0; i <= t->mask; i++) {
+        if (t->meta[i] == 0) {
+            continue;
+        }
+
+        const struct hash_entry *e = &t->entries[i];
+        struct index_snapshot_entry se;
+        se.key_len = e->key_len;
+        se.page_num = e->page_num;
+        se.slot = e->slot;
+        if (fwrite(&se, sizeof(se), 1, f) != 1 ||
+            fwrite(entry_key(e), 1, e->key_len, f) != e->key_len) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Two passes over every timer: one counts them, one writes them. */
+static int write_ttl_timers(FILE *f, struct ttl_wheel *w) {
+    pthread_mutex_lock(&w->lock);
+    int ret = 0;
+    for (int pass = 0; pass < 2 && ret == 0; pass++) {
+        uint64_t count = 0;
+        for (int i = 0; i <= TTL_LEVELS * TTL_SLOTS && ret == 0; i++) {
+            const struct ttl_timer *t = i < TTL_LEVELS * TTL_SLOTS
+                                        ? w->slots[i / TTL_SLOTS][i % TTL_SLOTS]
+                                        : w->due;
+            for (; t && ret == 0; t = t->next) {
+                if (pass == 1 &&
+                    (fwrite(&t->hash, sizeof(t->hash), 1, f) != 1 ||
+                     fwrite(&t->expires, sizeof(t->expires), 1, f) != 1)) {
+                    ret = -1;
+                }
+                count++;
+            }
+        }
+        if (pass == 0 && fwrite(&count, sizeof(count), 1, f) != 1) {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/* Writes "<path>.idx.tmp" and renames it over "<path>.idx", so a crash
+ * mid-write leaves the previous snapshot (whose generation is already stale)
+ * in place. */
+static int write_index_snapshot(struct db *db) {
+    char *path = sidecar_path(db->filepath, ".idx");
+    char *tmp = sidecar_path(db->filepath, ".idx.tmp");
+    FILE *f = NULL;
+    int ret = -1;
+
+    if (!path || !tmp) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    f = fopen(tmp, "wb");
+    if (!f) {
+        goto out;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    struct index_snapshot_header sh;
+    sh.magic = INDEX_MAGIC;
+    sh.version = VERSION;
+    sh.generation = db->header.generation;
+    sh.num_entries = index_count(db);
+    sh.num_pages = db->header.next_free_page;
+    if (fwrite(&sh, sizeof(sh), 1, f) != 1) {
+        goto out;
+    }
+
+    for (uint64_t page_num = 0; page_num < sh.num_pages; page_num++) {
+        uint16_t free_bytes = page_num < db->space.leaves
+                              ? db->space.tree[db->space.leaves + page_num] : 0;
+        if (fwrite(&free_bytes, sizeof(free_bytes), 1, f) != 1) {
+            goto out;
+        }
+    }
+
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        struct index_shard *s = &db->index[i];
+        if (s->fps ? write_fp_entries(f, &s->fps->cur) != 0 ||
+                     write_fp_entries(f, &s->fps->old) != 0
+                   : write_tab_entries(f, &s->table->cur) != 0 ||
+                     write_tab_entries(f, &s->table->old) != 0) {
+            goto out;
+        }
+    }
+    if (write_ttl_timers(f, &db->ttl) != 0) {
+        goto out;
+    }
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        goto out;
+    }
+    if (fclose(f) != 0) {
+        f = NULL;
+        goto out;
+    }
+    f = NULL;
+
+    if (rename(tmp, path) != 0 || fsync_parent_dir(path) != 0) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (f) {
+        fclose(f);
+    }
+    if (ret != 0 && tmp) {
+        unlink(tmp);
+    }
+    free(path);
+    free(tmp);
+    return ret;
+}
+
+/* Saved free map. The map is written with each checkpoint to its extent,
+ * which moves to a bigger one, with a page to spare for the growth this
+ * causes, once the file outgrows it. The old extent is only freed once the
+ * new one is taken. Moving can grow the file, so a checkpoint reserves
+ * room before it writes the index snapshot. Called with header_lock held. */
+
+static int free_map_reserve(struct db *db) {
+    uint64_t bits = FREE_MAP_BITS(db->page_size);
+    uint64_t need = (db->header.next_free_page + bits - 1) / bits;
+    if (db->header.free_map_pages >= need) {
+        return 0;
+    }
+
+    uint64_t first = alloc_run(db, need + 1);
+    if (first == 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < db->header.free_map_pages; i++) {
+        free_map_set(&db->free, db->header.free_map_page + i, 1);
+    }
+    db->header.free_map_page = first;
+    db->header.free_map_pages = (uint32_t)need + 1;
+    return 0;
+}
+
+static int free_map_save(struct db *db) {
+    uint64_t data = OVERFLOW_PAGE_DATA(db->page_size);
+    uint8_t *page = page_alloc(db, 1);
+    if (!page) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&db->header_lock);
+    int ret = -1;
+    if (free_map_reserve(db) != 0) {
+        goto out;
+    }
+
+    uint64_t bytes = (db->header.next_free_page + 7) / 8;
+    for (uint32_t i = 0; i < db->header.free_map_pages; i++) {
+        memset(page, 0, db->page_size);
+        struct page_header *ph = (struct page_header *)page;
+        ph->page_type = PAGE_TYPE_FREEMAP;
+        ph->reserved = i;
+        uint64_t from = (uint64_t)i * data;
+        if (from < bytes) {
+            uint64_t len = bytes - from < data ? bytes - from : data;
+            memcpy(page + sizeof(*ph), (uint8_t *)db->free.bits + from, len);
+        }
+        if (write_back(db, db->header.free_map_page + i, page) != 0) {
+            goto out;
+        }
+    }
+    db->header.free_map_generation = db->header.generation;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&db->header_lock);
+    free(page);
+    return ret;
+}
+
+/* Loads the free map saved with the current generation, if there is one. */
+static int free_map_load(struct db *db) {
+    uint64_t data = OVERFLOW_PAGE_DATA(db->page_size);
+    uint64_t num_pages = db->header.next_free_page;
+    uint64_t bytes = (num_pages + 7) / 8;
+    if (db->header.free_map_page == 0 ||
+        db->header.free_map_generation != db->header.generation ||
+        (uint64_t)db->header.free_map_pages * data < bytes) {
+        return -1;
+    }
+
+    uint8_t *page = page_alloc(db, 1);
+    if (!page) {
+        return -1;
+    }
+    free_map_clear(&db->free);
+    for (uint32_t i = 0; (uint64_t)i * data < bytes; i++) {
+        const struct page_header *ph = (const struct page_header *)page;
+        if (read_page(db, db->header.free_map_page + i, page) != 0 ||
+            ph->page_type != PAGE_TYPE_FREEMAP || ph->reserved != i) {
+            free(page);
+            return -1;
+        }
+        uint64_t from = (uint64_t)i * data;
+        uint64_t len = bytes - from < data ? bytes - from : data;
+        memcpy((uint8_t *)db->free.bits + from, page + sizeof(*ph), len);
+    }
+    free(page);
+
+    /* Only pages below num_pages count, and never the header. */
+    db->free.bits[0] &= ~1ull;
+    if (num_pages % 64) {
+        db->free.bits[num_pages / 64] &= ~(~0ull << (num_pages % 64));
+    }
+    for (uint64_t w = 0; w < db->free.words; w++) {
+        db->free.count += (uint64_t)__builtin_popcountll(db->free.bits[w]);
+    }
+    return 0;
+}
+
+static int parse_index_snapshot(struct db *db, const uint8_t *p, size_t size) {
+    const uint8_t *end = p + size;
+
+    struct index_snapshot_header sh;
+    if (size < sizeof(sh)) {
+        return -1;
+    }
+    memcpy(&sh, p, sizeof(sh));
+    p += sizeof(sh);
+
+    if (sh.magic != INDEX_MAGIC || sh.version != VERSION ||
+        sh.generation != db->header.generation ||
+        sh.num_pages != db->header.next_free_page ||
+        (uint64_t)(end - p) / sizeof(uint16_t) < sh.num_pages) {
+        return -1;
+    }
+
+    if (space_map_load(&db->space, (const uint16_t *)p, sh.num_pages) != 0) {
+        return -1;
+    }
+    p += sh.num_pages * sizeof(uint16_t);
+
+    if (index_create(db, sh.num_entries) != 0) {
+        return -1;
+    }
+
+    if (load_entries(db, &p, end, sh.num_entries, sh.num_pages, NULL) != 0) {
+        return -1;
+    }
+
+    /* A snapshot from before db_put_ttl ends here. */
+    uint64_t timers = 0;
+    if (p != end) {
+        if ((size_t)(end - p) < sizeof(timers)) {
+            return -1;
+        }
+        memcpy(&timers, p, sizeof(timers));
+        p += sizeof(timers);
+        if ((uint64_t)(end - p) / (2 * sizeof(uint64_t)) < timers) {
+            return -1;
+        }
+    }
+    for (uint64_t i = 0; i < timers; i++) {
+        uint64_t hash, expires;
+        memcpy(&hash, p, sizeof(hash));
+        memcpy(&expires, p + sizeof(hash), sizeof(expires));
+        p += sizeof(hash) + sizeof(expires);
+        if (ttl_add(db, hash, expires) != 0) {
+            return -1;
+        }
+    }
+    return p == end ? 0 : -1;
+}
+
+/* Loads the index and space map from the snapshot, and the free map, if
+ * they are current. On any failure the caller falls back to scan_pages(). */
+static int load_index_snapshot(struct db *db) {
+    if (db->header.index_generation != db->header.generation) {
+        return -1;
+    }
+
+    char *path = sidecar_path(db->filepath, ".idx");
+    if (!path) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    int ret = parse_index_snapshot(db, map, st.st_size);
+    munmap(map, st.st_size);
+    if (ret == 0) {
+        ret = free_map_load(db);
+    }
+
+    if (ret != 0) {
+        free_map_clear(&db->free);
+        ttl_clear(&db->ttl);
+        index_clear(db);
+        space_map_destroy(&db->space);
+        space_map_grow(&db->space, db->header.next_free_page);
+    }
+    return ret;
+}
+
+/* B+tree (DB_OPEN_ORDERED). Nodes live in the pool like data pages. Walking
+ * the tree takes btree.lock shared and no latches. Changing it takes
+ * btree.lock exclusively, and each page's latch only while its bytes change,
+ * so a flush never writes a half-edited node and no two latches are held at
+ * once. Deletes do not merge nodes: an emptied leaf stays in the chain until
+ * the tree is next rebuilt. */
+
+#define BTREE_DEPTH_MAX 32
+#define BTREE_READAHEAD 32
+#define BTREE_BUILD_SLACK(page_size) ((page_size) / 8)   /* room for inserts */
+
+struct btree_cell {
+    uint64_t child;
+    const uint8_t *key;
+    uint16_t len;
+};
+
+static struct btree_node *btree_hdr(uint8_t *page) {
+    return (struct btree_node *)(page + sizeof(struct page_header));
+}
+
+static uint16_t *btree_offsets(uint8_t *page) {
+    return (uint16_t *)(page + BTREE_HEADERS);
+}
+
+static size_t btree_cell_size(uint16_t level, uint32_t key_len) {
+    return (level ? sizeof(uint64_t) : 0) + sizeof(uint16_t) + key_len;
+}
+
+static void btree_node_init(uint8_t *page, uint32_t page_size, uint16_t level) {
+    memset(page, 0, page_size);
+    struct page_header *ph = (struct page_header *)page;
+    ph->page_type = level ? PAGE_TYPE_BTREE_INNER : PAGE_TYPE_BTREE_LEAF;
+
+    struct btree_node *n = btree_hdr(page);
+    n->level = level;
+    n->data_start = page_size;
+}
+
+static const uint8_t *btree_key(uint8_t *page, uint16_t i, uint16_t *len) {
+    const uint8_t *cell = page + btree_offsets(page)[i];
+    if (btree_hdr(page)->level) {
+        cell += sizeof(uint64_t);
+    }
+    memcpy(len, cell, sizeof(*len));
+    return cell + sizeof(uint16_t);
+}
+
+static uint64_t btree_child(uint8_t *page, uint16_t i) {
+    uint64_t child;
+    memcpy(&child, page + btree_offsets(page)[i], sizeof(child));
+    return child;
+}
+
+/* Checks a node read from the file, so a damaged page cannot send a walk
+ * out of bounds. */
+static int btree_node_valid(uint8_t *page, uint32_t page_size) {
+    uint32_t type = ((struct page_header *)page)->page_type;
+    struct btree_node *n = btree_hdr(page);
+    if ((type != PAGE_TYPE_BTREE_LEAF && type != PAGE_TYPE_BTREE_INNER) ||
+        (type == PAGE_TYPE_BTREE_INNER) != (n->level != 0) ||
+        n->data_start > page_size ||
+        BTREE_HEADERS + (size_t)n->num_keys * sizeof(uint16_t) > n->data_start) {
+        return 0;
+    }
+
+    size_t fixed = btree_cell_size(n->level, 0);
+    for (uint16_t i = 0; i < n->num_keys; i++) {
+        uint16_t off = btree_offsets(page)[i];
+        uint16_t len;
+        if (off < n->data_start || off + fixed > page_size) {
+            return 0;
+        }
+        btree_key(page, i, &len);
+        if (off + fixed + len > page_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int btree_compare(const uint8_t *a, uint32_t a_len,
+                         const uint8_t *b, uint32_t b_len) {
+    uint32_t n = a_len < b_len ? a_len : b_len;
+    int c = n ? memcmp(a, b, n) : 0;
+    if (c != 0) {
+        return c;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/* Index of the first key >= key; *exact says whether it is equal. */
+static uint16_t btree_search(uint8_t *page, const uint8_t *key,
+                             uint32_t key_len, int *exact) {
+    uint16_t lo = 0, hi = btree_hdr(page)->num_keys;
+    *exact = 0;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        uint16_t len;
+        const uint8_t *k = btree_key(page, mid, &len);
+        int c = btree_compare(k, len, key, key_len);
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            *exact |= c == 0;
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* The child of an internal node whose subtree covers key. */
+static uint64_t btree_route(uint8_t *page, const uint8_t *key, uint32_t key_len) {
+    int exact;
+    uint16_t i = btree_search(page, key, key_len, &exact);
+    if (exact) {
+        i++;
+    }
+    return i == 0 ? btree_hdr(page)->first_child : btree_child(page, i - 1);
+}
+
+/* Contiguous room between the offsets and the cells. */
+static size_t btree_gap(uint8_t *page) {
+    struct btree_node *n = btree_hdr(page);
+    return n->data_start - BTREE_HEADERS - (size_t)n->num_keys * sizeof(uint16_t);
+}
+
+/* Room once the holes left by deletes are reclaimed. */
+static size_t btree_room(uint8_t *page, uint32_t page_size) {
+    struct btree_node *n = btree_hdr(page);
+    size_t used = 0;
+    for (uint16_t i = 0; i < n->num_keys; i++) {
+        uint16_t len;
+        btree_key(page, i, &len);
+        used += btree_cell_size(n->level, len) + sizeof(uint16_t);
+    }
+    return page_size - BTREE_HEADERS - used;
+}
+
+/* Adds a cell at position pos; the caller has made sure it fits. */
+static void btree_put(uint8_t *page, uint16_t pos, const struct btree_cell *c) {
+    struct btree_node *n = btree_hdr(page);
+    n->data_start -= (uint16_t)btree_cell_size(n->level, c->len);
+
+    uint8_t *cell = page + n->data_start;
+    if (n->level) {
+        memcpy(cell, &c->child, sizeof(c->child));
+        cell += sizeof(c->child);
+    }
+    memcpy(cell, &c->len, sizeof(c->len));
+    memcpy(cell + sizeof(c->len), c->key, c->len);
+
+    uint16_t *offsets = btree_offsets(page);
+    memmove(&offsets[pos + 1], &offsets[pos],
+            (size_t)(n->num_keys - pos) * sizeof(uint16_t));
+    offsets[pos] = n->data_start;
+    n->num_keys++;
+}
+
+static void btree_fill(uint8_t *page, uint32_t page_size, uint16_t level,
+                       uint64_t first_child, uint64_t next,
+                       const struct btree_cell *cells, size_t count) {
+    btree_node_init(page, page_size, level);
+    btree_hdr(page)->first_child = first_child;
+    btree_hdr(page)->next = next;
+    for (size_t i = 0; i < count; i++) {
+        btree_put(page, (uint16_t)i, &cells[i]);
+    }
+}
+
+static void btree_cells(uint8_t *page, struct btree_cell *cells) {
+    struct btree_node *n = btree_hdr(page);
+    for (uint16_t i = 0; i < n->num_keys; i++) {
+        cells[i].key = btree_key(page, i, &cells[i].len);
+        cells[i].child = n->level ? btree_child(page, i) : 0;
+    }
+}
+
+/* Repacks a node's cells through a copy of the page, reclaiming the holes
+ * left by deletes. */
+static void btree_compact(uint8_t *page, uint32_t page_size) {
+    uint8_t *copy = compact_scratch;
+    memcpy(copy, page, page_size);
+
+    struct btree_node *n = btree_hdr(copy);
+    btree_fill(page, page_size, n->level, n->first_child, n->next, NULL, 0);
+    for (uint16_t i = 0; i < n->num_keys; i++) {
+        struct btree_cell c;
+        c.key = btree_key(copy, i, &c.len);
+        c.child = n->level ? btree_child(copy, i) : 0;
+        btree_put(page, i, &c);
+    }
+}
+
+static struct frame *btree_pin(struct db *db, uint64_t page_num) {
+    struct frame *f = pool_pin(db, page_num, 1);
+    if (f && !btree_node_valid(f->data, db->page_size)) {
+        pool_unpin(db, f, 0);
+        errno = EIO;
+        return NULL;
+    }
+    return f;
+}
+
+/* Allocates a page for a node and returns it pinned (not latched). */
+static struct frame *btree_new_node(struct db *db) {
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t page_num = alloc_page(db);
+    pthread_mutex_unlock(&db->header_lock);
+    if (page_num == 0) {
+        return NULL;
+    }
+    return pool_pin(db, page_num, 0);
+}
+
+/* Writes a new image over a pinned node and unpins it. */
+static void btree_store(struct db *db, struct frame *f, const uint8_t *image) {
+    pthread_rwlock_wrlock(&f->latch);
+    memcpy(f->data, image, db->page_size);
+    pthread_rwlock_unlock(&f->latch);
+    pool_unpin(db, f, 1);
+}
+
+static void btree_set_root(struct db *db, uint64_t page_num) {
+    pthread_mutex_lock(&db->header_lock);
+    db->header.btree_root = page_num;
+    pthread_mutex_unlock(&db->header_lock);
+}
+
+/* Walks from the root to the leaf that would hold key, recording the pages
+ * passed. Returns the depth, 0 for an empty tree, or -1. */
+static int btree_descend(struct db *db, const uint8_t *key, uint32_t key_len,
+                         uint64_t *path) {
+    uint64_t page_num = db->header.btree_root;
+    int depth = 0;
+    while (page_num != 0) {
+        if (depth == BTREE_DEPTH_MAX) {
+            errno = EIO;
+            return -1;
+        }
+        struct frame *f = btree_pin(db, page_num);
+        if (!f) {
+            return -1;
+        }
+        path[depth++] = page_num;
+        uint64_t next = btree_hdr(f->data)->level
+                        ? btree_route(f->data, key, key_len) : 0;
+        pool_unpin(db, f, 0);
+        page_num = next;
+    }
+    return depth;
+}
+
+/* Splits the full node in f around cell c, which belongs at pos. The lower
+ * half stays put and the upper half moves to a new right sibling; the
+ * separator the parent needs is copied into sep. Unpins f. */
+static int btree_split(struct db *db, struct frame *f, uint16_t pos,
+                       const struct btree_cell *c, struct btree_cell *sep,
+                       uint8_t *sep_buf) {
+    struct btree_node *n = btree_hdr(f->data);
+    uint16_t level = n->level;
+    size_t count = (size_t)n->num_keys + 1;
+
+    struct btree_cell *cells = malloc(count * sizeof(*cells));
+    uint8_t *image = malloc(db->page_size);
+    struct frame *rf = cells && image ? btree_new_node(db) : NULL;
+    if (!rf) {
+        if (!cells || !image) {
+            errno = ENOMEM;
+        }
+        free(cells);
+        free(image);
+        pool_unpin(db, f, 0);
+        return -1;
+    }
+
+    btree_cells(f->data, cells);
+    memmove(&cells[pos + 1], &cells[pos], (count - 1 - pos) * sizeof(*cells));
+    cells[pos] = *c;
+
+    /* Split by bytes, keeping at least one cell on each side. */
+    size_t total = 0, half = 0, m = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += btree_cell_size(level, cells[i].len) + sizeof(uint16_t);
+    }
+    while (m < count - 1 && (m == 0 || half < total / 2)) {
+        half += btree_cell_size(level, cells[m].len) + sizeof(uint16_t);
+        m++;
+    }
+
+    /* A leaf's separator is a copy of the right half's first key; an
+     * internal node's middle cell moves up and its child becomes the right
+     * node's first_child. */
+    memcpy(sep_buf, cells[m].key, cells[m].len);
+    sep->key = sep_buf;
+    sep->len = cells[m].len;
+    sep->child = rf->page_num;
+
+    if (level == 0) {
+        btree_fill(image, db->page_size, 0, 0, n->next, &cells[m], count - m);
+    } else {
+        btree_fill(image, db->page_size, level, cells[m].child, 0, &cells[m + 1],
+                   count - m - 1);
+    }
+    btree_store(db, rf, image);
+
+    btree_fill(image, db->page_size, level, n->first_child, level == 0 ? sep->child : 0,
+               cells, m);
+    btree_store(db, f, image);
+
+    free(cells);
+    free(image);
+    return 0;
+}
+
+static int btree_insert_locked(struct db *db, const uint8_t *key,
+                               uint32_t key_len) {
+    uint64_t path[BTREE_DEPTH_MAX];
+    int depth = btree_descend(db, key, key_len, path);
+    if (depth < 0) {
+        return -1;
+    }
+
+    struct btree_cell c = { 0, key, (uint16_t)key_len };
+    uint8_t sep_bufs[2][BTREE_MAX_KEY];
+    uint16_t level = 0;
+    for (int d = depth - 1; d >= 0; d--, level++) {
+        struct frame *f = btree_pin(db, path[d]);
+        if (!f) {
+            return -1;
+        }
+
+        /* A separator always falls strictly inside its node's range, so
+         * only the leaf can already hold the key. */
+        int exact;
+        uint16_t pos = btree_search(f->data, c.key, c.len, &exact);
+        if (exact && level == 0) {
+            pool_unpin(db, f, 0);
+            return 0;
+        }
+
+        size_t need = btree_cell_size(level, c.len) + sizeof(uint16_t);
+        if (btree_room(f->data, db->page_size) >= need) {
+            pthread_rwlock_wrlock(&f->latch);
+            if (btree_gap(f->data) < need) {
+                btree_compact(f->data, db->page_size);
+            }
+            btree_put(f->data, pos, &c);
+            pthread_rwlock_unlock(&f->latch);
+            pool_unpin(db, f, 1);
+            return 0;
+        }
+
+        struct btree_cell sep;
+        if (btree_split(db, f, pos, &c, &sep, sep_bufs[d & 1]) != 0) {
+            return -1;
+        }
+        c = sep;
+    }
+
+    /* The root split (or the tree was empty): grow a level. */
+    struct frame *f = btree_new_node(db);
+    if (!f) {
+        return -1;
+    }
+    uint8_t *image = malloc(db->page_size);
+    if (!image) {
+        pool_unpin(db, f, 0);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (depth == 0) {
+        btree_fill(image, db->page_size, 0, 0, 0, &c, 1);
+    } else {
+        btree_fill(image, db->page_size, level, path[0], 0, &c, 1);
+    }
+    uint64_t root = f->page_num;
+    btree_store(db, f, image);
+    free(image);
+    btree_set_root(db, root);
+    return 0;
+}
+
+static int btree_insert(struct db *db, const uint8_t *key, uint32_t key_len) {
+    if (!(db->flags & DB_OPEN_ORDERED)) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&db->btree.lock);
+    int ret = btree_insert_locked(db, key, key_len);
+    db->btree.version++;
+    pthread_rwlock_unlock(&db->btree.lock);
+    return ret;
+}
+
+static int btree_remove(struct db *db, const uint8_t *key, uint32_t key_len) {
+    if (!(db->flags & DB_OPEN_ORDERED)) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&db->btree.lock);
+    uint64_t path[BTREE_DEPTH_MAX];
+    int depth = btree_descend(db, key, key_len, path);
+    int ret = depth < 0 ? -1 : 0;
+    struct frame *f = depth > 0 ? btree_pin(db, path[depth - 1]) : NULL;
+    if (depth > 0 && !f) {
+        ret = -1;
+    }
+    if (f) {
+        int exact;
+        uint16_t pos = btree_search(f->data, key, key_len, &exact);
+        if (exact) {
+            pthread_rwlock_wrlock(&f->latch);
+            struct btree_node *n = btree_hdr(f->data);
+            uint16_t *offsets = btree_offsets(f->data);
+            memmove(&offsets[pos], &offsets[pos + 1],
+                    (size_t)(n->num_keys - pos - 1) * sizeof(uint16_t));
+            n->num_keys--;
+            pthread_rwlock_unlock(&f->latch);
+        }
+        pool_unpin(db, f, exact);
+    }
+    db->btree.version++;
+    pthread_rwlock_unlock(&db->btree.lock);
+    return ret;
+}
+
+/* Returns a tree's pages to the free map. A freed page no longer passes
+ * btree_pin, so a damaged tree that loops back on itself stops there. */
+static int btree_free_pages(struct db *db, uint64_t page_num, int depth) {
+    if (depth == BTREE_DEPTH_MAX) {
+        errno = EIO;
+        return -1;
+    }
+    struct frame *f = btree_pin(db, page_num);
+    if (!f) {
+        return -1;
+    }
+
+    int ret = 0;
+    struct btree_node *n = btree_hdr(f->data);
+    if (n->level) {
+        ret = btree_free_pages(db, n->first_child, depth + 1);
+        for (uint16_t i = 0; i < n->num_keys && ret == 0; i++) {
+            ret = btree_free_pages(db, btree_child(f->data, i), depth + 1);
+        }
+    }
+    pool_unpin(db, f, 0);
+    return ret == 0 ? free_page(db, page_num) : -1;
+}
+
+static int compare_cells(const void *a, const void *b) {
+    const struct btree_cell *x = a, *y = b;
+    return btree_compare(x->key, x->len, y->key, y->len);
+}
+
+static int collect_cells(const struct hash_tab *t, struct btree_cell *cells,
+                         size_t *n) {
+    if (!t->meta) return 0;
+
+    for (uint64_t i = 0; i <= t->mask; i++) {
+        if (t->meta[i] == 0) {
+            continue;
+        }
+        const struct hash_entry *e = &t->entries[i];
+        if (e->key_len > BTREE_MAX_KEY) {
+            errno = EFBIG;
+            return -1;
+        }
+        cells[*n].child = 0;
+        cells[*n].key = entry_key(e);
+        cells[*n].len = (uint16_t)e->key_len;
+        (*n)++;
+    }
+    return 0;
+}
+
+/* Takes a page for a node being bulk-loaded: the lowest free one with
+ * reuse, or else the next at the end of the file. */
+static uint64_t btree_take_page(struct db *db, int reuse) {
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t page_num;
+    if (reuse) {
+        db->free.hint = 1;
+        page_num = alloc_page(db);
+    } else {
+        page_num = grow_file(db, 1);
+    }
+    pthread_mutex_unlock(&db->header_lock);
+    return page_num;
+}
+
+/* Bulk-loads a tree from the index, one level at a time, and sets *root
+ * to it (0 for no keys). While opening, the nodes of a level are
+ * consecutive pages at the end of the file; a vacuum (reuse) packs them
+ * into the lowest free pages instead. Either way each leaf's successor is
+ * taken before the leaf is written, so the leaves are chained (and read
+ * ahead) in key order. */
+static int btree_build(struct db *db, int reuse, uint64_t *root) {
+    *root = 0;
+
+    uint64_t count = index_count(db);
+    struct btree_cell *cells = malloc((count ? count : 1) * sizeof(*cells));
+    if (!cells) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t n = 0;
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        if (collect_cells(&db->index[i].table->cur, cells, &n) != 0 ||
+            collect_cells(&db->index[i].table->old, cells, &n) != 0) {
+            free(cells);
+            return -1;
+        }
+    }
+    qsort(cells, n, sizeof(*cells), compare_cells);
+
+    /* Each node's first key and page number become a cell of the level
+     * above, written back over the front of the array. */
+    for (uint16_t level = 0; n > 0; level++) {
+        size_t out = 0, i = 0;
+        uint64_t page_num = btree_take_page(db, reuse);
+        while (i < n) {
+            struct frame *f = page_num ? pool_pin(db, page_num, 0) : NULL;
+            if (!f) {
+                free(cells);
+                return -1;
+            }
+
+            struct btree_cell first = cells[i];
+            pthread_rwlock_wrlock(&f->latch);
+            btree_node_init(f->data, db->page_size, level);
+            if (level > 0) {
+                btree_hdr(f->data)->first_child = cells[i++].child;
+            }
+            while (i < n &&
+                   btree_gap(f->data) >= btree_cell_size(level, cells[i].len) +
+                   sizeof(uint16_t) + BTREE_BUILD_SLACK(db->page_size)) {
+                btree_put(f->data, btree_hdr(f->data)->num_keys, &cells[i++]);
+            }
+            uint64_t next = i < n ? btree_take_page(db, reuse) : 0;
+            if (level == 0) {
+                btree_hdr(f->data)->next = next;
+            }
+            pthread_rwlock_unlock(&f->latch);
+            pool_unpin(db, f, 1);
+
+            cells[out].child = page_num;
+            cells[out].key = first.key;
+            cells[out].len = first.len;
+            out++;
+            page_num = next;
+        }
+        n = out;
+        if (n == 1) {
+            *root = cells[0].child;
+            break;
+        }
+    }
+
+    free(cells);
+    return 0;
+}
+
+/* Brings the tree in line with the index at open. A tree saved by a clean
+ * close of an ordered handle is used as is; anything else is freed and
+ * bulk-loaded again. (After a scan the old pages are already free and the
+ * root is 0.) */
+static int btree_open(struct db *db) {
+    if (db->header.btree_root != 0 &&
+        db->header.btree_generation == db->header.generation) {
+        return 0;
+    }
+
+    /* Pages a damaged stale tree still holds are only reclaimed by a scan. */
+    if (db->header.btree_root != 0) {
+        btree_free_pages(db, db->header.btree_root, 0);
+    }
+    uint64_t root;
+    int ret = btree_build(db, 0, &root);
+    btree_set_root(db, root);
+    return ret;
+}
+
+/* The first change after a checkpoint bumps the generation on disk, which
+ * invalidates the snapshot if we crash before the next checkpoint. */
+static int mark_dirty(struct db *db) {
+    pthread_mutex_lock(&db->header_lock);
+    db->snapshot_valid = 0;
+
+    int ret = 0;
+    if (db->header.index_generation == db->header.generation) {
+        db->header.generation++;
+        if (write_header(db) != 0) {
+            db->header.generation--;
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&db->header_lock);
+    return ret;
+}
+
+/* Decompresses the viewed value up to offset + len. From the start it
+ * decodes straight into buf; a later range needs the bytes before it. */
+static int view_decompress(struct db *db, const struct value_view *v,
+                           uint64_t offset, uint8_t *buf, uint64_t len) {
+    const uint8_t *dict = NULL;
+    uint32_t dict_len = 0;
+    if (v->form == VALUE_LZ4_DICT) {
+        const struct value_dict *d = atomic_load(&db->dict);
+        if (!d) {
+            errno = EIO;
+            return -1;
+        }
+        dict = d->data;
+        dict_len = d->len;
+    }
+    if (offset == 0) {
+        return lz4_decompress(v->val, v->stored_len, buf, len, dict, dict_len);
+    }
+
+    uint8_t *tmp = malloc(offset + len);
+    if (!tmp) {
+        return -1;
+    }
+    int ret = lz4_decompress(v->val, v->stored_len, tmp, offset + len, dict, dict_len);
+    if (ret == 0) {
+        memcpy(buf, tmp + offset, len);
+    }
+    free(tmp);
+    return ret;
+}
+
+/* Copies [offset, offset + len) of the viewed value into buf. An overflow
+ * value is read from its extent while the view still holds the page. */
+static int view_read(struct db *db, const struct value_view *v,
+                     uint64_t offset, uint8_t *buf, uint64_t len) {
+    if (v->form == VALUE_RAW) {
+        memcpy(buf, v->val + offset, len);
+        return 0;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (v->form != VALUE_OVERFLOW) {
+        return view_decompress(db, v, offset, buf, len);
+    }
+
+    struct overflow_ref ext;
+    memcpy(&ext, v->val, sizeof(ext));
+    if (overflow_pages(db, v->val_len) != ext.num_pages) {
+        errno = EIO;
+        return -1;
+    }
+    return read_overflow(db, &ext, offset, buf, len);
+}
+
+/* Snapshot versions (see struct version_store). */
+
+struct db_snapshot {
+    struct db *db;
+    uint64_t seq;
+    struct db_snapshot *prev;
+    struct db_snapshot *next;
+};
+
+static struct version *_Atomic *version_bucket(struct db *db, uint64_t hash) {
+    return &db->versions.buckets[hash & (VERSION_BUCKETS - 1)];
+}
+
+/* Returns the oldest version of key written after seq, or NULL. */
+static const struct version *version_find(struct db *db, uint64_t hash,
+                                          const uint8_t *key, uint32_t key_len,
+                                          uint64_t seq) {
+    const struct version *best = NULL;
+    for (const struct version *v = atomic_load(version_bucket(db, hash)); v;
+         v = atomic_load(&v->next)) {
+        if (v->seq > seq && (!best || v->seq < best->seq) && v->hash == hash &&
+            v->key_len == key_len && memcmp(v->data, key, key_len) == 0) {
+            best = v;
+        }
+    }
+    return best;
+}
+
+/* Keeps key's value at loc (or, with no loc, its absence) for the open
+ * snapshots before a write replaces it. The caller holds the key's shard
+ * write_lock and lock shared, so neither the value nor the set of
+ * snapshots changes meanwhile. Nothing is kept if a version since the
+ * newest snapshot already holds what every snapshot sees. */
+static int version_save(struct db *db, uint64_t hash, const uint8_t *key,
+                        uint32_t key_len, const struct index_loc *loc) {
+    struct version_store *vs = &db->versions;
+    if (atomic_load(&vs->open) == 0 ||
+        version_find(db, hash, key, key_len, vs->snapshots->seq)) {
+        return 0;
+    }
+
+    struct frame *f = NULL;
+    struct value_view view = {0};
+    if (loc) {
+        f = pool_pin(db, loc->page_num, 1);
+        if (!f) {
+            return -1;
+        }
+        pthread_rwlock_rdlock(&f->latch);
+        if (record_value(f->data, db->page_size, loc->slot, key, key_len, &view) != 0) {
+            pthread_rwlock_unlock(&f->latch);
+            pool_unpin(db, f, 0);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    int ret = 0;
+    struct version *v = malloc(sizeof(*v) + key_len + view.val_len);
+    if (!v) {
+        errno = ENOMEM;
+        ret = -1;
+    } else if (f && view_read(db, &view, 0, v->data + key_len, view.val_len) != 0) {
+        free(v);
+        ret = -1;
+    }
+    if (f) {
+        pthread_rwlock_unlock(&f->latch);
+        pool_unpin(db, f, 0);
+    }
+    if (ret != 0) {
+        return -1;
+    }
+
+    v->hash = hash;
+    v->seq = atomic_fetch_add(&vs->seq, 1) + 1;
+    v->key_len = key_len;
+    v->val_len = view.val_len;
+    v->absent = !loc;
+    v->expires = view.expires;
+    memcpy(v->data, key, key_len);
+    atomic_fetch_add(&vs->bytes, sizeof(*v) + key_len + view.val_len);
+
+    struct version *_Atomic *head = version_bucket(db, hash);
+    struct version *next = atomic_load(head);
+    do {
+        atomic_store(&v->next, next);
+    } while (!atomic_compare_exchange_weak(head, &next, v));
+    return 0;
+}
+
+static void versions_destroy(struct version_store *vs) {
+    if (vs->buckets) {
+        for (size_t i = 0; i < VERSION_BUCKETS; i++) {
+            struct version *v = atomic_load(&vs->buckets[i]);
+            while (v) {
+                struct version *next = atomic_load(&v->next);
+                free(v);
+                v = next;
+            }
+        }
+        free(vs->buckets);
+    }
+    while (vs->snapshots) {
+        struct db_snapshot *next = vs->snapshots->next;
+        free(vs->snapshots);
+        vs->snapshots = next;
+    }
+    pthread_mutex_destroy(&vs->reclaim_lock);
+}
+
+/* Applying changes to data pages. The caller holds the key's shard
+ * write_lock. A key's index entry is repointed while its new record's page is
+ * still latched, and its old record is killed only after that, so a reader
+ * always finds a live copy. */
+
+/* Finds a page with room for len bytes and returns it pinned and
+ * write-latched with the record space reserved. The space map is only a
+ * hint, so a page that turns out to be full (or freed meanwhile) is noted
+ * and the search starts over. */
+static struct frame *place_record(struct db *db, uint16_t len, uint16_t *slot,
+                                  uint8_t **rec) {
+    for (;;) {
+        pthread_mutex_lock(&db->header_lock);
+        uint64_t page_num = space_map_find(&db->space, len);
+        int fresh = page_num == 0;
+        if (fresh) {
+            page_num = alloc_page(db);
+        }
+        pthread_mutex_unlock(&db->header_lock);
+        if (page_num == 0) {
+            return NULL;
+        }
+
+        struct frame *f = pool_pin(db, page_num, !fresh);
+        if (!f) {
+            if (fresh) {
+                int err = errno;
+                pthread_mutex_lock(&db->header_lock);
+                unalloc_page(db, page_num);
+                pthread_mutex_unlock(&db->header_lock);
+                errno = err;
+            }
+            return NULL;
+        }
+
+        pthread_rwlock_wrlock(&f->latch);
+        if (fresh) {
+            data_page_init(f->data, db->page_size);
+        }
+        if (((struct page_header *)f->data)->page_type == PAGE_TYPE_DATA) {
+            int may_compact = atomic_load(&f->refs) == 0;
+            *rec = data_page_alloc(f->data, db->page_size, len, slot, may_compact);
+            if (*rec) {
+                return f;
+            }
+
+            pthread_mutex_lock(&db->header_lock);
+            space_map_set(&db->space, page_num, data_page_room(f->data, may_compact));
+            pthread_mutex_unlock(&db->header_lock);
+        }
+        pthread_rwlock_unlock(&f->latch);
+        pool_unpin(db, f, 0);
+    }
+}
+
+/* Whether a record of len bytes fits in place of the one in slot. */
+static int fits_after_kill(uint8_t *page, uint16_t slot, uint16_t len) {
+    struct data_page_header *dh = data_page_hdr(page);
+    return (uint32_t)len + sizeof(struct slot) <=
+           (uint32_t)dh->free_bytes + data_page_slots(page)[slot].length;
+}
+
+/* Kills a record and releases its overflow extent, if any. The extent goes
+ * only once the page latch is dropped, so no reader is still streaming it. */
+static int kill_record(struct db *db, uint64_t page_num, uint16_t slot) {
+    struct frame *f = pool_pin(db, page_num, 1);
+    if (!f) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&f->latch);
+    struct overflow_ref ext;
+    int has_ext = record_extent(f->data, db->page_size, slot, &ext);
+    data_page_kill(f->data, slot);
+    settle_page(db, f);
+    pthread_rwlock_unlock(&f->latch);
+
+    pool_unpin(db, f, 1);
+    if (has_ext) {
+        free_extent(db, &ext);
+    }
+    return 0;
+}
+
+static int apply_put(struct db *db, uint64_t hash, const uint8_t *key,
+                     uint32_t key_len, const uint8_t *val, uint32_t val_len,
+                     uint64_t expires) {
+    struct index_shard *s = index_shard(db, hash);
+    struct index_loc old;
+    int found = index_lookup(db, s, hash, key, key_len, &old);
+    if (found < 0) {
+        return -1;
+    }
+    if (version_save(db, hash, key, key_len, found ? &old : NULL) != 0) {
+        return -1;
+    }
+    uint64_t old_page = found ? old.page_num : 0;
+    uint16_t old_slot = found ? old.slot : 0;
+    if (expires && ttl_add(db, hash, expires) != 0) {
+        return -1;
+    }
+
+    /* A value is compressed if that saves an eighth and the result fits a
+     * data page. One too big for a data page still is written to a fresh
+     * extent first and the record only carries the extent. */
+    uint32_t tail = expires ? sizeof(expires) : 0;
+    uint32_t fixed = 2 * sizeof(uint32_t) + key_len + tail;
+    uint32_t stored_len = val_len;
+    const void *payload = val;
+    uint32_t payload_len = val_len;
+    uint32_t max_record = MAX_RECORD_SIZE(db->page_size);
+    if ((db->flags & DB_OPEN_COMPRESS) && val_len >= COMPRESS_MIN_VALUE &&
+        val_len <= COMPRESS_MAX_VALUE && fixed < max_record) {
+        uint32_t cap = max_record - fixed;
+        if (cap > val_len - val_len / 8) {
+            cap = val_len - val_len / 8;
+        }
+        const uint8_t *packed;
+        int dict_used;
+        uint32_t n = compress_value(db, val, val_len, cap, &packed, &dict_used);
+        if (n) {
+            stored_len = val_len | VAL_COMPRESSED | (dict_used ? VAL_DICT : 0);
+            payload = packed;
+            payload_len = n;
+        }
+    }
+    /* ext_live is set while the new extent is allocated but no indexed
+     * record refers to it yet; a failure then gives its pages back. */
+    int ret = -1;
+    struct overflow_ref ext;
+    int ext_live = 0;
+    if (stored_len == val_len && (uint64_t)fixed + val_len > max_record) {
+        ext.num_pages = overflow_pages(db, val_len);
+        ext.first_page = alloc_extent(db, ext.num_pages);
+        if (ext.first_page == 0) {
+            goto out;
+        }
+        ext_live = 1;
+        if (write_overflow(db, &ext, val, val_len) != 0) {
+            goto out;
+        }
+        stored_len = val_len | VAL_OVERFLOW;
+        payload = &ext;
+        payload_len = sizeof(ext);
+    }
+    uint16_t required = (uint16_t)(fixed + payload_len);
+
+    /* Same-size overwrites usually fit back into the page they came from. */
+    if (old_page) {
+        struct frame *f = pool_pin(db, old_page, 1);
+        if (!f) {
+            goto out;
+        }
+
+        pthread_rwlock_wrlock(&f->latch);
+        if (atomic_load(&f->refs) == 0 &&
+            fits_after_kill(f->data, old_slot, required)) {
+            struct overflow_ref old_ext;
+            int has_ext = record_extent(f->data, db->page_size, old_slot, &old_ext);
+            uint16_t slot;
+            data_page_kill(f->data, old_slot);
+            uint8_t *rec = data_page_alloc(f->data, db->page_size, required, &slot, 1);
+            write_record(rec, key, key_len, stored_len, payload, payload_len, expires);
+
+            ret = index_set(s, hash, key, key_len, &old, old_page, slot);
+            if (ret == 0) {
+                ext_live = 0;
+            } else {
+                data_page_kill(f->data, slot);
+            }
+            settle_page(db, f);
+            pthread_rwlock_unlock(&f->latch);
+            pool_unpin(db, f, 1);
+            if (ret == 0 && has_ext) {
+                free_extent(db, &old_ext);
+            }
+            goto out;
+        }
+        pthread_rwlock_unlock(&f->latch);
+        pool_unpin(db, f, 0);
+    }
+
+    uint16_t slot;
+    uint8_t *rec;
+    struct frame *f = place_record(db, required, &slot, &rec);
+    if (!f) {
+        goto out;
+    }
+    write_record(rec, key, key_len, stored_len, payload, payload_len, expires);
+
+    ret = index_set(s, hash, key, key_len, found ? &old : NULL,
+                    f->page_num, slot);
+    if (ret == 0) {
+        ext_live = 0;
+    } else {
+        data_page_kill(f->data, slot);
+    }
+    settle_page(db, f);
+    pthread_rwlock_unlock(&f->latch);
+    pool_unpin(db, f, 1);
+
+    if (ret != 0) {
+        errno = ENOMEM;
+        ret = -1;
+    } else if (old_page) {
+        ret = kill_record(db, old_page, old_slot);
+    } else {
+        ret = btree_insert(db, key, key_len);
+    }
+
+out:
+    if (ext_live) {
+        int saved_errno = errno;
+        free_extent(db, &ext);
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+static int apply_delete(struct db *db, uint64_t hash, const uint8_t *key,
+                        uint32_t key_len) {
+    struct index_shard *s = index_shard(db, hash);
+    struct index_loc loc;
+    int found = index_lookup(db, s, hash, key, key_len, &loc);
+    if (found <= 0) {
+        if (found == 0) {
+            errno = ENOENT;
+        }
+        return -1;
+    }
+    if (version_save(db, hash, key, key_len, &loc) != 0) {
+        return -1;
+    }
+
+    struct frame *f = pool_pin(db, loc.page_num, 1);
+    if (!f) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&f->latch);
+    struct overflow_ref ext;
+    int has_ext = record_extent(f->data, db->page_size, loc.slot, &ext);
+    data_page_kill(f->data, loc.slot);
+    index_unset(s, hash, key, key_len, &loc);
+    settle_page(db, f);
+    pthread_rwlock_unlock(&f->latch);
+
+    pool_unpin(db, f, 1);
+    if (has_ext) {
+        free_extent(db, &ext);
+    }
+    return btree_remove(db, key, key_len);
+}
+
+/* Write-ahead log */
+
+#define WAL_CHECKPOINT_SIZE (64u << 20)
+
+/* FNV-1a */
+static uint32_t checksum32(uint32_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t wal_record_checksum(const struct wal_record_header *h,
+                                    const uint8_t *key, const uint8_t *val) {
+    uint32_t sum = checksum32(2166136261u, &h->type,
+                              sizeof(*h) - sizeof(h->checksum));
+    sum = checksum32(sum, key, h->key_len);
+    return checksum32(sum, val, h->val_len);
+}
+
+static int sync_data(int fd) {
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+static int wal_sync(struct wal *w) {
+    switch (w->sync) {
+    case DB_SYNC_NONE:
+        return 0;
+    case DB_SYNC_FULL:
+        return fsync(w->fd);
+    default:
+        return sync_data(w->fd);
+    }
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int wal_open(struct wal *w, const char *db_path, int sync) {
+    memset(w, 0, sizeof(*w));
+    w->sync = sync;
+
+    char *path = sidecar_path(db_path, ".wal");
+    if (!path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    w->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    free(path);
+    if (w->fd < 0) {
+        return -1;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->flushed, NULL);
+    return 0;
+}
+
+static void wal_close(struct wal *w) {
+    if (w->fd < 0) return;
+
+    close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->flushed);
+    free(w->buf);
+    free(w->spare);
+    w->fd = -1;
+}
+
+/* Makes room for need more bytes in the log buffer. Called with lock held. */
+static int wal_reserve(struct wal *w, size_t need) {
+    if (w->len + need <= w->cap) {
+        return 0;
+    }
+
+    size_t cap = w->cap ? w->cap * 2 : 1 << 16;
+    while (cap < w->len + need) {
+        cap *= 2;
+    }
+    uint8_t *buf = realloc(w->buf, cap);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return 0;
+}
+
+/* Lays out a record at p and returns its size. A put with an expiry
+ * carries it ahead of the value, as a WAL_PUT_TTL. */
+static size_t encode_record(uint8_t *p, uint32_t type, uint64_t lsn,
+                            const uint8_t *key, uint32_t key_len,
+                            const uint8_t *val, uint32_t val_len,
+                            uint64_t expires) {
+    struct wal_record_header h;
+    h.type = type;
+    h.lsn = lsn;
+    h.key_len = key_len;
+    h.val_len = val_len;
+
+    uint8_t *q = p + sizeof(h);
+    memcpy(q, key, key_len);
+    if (expires) {
+        memcpy(q + key_len, &expires, sizeof(expires));
+        h.val_len += sizeof(expires);
+    }
+    if (val_len) {
+        memcpy(q + key_len + (h.val_len - val_len), val, val_len);
+    }
+    h.checksum = wal_record_checksum(&h, q, q + key_len);
+    memcpy(p, &h, sizeof(h));
+    return sizeof(h) + key_len + h.val_len;
+}
+
+static uint64_t wal_encode(struct wal *w, uint32_t type, const uint8_t *key,
+                           uint32_t key_len, const uint8_t *val,
+                           uint32_t val_len, uint64_t expires) {
+    uint64_t lsn = w->next_lsn++;
+    size_t size = encode_record(w->buf + w->len, type, lsn, key, key_len, val,
+                                val_len, expires);
+    w->len += size;
+    w->tail += size;
+    return lsn;
+}
+
+/* Appends a record to the in-memory log and returns its LSN, or 0. If
+ * offset is not NULL it gets the file offset the record will land at. */
+static uint64_t wal_append(struct wal *w, uint32_t type, const uint8_t *key,
+                           uint32_t key_len, const uint8_t *val,
+                           uint32_t val_len, uint64_t *offset) {
+    pthread_mutex_lock(&w->lock);
+    if (w->err) {
+        pthread_mutex_unlock(&w->lock);
+        errno = w->err;
+        return 0;
+    }
+
+    uint64_t lsn = 0;
+    if (wal_reserve(w, sizeof(struct wal_record_header) + key_len + val_len) == 0) {
+        if (offset) {
+            *offset = w->tail;
+        }
+        lsn = wal_encode(w, type, key, key_len, val, val_len, 0);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return lsn;
+}
+
+/* A batch passes its puts' expiries (db_put_ttl) alongside the ops, as
+ * expires, which is NULL if no key in it expires. */
+static uint64_t batch_expires(const uint64_t *expires, size_t i) {
+    return expires ? expires[i] : 0;
+}
+
+static uint32_t batch_wal_type(const struct db_batch_op *op, uint64_t expires) {
+    if (op->type != DB_BATCH_PUT) {
+        return WAL_DELETE;
+    }
+    return expires ? WAL_PUT_TTL : WAL_PUT;
+}
+
+static size_t batch_wal_size(const struct db_batch_op *op, uint64_t expires) {
+    size_t size = sizeof(struct wal_record_header) + op->key_len;
+    if (op->type == DB_BATCH_PUT) {
+        size += op->val_len + (expires ? sizeof(expires) : 0);
+    }
+    return size;
+}
+
+/* Appends a whole batch back to back, every record but the last flagged
+ * WAL_MORE, so replay applies it all or not at all. Returns the last LSN;
+ * offsets, if not NULL, gets each record's file offset. */
+static uint64_t wal_append_batch(struct wal *w, const struct db_batch_op *ops,
+                                 const uint64_t *expires, size_t count,
+                                 uint64_t *offsets) {
+    size_t need = 0;
+    for (size_t i = 0; i < count; i++) {
+        need += batch_wal_size(&ops[i], batch_expires(expires, i));
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (w->err) {
+        pthread_mutex_unlock(&w->lock);
+        errno = w->err;
+        return 0;
+    }
+
+    uint64_t lsn = 0;
+    if (wal_reserve(w, need) == 0) {
+        for (size_t i = 0; i < count; i++) {
+            const struct db_batch_op *op = &ops[i];
+            uint64_t at = batch_expires(expires, i);
+            uint32_t type = batch_wal_type(op, at) | (i + 1 < count ? WAL_MORE : 0);
+            if (offsets) {
+                offsets[i] = w->tail;
+            }
+            lsn = wal_encode(w, type, op->key, op->key_len, op->val,
+                             op->type == DB_BATCH_PUT ? op->val_len : 0, at);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return lsn;
+}
+
+/* Returns once every record up to lsn is durable. */
+static int wal_commit(struct wal *w, uint64_t lsn) {
+    pthread_mutex_lock(&w->lock);
+
+    while (w->durable_lsn < lsn && !w->err) {
+        if (w->flushing) {
+            pthread_cond_wait(&w->flushed, &w->lock);
+            continue;
+        }
+
+        uint8_t *buf = w->buf;
+        size_t len = w->len;
+        size_t cap = w->cap;
+        uint64_t upto = w->next_lsn - 1;
+
+        w->buf = w->spare;
+        w->cap = w->spare_cap;
+        w->len = 0;
+        w->flushing = 1;
+        pthread_mutex_unlock(&w->lock);
+
+        int err = 0;
+        if (write_all(w->fd, buf, len) != 0 || wal_sync(w) != 0) {
+            err = errno ? errno : EIO;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->spare = buf;
+        w->spare_cap = cap;
+        w->flushing = 0;
+        if (err) {
+            w->err = err;
+        } else {
+            w->durable_lsn = upto;
+            w->size += len;
+            w->writes++;
+            w->written += len;
+            w->syncs += w->sync != DB_SYNC_NONE;
+        }
+        pthread_cond_broadcast(&w->flushed);
+    }
+
+    int ret = 0;
+    if (w->durable_lsn < lsn) {
+        errno = w->err;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+static int wal_log(struct db *db, uint32_t type, const uint8_t *key,
+                   uint32_t key_len, const uint8_t *val, uint32_t val_len,
+                   uint64_t *lsn) {
+    *lsn = wal_append(&db->wal, type, key, key_len, val, val_len, NULL);
+    if (*lsn == 0) {
+        return -1;
+    }
+    return wal_commit(&db->wal, *lsn);
+}
+
+/* The change hook's copy of a write (see db_set_change_hook). It is
+ * allocated before the write is logged, so running out of memory fails
+ * the write instead of losing the change, and passed on as soon as the
+ * write is durable in the WAL, which is what recovery would apply. lsn is
+ * the last op's; the ones before it precede it. */
+static int change_alloc(struct db *db, const struct db_batch_op *ops,
+                        const uint64_t *expires, size_t count,
+                        uint8_t **change) {
+    *change = NULL;
+    if (!atomic_load(&db->change_fn)) {
+        return 0;
+    }
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += batch_wal_size(&ops[i], batch_expires(expires, i));
+    }
+    *change = malloc(size);
+    if (!*change) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void change_notify(struct db *db, uint8_t *change,
+                          const struct db_batch_op *ops,
+                          const uint64_t *expires, size_t count,
+                          uint64_t lsn) {
+    db_change_fn fn = atomic_load(&db->change_fn);
+    if (!fn || !change) {
+        return;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct db_batch_op *op = &ops[i];
+        uint64_t at = batch_expires(expires, i);
+        uint32_t type = batch_wal_type(op, at) | (i + 1 < count ? WAL_MORE : 0);
+        len += encode_record(change + len, type, lsn - (count - 1 - i), op->key,
+                             op->key_len, op->val,
+                             op->type == DB_BATCH_PUT ? op->val_len : 0, at);
+    }
+    fn(db->change_ctx, change, len);
+}
+
+static int replay_record(struct db *db, const uint8_t *rec) {
+    struct wal_record_header h;
+    memcpy(&h, rec, sizeof(h));
+    const uint8_t *key = rec + sizeof(h);
+
+    if (h.lsn <= db->header.checkpoint_lsn) {
+        return 0;
+    }
+    if (mark_dirty(db) != 0) {
+        return -1;
+    }
+    uint64_t hash = hash_key(db, key, h.key_len);
+    uint32_t type = h.type & ~WAL_MORE;
+    if (type == WAL_PUT) {
+        return apply_put(db, hash, key, h.key_len, key + h.key_len, h.val_len, 0);
+    }
+    if (type == WAL_PUT_TTL) {
+        uint64_t expires;
+        memcpy(&expires, key + h.key_len, sizeof(expires));
+        return apply_put(db, hash, key, h.key_len,
+                         key + h.key_len + sizeof(expires),
+                         h.val_len - sizeof(expires), expires);
+    }
+    if (apply_delete(db, hash, key, h.key_len) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Re-applies every intact record newer than the last checkpoint. Replay
+ * stops at the first record that is short or fails its checksum, and a
+ * batch is only applied once its final record has been read. */
+static int wal_replay(struct db *db) {
+    struct wal *w = &db->wal;
+    uint64_t last_lsn = db->header.checkpoint_lsn;
+
+    struct stat st;
+    if (fstat(w->fd, &st) != 0) {
+        return -1;
+    }
+    w->size = st.st_size;
+    w->tail = st.st_size;
+
+    if (st.st_size > 0) {
+        uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, w->fd, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+        const uint8_t *p = map, *end = map + st.st_size;
+        const uint8_t *group = NULL;
+        int ret = 0;
+        while ((size_t)(end - p) >= sizeof(struct wal_record_header)) {
+            struct wal_record_header h;
+            memcpy(&h, p, sizeof(h));
+            const uint8_t *key = p + sizeof(h);
+            if ((uint64_t)(end - key) < (uint64_t)h.key_len + h.val_len) {
+                break;
+            }
+            const uint8_t *val = key + h.key_len;
+            uint32_t type = h.type & ~WAL_MORE;
+            if (h.checksum != wal_record_checksum(&h, key, val) ||
+                (type != WAL_PUT && type != WAL_DELETE &&
+                 (type != WAL_PUT_TTL || h.val_len < sizeof(uint64_t)))) {
+                break;
+            }
+
+            if (!group) {
+                group = p;
+            }
+            p = val + h.val_len;
+            if (h.type & WAL_MORE) {
+                continue;
+            }
+
+            while (group < p && ret == 0) {
+                struct wal_record_header gh;
+                memcpy(&gh, group, sizeof(gh));
+                ret = replay_record(db, group);
+                group += sizeof(gh) + gh.key_len + gh.val_len;
+            }
+            group = NULL;
+            if (ret != 0) {
+                break;
+            }
+            if (h.lsn > last_lsn) {
+                last_lsn = h.lsn;
+            }
+        }
+
+        munmap(map, st.st_size);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
+    w->next_lsn = last_lsn + 1;
+    w->durable_lsn = last_lsn;
+    return 0;
+}
+
+/* Makes every logged change durable in the data file, records how far the
+ * log is covered, and empties the log. */
+static int wal_checkpoint(struct db *db) {
+    if (pool_flush(db) != 0 || free_map_save(db) != 0 || fsync(db->fd) != 0) {
+        return -1;
+    }
+
+    db->header.checkpoint_lsn = db->wal.durable_lsn;
+    if (db->flags & DB_OPEN_ORDERED) {
+        db->header.btree_generation = db->header.generation;
+    }
+    if (write_header(db) != 0) {
+        return -1;
+    }
+
+    if (db->wal.size > 0) {
+        if (ftruncate(db->wal.fd, 0) != 0) {
+            return -1;
+        }
+        /* wal_maybe_checkpoint peeks at size under the WAL lock alone. */
+        pthread_mutex_lock(&db->wal.lock);
+        db->wal.size = 0;
+        db->wal.tail = 0;
+        pthread_mutex_unlock(&db->wal.lock);
+    }
+    return 0;
+}
+
+/* Truncates the log once it has grown past WAL_CHECKPOINT_SIZE. Called
+ * without db->lock, which this takes exclusively. */
+static void wal_maybe_checkpoint(struct db *db) {
+    pthread_mutex_lock(&db->wal.lock);
+    int full = db->wal.size >= WAL_CHECKPOINT_SIZE;
+    pthread_mutex_unlock(&db->wal.lock);
+    if (!full) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&db->lock);
+    if (db->wal.size >= WAL_CHECKPOINT_SIZE) {
+        wal_checkpoint(db);
+    }
+    pthread_rwlock_unlock(&db->lock);
+}
+
+/* Log-structured engine (DB_OPEN_LOG). Records are never updated in place:
+ * a put or delete appends to the active segment and repoints the index, and
+ * each segment counts its records and how many of them are dead. */
+
+#define LOG_OFFSET_MASK      (((uint64_t)1 << LOG_OFFSET_BITS) - 1)
+#define LOG_COMPACT_CHUNK    256
+#define LOG_COMPACT_INTERVAL 1   /* seconds between compaction passes */
+
+static uint64_t log_loc(uint32_t id, uint64_t offset) {
+    return (uint64_t)id << LOG_OFFSET_BITS | offset;
+}
+
+static char *segment_path(struct db *db, uint32_t id) {
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), ".seg.%u", id);
+    return sidecar_path(db->filepath, suffix);
+}
+
+static int read_at(struct db *db, int fd, uint8_t *buf, size_t len,
+                   uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        stats_io(db, STAT_READS, n);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Called with log.lock held. */
+static struct log_segment *log_segment(struct db *db, uint32_t id) {
+    size_t lo = 0, hi = db->log.nsegs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (db->log.segs[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < db->log.nsegs && db->log.segs[lo].id == id
+           ? &db->log.segs[lo] : NULL;
+}
+
+/* Called with log.lock held exclusively, or while opening. */
+static int log_add_segment(struct db *db, uint32_t id, int fd) {
+    struct log_engine *l = &db->log;
+    if (l->nsegs == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 16;
+        struct log_segment *segs = realloc(l->segs, cap * sizeof(*segs));
+        if (!segs) {
+            errno = ENOMEM;
+            return -1;
+        }
+        l->segs = segs;
+        l->cap = cap;
+    }
+
+    struct log_segment *seg = &l->segs[l->nsegs++];
+    seg->id = id;
+    seg->fd = fd;
+    atomic_init(&seg->records, 0);
+    atomic_init(&seg->dead, 0);
+    return 0;
+}
+
+/* Counts a record appended at loc, and the one it supersedes (if any) as
+ * dead. A tombstone is dead from the start. */
+static void log_count(struct db *db, uint64_t loc, int dead, uint64_t old_loc) {
+    pthread_rwlock_rdlock(&db->log.lock);
+    struct log_segment *seg = log_segment(db, (uint32_t)(loc >> LOG_OFFSET_BITS));
+    if (seg) {
+        atomic_fetch_add(&seg->records, 1);
+        if (dead) {
+            atomic_fetch_add(&seg->dead, 1);
+        }
+    }
+    if (old_loc && (seg = log_segment(db, (uint32_t)(old_loc >> LOG_OFFSET_BITS)))) {
+        atomic_fetch_add(&seg->dead, 1);
+    }
+    pthread_rwlock_unlock(&db->log.lock);
+}
+
+/* Points the index at a record that is durable at loc. Called with the
+ * key's shard write_lock held. */
+static int log_index(struct db *db, uint64_t hash, const uint8_t *key,
+                     uint32_t key_len, uint32_t type, uint64_t loc) {
+    struct index_shard *s = index_shard(db, hash);
+    struct hash_entry *old = hash_table_lookup(s->table, hash, key, key_len);
+    uint64_t old_loc = old ? old->page_num : 0;
+
+    int ret = 0;
+    if (type == WAL_PUT) {
+        if (index_set(s, hash, key, key_len, NULL, loc, 0) != 0) {
+            errno = ENOMEM;
+            ret = -1;
+        }
+    } else if (old) {
+        index_unset(s, hash, key, key_len, NULL);
+    }
+    log_count(db, loc, type != WAL_PUT, old_loc);
+    return ret;
+}
+
+/* Finds a key's record. On success this returns with log.lock held shared,
+ * so the segment stays open while the caller reads the *val_len value bytes
+ * at *val_pos in *fd; the caller then drops the lock. */
+static int log_locate(struct db *db, const uint8_t *key, uint32_t key_len,
+                      int *fd, uint64_t *val_pos, uint32_t *val_len) {
+    uint64_t hash = hash_key(db, key, key_len);
+    uint64_t loc;
+    uint16_t slot;
+
+    pthread_rwlock_rdlock(&db->log.lock);
+    if (index_find(db, hash, key, key_len, &loc, &slot) != 0) {
+        errno = ENOENT;
+        goto fail;
+    }
+
+    struct log_segment *seg = log_segment(db, (uint32_t)(loc >> LOG_OFFSET_BITS));
+    struct wal_record_header h;
+    if (!seg) {
+        errno = EIO;
+        goto fail;
+    }
+    if (read_at(db, seg->fd, (uint8_t *)&h, sizeof(h), loc & LOG_OFFSET_MASK) != 0) {
+        goto fail;
+    }
+    if ((h.type & ~WAL_MORE) != WAL_PUT || h.key_len != key_len) {
+        errno = EIO;
+        goto fail;
+    }
+
+    *fd = seg->fd;
+    *val_pos = (loc & LOG_OFFSET_MASK) + sizeof(h) + key_len;
+    *val_len = h.val_len;
+    return 0;
+
+fail:;
+    int saved_errno = errno;
+    pthread_rwlock_unlock(&db->log.lock);
+    errno = saved_errno;
+    return -1;
+}
+
+static uint8_t *log_get(struct db *db, const uint8_t *key, uint32_t key_len,
+                        uint32_t *val_len_out) {
+    int fd;
+    uint64_t pos;
+    uint32_t len;
+    if (log_locate(db, key, key_len, &fd, &pos, &len) != 0) {
+        return NULL;
+    }
+
+    uint8_t *val = malloc(len ? len : 1);
+    int err = !val ? ENOMEM : read_at(db, fd, val, len, pos) != 0 ? errno : 0;
+    pthread_rwlock_unlock(&db->log.lock);
+    if (err) {
+        free(val);
+        errno = err;
+        return NULL;
+    }
+    *val_len_out = len;
+    return val;
+}
+
+/* Copies up to len bytes of the value from offset into buf. Returns the
+ * value's full length, with the number of bytes copied in *copied. */
+static int64_t log_read_value(struct db *db, const uint8_t *key,
+                              uint32_t key_len, uint64_t offset, uint8_t *buf,
+                              uint64_t len, uint64_t *copied) {
+    int fd;
+    uint64_t pos;
+    uint32_t val_len;
+    if (log_locate(db, key, key_len, &fd, &pos, &val_len) != 0) {
+        return -1;
+    }
+
+    uint64_t n = 0;
+    if (offset < val_len) {
+        n = val_len - offset < len ? val_len - offset : len;
+    }
+    int err = read_at(db, fd, buf, n, pos + offset) != 0 ? errno : 0;
+    pthread_rwlock_unlock(&db->log.lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    *copied = n;
+    return val_len;
+}
+
+static void log_wake_compactor(struct db *db) {
+    pthread_mutex_lock(&db->log.compact_lock);
+    pthread_cond_signal(&db->log.compact_cond);
+    pthread_mutex_unlock(&db->log.compact_lock);
+}
+
+/* Seals the active segment and starts the next. Called with db->lock held
+ * exclusively (or while opening), so nothing is mid-append. */
+static int log_roll(struct db *db) {
+    uint32_t id = db->header.log_next_segment;
+    char *path = segment_path(db, id);
+    if (!path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    int ok = fd >= 0 && fsync_parent_dir(path) == 0;
+    free(path);
+    if (!ok) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    /* Recovery only looks at segments the header knows about, so the
+     * header has to cover this one before anything lands in it. */
+    pthread_mutex_lock(&db->header_lock);
+    db->header.log_next_segment = id + 1;
+    int ret = write_header(db);
+    pthread_mutex_unlock(&db->header_lock);
+
+    if (ret == 0) {
+        pthread_rwlock_wrlock(&db->log.lock);
+        ret = log_add_segment(db, id, fd);
+        pthread_rwlock_unlock(&db->log.lock);
+    }
+    if (ret != 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&db->wal.lock);
+    db->wal.fd = fd;
+    db->wal.size = 0;
+    db->wal.tail = 0;
+    pthread_mutex_unlock(&db->wal.lock);
+    db->log.active = id;
+    return 0;
+}
+
+/* Rolls to a new segment once the active one has reached
+ * LOG_SEGMENT_SIZE. Called without db->lock, which this takes
+ * exclusively. */
+static void log_maybe_roll(struct db *db) {
+    pthread_mutex_lock(&db->wal.lock);
+    int full = db->wal.tail >= LOG_SEGMENT_SIZE;
+    pthread_mutex_unlock(&db->wal.lock);
+    if (!full) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&db->lock);
+    int rolled = db->wal.tail >= LOG_SEGMENT_SIZE && log_roll(db) == 0;
+    pthread_rwlock_unlock(&db->lock);
+    if (rolled) {
+        log_wake_compactor(db);
+    }
+}
+
+static int log_write(struct db *db, uint32_t type, const uint8_t *key,
+                     uint32_t key_len, const uint8_t *val, uint32_t val_len) {
+    uint64_t hash = hash_key(db, key, key_len);
+    struct index_shard *s = index_shard(db, hash);
+
+    pthread_rwlock_rdlock(&db->lock);
+    pthread_mutex_lock(&s->write_lock);
+    int ret = -1;
+    uint64_t offset, lsn;
+    if (type == WAL_DELETE && !hash_table_lookup(s->table, hash, key, key_len)) {
+        errno = ENOENT;
+    } else if ((lsn = wal_append(&db->wal, type, key, key_len, val, val_len,
+                                 &offset)) != 0 &&
+               wal_commit(&db->wal, lsn) == 0) {
+        ret = log_index(db, hash, key, key_len, type,
+                        log_loc(db->log.active, offset));
+    }
+    pthread_mutex_unlock(&s->write_lock);
+    pthread_rwlock_unlock(&db->lock);
+
+    if (ret == 0) {
+        log_maybe_roll(db);
+    }
+    return ret;
+}
+
+/* Indexes one segment's records. A torn record or half-written batch can
+ * only be at the end of the last segment, which is cut back to the last
+ * whole group; anywhere else it means the segment is damaged. */
+static int log_replay_segment(struct db *db, struct log_segment *seg, int last,
+                              uint64_t *max_lsn, uint64_t *end_out) {
+    struct stat st;
+    if (fstat(seg->fd, &st) != 0) {
+        return -1;
+    }
+    *end_out = 0;
+    if (st.st_size == 0) {
+        return 0;
+    }
+
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, seg->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const uint8_t *p = map, *end = map + st.st_size;
+    const uint8_t *group = NULL, *good = map;
+    int ret = 0;
+    while ((size_t)(end - p) >= sizeof(struct wal_record_header)) {
+        struct wal_record_header h;
+        memcpy(&h, p, sizeof(h));
+        const uint8_t *key = p + sizeof(h);
+        if ((uint64_t)(end - key) < (uint64_t)h.key_len + h.val_len) {
+            break;
+        }
+        const uint8_t *val = key + h.key_len;
+        uint32_t type = h.type & ~WAL_MORE;
+        if (h.checksum != wal_record_checksum(&h, key, val) ||
+            (type != WAL_PUT && type != WAL_DELETE)) {
+            break;
+        }
+
+        if (!group) {
+            group = p;
+        }
+        p = val + h.val_len;
+        if (h.lsn > *max_lsn) {
+            *max_lsn = h.lsn;
+        }
+        if (h.type & WAL_MORE) {
+            continue;
+        }
+
+        while (group < p && ret == 0) {
+            struct wal_record_header gh;
+            memcpy(&gh, group, sizeof(gh));
+            const uint8_t *gkey = group + sizeof(gh);
+            ret = log_index(db, hash_key(db, gkey, gh.key_len), gkey, gh.key_len,
+                            gh.type & ~WAL_MORE, log_loc(seg->id, group - map));
+            group += sizeof(gh) + gh.key_len + gh.val_len;
+        }
+        group = NULL;
+        good = p;
+        if (ret != 0) {
+            break;
+        }
+    }
+    munmap(map, st.st_size);
+
+    *end_out = good - map;
+    if (ret == 0 && *end_out != (uint64_t)st.st_size) {
+        if (!last) {
+            errno = EIO;
+            ret = -1;
+        } else if (ftruncate(seg->fd, *end_out) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static int log_stopping(struct db *db) {
+    pthread_mutex_lock(&db->log.compact_lock);
+    int stop = db->log.stop;
+    pthread_mutex_unlock(&db->log.compact_lock);
+    return stop;
+}
+
+/* A record copied forward by compaction: where it was (0 for a tombstone,
+ * which is never repointed) and where its copy lands in the active
+ * segment. */
+struct log_copy {
+    const uint8_t *rec;
+    uint64_t hash;
+    uint64_t old_loc;
+    uint64_t new_offset;
+};
+
+/* Copies whatever is still live in a sealed segment to the active segment
+ * and deletes it. Runs in chunks: the records still indexed at their old
+ * place are appended under their shard's write_lock, the copies are synced
+ * with one commit, and only then is each key repointed, if nothing has
+ * overwritten it meanwhile. A tombstone is carried forward unless the key
+ * was put again or no older segment is left for it to hide anything in. */
+static int log_compact_segment(struct db *db, uint32_t id, int oldest) {
+    /* Only this thread drops segments, so the fd stays open throughout. */
+    pthread_rwlock_rdlock(&db->log.lock);
+    struct log_segment *seg = log_segment(db, id);
+    int fd = seg ? seg->fd : -1;
+    pthread_rwlock_unlock(&db->log.lock);
+
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        return -1;
+    }
+    uint8_t *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    struct log_copy copies[LOG_COMPACT_CHUNK];
+    const uint8_t *p = map, *end = map + st.st_size;
+    int ret = 0;
+    while (p < end && ret == 0) {
+        if (log_stopping(db)) {
+            ret = -1;
+            break;
+        }
+
+        pthread_rwlock_rdlock(&db->lock);
+        int n = 0;
+        uint64_t lsn = 0;
+        while (p < end && n < LOG_COMPACT_CHUNK) {
+            struct wal_record_header h;
+            const uint8_t *key = p + sizeof(h);
+            if ((size_t)(end - p) < sizeof(h)) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+            memcpy(&h, p, sizeof(h));
+            if ((uint64_t)(end - key) < (uint64_t)h.key_len + h.val_len) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+
+            uint32_t type = h.type & ~WAL_MORE;
+            uint64_t hash = hash_key(db, key, h.key_len);
+            struct index_shard *s = index_shard(db, hash);
+            uint64_t loc = log_loc(id, p - map);
+            struct log_copy *c = &copies[n];
+            c->rec = p;
+            c->hash = hash;
+            c->old_loc = 0;
+
+            pthread_mutex_lock(&s->write_lock);
+            struct hash_entry *e = hash_table_lookup(s->table, hash, key, h.key_len);
+            int copy = 0;
+            if (type == WAL_PUT && e && e->page_num == loc) {
+                copy = 1;
+                c->old_loc = loc;
+                lsn = wal_append(&db->wal, WAL_PUT, key, h.key_len,
+                                 key + h.key_len, h.val_len, &c->new_offset);
+            } else if (type == WAL_DELETE && !e && !oldest) {
+                copy = 1;
+                lsn = wal_append(&db->wal, WAL_DELETE, key, h.key_len, NULL, 0,
+                                 &c->new_offset);
+            }
+            pthread_mutex_unlock(&s->write_lock);
+
+            if (copy && lsn == 0) {
+                ret = -1;
+                break;
+            }
+            n += copy;
+            p = key + h.key_len + h.val_len;
+        }
+
+        if (ret == 0 && lsn != 0 && wal_commit(&db->wal, lsn) != 0) {
+            ret = -1;
+        }
+        for (int i = 0; i < n && ret == 0; i++) {
+            struct wal_record_header h;
+            memcpy(&h, copies[i].rec, sizeof(h));
+            const uint8_t *key = copies[i].rec + sizeof(h);
+            struct index_shard *s = index_shard(db, copies[i].hash);
+            uint64_t new_loc = log_loc(db->log.active, copies[i].new_offset);
+
+            pthread_mutex_lock(&s->write_lock);
+            struct hash_entry *e = hash_table_lookup(s->table, copies[i].hash,
+                                                     key, h.key_len);
+            int live = copies[i].old_loc != 0 && e &&
+                       e->page_num == copies[i].old_loc;
+            if (live) {
+                index_set(s, copies[i].hash, key, h.key_len, NULL, new_loc, 0);
+            }
+            log_count(db, new_loc, !live, 0);
+            pthread_mutex_unlock(&s->write_lock);
+        }
+        pthread_rwlock_unlock(&db->lock);
+    }
+    if (map) {
+        munmap(map, st.st_size);
+    }
+    if (ret != 0) {
+        return -1;
+    }
+
+    /* Readers hold log.lock shared for as long as they read a segment. */
+    pthread_rwlock_wrlock(&db->log.lock);
+    seg = log_segment(db, id);
+    close(seg->fd);
+    size_t i = seg - db->log.segs;
+    memmove(seg, seg + 1, (db->log.nsegs - i - 1) * sizeof(*seg));
+    db->log.nsegs--;
+    pthread_rwlock_unlock(&db->log.lock);
+
+    char *path = segment_path(db, id);
+    if (path) {
+        unlink(path);
+        free(path);
+    }
+    return 0;
+}
+
+/* Compacts sealed segments with at least half their records dead, oldest
+ * first, until none is left. */
+static void log_compact(struct db *db) {
+    for (;;) {
+        uint32_t victim = 0;
+        int oldest = 0;
+        pthread_rwlock_rdlock(&db->log.lock);
+        for (size_t i = 0; i + 1 < db->log.nsegs; i++) {
+            uint64_t records = atomic_load(&db->log.segs[i].records);
+            uint64_t dead = atomic_load(&db->log.segs[i].dead);
+            if (dead * 2 >= records) {
+                victim = db->log.segs[i].id;
+                oldest = i == 0;
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&db->log.lock);
+
+        if (victim == 0 || log_compact_segment(db, victim, oldest) != 0) {
+            return;
+        }
+    }
+}
+
+static void *log_compactor(void *arg) {
+    struct db *db = arg;
+
+    pthread_mutex_lock(&db->log.compact_lock);
+    while (!db->log.stop) {
+        pthread_mutex_unlock(&db->log.compact_lock);
+        log_compact(db);
+        pthread_mutex_lock(&db->log.compact_lock);
+        if (!db->log.stop) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += LOG_COMPACT_INTERVAL;
+            pthread_cond_timedwait(&db->log.compact_cond,
+                                   &db->log.compact_lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&db->log.compact_lock);
+    return NULL;
+}
+
+/* Rebuilds the index from every segment the header knows of, oldest first,
+ * makes the last one active and starts the compactor. */
+static int log_open(struct db *db) {
+    if (index_create(db, 0) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (db->header.log_next_segment == 0) {
+        db->header.log_next_segment = 1;
+    }
+    for (uint32_t id = 1; id < db->header.log_next_segment; id++) {
+        char *path = segment_path(db, id);
+        if (!path) {
+            errno = ENOMEM;
+            return -1;
+        }
+        int fd = open(path, O_RDWR | O_APPEND);
+        free(path);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                continue;   /* compacted away */
+            }
+            return -1;
+        }
+        if (log_add_segment(db, id, fd) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    uint64_t max_lsn = 0, end = 0;
+    for (size_t i = 0; i < db->log.nsegs; i++) {
+        if (log_replay_segment(db, &db->log.segs[i], i + 1 == db->log.nsegs,
+                               &max_lsn, &end) != 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&db->wal.lock, NULL);
+    pthread_cond_init(&db->wal.flushed, NULL);
+    db->wal.next_lsn = max_lsn + 1;
+    db->wal.durable_lsn = max_lsn;
+    if (db->log.nsegs == 0) {
+        if (log_roll(db) != 0) {
+            return -1;
+        }
+    } else {
+        struct log_segment *seg = &db->log.segs[db->log.nsegs - 1];
+        db->wal.fd = seg->fd;
+        db->wal.size = end;
+        db->wal.tail = end;
+        db->log.active = seg->id;
+    }
+
+    if (pthread_create(&db->log.compactor, NULL, log_compactor, db) != 0) {
+        return -1;
+    }
+    db->log.compactor_running = 1;
+    return 0;
+}
+
+/* Stops the compactor and closes the sealed segments; the active one is
+ * db->wal's and closes with it. */
+static void log_close(struct db *db) {
+    if (db->log.compactor_running) {
+        pthread_mutex_lock(&db->log.compact_lock);
+        db->log.stop = 1;
+        pthread_cond_signal(&db->log.compact_cond);
+        pthread_mutex_unlock(&db->log.compact_lock);
+        pthread_join(db->log.compactor, NULL);
+    }
+    for (size_t i = 0; i < db->log.nsegs; i++) {
+        if (db->log.segs[i].fd != db->wal.fd) {
+            close(db->log.segs[i].fd);
+        }
+    }
+    free(db->log.segs);
+}
+
+/* Reads the dictionary the header points at, checking it against its id. */
+static int dict_load(struct db *db) {
+    uint32_t len = db->header.dict_len;
+    if (db->header.dict_page == 0) {
+        return 0;
+    }
+    if (len < LZ4_MINMATCH || len > DICT_MAX_SIZE) {
+        errno = EIO;
+        return -1;
+    }
+
+    uint8_t *data = malloc(len);
+    if (!data) {
+        return -1;
+    }
+    struct overflow_ref ext = {db->header.dict_page, overflow_pages(db, len)};
+    struct value_dict *d = NULL;
+    if (read_overflow(db, &ext, 0, data, len) == 0) {
+        d = dict_create(data, len);
+        if (d && d->id != db->header.dict_id) {
+            free(d);
+            d = NULL;
+            errno = EIO;
+        }
+    }
+    free(data);
+    if (!d) {
+        return -1;
+    }
+    atomic_store(&db->dict, d);
+    return 0;
+}
+
+static void db_free(struct db *db) {
+    log_close(db);
+    if (db->fd >= 0) {
+        close(db->fd);
+    }
+    wal_close(&db->wal);
+    index_destroy(db);
+    space_map_destroy(&db->space);
+    free_map_destroy(&db->free);
+    for (int i = 0; i < POOL_SHARDS; i++) {
+        pool_destroy(&db->pool[i]);
+    }
+    stage_set_destroy(&db->stage);
+    file_map_destroy(&db->map);
+    pthread_rwlock_destroy(&db->btree.lock);
+    pthread_rwlock_destroy(&db->log.lock);
+    pthread_mutex_destroy(&db->log.compact_lock);
+    pthread_cond_destroy(&db->log.compact_cond);
+    pthread_mutex_destroy(&db->backup.lock);
+    ttl_destroy(&db->ttl);
+    pthread_mutex_destroy(&db->header_lock);
+    pthread_rwlock_destroy(&db->lock);
+    free(db->stats.stripes);
+    free(atomic_load(&db->dict));
+    versions_destroy(&db->versions);
+    free(db->filepath);
+    free(db);
+}
+
+struct db *db_open(const char *path) {
+    return db_open_flags(path, 0);
+}
+
+struct db *db_open_flags(const char *path, int flags) {
+    struct db_options opts = { .flags = flags };
+    return db_open_opts(path, &opts);
+}
+
+static int page_size_valid(uint32_t page_size) {
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+           (page_size & (page_size - 1)) == 0;
+}
+
+struct db *db_open_opts(const char *path, const struct db_options *opts) {
+    int flags = opts ? opts->flags : 0;
+    if (!path || !opts ||
+        (opts->page_size != 0 && !page_size_valid(opts->page_size)) ||
+        (opts->sync != DB_SYNC_DATA && opts->sync != DB_SYNC_FULL &&
+         opts->sync != DB_SYNC_NONE) ||
+        (flags & ~(DB_OPEN_MMAP | DB_OPEN_ORDERED | DB_OPEN_LOG | DB_OPEN_DIRECT |
+                   DB_OPEN_COMPRESS | DB_OPEN_COMPACT_INDEX)) ||
+        ((flags & DB_OPEN_LOG) &&
+         (flags & (DB_OPEN_MMAP | DB_OPEN_ORDERED | DB_OPEN_COMPRESS))) ||
+        ((flags & DB_OPEN_COMPACT_INDEX) && (flags & (DB_OPEN_LOG | DB_OPEN_ORDERED))) ||
+        ((flags & DB_OPEN_DIRECT) && (flags & (DB_OPEN_MMAP | DB_OPEN_LOG)))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct db *db = calloc(1, sizeof(*db));
+    if (!db) {
+        return NULL;
+    }
+    uint64_t t0 = stats_clock();
+    db->fd = -1;
+    db->wal.fd = -1;
+    db->wal.sync = opts->sync;
+    db->flags = flags;
+    pthread_rwlock_init(&db->lock, NULL);
+    pthread_mutex_init(&db->header_lock, NULL);
+    pthread_mutex_init(&db->backup.lock, NULL);
+    ttl_init(&db->ttl);
+    pthread_rwlock_init(&db->btree.lock, NULL);
+    pthread_rwlock_init(&db->log.lock, NULL);
+    pthread_mutex_init(&db->log.compact_lock, NULL);
+    pthread_cond_init(&db->log.compact_cond, NULL);
+    stage_set_init(&db->stage);
+    pthread_mutex_init(&db->versions.reclaim_lock, NULL);
+    index_init(db);
+    file_map_init(&db->map);
+
+    if (posix_memalign((void **)&db->stats.stripes, _Alignof(struct stats_stripe),
+                       STATS_STRIPES * sizeof(struct stats_stripe)) != 0) {
+        db->stats.stripes = NULL;
+        errno = ENOMEM;
+        goto fail;
+    }
+    memset(db->stats.stripes, 0, STATS_STRIPES * sizeof(struct stats_stripe));
+
+    db->filepath = strdup(path);
+    if (!db->filepath) {
+        goto fail;
+    }
+
+    int is_new = !file_exists(path);
+    mode_t mode = 0644;
+
+    int open_flags = O_RDWR | O_CREAT;
+#ifdef O_DIRECT
+    if (flags & DB_OPEN_DIRECT) {
+        open_flags |= O_DIRECT;
+    }
+#endif
+    db->fd = open(path, open_flags, mode);
+    if (db->fd < 0) {
+        goto fail;
+    }
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if ((flags & DB_OPEN_DIRECT) && fcntl(db->fd, F_NOCACHE, 1) != 0) {
+        goto fail;
+    }
+#endif
+
+    uint32_t engine = (flags & DB_OPEN_LOG) ? ENGINE_LOG : ENGINE_PAGES;
+    uint32_t page_size = opts->page_size ? opts->page_size : DEFAULT_PAGE_SIZE;
+    if (is_new && init_new_db(db->fd, engine, page_size) != 0) {
+        goto fail;
+    }
+
+    if (read_header(db->fd, &db->header) != 0) {
+        goto fail;
+    }
+    if (db->header.engine != engine ||
+        (opts->page_size && db->header.page_size != opts->page_size)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    db->page_size = db->header.page_size;
+    if (engine == ENGINE_LOG) {
+        uint64_t t = stats_clock();
+        if (log_open(db) != 0) {
+            goto fail;
+        }
+        db->stats.recovery_ns = stats_clock() - t;
+        db->stats.open_ns = stats_clock() - t0;
+        return db;
+    }
+
+    if (space_map_grow(&db->space, db->header.next_free_page) != 0 ||
+        free_map_grow(&db->free, db->header.next_free_page) != 0) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    size_t frames = opts->cache_size ? opts->cache_size / db->page_size
+                                     : BUFFER_POOL_PAGES;
+    if (frames < POOL_MIN_PAGES) {
+        frames = POOL_MIN_PAGES;
+    }
+    int direct = (flags & DB_OPEN_DIRECT) != 0;
+    for (int i = 0; i < POOL_SHARDS; i++) {
+        if (pool_init(&db->pool[i], frames / POOL_SHARDS, db->page_size,
+                      direct) != 0) {
+            goto fail;
+        }
+    }
+    if (direct && stage_set_alloc(db, &db->stage) != 0) {
+        goto fail;
+    }
+
+    /* The WAL replay may compress against the dictionary. */
+    if (dict_load(db) != 0) {
+        goto fail;
+    }
+
+    uint64_t recovery_start = stats_clock();
+    if (load_index_snapshot(db) == 0) {
+        db->snapshot_valid = 1;
+    } else if (scan_pages(db) != 0) {
+        goto fail;
+    }
+    db->stats.recovery_scanned = !db->snapshot_valid;
+
+    if ((flags & DB_OPEN_ORDERED) && btree_open(db) != 0) {
+        goto fail;
+    }
+
+    if (wal_open(&db->wal, path, opts->sync) != 0 || wal_replay(db) != 0) {
+        goto fail;
+    }
+    if (db->wal.size > 0 && db_checkpoint(db) != 0) {
+        goto fail;
+    }
+    db->stats.recovery_ns = stats_clock() - recovery_start;
+
+    if ((flags & DB_OPEN_MMAP) && file_map_refresh(db) != 0) {
+        goto fail;
+    }
+
+    db->stats.open_ns = stats_clock() - t0;
+    return db;
+
+fail:;
+    int saved_errno = errno;
+    db_free(db);
+    errno = saved_errno;
+    return NULL;
+}
+
+int db_checkpoint(struct db *db) {
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        return 0;   /* every write is already durable in its segment */
+    }
+
+    pthread_rwlock_wrlock(&db->lock);
+    int ret = -1;
+    if (!db->snapshot_valid ||
+        db->header.index_generation != db->header.generation) {
+        pthread_mutex_lock(&db->header_lock);
+        int reserved = free_map_reserve(db);
+        pthread_mutex_unlock(&db->header_lock);
+        if (reserved != 0 || pool_flush(db) != 0 || fsync(db->fd) != 0 ||
+            write_index_snapshot(db) != 0) {
+            goto out;
+        }
+        db->header.index_generation = db->header.generation;
+    }
+
+    if (wal_checkpoint(db) != 0) {
+        goto out;
+    }
+
+    db->snapshot_valid = 1;
+    ret = 0;
+
+out:
+    pthread_rwlock_unlock(&db->lock);
+    return ret;
+}
+
+/* Takes the image point with lock held exclusively: once the pool is
+ * flushed the file holds every change up to the WAL's durable LSN and
+ * nothing else, and it only changes again through backup_preserve. */
+int db_backup(struct db *db, const char *path, uint64_t *lsn) {
+    if (!db || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct backup_state *b = &db->backup;
+    pthread_rwlock_wrlock(&db->lock);
+    pthread_mutex_lock(&b->lock);
+    int busy = b->copied != NULL;
+    pthread_mutex_unlock(&b->lock);
+    if (busy || pool_flush(db) != 0) {
+        int err = busy ? EBUSY : errno;
+        pthread_rwlock_unlock(&db->lock);
+        close(fd);
+        unlink(path);
+        errno = err;
+        return -1;
+    }
+
+    pthread_mutex_lock(&db->header_lock);
+    _Alignas(MIN_PAGE_SIZE) struct db_header header = db->header;
+    pthread_mutex_unlock(&db->header_lock);
+    uint64_t pages = header.next_free_page;
+    uint64_t at = db->wal.durable_lsn;
+
+    int ret = -1, cloned = 0;
+#ifdef FICLONE
+    cloned = ioctl(fd, FICLONE, db->fd) == 0;
+#endif
+    if (ftruncate(fd, (off_t)(pages * db->page_size)) == 0 &&
+        pwrite(fd, &header, sizeof(header), 0) == sizeof(header)) {
+        ret = 0;
+    }
+    if (ret == 0 && !cloned) {
+        pthread_mutex_lock(&b->lock);
+        b->copied = calloc((pages + 63) / 64, sizeof(uint64_t));
+        if (b->copied) {
+            b->copied[0] = 1;   /* the header is written already */
+            b->fd = fd;
+            b->err = 0;
+            b->pages = pages;
+            atomic_store(&b->active, 1);
+        } else {
+            errno = ENOMEM;
+            ret = -1;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    pthread_rwlock_unlock(&db->lock);
+
+    if (ret == 0 && !cloned) {
+        int failed = 0;
+        for (uint64_t p = 1; p < pages && !failed; p += BACKUP_CHUNK_PAGES) {
+            pthread_mutex_lock(&b->lock);
+            backup_copy(db, p, BACKUP_CHUNK_PAGES);
+            failed = b->err;
+            pthread_mutex_unlock(&b->lock);
+        }
+
+        pthread_mutex_lock(&b->lock);
+        atomic_store(&b->active, 0);
+        if (b->err) {
+            errno = b->err;
+            ret = -1;
+        }
+        free(b->copied);
+        b->copied = NULL;
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    if (ret == 0 && (fsync(fd) != 0 || fsync_parent_dir(path) != 0)) {
+        ret = -1;
+    }
+    int err = errno;
+    close(fd);
+    if (ret != 0) {
+        unlink(path);
+        errno = err;
+        return -1;
+    }
+    if (lsn) {
+        *lsn = at;
+    }
+    return 0;
+}
+
+int64_t db_verify(struct db *db) {
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t num_pages = db->header.next_free_page;
+    pthread_mutex_unlock(&db->header_lock);
+
+    int nthreads = scan_thread_count(num_pages - 1);
+    struct verify_worker *workers = calloc(nthreads, sizeof(*workers));
+    if (!workers) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint64_t chunks = (num_pages - 1 + SCAN_CHUNK_PAGES - 1) / SCAN_CHUNK_PAGES;
+    uint64_t per_worker = (chunks + nthreads - 1) / nthreads * SCAN_CHUNK_PAGES;
+    for (int i = 0; i < nthreads; i++) {
+        struct verify_worker *w = &workers[i];
+        w->db = db;
+        w->first_page = 1 + i * per_worker;
+        w->end_page = w->first_page + per_worker;
+        if (w->first_page > num_pages) {
+            w->first_page = num_pages;
+        }
+        if (w->end_page > num_pages) {
+            w->end_page = num_pages;
+        }
+    }
+
+    int started = 0;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, verify_worker_run,
+                           &workers[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+    verify_worker_run(&workers[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = started + 1; i < nthreads; i++) {
+        verify_worker_run(&workers[i]);
+    }
+
+    int64_t damaged = 0;
+    for (int i = 0; i < nthreads; i++) {
+        if (workers[i].err) {
+            errno = workers[i].err;
+            damaged = -1;
+            break;
+        }
+        damaged += workers[i].damaged;
+    }
+    free(workers);
+    return damaged;
+}
+
+/* Adds up the probe distances of one table's entries. */
+static void index_probe_stats(const uint32_t *meta, uint64_t mask,
+                              size_t entry_size, struct db_stats *out) {
+    if (!meta) {
+        return;
+    }
+    out->index_bytes += (mask + 1) * (sizeof(*meta) + entry_size);
+    for (uint64_t i = 0; i <= mask; i++) {
+        uint32_t m = meta[i];
+        if (m == 0) {
+            continue;
+        }
+        uint64_t probe = META_DIST(m) - 1;
+        out->index_probe_total += probe;
+        if (probe > out->index_max_probe) {
+            out->index_max_probe = probe;
+        }
+    }
+}
+
+int db_stats(struct db *db, struct db_stats *out) {
+    if (!db || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+
+    for (int i = 0; i < STATS_STRIPES; i++) {
+        struct stats_stripe *s = &db->stats.stripes[i];
+        out->reads += atomic_load_explicit(&s->counters[STAT_READS], memory_order_relaxed);
+        out->read_bytes += atomic_load_explicit(&s->counters[STAT_READ_BYTES], memory_order_relaxed);
+        out->writes += atomic_load_explicit(&s->counters[STAT_WRITES], memory_order_relaxed);
+        out->write_bytes += atomic_load_explicit(&s->counters[STAT_WRITE_BYTES], memory_order_relaxed);
+        out->pool_hits += atomic_load_explicit(&s->counters[STAT_POOL_HITS], memory_order_relaxed);
+        out->pool_misses += atomic_load_explicit(&s->counters[STAT_POOL_MISSES], memory_order_relaxed);
+        for (int op = 0; op < DB_OPS; op++) {
+            struct db_histogram *h = &out->latency[op];
+            h->count += atomic_load_explicit(&s->ops[op], memory_order_relaxed);
+            h->total_ns += atomic_load_explicit(&s->total_ns[op], memory_order_relaxed);
+            for (int b = 0; b < DB_HIST_BUCKETS; b++) {
+                h->buckets[b] += atomic_load_explicit(&s->hist[op][b], memory_order_relaxed);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&db->wal.lock);
+    out->wal_writes = db->wal.writes;
+    out->wal_write_bytes = db->wal.written;
+    out->wal_syncs = db->wal.syncs;
+    pthread_mutex_unlock(&db->wal.lock);
+
+    pthread_mutex_lock(&db->header_lock);
+    out->file_pages = db->header.next_free_page;
+    out->free_pages = db->free.count;
+    pthread_mutex_unlock(&db->header_lock);
+
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        struct index_shard *s = &db->index[i];
+        pthread_rwlock_rdlock(&s->lock);
+        out->keys += shard_count(s);
+        if (s->fps) {
+            index_probe_stats(s->fps->cur.meta, s->fps->cur.mask,
+                              sizeof(struct fp_entry), out);
+            index_probe_stats(s->fps->old.meta, s->fps->old.mask,
+                              sizeof(struct fp_entry), out);
+        } else {
+            struct hash_table *ht = s->table;
+            index_probe_stats(ht->cur.meta, ht->cur.mask, sizeof(struct hash_entry), out);
+            index_probe_stats(ht->old.meta, ht->old.mask, sizeof(struct hash_entry), out);
+            for (struct arena_block *b = ht->arena.blocks; b; b = b->next) {
+                out->index_bytes += sizeof(*b) + ARENA_BLOCK;
+            }
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+
+    out->snapshots = atomic_load(&db->versions.open);
+    out->version_bytes = atomic_load(&db->versions.bytes);
+    out->open_ns = db->stats.open_ns;
+    out->recovery_ns = db->stats.recovery_ns;
+    out->recovery_scanned = db->stats.recovery_scanned;
+    out->recovery_bad_pages = db->stats.recovery_bad_pages;
+    return 0;
+}
+
+void db_set_trace(struct db *db, db_trace_fn fn, void *ctx) {
+    if (!db) {
+        return;
+    }
+    db->stats.trace_ctx = ctx;
+    atomic_store(&db->stats.trace, fn);
+}
+
+int db_set_change_hook(struct db *db, db_change_fn fn, void *ctx) {
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    db->change_ctx = ctx;
+    atomic_store(&db->change_fn, fn);
+    return 0;
+}
+
+void db_close(struct db *db) {
+    if (!db) {
+        return;
+    }
+
+    if (db_checkpoint(db) != 0) {
+        write_header(db);
+    }
+    db_free(db);
+}
+
+/* Large values move to overflow pages, so only the key still has to fit in
+ * a data page next to an overflow_ref (or a B+tree node), and its expiry if
+ * it has one. */
+static int put_too_big(struct db *db, uint32_t key_len, uint32_t val_len,
+                       uint64_t expires) {
+    return val_len > MAX_VALUE_SIZE ||
+           ((db->flags & DB_OPEN_ORDERED) && key_len > BTREE_MAX_KEY) ||
+           (uint64_t)2 * sizeof(uint32_t) + key_len + sizeof(struct overflow_ref) +
+           (expires ? sizeof(expires) : 0) > MAX_RECORD_SIZE(db->page_size);
+}
+
+static int store_put(struct db *db, const uint8_t *key, uint32_t key_len,
+                     const uint8_t *val, uint32_t val_len, uint64_t expires) {
+    if (!db || !key || !val) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (put_too_big(db, key_len, val_len, expires)) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        if (expires) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        return log_write(db, WAL_PUT, key, key_len, val, val_len);
+    }
+
+    uint64_t hash = hash_key(db, key, key_len);
+    struct index_shard *s = index_shard(db, hash);
+    struct db_batch_op op = {DB_BATCH_PUT, key, key_len, val, val_len};
+    uint8_t *change;
+    if (change_alloc(db, &op, &expires, 1, &change) != 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&db->lock);
+    pthread_mutex_lock(&s->write_lock);
+    int ret = -1;
+    uint64_t lsn;
+    if (mark_dirty(db) == 0 &&
+        (lsn = wal_append_batch(&db->wal, &op, &expires, 1, NULL)) != 0 &&
+        wal_commit(&db->wal, lsn) == 0) {
+        change_notify(db, change, &op, &expires, 1, lsn);
+        ret = apply_put(db, hash, key, key_len, val, val_len, expires);
+    }
+    pthread_mutex_unlock(&s->write_lock);
+    pthread_rwlock_unlock(&db->lock);
+    free(change);
+
+    if (ret == 0) {
+        wal_maybe_checkpoint(db);
+    }
+    return ret;
+}
+
+int db_put(struct db *db, const uint8_t *key, uint32_t key_len,
+           const uint8_t *val, uint32_t val_len) {
+    uint64_t t0 = stats_clock();
+    int ret = store_put(db, key, key_len, val, val_len, 0);
+    stats_op(db, DB_OP_PUT, t0, key_len, ret != 0);
+    return ret;
+}
+
+int db_put_ttl(struct db *db, const uint8_t *key, uint32_t key_len,
+               const uint8_t *val, uint32_t val_len, uint64_t ttl_ms) {
+    uint64_t t0 = stats_clock();
+    uint64_t expires = 0;
+    if (ttl_ms) {
+        uint64_t now = wall_clock_ms();
+        expires = ttl_ms < UINT64_MAX - now ? now + ttl_ms : UINT64_MAX;
+    }
+    int ret = store_put(db, key, key_len, val, val_len, expires);
+    stats_op(db, DB_OP_PUT, t0, key_len, ret != 0);
+    return ret;
+}
+
+int db_set_dictionary(struct db *db, const void *dict, uint32_t len) {
+    if (!db || !dict || len < LZ4_MINMATCH || len > DICT_MAX_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    struct value_dict *d = dict_create(dict, len);
+    if (!d) {
+        return -1;
+    }
+
+    /* The extent is on disk before the header points at it. */
+    pthread_rwlock_wrlock(&db->lock);
+    int ret = -1;
+    struct overflow_ref ext = {0, overflow_pages(db, len)};
+    if (atomic_load(&db->dict)) {
+        errno = EEXIST;
+    } else if (mark_dirty(db) == 0 &&
+               (ext.first_page = alloc_extent(db, ext.num_pages)) != 0 &&
+               write_overflow(db, &ext, d->data, len) == 0 &&
+               fsync(db->fd) == 0) {
+        pthread_mutex_lock(&db->header_lock);
+        db->header.dict_page = ext.first_page;
+        db->header.dict_len = len;
+        db->header.dict_id = d->id;
+        ret = write_header(db);
+        pthread_mutex_unlock(&db->header_lock);
+        if (ret == 0) {
+            atomic_store(&db->dict, d);
+        }
+    }
+    pthread_rwlock_unlock(&db->lock);
+
+    if (ret != 0) {
+        free(d);
+    }
+    return ret;
+}
+
+/* Looks at a page in the mapping, which is only current while the pool
+ * does not hold the page and nothing is being written back. A write-back of
+ * this page can only start later, once the page is loaded again, so
+ * view_release catches it by the started count moving. A page that fails
+ * its checksum is left to the pool, which reports it. */
+static int map_view(struct db *db, uint64_t page_num, uint16_t slot,
+                    const uint8_t *key, uint32_t key_len,
+                    struct value_view *v) {
+    uint64_t seq = atomic_load(&db->writebacks_started);
+    if (atomic_load(&db->writebacks_done) != seq || pool_cached(db, page_num)) {
+        return -1;
+    }
+
+    const uint8_t *page = file_map_page(db, page_num);
+    if (!page || !page_intact(page, db->page_size) ||
+        record_value(page, db->page_size, slot, key, key_len, v) != 0) {
+        return -1;
+    }
+
+    v->frame = NULL;
+    v->seq = seq;
+    return 0;
+}
+
+/* Takes a view of key's record at loc. Returns 0, 1 if the record there
+ * is not key's, or -1. */
+static int view_at(struct db *db, const struct index_loc *loc,
+                   const uint8_t *key, uint32_t key_len, struct value_view *v,
+                   int use_map, int *damaged) {
+    if (use_map && map_view(db, loc->page_num, loc->slot, key, key_len, v) == 0) {
+        return 0;
+    }
+
+    /* A page reused for an overflow extent can also be caught
+     * mid-write, which fails its checksum. */
+    struct frame *f = pool_pin(db, loc->page_num, 1);
+    if (!f) {
+        if (errno != EIO) {
+            return -1;
+        }
+        *damaged = 1;
+        return 1;
+    }
+    pthread_rwlock_rdlock(&f->latch);
+    if (record_value(f->data, db->page_size, loc->slot, key, key_len, v) == 0) {
+        v->frame = f;
+        return 0;
+    }
+    pthread_rwlock_unlock(&f->latch);
+    pool_unpin(db, f, 0);
+    return 1;
+}
+
+static int same_locs(const struct index_loc *a, const struct index_loc *b,
+                     size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i].page_num != b[i].page_num || a[i].slot != b[i].slot) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns 0 if what the caller read through v was stable, or -1 if a mapped
+ * view raced a write-back and must be read again. */
+static int view_release(struct db *db, struct value_view *v) {
+    if (v->frame) {
+        pthread_rwlock_unlock(&v->frame->latch);
+        pool_unpin(db, v->frame, 0);
+        return 0;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load(&db->writebacks_started) == v->seq ? 0 : -1;
+}
+
+static int view_acquire(struct db *db, const uint8_t *key, uint32_t key_len,
+                        struct value_view *v, int use_map) {
+    uint64_t hash = hash_key(db, key, key_len);
+    struct index_loc stack[2 * INDEX_CANDIDATES];
+    struct index_loc *buf = stack, *locs = stack, *last = stack + INDEX_CANDIDATES;
+    size_t cap = INDEX_CANDIDATES, last_n = 0;
+    int damaged = 0, ret;
+
+    for (;;) {
+        size_t n = index_candidates(db, hash, key, key_len, locs, cap);
+        if (n > cap) {
+            /* Only a compact index has more than one; make room for all. */
+            struct index_loc *more = malloc(2 * n * sizeof(*more));
+            if (!more) {
+                ret = -1;
+                break;
+            }
+            if (buf != stack) {
+                free(buf);
+            }
+            buf = locs = more;
+            last = more + n;
+            cap = n;
+            last_n = 0;
+            continue;
+        }
+        if (n == 0) {
+            errno = ENOENT;
+            ret = -1;
+            break;
+        }
+
+        /* A record is only moved or killed after the index has stopped
+         * pointing at it, so locations that fail twice are damaged rather
+         * than raced, or in a compact index only share the key's hash. */
+        if (n == last_n && same_locs(locs, last, n)) {
+            errno = (db->flags & DB_OPEN_COMPACT_INDEX) && !damaged ? ENOENT : EIO;
+            ret = -1;
+            break;
+        }
+
+        ret = 1;
+        for (size_t i = 0; i < n && ret == 1; i++) {
+            ret = view_at(db, &locs[i], key, key_len, v, use_map, &damaged);
+        }
+        /* An expired record is a miss until db_expire reclaims it. */
+        if (ret == 0 && view_expired(v)) {
+            if (view_release(db, v) != 0) {
+                last_n = 0;
+                continue;
+            }
+            errno = ENOENT;
+            ret = -1;
+        }
+        if (ret != 1) {
+            break;
+        }
+
+        struct index_loc *t = last;
+        last = locs;
+        locs = t;
+        last_n = n;
+    }
+
+    if (buf != stack) {
+        free(buf);
+    }
+    return ret;
+}
+
+static uint8_t *store_get(struct db *db, const uint8_t *key, uint32_t key_len,
+                          uint32_t *val_len_out) {
+    if (!db || !key || !val_len_out) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        return log_get(db, key, key_len, val_len_out);
+    }
+
+    int use_map = db->flags & DB_OPEN_MMAP;
+    for (;;) {
+        struct value_view v;
+        if (view_acquire(db, key, key_len, &v, use_map) != 0) {
+            return NULL;
+        }
+
+        uint8_t *val = malloc(v.val_len ? v.val_len : 1);
+        int err = 0;
+        if (!val) {
+            err = ENOMEM;
+        } else if (view_read(db, &v, 0, val, v.val_len) != 0) {
+            err = errno;
+        }
+        if (view_release(db, &v) == 0) {
+            if (err) {
+                free(val);
+                errno = err;
+                return NULL;
+            }
+            *val_len_out = v.val_len;
+            return val;
+        }
+        free(val);
+        use_map = 0;
+    }
+}
+
+uint8_t *db_get(struct db *db, const uint8_t *key, uint32_t key_len,
+                uint32_t *val_len_out) {
+    uint64_t t0 = stats_clock();
+    uint8_t *val = store_get(db, key, key_len, val_len_out);
+    stats_op(db, DB_OP_GET, t0, key_len, val == NULL);
+    return val;
+}
+
+static int64_t store_get_into(struct db *db, const uint8_t *key,
+                              uint32_t key_len, uint8_t *buf, uint32_t cap) {
+    if (!db || !key || (!buf && cap > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        uint64_t copied;
+        return log_read_value(db, key, key_len, 0, buf, cap, &copied);
+    }
+
+    int use_map = db->flags & DB_OPEN_MMAP;
+    for (;;) {
+        struct value_view v;
+        if (view_acquire(db, key, key_len, &v, use_map) != 0) {
+            return -1;
+        }
+
+        int err = view_read(db, &v, 0, buf, v.val_len < cap ? v.val_len : cap) != 0
+                  ? errno : 0;
+        if (view_release(db, &v) == 0) {
+            if (err) {
+                errno = err;
+                return -1;
+            }
+            return v.val_len;
+        }
+        use_map = 0;
+    }
+}
+
+int64_t db_get_into(struct db *db, const uint8_t *key, uint32_t key_len,
+                    uint8_t *buf, uint32_t cap) {
+    uint64_t t0 = stats_clock();
+    int64_t len = store_get_into(db, key, key_len, buf, cap);
+    stats_op(db, DB_OP_GET, t0, key_len, len < 0);
+    return len;
+}
+
+/* Snapshots. One is taken, and the versions it no longer needs are dropped,
+ * with lock held exclusively, so no write is half done across either. */
+
+/* A reader counts itself in under the epoch's parity and checks the epoch
+ * did not move meanwhile, so epoch_wait, which moves it, then waits for
+ * every reader that could still be on a version unlinked before. */
+static unsigned epoch_enter(struct version_store *vs) {
+    for (;;) {
+        uint64_t e = atomic_load(&vs->epoch);
+        atomic_fetch_add(&vs->readers[e & 1], 1);
+        if (atomic_load(&vs->epoch) == e) {
+            return (unsigned)(e & 1);
+        }
+        atomic_fetch_sub(&vs->readers[e & 1], 1);
+    }
+}
+
+static void epoch_leave(struct version_store *vs, unsigned parity) {
+    atomic_fetch_sub(&vs->readers[parity], 1);
+}
+
+static void epoch_wait(struct version_store *vs) {
+    pthread_mutex_lock(&vs->reclaim_lock);
+    uint64_t e = atomic_fetch_add(&vs->epoch, 1);
+    while (atomic_load(&vs->readers[e & 1]) != 0) {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&vs->reclaim_lock);
+}
+
+struct db_snapshot *db_snapshot_create(struct db *db) {
+    if (!db) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    struct db_snapshot *snap = malloc(sizeof(*snap));
+    if (!snap) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct version_store *vs = &db->versions;
+    pthread_rwlock_wrlock(&db->lock);
+    if (!vs->buckets &&
+        !(vs->buckets = calloc(VERSION_BUCKETS, sizeof(*vs->buckets)))) {
+        pthread_rwlock_unlock(&db->lock);
+        free(snap);
+        errno = ENOMEM;
+        return NULL;
+    }
+    snap->db = db;
+    snap->seq = atomic_load(&vs->seq);
+    snap->prev = NULL;
+    snap->next = vs->snapshots;
+    if (vs->snapshots) {
+        vs->snapshots->prev = snap;
+    }
+    vs->snapshots = snap;
+    atomic_fetch_add(&vs->open, 1);
+    pthread_rwlock_unlock(&db->lock);
+    return snap;
+}
+
+/* The current value is read first. A write keeps the value it replaces
+ * before it touches the record, so if the read saw the write, the version
+ * is there to be found after it. */
+int64_t db_get_at(const struct db_snapshot *snap, const uint8_t *key,
+                  uint32_t key_len, uint8_t *buf, uint32_t cap) {
+    if (!snap || !key || (!buf && cap > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct db *db = snap->db;
+    struct version_store *vs = &db->versions;
+    uint64_t t0 = stats_clock();
+
+    int64_t len = store_get_into(db, key, key_len, buf, cap);
+    if (len >= 0 || errno == ENOENT) {
+        uint64_t hash = hash_key(db, key, key_len);
+        unsigned parity = epoch_enter(vs);
+        const struct version *v = version_find(db, hash, key, key_len, snap->seq);
+        if (v && (v->absent || (v->expires && v->expires <= wall_clock_ms()))) {
+            errno = ENOENT;
+            len = -1;
+        } else if (v) {
+            memcpy(buf, v->data + key_len, v->val_len < cap ? v->val_len : cap);
+            len = v->val_len;
+        }
+        epoch_leave(vs, parity);
+    }
+    stats_op(db, DB_OP_GET, t0, key_len, len < 0);
+    return len;
+}
+
+/* Drops the versions no open snapshot is older than, i.e. those that do not
+ * postdate the oldest one left. Readers may still be walking them, so they
+ * are only freed after epoch_wait, which runs once the lock is dropped so
+ * writers do not queue behind the slowest reader. */
+void db_snapshot_release(struct db_snapshot *snap) {
+    if (!snap) {
+        return;
+    }
+    struct db *db = snap->db;
+    struct version_store *vs = &db->versions;
+
+    pthread_rwlock_wrlock(&db->lock);
+    if (snap->prev) {
+        snap->prev->next = snap->next;
+    } else {
+        vs->snapshots = snap->next;
+    }
+    if (snap->next) {
+        snap->next->prev = snap->prev;
+    }
+    atomic_fetch_sub(&vs->open, 1);
+
+    uint64_t oldest = UINT64_MAX;
+    for (struct db_snapshot *o = vs->snapshots; o; o = o->next) {
+        oldest = o->seq;
+    }
+    struct version *retired = NULL;
+    for (size_t i = 0; i < VERSION_BUCKETS && atomic_load(&vs->bytes) != 0; i++) {
+        struct version *_Atomic *link = &vs->buckets[i];
+        struct version *v;
+        while ((v = atomic_load(link)) != NULL) {
+            if (v->seq > oldest) {
+                link = &v->next;
+                continue;
+            }
+            atomic_store(link, atomic_load(&v->next));
+            v->retired = retired;
+            retired = v;
+            atomic_fetch_sub(&vs->bytes, sizeof(*v) + v->key_len + v->val_len);
+        }
+    }
+    pthread_rwlock_unlock(&db->lock);
+
+    if (retired) {
+        epoch_wait(vs);
+    }
+    while (retired) {
+        struct version *next = retired->retired;
+        free(retired);
+        retired = next;
+    }
+    free(snap);
+}
+
+static int64_t store_get_range(struct db *db, const uint8_t *key,
+                               uint32_t key_len, uint64_t offset, uint8_t *buf,
+                               uint32_t len) {
+    if (!db || !key || (!buf && len > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        uint64_t copied;
+        if (log_read_value(db, key, key_len, offset, buf, len, &copied) < 0) {
+            return -1;
+        }
+        return (int64_t)copied;
+    }
+
+    int use_map = db->flags & DB_OPEN_MMAP;
+    for (;;) {
+        struct value_view v;
+        if (view_acquire(db, key, key_len, &v, use_map) != 0) {
+            return -1;
+        }
+
+        uint64_t n = 0;
+        if (offset < v.val_len) {
+            n = v.val_len - offset < len ? v.val_len - offset : len;
+        }
+        int err = view_read(db, &v, offset, buf, n) != 0 ? errno : 0;
+        if (view_release(db, &v) == 0) {
+            if (err) {
+                errno = err;
+                return -1;
+            }
+            return (int64_t)n;
+        }
+        use_map = 0;
+    }
+}
+
+int64_t db_get_range(struct db *db, const uint8_t *key, uint32_t key_len,
+                     uint64_t offset, uint8_t *buf, uint32_t len) {
+    uint64_t t0 = stats_clock();
+    int64_t n = store_get_range(db, key, key_len, offset, buf, len);
+    stats_op(db, DB_OP_GET, t0, key_len, n < 0);
+    return n;
+}
+
+static int compare_pages(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Brings the pages holding the keys' records into the pool in page order.
+ * Not worth it with DB_OPEN_MMAP, whose reads skip the pool. */
+static void multi_get_prefetch(struct db *db, const struct db_key *keys,
+                               size_t count) {
+    uint64_t *pages = malloc(count * sizeof(*pages));
+    if (!pages) {
+        return;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint16_t slot;
+        if (keys[i].key && index_find(db, hash_key(db, keys[i].key, keys[i].key_len),
+                                      keys[i].key, keys[i].key_len,
+                                      &pages[n], &slot) == 0) {
+            n++;
+        }
+    }
+    qsort(pages, n, sizeof(*pages), compare_pages);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (distinct == 0 || pages[i] != pages[distinct - 1]) {
+            pages[distinct++] = pages[i];
+        }
+    }
+    pool_prefetch(db, pages, distinct);
+    free(pages);
+}
+
+int64_t db_multi_get(struct db *db, const struct db_key *keys, size_t count,
+                     uint8_t *buf, size_t cap, struct db_get_result *results) {
+    if (!db || (count > 0 && (!keys || !results)) || (!buf && cap > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (count > 1 && !(db->flags & (DB_OPEN_LOG | DB_OPEN_MMAP))) {
+        multi_get_prefetch(db, keys, count);
+    }
+
+    size_t used = 0;
+    int64_t copied = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct db_get_result *r = &results[i];
+        size_t room = cap - used;
+        uint32_t want = room > UINT32_MAX ? UINT32_MAX : (uint32_t)room;
+        int64_t len = db_get_into(db, keys[i].key, keys[i].key_len,
+                                  buf ? buf + used : NULL, want);
+        r->val = NULL;
+        r->val_len = len < 0 ? 0 : (uint32_t)len;
+        if (len < 0) {
+            r->err = errno;
+        } else if ((uint64_t)len > want) {
+            r->err = ENOBUFS;
+        } else {
+            r->val = buf ? buf + used : NULL;
+            r->err = 0;
+            used += (size_t)len;
+            copied++;
+        }
+    }
+    return copied;
+}
+
+/* A db_aio request. Its slot is taken when the request is made and given
+ * back once its completion has been collected. */
+struct aio_slot {
+    const uint8_t *key;
+    uint32_t key_len;
+    uint8_t *buf;
+    uint32_t cap;
+    uint64_t page_num;
+    uint16_t slot;
+    uint64_t seq;
+    struct db_completion c;
+};
+
+#ifdef HAVE_IO_URING
+/* The shared rings of an io_uring instance. sq_tail and cq_head are only
+ * written here, the kernel writes sq_head and cq_tail. */
+struct aio_ring {
+    int fd;
+    int fixed_file;
+    int fixed_bufs;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned queued;
+    uint32_t page_size;
+};
+#endif
+
+struct db_aio {
+    struct db *db;
+    unsigned depth;
+    struct aio_slot *slots;
+    uint8_t *pages;
+    unsigned *free_slots;
+    unsigned nfree;
+    unsigned *done;
+    unsigned done_head, ndone;
+    unsigned *puts;
+    struct db_batch_op *ops;
+    unsigned nputs;
+    unsigned reading;
+    int use_ring;
+#ifdef HAVE_IO_URING
+    struct aio_ring ring;
+#endif
+};
+
+#ifdef HAVE_IO_URING
+static void aio_ring_close(struct aio_ring *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_map && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_len);
+    }
+    if (r->sq_map) {
+        munmap(r->sq_map, r->sq_map_len);
+    }
+    close(r->fd);
+}
+
+/* Sets up a ring of depth entries reading from fd into the n page buffers
+ * at pages. Registering the file and the buffers saves the kernel looking
+ * them up on every read; either is skipped if the kernel refuses it, e.g.
+ * for the locked memory limit. */
+static int aio_ring_open(struct aio_ring *r, unsigned depth, int fd,
+                         uint8_t *pages, unsigned n, uint32_t page_size) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->page_size = page_size;
+    r->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && r->cq_map_len > r->sq_map_len) {
+        r->sq_map_len = r->cq_map_len;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) {
+        r->sq_map = NULL;
+        goto fail;
+    }
+    r->cq_map = single ? r->sq_map
+                       : mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED) {
+        r->cq_map = NULL;
+        goto fail;
+    }
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    r->fixed_file = syscall(__NR_io_uring_register, r->fd,
+                            IORING_REGISTER_FILES, &fd, 1) == 0;
+
+    struct iovec *iov = malloc(n * sizeof(*iov));
+    if (iov) {
+        for (unsigned i = 0; i < n; i++) {
+            iov[i].iov_base = pages + (size_t)i * page_size;
+            iov[i].iov_len = page_size;
+        }
+        r->fixed_bufs = syscall(__NR_io_uring_register, r->fd,
+                                IORING_REGISTER_BUFFERS, iov, n) == 0;
+        free(iov);
+    }
+    return 0;
+
+fail:
+    aio_ring_close(r);
+    return -1;
+}
+
+static void aio_ring_read(struct aio_ring *r, int fd, unsigned index,
+                          uint8_t *page, uint64_t page_num) {
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = r->fixed_file ? 0 : fd;
+    sqe->flags = r->fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uint64_t)(uintptr_t)page;
+    sqe->len = r->page_size;
+    sqe->off = page_num * r->page_size;
+    sqe->buf_index = (uint16_t)index;
+    sqe->user_data = index;
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+}
+
+/* Submits the queued reads and waits for min_complete completions. */
+static int aio_ring_enter(struct aio_ring *r, unsigned min_complete) {
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, r->fd, r->queued, min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            r->queued -= (unsigned)n;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+#endif
+
+static void aio_complete(struct db_aio *q, unsigned index, int64_t result,
+                         int err) {
+    struct aio_slot *s = &q->slots[index];
+    s->c.result = result;
+    s->c.err = err;
+    q->done[(q->done_head + q->ndone++) % q->depth] = index;
+}
+
+static void aio_get_now(struct db_aio *q, unsigned index) {
+    struct aio_slot *s = &q->slots[index];
+    int64_t len = db_get_into(q->db, s->key, s->key_len, s->buf, s->cap);
+    aio_complete(q, index, len, len < 0 ? errno : 0);
+}
+
+/* Finishes a read the ring completed. Like a mapped read, the page is only
+ * trusted if no write-back started while it was being read; otherwise, and
+ * for an overflow or compressed value, the get is redone through the pool. */
+static void aio_finish_read(struct db_aio *q, unsigned index, int res) {
+    struct aio_slot *s = &q->slots[index];
+    uint32_t page_size = q->db->page_size;
+    const uint8_t *page = q->pages + (size_t)index * page_size;
+    struct value_view v;
+
+    q->reading--;
+    stats_io(q->db, STAT_READS, res);
+    atomic_thread_fence(memory_order_acquire);
+    if (res == (int)page_size && page_intact(page, page_size) &&
+        atomic_load(&q->db->writebacks_started) == s->seq &&
+        record_value(page, page_size, s->slot, s->key, s->key_len, &v) == 0 &&
+        v.form == VALUE_RAW && !view_expired(&v)) {
+        memcpy(s->buf, v.val, v.val_len < s->cap ? v.val_len : s->cap);
+        aio_complete(q, index, v.val_len, 0);
+        return;
+    }
+    aio_get_now(q, index);
+}
+
+#ifdef HAVE_IO_URING
+static void aio_reap(struct db_aio *q) {
+    struct aio_ring *r = &q->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        aio_finish_read(q, (unsigned)cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+struct db_aio *db_aio_open(struct db *db, unsigned depth) {
+    if (!db || depth == 0 || depth > 1024) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct db_aio *q = calloc(1, sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+    q->db = db;
+    q->depth = depth;
+    q->slots = calloc(depth, sizeof(*q->slots));
+    q->free_slots = malloc(depth * sizeof(*q->free_slots));
+    q->done = malloc(depth * sizeof(*q->done));
+    q->puts = malloc(depth * sizeof(*q->puts));
+    q->ops = malloc(depth * sizeof(*q->ops));
+    if (!q->slots || !q->free_slots || !q->done || !q->puts || !q->ops ||
+        posix_memalign((void **)&q->pages, db->page_size,
+                       (size_t)depth * db->page_size) != 0) {
+        q->pages = NULL;
+        db_aio_close(q);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        q->free_slots[i] = depth - 1 - i;
+    }
+    q->nfree = depth;
+
+#ifdef HAVE_IO_URING
+    if (!(db->flags & DB_OPEN_LOG) &&
+        aio_ring_open(&q->ring, depth, db->fd, q->pages, depth, db->page_size) == 0) {
+        q->use_ring = 1;
+    }
+#endif
+    return q;
+}
+
+static int aio_take_slot(struct db_aio *q, void *user, unsigned *index) {
+    if (q->nfree == 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    *index = q->free_slots[--q->nfree];
+    q->slots[*index].c.user = user;
+    return 0;
+}
+
+int db_get_async(struct db_aio *q, const uint8_t *key, uint32_t key_len,
+                 uint8_t *buf, uint32_t cap, void *user) {
+    unsigned index;
+    if (!q || !key || (!buf && cap > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (aio_take_slot(q, user, &index) != 0) {
+        return -1;
+    }
+
+    struct aio_slot *s = &q->slots[index];
+    s->key = key;
+    s->key_len = key_len;
+    s->buf = buf;
+    s->cap = cap;
+    if (!q->use_ring) {
+        aio_get_now(q, index);
+        return 0;
+    }
+
+    struct db *db = q->db;
+    if (index_find(db, hash_key(db, key, key_len), key, key_len, &s->page_num,
+                   &s->slot) != 0) {
+        aio_complete(q, index, -1, ENOENT);
+        return 0;
+    }
+
+    /* Same rule as map_view: the file only has the current page while the
+     * pool does not hold it and nothing is being written back. */
+    s->seq = atomic_load(&db->writebacks_started);
+    if (atomic_load(&db->writebacks_done) != s->seq ||
+        pool_cached(db, s->page_num)) {
+        aio_get_now(q, index);
+        return 0;
+    }
+
+#ifdef HAVE_IO_URING
+    aio_ring_read(&q->ring, db->fd, index, q->pages + (size_t)index * db->page_size,
+                  s->page_num);
+#endif
+    q->reading++;
+    return 0;
+}
+
+int db_put_async(struct db_aio *q, const uint8_t *key, uint32_t key_len,
+                 const uint8_t *val, uint32_t val_len, void *user) {
+    unsigned index;
+    if (!q || !key || !val) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (put_too_big(q->db, key_len, val_len, 0)) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (aio_take_slot(q, user, &index) != 0) {
+        return -1;
+    }
+
+    struct db_batch_op *op = &q->ops[q->nputs];
+    op->type = DB_BATCH_PUT;
+    op->key = key;
+    op->key_len = key_len;
+    op->val = val;
+    op->val_len = val_len;
+    q->puts[q->nputs++] = index;
+    return 0;
+}
+
+/* Commits the held puts as one batch, which succeeds or fails as a whole. */
+static void aio_commit_puts(struct db_aio *q) {
+    if (q->nputs == 0) {
+        return;
+    }
+    int err = db_write_batch(q->db, q->ops, q->nputs) == 0 ? 0 : errno;
+    for (unsigned i = 0; i < q->nputs; i++) {
+        aio_complete(q, q->puts[i], err ? -1 : 0, err);
+    }
+    q->nputs = 0;
+}
+
+int db_aio_wait(struct db_aio *q, struct db_completion *out, unsigned max,
+                unsigned min) {
+    if (!q || (!out && max > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (min > max) {
+        min = max;
+    }
+
+    aio_commit_puts(q);
+#ifdef HAVE_IO_URING
+    if (q->use_ring) {
+        unsigned want = 0;
+        if (q->ndone < min) {
+            want = min - q->ndone < q->reading ? min - q->ndone : q->reading;
+        }
+        if ((q->ring.queued > 0 || want > 0) && aio_ring_enter(&q->ring, want) != 0) {
+            return -1;
+        }
+        aio_reap(q);
+    }
+#endif
+
+    unsigned n = 0;
+    while (n < max && q->ndone > 0) {
+        unsigned index = q->done[q->done_head];
+        q->done_head = (q->done_head + 1) % q->depth;
+        q->ndone--;
+        out[n++] = q->slots[index].c;
+        q->free_slots[q->nfree++] = index;
+    }
+    return (int)n;
+}
+
+void db_aio_close(struct db_aio *q) {
+    if (!q) {
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    /* The kernel may still be reading into the registered pages. */
+    if (q->use_ring) {
+        while (q->reading > 0 && aio_ring_enter(&q->ring, 1) == 0) {
+            aio_reap(q);
+        }
+        aio_ring_close(&q->ring);
+    }
+#endif
+    aio_commit_puts(q);
+    free(q->pages);
+    free(q->ops);
+    free(q->puts);
+    free(q->done);
+    free(q->free_slots);
+    free(q->slots);
+    free(q);
+}
+
+static int store_get_ref(struct db *db, const uint8_t *key, uint32_t key_len,
+                         struct db_ref *ref) {
+    if (!db || !key || !ref) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        ref->page = NULL;
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    /* Always from the pool: a mapped page can be rewritten under the ref. */
+    struct value_view v;
+    if (view_acquire(db, key, key_len, &v, 0) != 0) {
+        ref->page = NULL;
+        return -1;
+    }
+
+    if (v.form != VALUE_RAW) {
+        view_release(db, &v);
+        ref->page = NULL;
+        errno = EFBIG;
+        return -1;
+    }
+
+    atomic_fetch_add(&v.frame->refs, 1);
+    pthread_rwlock_unlock(&v.frame->latch);
+
+    ref->val = v.val;
+    ref->val_len = v.val_len;
+    ref->page = v.frame;
+    return 0;
+}
+
+int db_get_ref(struct db *db, const uint8_t *key, uint32_t key_len,
+               struct db_ref *ref) {
+    uint64_t t0 = stats_clock();
+    int ret = store_get_ref(db, key, key_len, ref);
+    stats_op(db, DB_OP_GET, t0, key_len, ret != 0);
+    return ret;
+}
+
+void db_release(struct db *db, struct db_ref *ref) {
+    if (!db || !ref) {
+        return;
+    }
+
+    struct frame *f = ref->page;
+    if (f) {
+        /* The last ref lets the page be compacted or freed again. */
+        int dirty = 0;
+        if (atomic_fetch_sub(&f->refs, 1) == 1) {
+            pthread_rwlock_rdlock(&db->lock);
+            pthread_rwlock_wrlock(&f->latch);
+            if (atomic_load(&f->refs) == 0 &&
+                ((struct page_header *)f->data)->page_type == PAGE_TYPE_DATA) {
+                settle_page(db, f);
+                dirty = 1;
+            }
+            pthread_rwlock_unlock(&f->latch);
+            pthread_rwlock_unlock(&db->lock);
+        }
+        pool_unpin(db, f, dirty);
+    }
+    ref->page = NULL;
+    ref->val = NULL;
+    ref->val_len = 0;
+}
+
+static int store_delete(struct db *db, const uint8_t *key, uint32_t key_len) {
+    if (!db || !key) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        return log_write(db, WAL_DELETE, key, key_len, NULL, 0);
+    }
+
+    uint64_t hash = hash_key(db, key, key_len);
+    struct index_shard *s = index_shard(db, hash);
+    struct db_batch_op op = {DB_BATCH_DELETE, key, key_len, NULL, 0};
+    uint8_t *change;
+    if (change_alloc(db, &op, NULL, 1, &change) != 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&db->lock);
+    pthread_mutex_lock(&s->write_lock);
+    int ret = -1;
+    struct index_loc loc;
+    uint64_t lsn;
+    int found = index_lookup(db, s, hash, key, key_len, &loc);
+    if (found == 0) {
+        errno = ENOENT;
+    } else if (found > 0 && mark_dirty(db) == 0 &&
+               wal_log(db, WAL_DELETE, key, key_len, NULL, 0, &lsn) == 0) {
+        change_notify(db, change, &op, NULL, 1, lsn);
+        ret = apply_delete(db, hash, key, key_len);
+    }
+    pthread_mutex_unlock(&s->write_lock);
+    pthread_rwlock_unlock(&db->lock);
+    free(change);
+
+    if (ret == 0) {
+        wal_maybe_checkpoint(db);
+    }
+    return ret;
+}
+
+int db_delete(struct db *db, const uint8_t *key, uint32_t key_len) {
+    uint64_t t0 = stats_clock();
+    int ret = store_delete(db, key, key_len);
+    stats_op(db, DB_OP_DELETE, t0, key_len, ret != 0);
+    return ret;
+}
+
+/* Copies out the key of the record at loc if it expired by now. Returns 1
+ * if so, 0 if not, or -1. */
+static int record_expired(struct db *db, const struct index_loc *loc,
+                          uint64_t now, uint8_t *key, uint32_t *key_len) {
+    struct frame *f = pool_pin(db, loc->page_num, 1);
+    if (!f) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&f->latch);
+    int expired = 0;
+    if (((const struct page_header *)f->data)->page_type == PAGE_TYPE_DATA) {
+        uint64_t expires = record_expires(f->data, db->page_size, loc->slot);
+        if (expires && expires <= now) {
+            const uint8_t *rec = data_page_record(f->data, db->page_size, loc->slot);
+            *key_len = record_key_len(rec);
+            memcpy(key, rec + sizeof(uint32_t), *key_len);
+            expired = 1;
+        }
+    }
+    pthread_rwlock_unlock(&f->latch);
+    pool_unpin(db, f, 0);
+    return expired;
+}
+
+/* Deletes the keys with hash whose records expired by now and returns how
+ * many. The deletes are not logged: a put the WAL replays carries its
+ * expiry and is reclaimed again. */
+static int expire_hash(struct db *db, uint64_t hash, uint64_t now) {
+    struct index_shard *s = index_shard(db, hash);
+    pthread_rwlock_rdlock(&db->lock);
+    pthread_mutex_lock(&s->write_lock);
+
+    struct index_loc stack[INDEX_CANDIDATES], *locs = stack;
+    size_t n = s->fps ? fp_table_collect(s->fps, hash, locs, INDEX_CANDIDATES)
+                      : hash_table_collect(s->table, hash, locs, INDEX_CANDIDATES);
+    if (n > INDEX_CANDIDATES) {
+        locs = malloc(n * sizeof(*locs));
+        if (!locs) {
+            n = 0;
+        } else if (s->fps) {
+            fp_table_collect(s->fps, hash, locs, n);
+        } else {
+            hash_table_collect(s->table, hash, locs, n);
+        }
+    }
+
+    uint8_t *key = n ? malloc(MAX_RECORD_SIZE(db->page_size)) : NULL;
+    int ret = locs && (key || n == 0) ? 0 : -1;
+    for (size_t i = 0; i < n && ret >= 0; i++) {
+        uint32_t key_len;
+        int expired = record_expired(db, &locs[i], now, key, &key_len);
+        if (expired < 0 ||
+            (expired && (mark_dirty(db) != 0 ||
+                         apply_delete(db, hash, key, key_len) != 0))) {
+            ret = -1;
+        } else {
+            ret += expired;
+        }
+    }
+    pthread_mutex_unlock(&s->write_lock);
+    pthread_rwlock_unlock(&db->lock);
+
+    if (!locs || (n && !key)) {
+        errno = ENOMEM;
+    }
+    if (locs != stack) {
+        free(locs);
+    }
+    free(key);
+    return ret;
+}
+
+/* Timers are taken off the due list before their keys are looked at, and
+ * whatever is left when a delete fails goes back on it. */
+int64_t db_expire(struct db *db, size_t max) {
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    struct ttl_wheel *w = &db->ttl;
+    uint64_t now = wall_clock_ms();
+    pthread_mutex_lock(&w->lock);
+    ttl_advance(w, now / TTL_TICK_MS);
+    struct ttl_timer *due = w->due, **end = &due;
+    for (size_t n = 0; *end && (max == 0 || n < max); n++) {
+        end = &(*end)->next;
+    }
+    w->due = *end;
+    *end = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    int64_t deleted = 0;
+    struct ttl_timer *t = due;
+    for (; t; t = t->next) {
+        int n = expire_hash(db, t->hash, now);
+        if (n < 0) {
+            break;
+        }
+        deleted += n;
+    }
+
+    int saved_errno = errno;
+    pthread_mutex_lock(&w->lock);
+    while (due != t) {
+        struct ttl_timer *next = due->next;
+        due->next = w->free;
+        w->free = due;
+        due = next;
+    }
+    if (t) {
+        *end = w->due;
+        w->due = t;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (t) {
+        errno = saved_errno;
+        return -1;
+    }
+    return deleted;
+}
+
+/* Locks the write_lock of every shard the batch touches, in shard order. */
+static uint32_t lock_batch_shards(struct db *db, const struct db_batch_op *ops,
+                                  size_t count) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct index_shard *s = index_shard(db, hash_key(db, ops[i].key, ops[i].key_len));
+        mask |= 1u << (s - db->index);
+    }
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        if (mask & (1u << i)) {
+            pthread_mutex_lock(&db->index[i].write_lock);
+        }
+    }
+    return mask;
+}
+
+static void unlock_batch_shards(struct db *db, uint32_t mask) {
+    for (int i = INDEX_SHARDS - 1; i >= 0; i--) {
+        if (mask & (1u << i)) {
+            pthread_mutex_unlock(&db->index[i].write_lock);
+        }
+    }
+}
+
+/* The batch's records go into the active segment back to back, as they do
+ * in the WAL, so recovery indexes all of them or none. */
+static int log_write_batch(struct db *db, const struct db_batch_op *ops,
+                           size_t count) {
+    uint64_t *offsets = malloc(count * sizeof(*offsets));
+    if (!offsets) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&db->lock);
+    uint32_t shards = lock_batch_shards(db, ops, count);
+
+    int ret = -1;
+    uint64_t lsn = wal_append_batch(&db->wal, ops, NULL, count, offsets);
+    if (lsn != 0 && wal_commit(&db->wal, lsn) == 0) {
+        ret = 0;
+        for (size_t i = 0; i < count && ret == 0; i++) {
+            const struct db_batch_op *op = &ops[i];
+            ret = log_index(db, hash_key(db, op->key, op->key_len), op->key,
+                            op->key_len, batch_wal_type(op, 0),
+                            log_loc(db->log.active, offsets[i]));
+        }
+    }
+
+    int saved_errno = errno;
+    unlock_batch_shards(db, shards);
+    pthread_rwlock_unlock(&db->lock);
+    free(offsets);
+
+    if (ret == 0) {
+        log_maybe_roll(db);
+    }
+    errno = saved_errno;
+    return ret;
+}
+
+/* A batch of ops with their expiries (see batch_expires). */
+static int write_batch(struct db *db, const struct db_batch_op *ops,
+                       const uint64_t *expires, size_t count) {
+    if (!db || (!ops && count > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int expiring = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct db_batch_op *op = &ops[i];
+        if (!op->key || (op->type != DB_BATCH_PUT && op->type != DB_BATCH_DELETE) ||
+            (op->type == DB_BATCH_PUT && !op->val)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (op->type == DB_BATCH_PUT &&
+            put_too_big(db, op->key_len, op->val_len, batch_expires(expires, i))) {
+            errno = EFBIG;
+            return -1;
+        }
+        expiring |= batch_expires(expires, i) != 0;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        if (expiring) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        return log_write_batch(db, ops, count);
+    }
+    uint8_t *change;
+    if (change_alloc(db, ops, expires, count, &change) != 0) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&db->lock);
+    uint32_t shards = lock_batch_shards(db, ops, count);
+
+    int ret = -1;
+    uint64_t lsn = 0;
+    if (mark_dirty(db) != 0 ||
+        (lsn = wal_append_batch(&db->wal, ops, expires, count, NULL)) == 0 ||
+        wal_commit(&db->wal, lsn) != 0) {
+        goto out;
+    }
+
+    /* The batch is already durable in the log, so ops applied before a
+     * failing one stay applied; recovery replays the rest. */
+    change_notify(db, change, ops, expires, count, lsn);
+    ret = 0;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        const struct db_batch_op *op = &ops[i];
+        uint64_t hash = hash_key(db, op->key, op->key_len);
+        if (op->type == DB_BATCH_PUT) {
+            ret = apply_put(db, hash, op->key, op->key_len, op->val, op->val_len,
+                            batch_expires(expires, i));
+        } else if (apply_delete(db, hash, op->key, op->key_len) != 0 &&
+                   errno != ENOENT) {
+            ret = -1;
+        }
+    }
+
+out:;
+    int out_errno = errno;
+    unlock_batch_shards(db, shards);
+    pthread_rwlock_unlock(&db->lock);
+    free(change);
+
+    if (ret == 0) {
+        wal_maybe_checkpoint(db);
+    }
+    errno = out_errno;
+    return ret;
+}
+
+int db_write_batch(struct db *db, const struct db_batch_op *ops, size_t count) {
+    return write_batch(db, ops, NULL, count);
+}
+
+/* Each run of records up to one without WAL_MORE goes in as one batch. */
+int db_apply_changes(struct db *db, const void *records, size_t len) {
+    if (!db || (!records && len > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const uint8_t *p = records, *end = p + len;
+    struct db_batch_op *ops = NULL;
+    uint64_t *expires = NULL;
+    size_t n = 0, cap = 0;
+    int ret = 0;
+    while (p < end && ret == 0) {
+        struct wal_record_header h;
+        if ((size_t)(end - p) < sizeof(h)) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        memcpy(&h, p, sizeof(h));
+        const uint8_t *key = p + sizeof(h);
+        uint32_t type = h.type & ~WAL_MORE;
+        if ((uint64_t)(end - key) < (uint64_t)h.key_len + h.val_len ||
+            h.checksum != wal_record_checksum(&h, key, key + h.key_len) ||
+            (type != WAL_PUT && type != WAL_DELETE &&
+             (type != WAL_PUT_TTL || h.val_len < sizeof(uint64_t)))) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+
+        if (n == cap) {
+            size_t new_cap = cap ? 2 * cap : 16;
+            struct db_batch_op *more = realloc(ops, new_cap * sizeof(*ops));
+            uint64_t *more_expires = more ? realloc(expires, new_cap * sizeof(*expires))
+                                          : NULL;
+            if (more) {
+                ops = more;
+            }
+            if (!more_expires) {
+                errno = ENOMEM;
+                ret = -1;
+                break;
+            }
+            expires = more_expires;
+            cap = new_cap;
+        }
+        struct db_batch_op *op = &ops[n];
+        op->type = type == WAL_DELETE ? DB_BATCH_DELETE : DB_BATCH_PUT;
+        op->key = key;
+        op->key_len = h.key_len;
+        op->val = key + h.key_len;
+        op->val_len = h.val_len;
+        expires[n] = 0;
+        if (type == WAL_PUT_TTL) {
+            memcpy(&expires[n], op->val, sizeof(expires[n]));
+            op->val += sizeof(expires[n]);
+            op->val_len -= sizeof(expires[n]);
+        }
+        n++;
+        p = key + h.key_len + h.val_len;
+
+        if (!(h.type & WAL_MORE)) {
+            ret = write_batch(db, ops, expires, n);
+            n = 0;
+        }
+    }
+    if (ret == 0 && n > 0) {
+        errno = EINVAL;   /* a batch cut short */
+        ret = -1;
+    }
+    free(ops);
+    free(expires);
+    return ret;
+}
+
+/* Vacuum. Each step holds lock exclusively, so no write is in flight, and
+ * walks down from the last page in use, moving what it finds into the
+ * lowest free pages: a data page is copied whole, an overflow extent is
+ * rewritten and its record's reference patched, and an ordered handle's
+ * B+tree is bulk-loaded again. A copy is on disk before anything points at
+ * it and before its source is given up, so a crash leaves at worst two
+ * copies of a record, which the scan treats like any other duplicate. Free
+ * pages left at the end of the file are then cut off. */
+
+#define VACUUM_STEP_PAGES 64
+
+/* The record pointing at an extent, found through the index when an extent
+ * is first met at the end of the file. Moves make entries stale, so each is
+ * checked against the record and the map is built again once if it fails. */
+struct extent_owner {
+    uint64_t first_page;
+    uint64_t page_num;
+    uint16_t slot;
+};
+
+struct vacuum_move {
+    uint64_t from;
+    uint64_t to;
+};
+
+struct vacuum {
+    struct db *db;
+    struct extent_owner *owners;
+    size_t nowners;
+    int owners_fresh;      /* built since the last page moved */
+    int btree_rebuilt;
+    struct vacuum_move moves[VACUUM_STEP_PAGES];
+    size_t nmoves;
+};
+
+static int compare_owners(const void *a, const void *b) {
+    uint64_t x = ((const struct extent_owner *)a)->first_page;
+    uint64_t y = ((const struct extent_owner *)b)->first_page;
+    return x < y ? -1 : x > y;
+}
+
+static void collect_pages(const struct index_shard *s, uint64_t *pages,
+                          size_t *n) {
+    for (int old = 0; old < 2; old++) {
+        if (s->fps) {
+            const struct fp_tab *t = old ? &s->fps->old : &s->fps->cur;
+            for (uint64_t i = 0; t->meta && i <= t->mask; i++) {
+                if (t->meta[i] != 0) {
+                    pages[(*n)++] = t->entries[i].page_num;
+                }
+            }
+        } else {
+            const struct hash_tab *t = old ? &s->table->old : &s->table->cur;
+            for (uint64_t i = 0; t->meta && i <= t->mask; i++) {
+                if (t->meta[i] != 0) {
+                    pages[(*n)++] = t->entries[i].page_num;
+                }
+            }
+        }
+    }
+}
+
+/* Builds the owner map from the extents of every data page the index
+ * points into. */
+static int vacuum_find_owners(struct vacuum *v) {
+    struct db *db = v->db;
+    uint64_t count = index_count(db);
+    uint64_t *pages = malloc((count ? count : 1) * sizeof(*pages));
+    if (!pages) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t n = 0;
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        collect_pages(&db->index[i], pages, &n);
+    }
+    qsort(pages, n, sizeof(*pages), compare_pages);
+
+    v->nowners = 0;
+    size_t cap = 0;
+    int ret = 0;
+    for (size_t i = 0; i < n && ret == 0; i++) {
+        if (i > 0 && pages[i] == pages[i - 1]) {
+            continue;
+        }
+        struct frame *f = pool_pin(db, pages[i], 1);
+        if (!f) {
+            ret = -1;
+            break;
+        }
+        pthread_rwlock_rdlock(&f->latch);
+        uint16_t num_slots = data_page_hdr(f->data)->num_slots;
+        if (((const struct page_header *)f->data)->page_type != PAGE_TYPE_DATA) {
+            num_slots = 0;
+        }
+        for (uint16_t slot = 0; slot < num_slots && ret == 0; slot++) {
+            struct overflow_ref ext;
+            if (!record_extent(f->data, db->page_size, slot, &ext)) {
+                continue;
+            }
+            if (v->nowners == cap) {
+                size_t new_cap = cap ? 2 * cap : 64;
+                struct extent_owner *more =
+                    realloc(v->owners, new_cap * sizeof(*more));
+                if (!more) {
+                    errno = ENOMEM;
+                    ret = -1;
+                    break;
+                }
+                v->owners = more;
+                cap = new_cap;
+            }
+            struct extent_owner *o = &v->owners[v->nowners++];
+            o->first_page = ext.first_page;
+            o->page_num = pages[i];
+            o->slot = slot;
+        }
+        pthread_rwlock_unlock(&f->latch);
+        pool_unpin(db, f, 0);
+    }
+    free(pages);
+
+    qsort(v->owners, v->nowners, sizeof(*v->owners), compare_owners);
+    v->owners_fresh = ret == 0;
+    return ret;
+}
+
+/* Finds the record pointing at the extent starting at first and returns 1
+ * with its page pinned and write-latched, 0 if there is none, or -1. */
+static int vacuum_pin_owner(struct vacuum *v, uint64_t first,
+                            struct frame **out, uint16_t *slot,
+                            struct overflow_ref *ext) {
+    for (;;) {
+        struct extent_owner key = {first, 0, 0};
+        const struct extent_owner *o = v->nowners == 0 ? NULL :
+            bsearch(&key, v->owners, v->nowners, sizeof(key), compare_owners);
+        if (o) {
+            struct frame *f = pool_pin(v->db, o->page_num, 1);
+            if (!f) {
+                return -1;
+            }
+            pthread_rwlock_wrlock(&f->latch);
+            if (((const struct page_header *)f->data)->page_type == PAGE_TYPE_DATA &&
+                record_extent(f->data, v->db->page_size, o->slot, ext) &&
+                ext->first_page == first) {
+                *out = f;
+                *slot = o->slot;
+                return 1;
+            }
+            pthread_rwlock_unlock(&f->latch);
+            pool_unpin(v->db, f, 0);
+        }
+        if (v->owners_fresh) {
+            return 0;
+        }
+        if (vacuum_find_owners(v) != 0) {
+            return -1;
+        }
+    }
+}
+
+/* The dictionary is read from memory; the header points at the new extent
+ * once it is on disk. */
+static int64_t vacuum_move_dict(struct db *db, uint64_t first, uint64_t last) {
+    const struct value_dict *d = atomic_load(&db->dict);
+    struct overflow_ref from = {first, overflow_pages(db, db->header.dict_len)};
+    if (!d || first + from.num_pages - 1 != last) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&db->header_lock);
+    struct overflow_ref to = {take_run(db, from.num_pages, first), from.num_pages};
+    pthread_mutex_unlock(&db->header_lock);
+    if (to.first_page == 0) {
+        return 0;
+    }
+    if (write_overflow(db, &to, d->data, d->len) != 0 || fsync(db->fd) != 0) {
+        free_extent(db, &to);
+        return -1;
+    }
+
+    /* If the header write fails the file may point at either copy. */
+    pthread_mutex_lock(&db->header_lock);
+    db->header.dict_page = to.first_page;
+    int ret = write_header(db);
+    pthread_mutex_unlock(&db->header_lock);
+    if (ret != 0) {
+        return -1;
+    }
+    free_extent(db, &from);
+    return from.num_pages;
+}
+
+/* Moves the extent [first, last] at the end of the file into the first
+ * free run below it. The new extent is on disk before the record points at
+ * it, and the record is before the old one is freed. Returns the number of
+ * pages moved, 0 if the extent stays, or -1. */
+static int64_t vacuum_move_extent(struct vacuum *v, uint64_t first,
+                                  uint64_t last) {
+    struct db *db = v->db;
+    if (first == db->header.dict_page) {
+        return vacuum_move_dict(db, first, last);
+    }
+
+    struct frame *f;
+    uint16_t slot;
+    struct overflow_ref from;
+    int found = vacuum_pin_owner(v, first, &f, &slot, &from);
+    if (found <= 0) {
+        return found;
+    }
+
+    uint8_t *rec = (uint8_t *)data_page_record(f->data, db->page_size, slot);
+    uint32_t key_len = record_key_len(rec), val_len;
+    memcpy(&val_len, rec + sizeof(uint32_t) + key_len, sizeof(val_len));
+    val_len &= ~VAL_OVERFLOW;
+
+    int64_t ret = 0;
+    int dirty = 0;
+    struct overflow_ref to = {0, from.num_pages};
+    uint8_t *val = NULL;
+    if (first + from.num_pages - 1 == last &&
+        overflow_pages(db, val_len) == from.num_pages) {
+        pthread_mutex_lock(&db->header_lock);
+        to.first_page = take_run(db, to.num_pages, first);
+        pthread_mutex_unlock(&db->header_lock);
+    }
+    if (to.first_page != 0) {
+        ret = -1;
+        val = malloc(val_len);
+        if (!val || read_overflow(db, &from, 0, val, val_len) != 0 ||
+            write_overflow(db, &to, val, val_len) != 0 ||
+            sync_data(db->fd) != 0) {
+            free_extent(db, &to);
+        } else {
+            /* Until the page is on disk neither extent may be reused. */
+            memcpy(rec + 2 * sizeof(uint32_t) + key_len, &to, sizeof(to));
+            dirty = 1;
+            if (write_back(db, f->page_num, f->data) == 0 &&
+                sync_data(db->fd) == 0) {
+                pool_set_dirty(db, f, 0);
+                dirty = 0;
+                ret = from.num_pages;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&f->latch);
+    pool_unpin(db, f, dirty);
+    free(val);
+
+    if (ret > 0) {
+        free_extent(db, &from);
+    }
+    return ret;
+}
+
+/* Whether the index points at the record in (page_num, slot). */
+static int vacuum_indexed(struct db *db, uint64_t hash, const uint8_t *key,
+                          uint32_t key_len, uint64_t page_num, uint16_t slot) {
+    struct index_loc locs[INDEX_CANDIDATES];
+    size_t n = index_candidates(db, hash, key, key_len, locs, INDEX_CANDIDATES);
+    for (size_t i = 0; i < n && i < INDEX_CANDIDATES; i++) {
+        if (locs[i].page_num == page_num && locs[i].slot == slot) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Copies the data page at page_num into the lowest free page and writes
+ * the copy back; vacuum_commit makes it count. A page a db_ref points into
+ * stays, as does one with a record the index does not point at. Returns 1
+ * if copied, 0 if the page stays, or -1. */
+static int vacuum_move_data(struct vacuum *v, uint64_t page_num) {
+    struct db *db = v->db;
+    struct frame *f = pool_pin(db, page_num, 1);
+    if (!f) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&f->latch);
+
+    int ret = atomic_load(&f->refs) == 0;
+    for (uint16_t slot = 0; ret == 1 && slot < data_page_hdr(f->data)->num_slots;
+         slot++) {
+        const uint8_t *rec = data_page_record(f->data, db->page_size, slot);
+        if (rec) {
+            uint32_t key_len = record_key_len(rec);
+            const uint8_t *key = rec + sizeof(uint32_t);
+            ret = vacuum_indexed(db, hash_key(db, key, key_len), key, key_len,
+                                 page_num, slot);
+        }
+    }
+
+    uint64_t to = 0;
+    if (ret == 1) {
+        pthread_mutex_lock(&db->header_lock);
+        to = take_run(db, 1, page_num);
+        pthread_mutex_unlock(&db->header_lock);
+        ret = to != 0;
+    }
+    struct frame *g = ret == 1 ? pool_pin(db, to, 0) : NULL;
+    if (ret == 1 && !g) {
+        struct overflow_ref ext = {to, 1};
+        free_extent(db, &ext);
+        ret = -1;
+    }
+    if (g) {
+        pthread_rwlock_wrlock(&g->latch);
+        memcpy(g->data, f->data, db->page_size);
+        settle_page(db, g);
+        int written = write_back(db, to, g->data) == 0;
+        if (!written) {
+            pthread_mutex_lock(&db->header_lock);
+            free_frame(db, g);
+            pthread_mutex_unlock(&db->header_lock);
+            ret = -1;
+        }
+        pthread_rwlock_unlock(&g->latch);
+        pool_unpin(db, g, !written);
+        if (written) {
+            v->moves[v->nmoves].from = page_num;
+            v->moves[v->nmoves].to = to;
+            v->nmoves++;
+        }
+    }
+
+    pthread_rwlock_unlock(&f->latch);
+    pool_unpin(db, f, 0);
+    return ret;
+}
+
+/* Once this step's copies are on disk, points their keys at them and
+ * empties the sources, which are freed unless a db_ref has come to point
+ * into one meanwhile. If they cannot be made durable the copies are freed
+ * instead. */
+static int vacuum_commit(struct vacuum *v) {
+    struct db *db = v->db;
+    int ret = v->nmoves > 0 ? sync_data(db->fd) : 0;
+    for (size_t i = 0; i < v->nmoves; i++) {
+        struct frame *f = ret == 0 ? pool_pin(db, v->moves[i].from, 1) : NULL;
+        if (!f) {
+            free_page(db, v->moves[i].to);
+            ret = -1;
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&f->latch);
+        for (uint16_t slot = data_page_hdr(f->data)->num_slots; slot-- > 0;) {
+            const uint8_t *rec = data_page_record(f->data, db->page_size, slot);
+            if (!rec) {
+                continue;
+            }
+            uint32_t key_len = record_key_len(rec);
+            const uint8_t *key = rec + sizeof(uint32_t);
+            uint64_t hash = hash_key(db, key, key_len);
+            struct index_loc loc = {v->moves[i].from, slot};
+            index_set(index_shard(db, hash), hash, key, key_len, &loc,
+                      v->moves[i].to, slot);
+            data_page_kill(f->data, slot);
+        }
+        settle_page(db, f);
+        pthread_rwlock_unlock(&f->latch);
+        pool_unpin(db, f, 1);
+    }
+    if (v->nmoves > 0) {
+        v->owners_fresh = 0;
+    }
+    v->nmoves = 0;
+    return ret;
+}
+
+/* Frees the saved free map's extent; the next checkpoint takes a new one. */
+static int vacuum_drop_free_map(struct db *db, uint64_t page_num) {
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t first = db->header.free_map_page;
+    uint32_t n = db->header.free_map_pages;
+    int ret = first != 0 && page_num >= first && page_num < first + n;
+    if (ret) {
+        for (uint32_t i = 0; i < n; i++) {
+            free_map_set(&db->free, first + i, 1);
+        }
+        db->header.free_map_page = 0;
+        db->header.free_map_pages = 0;
+    }
+    pthread_mutex_unlock(&db->header_lock);
+    return ret;
+}
+
+/* Bulk-loads the tree again into the lowest free pages, which also lays
+ * its leaves out in key order, then frees the old one. */
+static int vacuum_rebuild_btree(struct db *db) {
+    pthread_rwlock_wrlock(&db->btree.lock);
+    uint64_t old = db->header.btree_root, root;
+    int ret = btree_build(db, 1, &root);
+    if (ret == 0) {
+        btree_set_root(db, root);
+        db->btree.version++;
+        if (old != 0) {
+            ret = btree_free_pages(db, old, 0);
+        }
+    }
+    pthread_rwlock_unlock(&db->btree.lock);
+    return ret;
+}
+
+/* Cuts the free pages at the end of the file off; the pool writes back
+ * what it holds of them first, so a scan of a longer file (with
+ * DB_OPEN_MMAP the file is not shortened, since a mapped reader could fault
+ * on a page past its end) never finds a stale record there. Returns how
+ * many pages went, or -1. */
+static int64_t vacuum_trim(struct db *db) {
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t end = db->header.next_free_page;
+    while (end > 1 && free_map_test(&db->free, end - 1) &&
+           pool_forget(db, end - 1) == 0) {
+        end--;
+    }
+
+    int64_t cut = (int64_t)(db->header.next_free_page - end);
+    if (cut > 0) {
+        backup_preserve(db, end, (uint64_t)cut);
+        for (uint64_t p = end; p < db->header.next_free_page; p++) {
+            free_map_set(&db->free, p, 0);
+            if (p < db->space.leaves) {
+                space_map_set(&db->space, p, 0);
+            }
+        }
+        db->header.next_free_page = end;
+        db->header.num_pages -= (uint32_t)cut;
+        if (write_header(db) != 0 ||
+            (!(db->flags & DB_OPEN_MMAP) &&
+             ftruncate(db->fd, (off_t)(end * db->page_size)) != 0)) {
+            cut = -1;
+        }
+    }
+    pthread_mutex_unlock(&db->header_lock);
+    return cut;
+}
+
+/* Moves up to budget pages off the end of the file and cuts off what that
+ * frees. *done is set once nothing more can move. Returns the pages moved,
+ * or -1; *cut gets the pages cut off. */
+static int64_t vacuum_step(struct vacuum *v, uint64_t budget, int64_t *cut,
+                           int *done) {
+    struct db *db = v->db;
+    pthread_rwlock_wrlock(&db->lock);
+    if (mark_dirty(db) != 0) {
+        pthread_rwlock_unlock(&db->lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&db->header_lock);
+    uint64_t page_num = db->header.next_free_page;
+    pthread_mutex_unlock(&db->header_lock);
+
+    int64_t moved = 0;
+    *done = 1;
+    while (--page_num > 0) {
+        if ((uint64_t)moved >= budget) {
+            *done = 0;
+            break;
+        }
+        pthread_mutex_lock(&db->header_lock);
+        int is_free = free_map_test(&db->free, page_num);
+        pthread_mutex_unlock(&db->header_lock);
+        if (is_free) {
+            continue;
+        }
+
+        struct frame *f = pool_pin(db, page_num, 1);
+        if (!f) {
+            moved = -1;
+            break;
+        }
+        pthread_rwlock_rdlock(&f->latch);
+        struct page_header ph = *(const struct page_header *)f->data;
+        pthread_rwlock_unlock(&f->latch);
+        pool_unpin(db, f, 0);
+
+        /* Anything but another data page waits for the copies so far. */
+        int64_t n = 0;
+        if (ph.page_type == PAGE_TYPE_DATA) {
+            n = vacuum_move_data(v, page_num);
+        } else if (v->nmoves > 0) {
+            *done = 0;
+            break;
+        } else if (ph.page_type == PAGE_TYPE_OVERFLOW && ph.reserved <= page_num) {
+            n = vacuum_move_extent(v, ph.reserved, page_num);
+            if (n > 0) {
+                page_num = ph.reserved;
+            }
+        } else if (ph.page_type == PAGE_TYPE_FREEMAP) {
+            n = vacuum_drop_free_map(db, page_num);
+        } else if ((ph.page_type == PAGE_TYPE_BTREE_LEAF ||
+                    ph.page_type == PAGE_TYPE_BTREE_INNER) &&
+                   !v->btree_rebuilt) {
+            v->btree_rebuilt = 1;
+            n = vacuum_rebuild_btree(db) == 0 ? 1 : -1;
+            pthread_mutex_lock(&db->header_lock);
+            page_num = db->header.next_free_page;
+            pthread_mutex_unlock(&db->header_lock);
+        }
+        if (n <= 0) {
+            moved = n < 0 ? -1 : moved;
+            break;
+        }
+        moved += n;
+    }
+
+    if (vacuum_commit(v) != 0) {
+        moved = -1;
+    }
+    *cut = moved < 0 ? 0 : vacuum_trim(db);
+    if (*cut < 0) {
+        moved = -1;
+    }
+    pthread_rwlock_unlock(&db->lock);
+    return moved;
+}
+
+int64_t db_vacuum(struct db *db, uint64_t max_pages, unsigned pages_per_sec) {
+    if (!db) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (db->flags & DB_OPEN_LOG) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    struct vacuum v = {.db = db};
+    uint64_t t0 = stats_clock(), moved = 0;
+    int64_t shrunk = 0;
+    int done = 0;
+    while (!done && (max_pages == 0 || moved < max_pages)) {
+        uint64_t budget = VACUUM_STEP_PAGES;
+        if (max_pages != 0 && max_pages - moved < budget) {
+            budget = max_pages - moved;
+        }
+        if (pages_per_sec != 0 && pages_per_sec < budget) {
+            budget = pages_per_sec;
+        }
+
+        int64_t cut;
+        int64_t n = vacuum_step(&v, budget, &cut, &done);
+        if (n < 0) {
+            shrunk = -1;
+            break;
+        }
+        moved += (uint64_t)n;
+        shrunk += cut;
+
+        /* Sleep off whatever the steps so far ran ahead of the rate. */
+        if (pages_per_sec != 0 && !done) {
+            uint64_t due = t0 + moved * 1000000000u / pages_per_sec;
+            uint64_t now = stats_clock();
+            if (due > now) {
+                struct timespec ts = {(time_t)((due - now) / 1000000000u),
+                                      (long)((due - now) % 1000000000u)};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    free(v.owners);
+    return shrunk;
+}
+
+/* Ordered iteration. An iterator copies the rest of a leaf's keys out under
+ * btree.lock shared and serves them without holding anything, then follows
+ * the leaf chain if the tree has not changed since, or seeks past the last
+ * key it returned if it has. */
+
+struct db_iter {
+    struct db *db;
+    uint8_t *keys;         /* key_len (u16), key, ... */
+    size_t keys_len;
+    size_t keys_pos;
+    uint64_t next_leaf;
+    uint64_t version;
+    uint64_t readahead_end;
+    uint8_t *last;         /* seek key, then the last key returned */
+    uint32_t last_len;
+    int past_last;
+    uint8_t *val;
+    uint32_t val_cap;
+};
+
+/* Leaves laid out in key order, as a bulk load leaves them, are read ahead
+ * BTREE_READAHEAD pages at a time; otherwise only the next leaf is. */
+static void iter_readahead(struct db_iter *it, uint64_t page_num) {
+#ifdef POSIX_FADV_WILLNEED
+    uint64_t next = it->next_leaf;
+    if (next == 0) {
+        return;
+    }
+    if (next != page_num + 1) {
+        it->readahead_end = 0;
+        if (!pool_cached(it->db, next)) {
+            posix_fadvise(it->db->fd, next * it->db->page_size, it->db->page_size,
+                          POSIX_FADV_WILLNEED);
+        }
+        return;
+    }
+    if (next + BTREE_READAHEAD / 2 >= it->readahead_end) {
+        uint64_t start = it->readahead_end > next ? it->readahead_end : next;
+        it->readahead_end = next + BTREE_READAHEAD;
+        posix_fadvise(it->db->fd, start * it->db->page_size,
+                      (it->readahead_end - start) * it->db->page_size,
+                      POSIX_FADV_WILLNEED);
+    }
+#else
+    (void)it;
+    (void)page_num;
+#endif
+}
+
+/* Copies a leaf's keys from index start on. Called with btree.lock held. */
+static void iter_load(struct db_iter *it, struct frame *f, uint16_t start) {
+    struct btree_node *n = btree_hdr(f->data);
+    it->keys_len = 0;
+    it->keys_pos = 0;
+    for (uint16_t i = start; i < n->num_keys; i++) {
+        uint16_t len;
+        const uint8_t *key = btree_key(f->data, i, &len);
+        memcpy(it->keys + it->keys_len, &len, sizeof(len));
+        memcpy(it->keys + it->keys_len + sizeof(len), key, len);
+        it->keys_len += sizeof(len) + len;
+    }
+    it->next_leaf = n->next;
+    it->version = it->db->btree.version;
+    iter_readahead(it, f->page_num);
+}
+
+/* Positions at the first key >= it->last, or > it once it was returned. */
+static int iter_seek(struct db_iter *it) {
+    struct db *db = it->db;
+    uint64_t path[BTREE_DEPTH_MAX];
+
+    pthread_rwlock_rdlock(&db->btree.lock);
+    int depth = btree_descend(db, it->last, it->last_len, path);
+    struct frame *f = depth > 0 ? btree_pin(db, path[depth - 1]) : NULL;
+    int ret = depth < 0 || (depth > 0 && !f) ? -1 : 0;
+    it->keys_len = it->keys_pos = 0;
+    it->next_leaf = 0;
+    if (f) {
+        int exact;
+        uint16_t pos = btree_search(f->data, it->last, it->last_len, &exact);
+        iter_load(it, f, pos + (exact && it->past_last));
+        pool_unpin(db, f, 0);
+    }
+    pthread_rwlock_unlock(&db->btree.lock);
+    return ret;
+}
+
+/* Refills from the next leaf once the current one is used up. */
+static int iter_advance(struct db_iter *it) {
+    struct db *db = it->db;
+    if (it->next_leaf == 0) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&db->btree.lock);
+    if (it->version != db->btree.version) {
+        pthread_rwlock_unlock(&db->btree.lock);
+        return iter_seek(it);
+    }
+
+    struct frame *f = btree_pin(db, it->next_leaf);
+    int ret = 0;
+    if (!f) {
+        ret = -1;
+    } else if (btree_hdr(f->data)->level != 0) {
+        errno = EIO;
+        ret = -1;
+    } else {
+        iter_load(it, f, 0);
+    }
+    if (f) {
+        pool_unpin(db, f, 0);
+    }
+    pthread_rwlock_unlock(&db->btree.lock);
+    return ret;
+}
+
+struct db_iter *db_iter_seek(struct db *db, const uint8_t *key, uint32_t key_len) {
+    if (!db || (!key && key_len > 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(db->flags & DB_OPEN_ORDERED)) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    struct db_iter *it = calloc(1, sizeof(*it));
+    if (!it) {
+        return NULL;
+    }
+    it->db = db;
+    it->keys = malloc(db->page_size);
+    it->last = malloc(key_len > BTREE_MAX_KEY ? key_len : BTREE_MAX_KEY);
+    it->val_cap = 256;
+    it->val = malloc(it->val_cap);
+    if (!it->keys || !it->last || !it->val) {
+        db_iter_close(it);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (key_len > 0) {
+        memcpy(it->last, key, key_len);
+    }
+    it->last_len = key_len;
+    if (iter_seek(it) != 0) {
+        int saved_errno = errno;
+        db_iter_close(it);
+        errno = saved_errno;
+        return NULL;
+    }
+    return it;
+}
+
+int db_iter_next(struct db_iter *it, const uint8_t **key, uint32_t *key_len,
+                 const uint8_t **val, uint32_t *val_len) {
+    if (!it || !key || !key_len || !val || !val_len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        while (it->keys_pos == it->keys_len) {
+            if (it->next_leaf == 0) {
+                return 0;
+            }
+            if (iter_advance(it) != 0) {
+                return -1;
+            }
+        }
+
+        uint16_t len;
+        memcpy(&len, it->keys + it->keys_pos, sizeof(len));
+        memcpy(it->last, it->keys + it->keys_pos + sizeof(len), len);
+        it->keys_pos += sizeof(len) + len;
+        it->last_len = len;
+        it->past_last = 1;
+
+        /* The key may have been deleted since its leaf was copied. */
+        int64_t n;
+        while ((n = db_get_into(it->db, it->last, len, it->val, it->val_cap)) >
+               it->val_cap) {
+            uint8_t *grown = realloc(it->val, n);
+            if (!grown) {
+                errno = ENOMEM;
+                return -1;
+            }
+            it->val = grown;
+            it->val_cap = (uint32_t)n;
+        }
+        if (n < 0) {
+            if (errno == ENOENT) {
+                continue;
+            }
+            return -1;
+        }
+
+        *key = it->last;
+        *key_len = len;
+        *val = it->val;
+        *val_len = (uint32_t)n;
+        return 1;
+    }
+}
+
+void db_iter_close(struct db_iter *it) {
+    if (!it) {
+        return;
+    }
+    free(it->keys);
+    free(it->last);
+    free(it->val);
+    free(it);
+}
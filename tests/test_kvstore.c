@@ -1,10 +1,19 @@
+#define _GNU_SOURCE
 #include "kvstore.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 
 /* ANSI color codes for output */
 #define GREEN "\033[32m"
@@ -36,6 +45,26 @@ static int tests_failed = 0;
         return; \
     }
 
+/* Removes a database file together with its sidecar files. */
+static void unlink_db(const char *path) {
+    static const char *suffixes[] = { "", ".idx", ".idx.tmp", ".wal" };
+    char buf[256];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(buf, sizeof(buf), "%s%s", path, suffixes[i]);
+        unlink(buf);
+    }
+}
+
+/* Removes a log-structured database with its segment files. */
+static void unlink_log_db(const char *path) {
+    unlink_db(path);
+    for (int id = 1; id < 64; id++) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s.seg.%d", path, id);
+        unlink(buf);
+    }
+}
+
 /* ============================================================================
  * Test Cases
  * ============================================================================
@@ -45,7 +74,7 @@ void test_create_new_db(void) {
     TEST("Create new database");
 
     const char *path = "test_new.db";
-    unlink(path);  /* Remove if exists */
+    unlink_db(path);  /* Remove if exists */
 
     struct db *db = db_open(path);
     ASSERT(db != NULL, "db_open() returned NULL");
@@ -53,12 +82,12 @@ void test_create_new_db(void) {
     /* Check header was initialized correctly */
     ASSERT(db->header.magic == MAGIC, "Invalid magic number");
     ASSERT(db->header.version == VERSION, "Invalid version");
-    ASSERT(db->header.page_size == PAGE_SIZE, "Invalid page size");
+    ASSERT(db->header.page_size == DEFAULT_PAGE_SIZE, "Invalid page size");
     ASSERT(db->header.num_pages == 1, "Should have 1 page (header)");
     ASSERT(db->header.next_free_page == 1, "Next free page should be 1");
 
     db_close(db);
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -82,7 +111,7 @@ void test_open_existing_db(void) {
     ASSERT(db2->header.version == VERSION, "Version not persisted");
 
     db_close(db2);
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -95,8 +124,8 @@ void test_open_invalid_file(void) {
     /* Create a garbage file */
     FILE *f = fopen(path, "wb");
     ASSERT(f != NULL, "Failed to create test file");
-    uint8_t garbage[PAGE_SIZE] = {0};
-    fwrite(garbage, 1, PAGE_SIZE, f);
+    uint8_t garbage[DEFAULT_PAGE_SIZE] = {0};
+    fwrite(garbage, 1, DEFAULT_PAGE_SIZE, f);
     fclose(f);
 
     /* Try to open it */
@@ -104,7 +133,7 @@ void test_open_invalid_file(void) {
     ASSERT(db == NULL, "Should reject invalid file");
     ASSERT(errno == EINVAL, "Should set errno to EINVAL");
 
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -121,7 +150,7 @@ void test_multiple_open_close(void) {
     TEST("Multiple open/close cycles");
 
     const char *path = "test_cycles.db";
-    unlink(path);
+    unlink_db(path);
 
     for (int i = 0; i < 5; i++) {
         struct db *db = db_open(path);
@@ -130,7 +159,7 @@ void test_multiple_open_close(void) {
         db_close(db);
     }
 
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -139,7 +168,7 @@ void test_put_get(void) {
     TEST("Put and get simple key-value");
 
     const char *path = "test_put_get.db";
-    unlink(path);
+    unlink_db(path);
 
     struct db *db = db_open(path);
     ASSERT(db != NULL, "Failed to open database");
@@ -159,7 +188,7 @@ void test_put_get(void) {
 
     free(retrieved);
     db_close(db);
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -168,7 +197,7 @@ void test_get_nonexistent(void) {
     TEST("Get nonexistent key");
 
     const char *path = "test_get_nonexistent.db";
-    unlink(path);
+    unlink_db(path);
 
     struct db *db = db_open(path);
     ASSERT(db != NULL, "Failed to open database");
@@ -179,7 +208,7 @@ void test_get_nonexistent(void) {
     ASSERT(errno == ENOENT, "Should set errno to ENOENT");
 
     db_close(db);
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -188,7 +217,7 @@ void test_put_overwrite(void) {
     TEST("Overwrite existing key");
 
     const char *path = "test_overwrite.db";
-    unlink(path);
+    unlink_db(path);
 
     struct db *db = db_open(path);
     ASSERT(db != NULL, "Failed to open database");
@@ -205,7 +234,7 @@ void test_put_overwrite(void) {
 
     free(val);
     db_close(db);
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -214,7 +243,7 @@ void test_delete(void) {
     TEST("Delete key");
 
     const char *path = "test_delete.db";
-    unlink(path);
+    unlink_db(path);
 
     struct db *db = db_open(path);
     ASSERT(db != NULL, "Failed to open database");
@@ -229,7 +258,7 @@ void test_delete(void) {
     ASSERT(val == NULL, "Deleted key should not be found");
 
     db_close(db);
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -238,7 +267,7 @@ void test_persistence(void) {
     TEST("Data persists across restarts");
 
     const char *path = "test_persist.db";
-    unlink(path);
+    unlink_db(path);
 
     struct db *db1 = db_open(path);
     db_put(db1, (uint8_t *)"persist", 7, (uint8_t *)"data", 4);
@@ -252,7 +281,7 @@ void test_persistence(void) {
 
     free(val);
     db_close(db2);
-    unlink(path);
+    unlink_db(path);
 
     PASS();
 }
@@ -261,7 +290,7 @@ void test_free_list_reuse(void) {
     TEST("Free list reuses deleted pages");
 
     const char *path = "test_freelist.db";
-    unlink(path);
+    unlink_db(path);
 
     struct db *db = db_open(path);
     ASSERT(db != NULL, "Failed to open database");
@@ -287,7 +316,2704 @@ void test_free_list_reuse(void) {
 
     free(val);
     db_close(db);
-    unlink(path);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_free_map_reload(void) {
+    TEST("Free map survives a clean reopen");
+
+    const char *path = "test_free_map.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* One record per page, then every other page freed. */
+    uint8_t val[3000];
+    char key[16];
+    for (int i = 0; i < 50; i++) {
+        int len = snprintf(key, sizeof(key), "page-%d", i);
+        memset(val, i, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0, "db_put failed");
+    }
+    for (int i = 0; i < 50; i += 2) {
+        int len = snprintf(key, sizeof(key), "page-%d", i);
+        ASSERT(db_delete(db, (uint8_t *)key, len) == 0, "db_delete failed");
+    }
+    ASSERT(db_checkpoint(db) == 0, "Checkpoint failed");
+    uint64_t free_pages = db->free.count;
+    uint64_t pages = db->header.next_free_page;
+    ASSERT(free_pages >= 25, "Deleted pages not free");
+    db_close(db);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen failed");
+    ASSERT(db->free.count == free_pages, "Free map not restored");
+    for (int i = 0; i < 50; i += 2) {
+        int len = snprintf(key, sizeof(key), "again-%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0, "db_put failed");
+    }
+    ASSERT(db->header.next_free_page == pages, "Free pages not reused after reopen");
+    db_close(db);
+
+    unlink_db(path);
+    PASS();
+}
+
+void test_small_records_share_page(void) {
+    TEST("Small records share a data page");
+
+    const char *path = "test_slotted.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    char key[32], val[64];
+    for (int i = 0; i < 40; i++) {
+        snprintf(key, sizeof(key), "key-%02d", i);
+        snprintf(val, sizeof(val), "value-%02d-padding-padding", i);
+        int ret = db_put(db, (uint8_t *)key, strlen(key),
+                         (uint8_t *)val, strlen(val));
+        ASSERT(ret == 0, "db_put failed");
+    }
+
+    ASSERT(db->header.next_free_page == 2, "40 small records should fit in one page");
+    db_close(db);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen database");
+    for (int i = 0; i < 40; i++) {
+        snprintf(key, sizeof(key), "key-%02d", i);
+        snprintf(val, sizeof(val), "value-%02d-padding-padding", i);
+        uint32_t val_len;
+        uint8_t *got = db_get(db, (uint8_t *)key, strlen(key), &val_len);
+        ASSERT(got != NULL, "Record missing after reopen");
+        ASSERT(val_len == strlen(val) && memcmp(got, val, val_len) == 0,
+               "Record mismatch after reopen");
+        free(got);
+    }
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_slot_space_reuse(void) {
+    TEST("Freed slot space is compacted and reused");
+
+    const char *path = "test_slot_reuse.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* Fill one page with ~1 KiB records, punch holes, then refill. */
+    uint8_t val[1000];
+    memset(val, 'x', sizeof(val));
+    char key[16];
+    for (int i = 0; i < 4; i++) {
+        snprintf(key, sizeof(key), "big-%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, strlen(key), val, sizeof(val)) == 0,
+               "db_put failed");
+    }
+    uint64_t pages = db->header.next_free_page;
+
+    ASSERT(db_delete(db, (uint8_t *)"big-0", 5) == 0, "delete failed");
+    ASSERT(db_delete(db, (uint8_t *)"big-2", 5) == 0, "delete failed");
+
+    uint8_t val2[1900];
+    memset(val2, 'y', sizeof(val2));
+    ASSERT(db_put(db, (uint8_t *)"merged", 6, val2, sizeof(val2)) == 0,
+           "db_put into fragmented page failed");
+    ASSERT(db->header.next_free_page == pages, "Should reuse fragmented space");
+
+    uint32_t val_len;
+    uint8_t *got = db_get(db, (uint8_t *)"big-3", 5, &val_len);
+    ASSERT(got != NULL && val_len == sizeof(val) && got[999] == 'x',
+           "Surviving record damaged by compaction");
+    free(got);
+    got = db_get(db, (uint8_t *)"merged", 6, &val_len);
+    ASSERT(got != NULL && val_len == sizeof(val2) && got[0] == 'y',
+           "New record mismatch");
+    free(got);
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_index_growth(void) {
+    TEST("Index grows and stays consistent past initial capacity");
+
+    const char *path = "test_index_growth.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* Mix inline and out-of-line key lengths. */
+    const int n = 20000;
+    char key[64];
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(key, sizeof(key), i % 2 ? "k%d" : "a-much-longer-key-%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, len, (uint8_t *)&i, sizeof(i)) == 0,
+               "db_put failed");
+    }
+    for (int i = 0; i < n; i += 3) {
+        int len = snprintf(key, sizeof(key), i % 2 ? "k%d" : "a-much-longer-key-%d", i);
+        ASSERT(db_delete(db, (uint8_t *)key, len) == 0, "db_delete failed");
+    }
+    db_close(db);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen database");
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(key, sizeof(key), i % 2 ? "k%d" : "a-much-longer-key-%d", i);
+        uint32_t val_len;
+        uint8_t *got = db_get(db, (uint8_t *)key, len, &val_len);
+        if (i % 3 == 0) {
+            ASSERT(got == NULL && errno == ENOENT, "Deleted key still present");
+        } else {
+            ASSERT(got != NULL && val_len == sizeof(i) && memcmp(got, &i, sizeof(i)) == 0,
+                   "Key lost or corrupted");
+            free(got);
+        }
+    }
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_index_snapshot_reload(void) {
+    TEST("Index snapshot is written on close and trusted on reopen");
+
+    const char *path = "test_snapshot.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    char key[32];
+    for (int i = 0; i < 500; i++) {
+        int len = snprintf(key, sizeof(key), "snap-%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, len, (uint8_t *)&i, sizeof(i)) == 0,
+               "db_put failed");
+    }
+    db_delete(db, (uint8_t *)"snap-7", 6);
+    db_close(db);
+
+    ASSERT(access("test_snapshot.db.idx", F_OK) == 0, "Snapshot file not written");
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen database");
+    ASSERT(db->header.index_generation == db->header.generation,
+           "Snapshot should be current after a clean close");
+    for (int i = 0; i < 500; i++) {
+        int len = snprintf(key, sizeof(key), "snap-%d", i);
+        uint32_t val_len;
+        uint8_t *got = db_get(db, (uint8_t *)key, len, &val_len);
+        if (i == 7) {
+            ASSERT(got == NULL, "Deleted key came back from snapshot");
+            continue;
+        }
+        ASSERT(got != NULL && memcmp(got, &i, sizeof(i)) == 0,
+               "Key missing from snapshot");
+        free(got);
+    }
+
+    /* Writes after loading must still land in pages with free space. */
+    uint64_t pages = db->header.next_free_page;
+    ASSERT(db_put(db, (uint8_t *)"after", 5, (uint8_t *)"x", 1) == 0, "db_put failed");
+    ASSERT(db->header.next_free_page == pages, "Space map not restored");
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_stale_snapshot_rescan(void) {
+    TEST("Stale or missing snapshot falls back to a page scan");
+
+    const char *path = "test_stale_snapshot.db";
+    unlink_db(path);
+
+    /* Child checkpoints, keeps writing, then dies without db_close. */
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        struct db *db = db_open(path);
+        if (!db) _exit(1);
+        db_put(db, (uint8_t *)"old", 3, (uint8_t *)"1", 1);
+        if (db_checkpoint(db) != 0) _exit(1);
+        db_put(db, (uint8_t *)"new", 3, (uint8_t *)"2", 1);
+        db_delete(db, (uint8_t *)"old", 3);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen after crash");
+    uint32_t val_len;
+    uint8_t *got = db_get(db, (uint8_t *)"new", 3, &val_len);
+    ASSERT(got != NULL && val_len == 1 && got[0] == '2', "Write after checkpoint lost");
+    free(got);
+    ASSERT(db_get(db, (uint8_t *)"old", 3, &val_len) == NULL,
+           "Delete after checkpoint lost");
+    db_close(db);
+
+    unlink("test_stale_snapshot.db.idx");
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to open without snapshot");
+    got = db_get(db, (uint8_t *)"new", 3, &val_len);
+    ASSERT(got != NULL && got[0] == '2', "Scan without snapshot lost data");
+    free(got);
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_parallel_recovery_scan(void) {
+    TEST("Recovery scan across many pages and workers");
+
+    const char *path = "test_recovery_scan.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    uint8_t val[900];
+    char key[32];
+    const int n = 3000;
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(key, sizeof(key), "scan-%d", i);
+        memset(val, i & 0xff, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0,
+               "db_put failed");
+    }
+    ASSERT(db_checkpoint(db) == 0, "Checkpoint failed");
+    uint64_t pages = db->header.next_free_page;
+    db_close(db);
+
+    unlink("test_recovery_scan.db.idx");
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen database");
+    ASSERT(db->header.next_free_page == pages, "Page count changed");
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(key, sizeof(key), "scan-%d", i);
+        uint32_t val_len;
+        uint8_t *got = db_get(db, (uint8_t *)key, len, &val_len);
+        ASSERT(got != NULL && val_len == sizeof(val) && got[0] == (i & 0xff),
+               "Record lost by recovery scan");
+        free(got);
+    }
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_wal_crash_recovery(void) {
+    TEST("WAL replays changes lost in a crash");
+
+    const char *path = "test_wal_crash.db";
+    unlink_db(path);
+
+    /* The child checkpoints, then frees and reuses pages and grows the file
+     * before dying, so the on-disk header and free list are out of date. */
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        struct db *db = db_open(path);
+        if (!db) _exit(1);
+        uint8_t val[2000];
+        char key[32];
+        for (int i = 0; i < 20; i++) {
+            int len = snprintf(key, sizeof(key), "wal-%d", i);
+            memset(val, i, sizeof(val));
+            if (db_put(db, (uint8_t *)key, len, val, sizeof(val)) != 0) _exit(1);
+        }
+        if (db_checkpoint(db) != 0) _exit(1);
+        for (int i = 0; i < 10; i++) {
+            int len = snprintf(key, sizeof(key), "wal-%d", i);
+            if (db_delete(db, (uint8_t *)key, len) != 0) _exit(1);
+        }
+        for (int i = 20; i < 40; i++) {
+            int len = snprintf(key, sizeof(key), "wal-%d", i);
+            memset(val, i, sizeof(val));
+            if (db_put(db, (uint8_t *)key, len, val, sizeof(val)) != 0) _exit(1);
+        }
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+
+    /* A torn record at the tail must be ignored. */
+    FILE *f = fopen("test_wal_crash.db.wal", "ab");
+    ASSERT(f != NULL, "WAL file missing");
+    fwrite("\x01\x02\x03torn", 1, 7, f);
+    fclose(f);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to recover");
+
+    /* New writes must not clobber recovered records. */
+    uint8_t val[2000];
+    memset(val, 0xee, sizeof(val));
+    for (int i = 0; i < 10; i++) {
+        char key[32];
+        int len = snprintf(key, sizeof(key), "post-%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0, "db_put failed");
+    }
+
+    for (int i = 0; i < 40; i++) {
+        char key[32];
+        int len = snprintf(key, sizeof(key), "wal-%d", i);
+        uint32_t val_len;
+        uint8_t *got = db_get(db, (uint8_t *)key, len, &val_len);
+        if (i < 10) {
+            ASSERT(got == NULL, "Delete was not replayed");
+            continue;
+        }
+        ASSERT(got != NULL && val_len == 2000 && got[0] == i && got[1999] == i,
+               "Put was not replayed");
+        free(got);
+    }
+    db_close(db);
+
+    struct stat st;
+    ASSERT(stat("test_wal_crash.db.wal", &st) == 0 && st.st_size == 0,
+           "WAL should be empty after a clean close");
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_write_batch(void) {
+    TEST("Write batch applies puts and deletes in order");
+
+    const char *path = "test_batch.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    ASSERT(db_put(db, (uint8_t *)"gone", 4, (uint8_t *)"x", 1) == 0, "db_put failed");
+
+    enum { N = 300 };
+    static char keys[N][16];
+    static uint8_t vals[N][200];
+    struct db_batch_op ops[N + 3];
+    for (int i = 0; i < N; i++) {
+        int len = snprintf(keys[i], sizeof(keys[i]), "batch-%d", i);
+        memset(vals[i], i & 0xff, sizeof(vals[i]));
+        ops[i] = (struct db_batch_op){ DB_BATCH_PUT, (uint8_t *)keys[i], len,
+                                       vals[i], sizeof(vals[i]) };
+    }
+    ops[N] = (struct db_batch_op){ DB_BATCH_DELETE, (uint8_t *)"gone", 4, NULL, 0 };
+    ops[N + 1] = (struct db_batch_op){ DB_BATCH_PUT, (uint8_t *)"batch-5", 7,
+                                       (uint8_t *)"latest", 6 };
+    ops[N + 2] = (struct db_batch_op){ DB_BATCH_DELETE, (uint8_t *)"missing", 7, NULL, 0 };
+    ASSERT(db_write_batch(db, ops, N + 3) == 0, "db_write_batch failed");
+
+    /* A batch with an invalid op must not apply anything. */
+    struct db_batch_op bad[2] = {
+        { DB_BATCH_PUT, (uint8_t *)"never", 5, (uint8_t *)"1", 1 },
+        { 99, (uint8_t *)"x", 1, NULL, 0 },
+    };
+    ASSERT(db_write_batch(db, bad, 2) == -1 && errno == EINVAL, "Invalid batch accepted");
+    db_close(db);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen database");
+    uint32_t val_len;
+    ASSERT(db_get(db, (uint8_t *)"gone", 4, &val_len) == NULL, "Batch delete lost");
+    ASSERT(db_get(db, (uint8_t *)"never", 5, &val_len) == NULL, "Invalid batch applied");
+    uint8_t *got = db_get(db, (uint8_t *)"batch-5", 7, &val_len);
+    ASSERT(got != NULL && val_len == 6 && memcmp(got, "latest", 6) == 0,
+           "Later op in batch should win");
+    free(got);
+    for (int i = 0; i < N; i++) {
+        if (i == 5) continue;
+        got = db_get(db, (uint8_t *)keys[i], strlen(keys[i]), &val_len);
+        ASSERT(got != NULL && val_len == sizeof(vals[i]) && got[0] == (i & 0xff),
+               "Batch put lost");
+        free(got);
+    }
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_write_batch_crash(void) {
+    TEST("Write batch survives a crash");
+
+    const char *path = "test_batch_crash.db";
+    unlink_db(path);
+
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        struct db *db = db_open(path);
+        if (!db) _exit(1);
+        struct db_batch_op ops[2] = {
+            { DB_BATCH_PUT, (uint8_t *)"a", 1, (uint8_t *)"1", 1 },
+            { DB_BATCH_PUT, (uint8_t *)"b", 1, (uint8_t *)"2", 1 },
+        };
+        if (db_write_batch(db, ops, 2) != 0) _exit(1);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to recover");
+    uint32_t val_len;
+    uint8_t *a = db_get(db, (uint8_t *)"a", 1, &val_len);
+    uint8_t *b = db_get(db, (uint8_t *)"b", 1, &val_len);
+    ASSERT(a != NULL && b != NULL && a[0] == '1' && b[0] == '2', "Batch lost in crash");
+    free(a);
+    free(b);
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_get_into(void) {
+    TEST("Get into a caller buffer");
+
+    const char *path = "test_get_into.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    ASSERT(db_put(db, (uint8_t *)"k", 1, (uint8_t *)"hello world", 11) == 0,
+           "db_put failed");
+
+    uint8_t buf[32];
+    int64_t n = db_get_into(db, (uint8_t *)"k", 1, buf, sizeof(buf));
+    ASSERT(n == 11 && memcmp(buf, "hello world", 11) == 0, "Wrong value");
+
+    memset(buf, 0, sizeof(buf));
+    n = db_get_into(db, (uint8_t *)"k", 1, buf, 5);
+    ASSERT(n == 11, "Should report the full length");
+    ASSERT(memcmp(buf, "hello", 5) == 0 && buf[5] == 0, "Should copy at most cap bytes");
+
+    n = db_get_into(db, (uint8_t *)"nope", 4, buf, sizeof(buf));
+    ASSERT(n == -1 && errno == ENOENT, "Missing key should fail with ENOENT");
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_get_ref(void) {
+    TEST("Get a pinned reference and release it");
+
+    const char *path = "test_get_ref.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    db_put(db, (uint8_t *)"a", 1, (uint8_t *)"alpha", 5);
+    db_put(db, (uint8_t *)"b", 1, (uint8_t *)"beta", 4);
+
+    struct db_ref ra, rb;
+    ASSERT(db_get_ref(db, (uint8_t *)"a", 1, &ra) == 0, "db_get_ref failed");
+    ASSERT(db_get_ref(db, (uint8_t *)"b", 1, &rb) == 0, "db_get_ref failed");
+    ASSERT(ra.val_len == 5 && memcmp(ra.val, "alpha", 5) == 0, "Wrong view of a");
+    ASSERT(rb.val_len == 4 && memcmp(rb.val, "beta", 4) == 0, "Wrong view of b");
+
+    /* Views stay valid while pinned, even across other operations. */
+    db_put(db, (uint8_t *)"c", 1, (uint8_t *)"gamma", 5);
+    ASSERT(memcmp(ra.val, "alpha", 5) == 0, "Pinned view changed");
+    db_release(db, &ra);
+    db_release(db, &rb);
+    ASSERT(ra.val == NULL, "Release should clear the view");
+
+    struct db_ref rm;
+    ASSERT(db_get_ref(db, (uint8_t *)"zzz", 3, &rm) == -1 && errno == ENOENT,
+           "Missing key should fail with ENOENT");
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+struct pool_worker_arg {
+    struct db *db;
+    int n;
+    int first;
+    int write;
+    int ok;
+};
+
+/* Reads (or rewrites, unchanged) every key of test_pool_eviction, starting
+ * at first. */
+static void *pool_worker(void *p) {
+    struct pool_worker_arg *a = p;
+    uint8_t val[3000];
+    a->ok = 1;
+    for (int j = 0; j < a->n && a->ok; j++) {
+        int i = (a->first + j) % a->n;
+        char key[16];
+        int len = snprintf(key, sizeof(key), "k%d", i);
+        if (a->write) {
+            memset(val, 'a' + i % 26, sizeof(val));
+            a->ok = db_put(a->db, (uint8_t *)key, len, val, sizeof(val)) == 0;
+        } else {
+            a->ok = db_get_into(a->db, (uint8_t *)key, len, val, sizeof(val)) == sizeof(val) &&
+                    val[0] == 'a' + i % 26 && val[sizeof(val) - 1] == 'a' + i % 26;
+        }
+    }
+    return NULL;
+}
+
+void test_pool_eviction(void) {
+    TEST("Dataset larger than the buffer pool");
+
+    const char *path = "test_pool_eviction.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* One record per page, so this cycles well past BUFFER_POOL_PAGES. */
+    uint8_t val[3000];
+    int n = BUFFER_POOL_PAGES + BUFFER_POOL_PAGES / 2;
+    struct db_ref pinned;
+    for (int i = 0; i < n; i++) {
+        char key[16];
+        int len = snprintf(key, sizeof(key), "k%d", i);
+        memset(val, 'a' + i % 26, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0, "db_put failed");
+        if (i == 0) {
+            ASSERT(db_get_ref(db, (uint8_t *)key, len, &pinned) == 0, "db_get_ref failed");
+        }
+    }
+
+    /* A pinned frame is never chosen as a victim. */
+    ASSERT(pinned.val_len == sizeof(val) && pinned.val[0] == 'a' &&
+           pinned.val[sizeof(val) - 1] == 'a', "Pinned view was evicted");
+    db_release(db, &pinned);
+    db_close(db);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen");
+    for (int i = 0; i < n; i++) {
+        char key[16];
+        int len = snprintf(key, sizeof(key), "k%d", i);
+        int64_t got = db_get_into(db, (uint8_t *)key, len, val, sizeof(val));
+        ASSERT(got == sizeof(val) && val[0] == 'a' + i % 26 &&
+               val[sizeof(val) - 1] == 'a' + i % 26, "Evicted page lost its data");
+    }
+
+    /* Readers starting apart miss on the same pages at once while a
+     * writer's dirty frames are evicted under them. */
+    enum { WORKERS = 4 };
+    pthread_t workers[WORKERS];
+    struct pool_worker_arg args[WORKERS];
+    for (int t = 0; t < WORKERS; t++) {
+        args[t] = (struct pool_worker_arg){ db, n, t * n / WORKERS, t == 0, 0 };
+        ASSERT(pthread_create(&workers[t], NULL, pool_worker, &args[t]) == 0,
+               "pthread_create failed");
+    }
+    int workers_ok = 1;
+    for (int t = 0; t < WORKERS; t++) {
+        pthread_join(workers[t], NULL);
+        workers_ok &= args[t].ok;
+    }
+    ASSERT(workers_ok, "Concurrent misses and evictions lost data");
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_pool_exhaustion(void) {
+    TEST("Puts with every frame pinned");
+
+    const char *path = "test_pool_exhaustion.db";
+    unlink_db(path);
+
+    /* Raised to POOL_MIN_PAGES frames. */
+    struct db_options opts = { .cache_size = 1 };
+    struct db *db = db_open_opts(path, &opts);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* One record per page, and a db_ref on every one the pool can hold. */
+    enum { KEYS = POOL_MIN_PAGES * 4 };
+    static struct db_ref refs[KEYS];
+    uint8_t val[3000];
+    char key[16];
+    int len, held = 0;
+    memset(val, 'x', sizeof(val));
+    for (int i = 0; i < KEYS; i++) {
+        len = snprintf(key, sizeof(key), "k%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0, "db_put failed");
+    }
+    for (int i = 0; i < KEYS; i++) {
+        len = snprintf(key, sizeof(key), "k%d", i);
+        if (db_get_ref(db, (uint8_t *)key, len, &refs[held]) == 0) {
+            held++;
+        } else {
+            ASSERT(errno == ENOBUFS, "db_get_ref failed");
+        }
+    }
+    ASSERT(held < KEYS, "Pool never ran out of frames");
+
+    /* The new page a put takes and cannot pin goes back to the free map. */
+    uint64_t in_use = db->header.next_free_page - db->free.count;
+    ASSERT(db_put(db, (uint8_t *)"extra", 5, val, sizeof(val)) == -1 && errno == ENOBUFS,
+           "Put should fail for want of frames");
+    ASSERT(db->header.next_free_page - db->free.count == in_use, "Page lost");
+
+    for (int i = 0; i < held; i++) {
+        db_release(db, &refs[i]);
+    }
+    ASSERT(db_put(db, (uint8_t *)"extra", 5, val, sizeof(val)) == 0, "Put failed once unpinned");
+    ASSERT(db->header.next_free_page - db->free.count == in_use + 1, "Put took more than a page");
+
+    /* Nothing is left in the way of a vacuum emptying the file. */
+    struct db_stats before, after;
+    ASSERT(db_stats(db, &before) == 0, "Stats failed");
+    for (int i = 0; i < KEYS; i++) {
+        len = snprintf(key, sizeof(key), "k%d", i);
+        ASSERT(db_delete(db, (uint8_t *)key, len) == 0, "Delete failed");
+    }
+    ASSERT(db_delete(db, (uint8_t *)"extra", 5) == 0, "Delete failed");
+    ASSERT(db_vacuum(db, 0, 0) > 0, "Nothing was cut off");
+    ASSERT(db_stats(db, &after) == 0, "Stats failed");
+    ASSERT(after.file_pages < before.file_pages / 4, "File did not shrink");
+    ASSERT(db_verify(db) == 0, "Vacuum left a damaged page");
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_mmap_reads(void) {
+    TEST("Reads through the file mapping");
+
+    const char *path = "test_mmap.db";
+    unlink_db(path);
+
+    struct db *db = db_open_flags(path, DB_OPEN_MMAP);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* Enough pages to force the mapping to grow past its first region. */
+    uint8_t val[3000];
+    int n = 600;
+    for (int i = 0; i < n; i++) {
+        char key[16];
+        int len = snprintf(key, sizeof(key), "k%d", i);
+        memset(val, 'a' + i % 26, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0, "db_put failed");
+    }
+    ASSERT(db_checkpoint(db) == 0, "db_checkpoint failed");
+    db_close(db);
+
+    db = db_open_flags(path, DB_OPEN_MMAP);
+    ASSERT(db != NULL, "Failed to reopen");
+
+    struct db_ref ref;
+    ASSERT(db_get_ref(db, (uint8_t *)"k0", 2, &ref) == 0, "db_get_ref failed");
+    ASSERT(ref.val_len == 3000 && ref.val[0] == 'a', "Wrong view of k0");
+
+    /* Overwrites land in the pool and must shadow the mapped image. */
+    memset(val, 'z', sizeof(val));
+    ASSERT(db_put(db, (uint8_t *)"k1", 2, val, sizeof(val)) == 0, "db_put failed");
+    int64_t got = db_get_into(db, (uint8_t *)"k1", 2, val, sizeof(val));
+    ASSERT(got == sizeof(val) && val[0] == 'z', "Stale value from the mapping");
+
+    for (int i = n; i < 3 * n; i++) {
+        char key[16];
+        int len = snprintf(key, sizeof(key), "k%d", i);
+        memset(val, 'a' + i % 26, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)key, len, val, sizeof(val)) == 0, "db_put failed");
+    }
+    ASSERT(db_checkpoint(db) == 0, "db_checkpoint failed");
+    for (int i = 2; i < 3 * n; i++) {
+        char key[16];
+        int len = snprintf(key, sizeof(key), "k%d", i);
+        got = db_get_into(db, (uint8_t *)key, len, val, sizeof(val));
+        ASSERT(got == sizeof(val) && val[0] == 'a' + i % 26, "Wrong value");
+    }
+
+    ASSERT(ref.val[0] == 'a' && ref.val[sizeof(val) - 1] == 'a', "Ref invalidated by remap");
+    db_release(db, &ref);
+
+    ASSERT(db_open_flags(path, 0x80) == NULL && errno == EINVAL, "Unknown flag accepted");
+
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+#define STRESS_THREADS 4
+#define STRESS_KEYS 64
+#define STRESS_ROUNDS 300
+
+struct stress_arg {
+    struct db *db;
+    int id;
+    int errors;
+};
+
+/* Each writer owns a slice of keys and rewrites them with values whose
+ * bytes are all the round number; shared keys are written by everyone. */
+static void *stress_writer(void *p) {
+    struct stress_arg *a = p;
+    uint8_t val[200];
+    for (int round = 1; round <= STRESS_ROUNDS; round++) {
+        memset(val, round & 0xff, sizeof(val));
+        char key[16];
+        int len = snprintf(key, sizeof(key), "w%d-%d", a->id, round % STRESS_KEYS);
+        if (db_put(a->db, (uint8_t *)key, len, val, 50 + round % 150) != 0) a->errors++;
+        len = snprintf(key, sizeof(key), "shared%d", round % 8);
+        if (db_put(a->db, (uint8_t *)key, len, val, 100) != 0) a->errors++;
+        if (round % 50 == 0) {
+            len = snprintf(key, sizeof(key), "w%d-%d", a->id, (round + 1) % STRESS_KEYS);
+            if (db_delete(a->db, (uint8_t *)key, len) != 0 && errno != ENOENT) a->errors++;
+        }
+    }
+    return NULL;
+}
+
+/* Readers must only ever see whole values. */
+static void *stress_reader(void *p) {
+    struct stress_arg *a = p;
+    uint8_t buf[200];
+    for (int i = 0; i < STRESS_ROUNDS * 4; i++) {
+        char key[16];
+        int len = i % 2 ? snprintf(key, sizeof(key), "shared%d", i % 8)
+                        : snprintf(key, sizeof(key), "w%d-%d", i % STRESS_THREADS,
+                                   i % STRESS_KEYS);
+        int64_t n = db_get_into(a->db, (uint8_t *)key, len, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno != ENOENT) a->errors++;
+            continue;
+        }
+        for (int64_t j = 1; j < n; j++) {
+            if (buf[j] != buf[0]) {
+                a->errors++;
+                break;
+            }
+        }
+
+        struct db_ref ref;
+        if (db_get_ref(a->db, (uint8_t *)key, len, &ref) == 0) {
+            uint8_t first = ref.val[0], last = ref.val[ref.val_len - 1];
+            if (first != last) a->errors++;
+            db_release(a->db, &ref);
+        }
+        if (i % 400 == 0 && db_checkpoint(a->db) != 0) a->errors++;
+
+        if (i % 16 == 0) {
+            char names[8][16];
+            struct db_key keys[8];
+            struct db_get_result res[8];
+            uint8_t many[8 * 200];
+            for (int k = 0; k < 8; k++) {
+                keys[k].key = (uint8_t *)names[k];
+                keys[k].key_len = snprintf(names[k], sizeof(names[k]), "w%d-%d",
+                                           k % STRESS_THREADS, (i + k * 13) % STRESS_KEYS);
+            }
+            if (db_multi_get(a->db, keys, 8, many, sizeof(many), res) < 0) a->errors++;
+            for (int k = 0; k < 8; k++) {
+                if (res[k].err != 0 && res[k].err != ENOENT) a->errors++;
+                if (res[k].err == 0 && res[k].val[0] != res[k].val[res[k].val_len - 1])
+                    a->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_access(void) {
+    TEST("Concurrent readers and writers");
+
+    const char *path = "test_concurrent.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    pthread_t threads[2 * STRESS_THREADS];
+    struct stress_arg args[2 * STRESS_THREADS];
+    for (int i = 0; i < 2 * STRESS_THREADS; i++) {
+        args[i].db = db;
+        args[i].id = i % STRESS_THREADS;
+        args[i].errors = 0;
+        ASSERT(pthread_create(&threads[i], NULL,
+                              i < STRESS_THREADS ? stress_writer : stress_reader,
+                              &args[i]) == 0, "pthread_create failed");
+    }
+    int errors = 0;
+    for (int i = 0; i < 2 * STRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+    ASSERT(errors == 0, "Torn value or failed operation under concurrency");
+
+    /* Every writer's last round for a key is what survives a reopen. */
+    uint8_t buf[200];
+    int64_t n = db_get_into(db, (uint8_t *)"w0-44", 5, buf, sizeof(buf));
+    ASSERT(n == 50 + STRESS_ROUNDS % 150 && buf[0] == (STRESS_ROUNDS & 0xff),
+           "Wrong final value");
+    db_close(db);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen");
+    n = db_get_into(db, (uint8_t *)"w3-44", 5, buf, sizeof(buf));
+    ASSERT(n == 50 + STRESS_ROUNDS % 150 && buf[0] == (STRESS_ROUNDS & 0xff),
+           "Wrong value after reopen");
+    db_close(db);
+    unlink_db(path);
+
+    PASS();
+}
+
+static void fill_pattern(uint8_t *buf, size_t len, uint32_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)((i * 31 + seed) ^ (i >> 12));
+    }
+}
+
+void test_large_values(void) {
+    TEST("Large values in overflow pages");
+
+    const char *path = "test_large.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    size_t big_len = 3 * 1024 * 1024 + 123;
+    uint8_t *big = malloc(big_len);
+    uint8_t *out = malloc(big_len);
+    ASSERT(big && out, "malloc failed");
+    fill_pattern(big, big_len, 7);
+
+    ASSERT(db_put(db, (uint8_t *)"big", 3, big, big_len) == 0, "Large put failed");
+    ASSERT(db_put(db, (uint8_t *)"small", 5, (uint8_t *)"tiny", 4) == 0, "db_put failed");
+
+    uint32_t val_len;
+    uint8_t *val = db_get(db, (uint8_t *)"big", 3, &val_len);
+    ASSERT(val && val_len == big_len && memcmp(val, big, big_len) == 0, "Large get mismatch");
+    free(val);
+
+    /* Ranges straddling page boundaries read only what they cover. */
+    uint8_t part[10000];
+    int64_t n = db_get_range(db, (uint8_t *)"big", 3, 4000, part, sizeof(part));
+    ASSERT(n == sizeof(part) && memcmp(part, big + 4000, sizeof(part)) == 0, "Range mismatch");
+    n = db_get_range(db, (uint8_t *)"big", 3, big_len - 100, part, sizeof(part));
+    ASSERT(n == 100 && memcmp(part, big + big_len - 100, 100) == 0, "Tail range mismatch");
+    n = db_get_range(db, (uint8_t *)"big", 3, big_len + 5, part, sizeof(part));
+    ASSERT(n == 0, "Range past the end should be empty");
+    n = db_get_range(db, (uint8_t *)"small", 5, 1, part, 2);
+    ASSERT(n == 2 && memcmp(part, "in", 2) == 0, "Inline range mismatch");
+
+    n = db_get_into(db, (uint8_t *)"big", 3, part, 5000);
+    ASSERT(n == (int64_t)big_len && memcmp(part, big, 5000) == 0, "Truncated get_into mismatch");
+
+    struct db_ref ref;
+    ASSERT(db_get_ref(db, (uint8_t *)"big", 3, &ref) == -1 && errno == EFBIG,
+           "Overflow values cannot be referenced");
+
+    /* Shrinking a value frees its extent for reuse as data pages. */
+    ASSERT(db_put(db, (uint8_t *)"big", 3, (uint8_t *)"now small", 9) == 0, "Shrink failed");
+    val = db_get(db, (uint8_t *)"big", 3, &val_len);
+    ASSERT(val && val_len == 9 && memcmp(val, "now small", 9) == 0, "Shrunk value mismatch");
+    free(val);
+    uint64_t per_page = OVERFLOW_PAGE_DATA(db->page_size);
+    ASSERT(db->free.count >= (big_len + per_page - 1) / per_page, "Extent pages not freed");
+
+    /* A new extent takes a run of the freed pages instead of growing. */
+    uint64_t pages = db->header.next_free_page;
+    fill_pattern(big, big_len, 11);
+    ASSERT(db_put(db, (uint8_t *)"big", 3, big, 20000) == 0, "Regrow failed");
+    ASSERT(db->header.next_free_page == pages, "Extent did not reuse free pages");
+    db_close(db);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to reopen");
+    n = db_get_into(db, (uint8_t *)"big", 3, out, big_len);
+    ASSERT(n == 20000 && memcmp(out, big, 20000) == 0, "Large value lost on reopen");
+    db_close(db);
+    unlink_db(path);
+
+    /* An extent whose write fails goes back to the free map. The file size
+     * limit stops writes past the current end, which the log stays under. */
+    db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    for (int i = 0; i < 600; i++) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "fill%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, klen, big, 1000) == 0, "Fill put failed");
+    }
+    ASSERT(db_checkpoint(db) == 0, "db_checkpoint failed");
+    struct stat st;
+    ASSERT(stat(path, &st) == 0, "stat failed");
+    uint64_t free_before = db->free.count;
+    struct rlimit old_limit, limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = st.st_size;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    int put_ret = db_put(db, (uint8_t *)"doomed", 6, big, 200000);
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, SIG_DFL);
+    ASSERT(put_ret == -1, "Put past the file size limit should fail");
+    ASSERT(db->free.count >= free_before + (200000 + per_page - 1) / per_page,
+           "Failed extent was not freed");
+    db_close(db);
+
+    free(big);
+    free(out);
+    unlink_db(path);
+
+    PASS();
+}
+
+void test_large_value_crash(void) {
+    TEST("Large values survive a crash and rescan");
+
+    const char *path = "test_large_crash.db";
+    unlink_db(path);
+
+    size_t len = 100000;
+    uint8_t *big = malloc(len);
+    ASSERT(big != NULL, "malloc failed");
+
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        struct db *db = db_open(path);
+        if (!db) _exit(1);
+        for (uint32_t i = 0; i < 4; i++) {
+            char key[8];
+            int klen = snprintf(key, sizeof(key), "b%u", i);
+            fill_pattern(big, len, i);
+            if (db_put(db, (uint8_t *)key, klen, big, len) != 0) _exit(1);
+        }
+        if (db_delete(db, (uint8_t *)"b1", 2) != 0) _exit(1);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to recover");
+    uint8_t *out = malloc(len);
+    for (uint32_t i = 0; i < 4; i++) {
+        char key[8];
+        int klen = snprintf(key, sizeof(key), "b%u", i);
+        int64_t n = db_get_into(db, (uint8_t *)key, klen, out, len);
+        if (i == 1) {
+            ASSERT(n == -1 && errno == ENOENT, "Deleted value came back");
+            continue;
+        }
+        fill_pattern(big, len, i);
+        ASSERT(n == (int64_t)len && memcmp(out, big, len) == 0, "Large value lost in crash");
+    }
+    db_close(db);
+
+    free(big);
+    free(out);
+    unlink_db(path);
+
+    PASS();
+}
+
+/* Walks an iterator to the end, checking keys come in strictly increasing
+ * order with the values they were written with. Returns the count, or -1. */
+static int iter_count(struct db *db, const char *from, const char *prefix) {
+    struct db_iter *it = db_iter_seek(db, (const uint8_t *)from,
+                                      from ? strlen(from) : 0);
+    if (!it) return -1;
+
+    char prev[32] = "";
+    int count = 0;
+    const uint8_t *key, *val;
+    uint32_t key_len, val_len;
+    int r;
+    while ((r = db_iter_next(it, &key, &key_len, &val, &val_len)) == 1) {
+        char k[32];
+        snprintf(k, sizeof(k), "%.*s", (int)key_len, (const char *)key);
+        if (prefix && strncmp(k, prefix, strlen(prefix)) != 0) break;
+        if (count > 0 && strcmp(prev, k) >= 0) { count = -1; break; }
+        if (val_len != key_len || memcmp(val, key, key_len) != 0) { count = -1; break; }
+        strcpy(prev, k);
+        count++;
+    }
+    db_iter_close(it);
+    return r < 0 ? -1 : count;
+}
+
+void test_multi_get(void) {
+    TEST("Multi-get packs values in key order");
+
+    const char *path = "test_multi_get.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    enum { KEYS = 300, VAL = 500 };
+    char names[KEYS + 1][16];
+    uint8_t val[VAL];
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(names[i], sizeof(names[i]), "mg-%d", i);
+        fill_pattern(val, VAL, i);
+        ASSERT(db_put(db, (uint8_t *)names[i], strlen(names[i]), val, VAL) == 0,
+               "db_put failed");
+    }
+    uint8_t *big = malloc(50000);
+    fill_pattern(big, 50000, 99);
+    ASSERT(db_put(db, (uint8_t *)"mg-big", 6, big, 50000) == 0, "Large put failed");
+    db_close(db);
+
+    /* Cold pool, keys in scrambled order, one missing and one large. */
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen failed");
+    struct db_key keys[KEYS + 2];
+    struct db_get_result results[KEYS + 2];
+    for (int i = 0; i < KEYS; i++) {
+        int k = (i * 7) % KEYS;
+        keys[i].key = (uint8_t *)names[k];
+        keys[i].key_len = strlen(names[k]);
+    }
+    keys[KEYS].key = (uint8_t *)"mg-missing";
+    keys[KEYS].key_len = 10;
+    keys[KEYS + 1].key = (uint8_t *)"mg-big";
+    keys[KEYS + 1].key_len = 6;
+
+    size_t cap = (size_t)KEYS * VAL + 50000;
+    uint8_t *buf = malloc(cap);
+    ASSERT(db_multi_get(db, keys, KEYS + 2, buf, cap, results) == KEYS + 1,
+           "Wrong number of values");
+    for (int i = 0; i < KEYS; i++) {
+        fill_pattern(val, VAL, (i * 7) % KEYS);
+        ASSERT(results[i].err == 0 && results[i].val == buf + (size_t)i * VAL &&
+               results[i].val_len == VAL && memcmp(results[i].val, val, VAL) == 0,
+               "Multi-get value mismatch");
+    }
+    ASSERT(results[KEYS].err == ENOENT && results[KEYS].val == NULL, "Missing key not reported");
+    ASSERT(results[KEYS + 1].err == 0 && results[KEYS + 1].val_len == 50000 &&
+           memcmp(results[KEYS + 1].val, big, 50000) == 0, "Large value mismatch");
+
+    /* Values that do not fit are reported with their length. */
+    ASSERT(db_multi_get(db, keys, 3, buf, VAL * 2 + 10, results) == 2, "Expected two to fit");
+    ASSERT(results[2].err == ENOBUFS && results[2].val_len == VAL, "Overflowing value not reported");
+
+    db_close(db);
+    free(buf);
+    free(big);
+    unlink_db(path);
+    PASS();
+}
+
+void test_async_io(void) {
+    TEST("Async gets and puts through a completion queue");
+
+    const char *path = "test_async.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    enum { KEYS = 200, VAL = 300, DEPTH = 32 };
+    char names[KEYS][16];
+    uint8_t val[VAL];
+    struct db_aio *q = db_aio_open(db, DEPTH);
+    ASSERT(q != NULL, "db_aio_open failed");
+
+    /* Puts are held until the wait and completed together. */
+    uint8_t vals[DEPTH][VAL];
+    struct db_completion done[DEPTH];
+    for (int i = 0; i < KEYS; i += DEPTH) {
+        int n = KEYS - i < DEPTH ? KEYS - i : DEPTH;
+        for (int j = 0; j < n; j++) {
+            snprintf(names[i + j], sizeof(names[i + j]), "aio-%d", i + j);
+            fill_pattern(vals[j], VAL, i + j);
+            ASSERT(db_put_async(q, (uint8_t *)names[i + j], strlen(names[i + j]),
+                                vals[j], VAL, NULL) == 0, "db_put_async failed");
+        }
+        ASSERT(db_aio_wait(q, done, DEPTH, n) == n, "Puts not completed");
+        for (int j = 0; j < n; j++) {
+            ASSERT(done[j].result == 0 && done[j].err == 0, "Put failed");
+        }
+    }
+    uint8_t *big = malloc(30000);
+    fill_pattern(big, 30000, 7);
+    ASSERT(db_put(db, (uint8_t *)"aio-big", 7, big, 30000) == 0, "Large put failed");
+    db_aio_close(q);
+    db_close(db);
+
+    /* Cold pool: the gets go to the file, with a missing and a large key. */
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen failed");
+    q = db_aio_open(db, DEPTH);
+    ASSERT(q != NULL, "db_aio_open failed");
+    uint8_t (*out)[VAL] = malloc(sizeof(uint8_t[KEYS][VAL]));
+    uint8_t *big_out = malloc(30000);
+    int seen[KEYS + 2] = {0};
+    int next = 0, pending = 0;
+    while (next < KEYS + 2 || pending > 0) {
+        while (next < KEYS + 2 && pending < DEPTH) {
+            int r;
+            if (next < KEYS) {
+                r = db_get_async(q, (uint8_t *)names[next], strlen(names[next]),
+                                 out[next], VAL, &seen[next]);
+            } else if (next == KEYS) {
+                r = db_get_async(q, (uint8_t *)"aio-none", 8, NULL, 0, &seen[next]);
+            } else {
+                r = db_get_async(q, (uint8_t *)"aio-big", 7, big_out, 30000, &seen[next]);
+            }
+            ASSERT(r == 0, "db_get_async failed");
+            next++;
+            pending++;
+        }
+        ASSERT(pending < DEPTH ||
+               (db_get_async(q, (uint8_t *)"aio-0", 5, val, VAL, NULL) == -1 &&
+                errno == EBUSY), "Full queue accepted a request");
+
+        int n = db_aio_wait(q, done, DEPTH, 1);
+        ASSERT(n > 0, "Nothing completed");
+        for (int j = 0; j < n; j++) {
+            int k = (int *)done[j].user - seen;
+            seen[k]++;
+            if (k < KEYS) {
+                fill_pattern(val, VAL, k);
+                ASSERT(done[j].result == VAL && memcmp(out[k], val, VAL) == 0,
+                       "Async value mismatch");
+            } else if (k == KEYS) {
+                ASSERT(done[j].result == -1 && done[j].err == ENOENT,
+                       "Missing key not reported");
+            } else {
+                ASSERT(done[j].result == 30000 && memcmp(big_out, big, 30000) == 0,
+                       "Large value mismatch");
+            }
+        }
+        pending -= n;
+    }
+    for (int k = 0; k < KEYS + 2; k++) {
+        ASSERT(seen[k] == 1, "Request not completed exactly once");
+    }
+    ASSERT(db_aio_wait(q, done, DEPTH, 1) == 0, "Spurious completion");
+
+    db_aio_close(q);
+    db_close(db);
+    free(out);
+    free(big_out);
+    free(big);
+    unlink_db(path);
+    PASS();
+}
+
+struct direct_reader_arg {
+    struct db *db;
+    const uint8_t *want;
+    uint32_t len;
+    int ok;
+};
+
+static void *direct_reader(void *p) {
+    struct direct_reader_arg *a = p;
+    uint8_t *out = malloc(a->len);
+    a->ok = out != NULL;
+    for (int i = 0; i < 20 && a->ok; i++) {
+        a->ok = db_get_into(a->db, (uint8_t *)"dio-big", 7, out, a->len) == a->len &&
+                memcmp(out, a->want, a->len) == 0;
+    }
+    free(out);
+    return NULL;
+}
+
+void test_direct_io(void) {
+    TEST("O_DIRECT data file");
+
+    const char *path = "test_direct.db";
+    unlink_db(path);
+
+    ASSERT(db_open_flags(path, DB_OPEN_DIRECT | DB_OPEN_MMAP) == NULL && errno == EINVAL,
+           "DB_OPEN_DIRECT with DB_OPEN_MMAP accepted");
+
+    struct db *db = db_open_flags(path, DB_OPEN_DIRECT | DB_OPEN_ORDERED);
+    ASSERT(db != NULL, "Failed to open database");
+
+    enum { KEYS = 500, VAL = 200, BIG = 70000 };
+    uint8_t val[VAL], out[VAL];
+    for (int i = 0; i < KEYS; i++) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "dio-%d", i);
+        fill_pattern(val, VAL, i);
+        ASSERT(db_put(db, (uint8_t *)key, klen, val, VAL) == 0, "db_put failed");
+    }
+    uint8_t *big = malloc(BIG), *big_out = malloc(BIG + 1);
+    fill_pattern(big, BIG, 3);
+    ASSERT(db_put(db, (uint8_t *)"dio-big", 7, big, BIG) == 0, "Large put failed");
+    ASSERT(db_checkpoint(db) == 0, "Checkpoint failed");
+    db_close(db);
+
+    /* Reads come back through the aligned paths, including an unaligned
+     * buffer and a range that starts and ends inside overflow pages. */
+    db = db_open_flags(path, DB_OPEN_DIRECT | DB_OPEN_ORDERED);
+    ASSERT(db != NULL, "Reopen failed");
+    for (int i = 0; i < KEYS; i++) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "dio-%d", i);
+        fill_pattern(val, VAL, i);
+        ASSERT(db_get_into(db, (uint8_t *)key, klen, out, VAL) == VAL &&
+               memcmp(out, val, VAL) == 0, "Value mismatch after reopen");
+    }
+    ASSERT(db_get_into(db, (uint8_t *)"dio-big", 7, big_out + 1, BIG) == BIG &&
+           memcmp(big_out + 1, big, BIG) == 0, "Large value mismatch");
+    ASSERT(db_get_range(db, (uint8_t *)"dio-big", 7, 5000, big_out, 10000) == 10000 &&
+           memcmp(big_out, big + 5000, 10000) == 0, "Range mismatch");
+    ASSERT(db_verify(db) == 0, "Direct file reported damage");
+
+    /* More concurrent large reads than there are staging buffers take
+     * turns with them. */
+    pthread_t readers[OVERFLOW_STAGE_BUFS * 2];
+    struct direct_reader_arg args[OVERFLOW_STAGE_BUFS * 2];
+    for (int i = 0; i < OVERFLOW_STAGE_BUFS * 2; i++) {
+        args[i] = (struct direct_reader_arg){ db, big, BIG, 0 };
+        ASSERT(pthread_create(&readers[i], NULL, direct_reader, &args[i]) == 0,
+               "pthread_create failed");
+    }
+    int readers_ok = 1;
+    for (int i = 0; i < OVERFLOW_STAGE_BUFS * 2; i++) {
+        pthread_join(readers[i], NULL);
+        readers_ok &= args[i].ok;
+    }
+    ASSERT(readers_ok, "Concurrent large reads mismatched");
+    ASSERT(db_delete(db, (uint8_t *)"dio-0", 5) == 0, "Delete failed");
+    db_close(db);
+
+    /* The file is an ordinary one opened without the flag. */
+    db = db_open_flags(path, DB_OPEN_ORDERED);
+    ASSERT(db != NULL, "Buffered reopen failed");
+    uint32_t len;
+    ASSERT(db_get(db, (uint8_t *)"dio-0", 5, &len) == NULL && errno == ENOENT,
+           "Deleted key came back");
+    ASSERT(db_get_into(db, (uint8_t *)"dio-big", 7, big_out, BIG) == BIG &&
+           memcmp(big_out, big, BIG) == 0, "Large value mismatch when buffered");
+    db_close(db);
+
+    free(big);
+    free(big_out);
+    unlink_db(path);
+    PASS();
+}
+
+struct trace_counts {
+    int events[DB_OPS];
+    int enoent;
+};
+
+static void count_event(void *ctx, const struct db_trace_event *ev) {
+    struct trace_counts *c = ctx;
+    c->events[ev->op]++;
+    if (ev->err == ENOENT) {
+        c->enoent++;
+    }
+}
+
+void test_stats(void) {
+    TEST("Runtime statistics and trace hook");
+
+    const char *path = "test_stats.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    struct trace_counts counts;
+    memset(&counts, 0, sizeof(counts));
+    db_set_trace(db, count_event, &counts);
+
+    uint8_t val[300], out[300];
+    memset(val, 'v', sizeof(val));
+    for (int i = 0; i < 100; i++) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "st-%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, klen, val, sizeof(val)) == 0, "db_put failed");
+        ASSERT(db_get_into(db, (uint8_t *)key, klen, out, sizeof(out)) == sizeof(val),
+               "db_get_into failed");
+    }
+    for (int i = 0; i < 10; i++) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "st-%d", i);
+        ASSERT(db_delete(db, (uint8_t *)key, klen) == 0, "db_delete failed");
+    }
+    ASSERT(db_get_into(db, (uint8_t *)"st-0", 4, out, sizeof(out)) == -1 && errno == ENOENT,
+           "Deleted key found");
+
+    struct db_stats st;
+    ASSERT(db_stats(db, &st) == 0, "db_stats failed");
+    ASSERT(st.latency[DB_OP_PUT].count == 100 && st.latency[DB_OP_GET].count == 101 &&
+           st.latency[DB_OP_DELETE].count == 10 && st.latency[DB_OP_ALLOC_PAGE].count > 0,
+           "Wrong op counts");
+    uint64_t sum = 0;
+    for (int b = 0; b < DB_HIST_BUCKETS; b++) {
+        sum += st.latency[DB_OP_PUT].buckets[b];
+    }
+    ASSERT(sum == 100 && st.latency[DB_OP_PUT].total_ns > 0, "Histogram does not add up");
+    ASSERT(counts.events[DB_OP_PUT] == 100 && counts.events[DB_OP_GET] == 101 &&
+           counts.events[DB_OP_DELETE] == 10 && counts.enoent == 1 &&
+           (uint64_t)counts.events[DB_OP_ALLOC_PAGE] == st.latency[DB_OP_ALLOC_PAGE].count,
+           "Trace events do not match the stats");
+    ASSERT(st.keys == 90 && st.wal_syncs > 0 && st.wal_writes > 0 &&
+           st.wal_write_bytes > 100 * sizeof(val) && st.file_pages > 1,
+           "Wrong counters");
+    db_set_trace(db, NULL, NULL);
+    db_close(db);
+
+    /* A cold pool reads the pages back; removing the snapshot forces a scan. */
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen failed");
+    ASSERT(db_get_into(db, (uint8_t *)"st-50", 5, out, sizeof(out)) == sizeof(val),
+           "db_get_into failed after reopen");
+    ASSERT(db_stats(db, &st) == 0, "db_stats failed");
+    ASSERT(st.pool_misses > 0 && st.reads > 0 && st.read_bytes >= DEFAULT_PAGE_SIZE &&
+           st.open_ns > 0 && st.recovery_ns <= st.open_ns && !st.recovery_scanned,
+           "Wrong counters after reopen");
+    db_close(db);
+    unlink("test_stats.db.idx");
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen without snapshot failed");
+    ASSERT(db_stats(db, &st) == 0 && st.recovery_scanned && st.keys == 90,
+           "Scan not reported");
+    db_close(db);
+
+    unlink_db(path);
+    PASS();
+}
+
+/* A record-like value: mostly fixed text, so it compresses well. */
+static int fill_record(uint8_t *buf, int len, int i) {
+    int n = 0;
+    while (n < len) {
+        char part[64];
+        int m = snprintf(part, sizeof(part), "{\"id\":%d,\"name\":\"user\",\"city\":\"x\"} ", i);
+        memcpy(buf + n, part, m < len - n ? m : len - n);
+        n += m;
+    }
+    return len;
+}
+
+static uint64_t fill_db_pages(const char *path, int flags) {
+    unlink_db(path);
+    struct db *db = db_open_flags(path, flags);
+    if (!db) {
+        return 0;
+    }
+    uint8_t val[400];
+    for (int i = 0; i < 500; i++) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "cz-%d", i);
+        fill_record(val, sizeof(val), i);
+        db_put(db, (uint8_t *)key, klen, val, sizeof(val));
+    }
+    struct db_stats st;
+    db_stats(db, &st);
+    db_close(db);
+    return st.file_pages;
+}
+
+void test_compression(void) {
+    TEST("Value compression");
+
+    const char *path = "test_compress.db";
+    ASSERT(db_open_flags(path, DB_OPEN_COMPRESS | DB_OPEN_LOG) == NULL && errno == EINVAL,
+           "DB_OPEN_COMPRESS with DB_OPEN_LOG accepted");
+
+    uint64_t plain = fill_db_pages(path, 0);
+    uint64_t packed = fill_db_pages(path, DB_OPEN_COMPRESS);
+    ASSERT(plain > 0 && packed > 0 && packed * 2 < plain, "Compression saved no pages");
+
+    struct db *db = db_open_flags(path, DB_OPEN_COMPRESS);
+    ASSERT(db != NULL, "Failed to open database");
+    uint8_t val[400], out[400];
+    fill_record(val, sizeof(val), 7);
+    ASSERT(db_get_into(db, (uint8_t *)"cz-7", 4, out, sizeof(out)) == sizeof(val) &&
+           memcmp(out, val, sizeof(val)) == 0, "Value mismatch");
+    ASSERT(db_get_into(db, (uint8_t *)"cz-7", 4, out, 50) == sizeof(val) &&
+           memcmp(out, val, 50) == 0, "Partial get mismatch");
+    ASSERT(db_get_range(db, (uint8_t *)"cz-7", 4, 123, out, 200) == 200 &&
+           memcmp(out, val + 123, 200) == 0, "Range mismatch");
+    struct db_ref ref;
+    ASSERT(db_get_ref(db, (uint8_t *)"cz-7", 4, &ref) == -1 && errno == EFBIG,
+           "Ref to a compressed value");
+
+    /* A large value that compresses stays inline; random bytes do not
+     * compress and are stored as they are. */
+    enum { BIG = COMPRESS_MAX_VALUE };
+    uint8_t *big = malloc(BIG), *big_out = malloc(BIG);
+    fill_record(big, BIG, 1);
+    ASSERT(db_put(db, (uint8_t *)"cz-big", 6, big, BIG) == 0, "Large put failed");
+    uint32_t x = 9;
+    for (size_t i = 0; i < sizeof(val); i++) {
+        x = x * 1103515245 + 12345;
+        val[i] = (uint8_t)(x >> 16);
+    }
+    ASSERT(db_put(db, (uint8_t *)"cz-raw", 6, val, sizeof(val)) == 0, "Raw put failed");
+    ASSERT(db_get_ref(db, (uint8_t *)"cz-raw", 6, &ref) == 0 && ref.val_len == sizeof(val),
+           "Raw value compressed");
+    db_release(db, &ref);
+
+    /* Short values only compress against the dictionary. */
+    char sample[2048];
+    int sample_len = 0;
+    for (int i = 0; i < 40; i++) {
+        sample_len += snprintf(sample + sample_len, sizeof(sample) - sample_len,
+                               "{\"kind\":\"session\",\"state\":\"active\",\"n\":%d}", i);
+    }
+    ASSERT(db_set_dictionary(db, sample, sample_len) == 0, "db_set_dictionary failed");
+    ASSERT(db_set_dictionary(db, sample, sample_len) == -1 && errno == EEXIST,
+           "Dictionary set twice");
+    const char *small = "{\"kind\":\"session\",\"state\":\"active\",\"n\":123456}";
+    ASSERT(db_put(db, (uint8_t *)"cz-dict", 7, (const uint8_t *)small, strlen(small)) == 0,
+           "Dictionary put failed");
+    /* A match starting in the dictionary's tail runs on into the value. */
+    char tail[128];
+    int tail_len = snprintf(tail, sizeof(tail), "%.*s%.*s%.*s", 24, sample + sample_len - 24,
+                            24, sample + sample_len - 24, 24, sample + sample_len - 24);
+    ASSERT(db_put(db, (uint8_t *)"cz-tail", 7, (const uint8_t *)tail, tail_len) == 0,
+           "Dictionary put failed");
+    db_close(db);
+
+    /* The dictionary survives a reopen without the flag and a scan. */
+    for (int pass = 0; pass < 2; pass++) {
+        db = db_open(path);
+        ASSERT(db != NULL, "Reopen failed");
+        ASSERT(db_get_into(db, (uint8_t *)"cz-big", 6, big_out, BIG) == BIG &&
+               memcmp(big_out, big, BIG) == 0, "Large value mismatch");
+        ASSERT(db_get_into(db, (uint8_t *)"cz-dict", 7, out, sizeof(out)) == (int64_t)strlen(small) &&
+               memcmp(out, small, strlen(small)) == 0, "Dictionary value mismatch");
+        ASSERT(db_get_ref(db, (uint8_t *)"cz-dict", 7, &ref) == -1 && errno == EFBIG,
+               "Dictionary value stored raw");
+        ASSERT(db_get_into(db, (uint8_t *)"cz-tail", 7, out, sizeof(out)) == tail_len &&
+               memcmp(out, tail, tail_len) == 0 &&
+               db_get_ref(db, (uint8_t *)"cz-tail", 7, &ref) == -1 && errno == EFBIG,
+               "Value matching past the dictionary mismatch");
+        fill_record(val, sizeof(val), 499);
+        ASSERT(db_get_into(db, (uint8_t *)"cz-499", 6, out, sizeof(out)) == sizeof(val) &&
+               memcmp(out, val, sizeof(val)) == 0, "Value mismatch after reopen");
+        ASSERT(db_verify(db) == 0, "Compressed file reported damage");
+        db_close(db);
+        unlink("test_compress.db.idx");
+    }
+
+    free(big);
+    free(big_out);
+    unlink_db(path);
+    PASS();
+}
+
+/* Keys that a multiply-by-33 hash cannot tell apart: "ci-" and four of
+ * "Aa" or "B@". */
+static int colliding_key(char *buf, int i) {
+    int n = snprintf(buf, 16, "ci-");
+    for (int b = 0; b < 4; b++) {
+        n += snprintf(buf + n, 16 - n, "%s", (i >> b) & 1 ? "B@" : "Aa");
+    }
+    return n;
+}
+
+void test_compact_index(void) {
+    TEST("Compact index without keys in memory");
+
+    const char *path = "test_compact.db";
+    unlink_db(path);
+    ASSERT(db_open_flags(path, DB_OPEN_COMPACT_INDEX | DB_OPEN_ORDERED) == NULL &&
+           errno == EINVAL, "DB_OPEN_COMPACT_INDEX with DB_OPEN_ORDERED accepted");
+
+    struct db *db = db_open_flags(path, DB_OPEN_COMPACT_INDEX);
+    ASSERT(db != NULL, "Failed to open database");
+    /* Enough keys that the tables are past their initial size. */
+    enum { KEYS = 40000, BATCH = 500, COLLIDE = 10 };
+    static char keys[BATCH][80];
+    static uint8_t vals[BATCH][32];
+    struct db_batch_op ops[BATCH];
+    for (int i = 0; i < KEYS; i += BATCH) {
+        for (int j = 0; j < BATCH; j++) {
+            ops[j].type = DB_BATCH_PUT;
+            ops[j].key = (uint8_t *)keys[j];
+            ops[j].key_len = snprintf(keys[j], sizeof(keys[j]), "compact-index-key-%060d", i + j);
+            memset(vals[j], (i + j) & 0xff, sizeof(vals[j]));
+            ops[j].val = vals[j];
+            ops[j].val_len = sizeof(vals[j]);
+        }
+        ASSERT(db_write_batch(db, ops, BATCH) == 0, "db_write_batch failed");
+    }
+    char key[80];
+    uint8_t val[32], out[32];
+    for (int i = 0; i < COLLIDE; i++) {
+        int klen = colliding_key(key, i);
+        memset(val, 'a' + i, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)key, klen, val, sizeof(val)) == 0,
+               "Alike put failed");
+    }
+    struct db_stats st;
+    ASSERT(db_stats(db, &st) == 0 && st.keys == KEYS + COLLIDE, "Wrong key count");
+    ASSERT(st.index_bytes / st.keys < 32, "Compact index too large");
+
+    /* Every key of the group is found, and one never put is not. */
+    for (int i = 0; i < COLLIDE; i++) {
+        int klen = colliding_key(key, i);
+        ASSERT(db_get_into(db, (uint8_t *)key, klen, out, sizeof(out)) == sizeof(out) &&
+               out[0] == 'a' + i, "Alike key mismatch");
+    }
+    int klen = colliding_key(key, COLLIDE);
+    ASSERT(db_get_into(db, (uint8_t *)key, klen, out, sizeof(out)) == -1 && errno == ENOENT,
+           "Absent alike key found");
+    ASSERT(db_delete(db, (uint8_t *)key, klen) == -1 && errno == ENOENT,
+           "Absent alike key deleted");
+    klen = colliding_key(key, 3);
+    ASSERT(db_delete(db, (uint8_t *)key, klen) == 0, "Alike delete failed");
+    memset(val, 'z', sizeof(val));
+    klen = colliding_key(key, 4);
+    ASSERT(db_put(db, (uint8_t *)key, klen, val, sizeof(val)) == 0, "Alike overwrite failed");
+    db_close(db);
+
+    /* The snapshot holds no keys; without it the pages are scanned. */
+    for (int pass = 0; pass < 2; pass++) {
+        db = db_open_flags(path, DB_OPEN_COMPACT_INDEX);
+        ASSERT(db != NULL, "Reopen failed");
+        ASSERT(db_stats(db, &st) == 0 && st.keys == KEYS + COLLIDE - 1 &&
+               st.recovery_scanned == pass, "Wrong key count after reopen");
+        ASSERT(db_get_into(db, (uint8_t *)"compact-index-key-missing", 25, out,
+                           sizeof(out)) == -1 && errno == ENOENT, "Missing key found");
+        struct db_stats after;
+        ASSERT(db_stats(db, &after) == 0 && after.reads == st.reads &&
+               after.pool_misses == st.pool_misses, "A miss read the file");
+
+        klen = snprintf(key, sizeof(key), "compact-index-key-%060d", 1234);
+        ASSERT(db_get_into(db, (uint8_t *)key, klen, out, sizeof(out)) == sizeof(out) &&
+               out[0] == (1234 & 0xff), "Value mismatch after reopen");
+        klen = colliding_key(key, 3);
+        ASSERT(db_get_into(db, (uint8_t *)key, klen, out, sizeof(out)) == -1 && errno == ENOENT,
+               "Deleted alike key found");
+        klen = colliding_key(key, 4);
+        ASSERT(db_get_into(db, (uint8_t *)key, klen, out, sizeof(out)) == sizeof(out) &&
+               out[0] == 'z', "Overwritten alike key mismatch");
+        db_close(db);
+        unlink("test_compact.db.idx");
+    }
+
+    /* A full index opens the same file, scanning past the keyless snapshot. */
+    db = db_open_flags(path, DB_OPEN_COMPACT_INDEX);
+    ASSERT(db != NULL, "Reopen failed");
+    db_close(db);
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen with a full index failed");
+    ASSERT(db_stats(db, &st) == 0 && st.keys == KEYS + COLLIDE - 1 && st.recovery_scanned &&
+           st.index_bytes / st.keys > 80, "Full index wrong");
+    db_close(db);
+
+    unlink_db(path);
+    PASS();
+}
+
+void test_key_hash(void) {
+    TEST("Seeded key hash");
+
+    /* Each new file draws its own seed and keeps it. */
+    const char *paths[2] = {"test_hash_a.db", "test_hash_b.db"};
+    uint64_t seeds[2];
+    for (int i = 0; i < 2; i++) {
+        unlink_db(paths[i]);
+        struct db *db = db_open(paths[i]);
+        ASSERT(db != NULL, "Failed to open database");
+        db_close(db);
+        int fd = open(paths[i], O_RDONLY);
+        ASSERT(fd >= 0 && pread(fd, &seeds[i], sizeof(seeds[i]),
+                                offsetof(struct db_header, hash_seed)) == sizeof(seeds[i]),
+               "Failed to read the header");
+        close(fd);
+    }
+    ASSERT(seeds[0] != seeds[1], "Files share a seed");
+
+    /* Keys alike but for a counter, and keys a multiply-by-33 hash maps to
+     * one value, spread over the table. */
+    struct db *db = db_open(paths[0]);
+    ASSERT(db != NULL, "Reopen failed");
+    enum { KEYS = 4096, BATCH = 256 };
+    static char keys[BATCH][48];
+    struct db_batch_op ops[BATCH];
+    uint8_t val[8] = "value";
+    for (int i = 0; i < KEYS; i += BATCH) {
+        for (int j = 0; j < BATCH; j++) {
+            int n = i + j, len = 0;
+            if (n < KEYS / 2) {
+                len = snprintf(keys[j], sizeof(keys[j]), "tenant/0001/user/%08d", n);
+            } else {
+                len = snprintf(keys[j], sizeof(keys[j]), "h-");
+                for (int b = 0; b < 11; b++) {
+                    len += snprintf(keys[j] + len, sizeof(keys[j]) - len, "%s",
+                                    (n >> b) & 1 ? "B@" : "Aa");
+                }
+            }
+            ops[j].type = DB_BATCH_PUT;
+            ops[j].key = (uint8_t *)keys[j];
+            ops[j].key_len = len;
+            ops[j].val = val;
+            ops[j].val_len = sizeof(val);
+        }
+        ASSERT(db_write_batch(db, ops, BATCH) == 0, "db_write_batch failed");
+    }
+    struct db_stats st;
+    ASSERT(db_stats(db, &st) == 0 && st.keys == KEYS, "Wrong key count");
+    ASSERT(st.index_probe_total < 2 * st.keys && st.index_max_probe < 32,
+           "Keys cluster in the index");
+    db_close(db);
+
+    /* The stored seed finds them again, by snapshot and by scan. */
+    for (int pass = 0; pass < 2; pass++) {
+        db = db_open(paths[0]);
+        ASSERT(db != NULL, "Reopen failed");
+        uint8_t out[8];
+        ASSERT(db_get_into(db, (uint8_t *)keys[BATCH - 1], ops[BATCH - 1].key_len,
+                           out, sizeof(out)) == sizeof(val) &&
+               db_get_into(db, (uint8_t *)"tenant/0001/user/00000007", 25,
+                           out, sizeof(out)) == sizeof(val), "Key lost after reopen");
+        db_close(db);
+        unlink("test_hash_a.db.idx");
+    }
+
+    unlink_db(paths[0]);
+    unlink_db(paths[1]);
+    PASS();
+}
+
+struct snapshot_arg {
+    struct db *db;
+    int rounds;
+    int errors;
+};
+
+/* Writes a and b to the same round number, always in one batch. */
+static void *snapshot_writer(void *arg) {
+    struct snapshot_arg *a = arg;
+    for (int i = 1; i <= a->rounds; i++) {
+        uint8_t val[64];
+        memset(val, i & 0xff, sizeof(val));
+        struct db_batch_op ops[2] = {
+            {DB_BATCH_PUT, (uint8_t *)"pair-a", 6, val, sizeof(val)},
+            {DB_BATCH_PUT, (uint8_t *)"pair-b", 6, val, sizeof(val)},
+        };
+        if (db_write_batch(a->db, ops, 2) != 0) a->errors++;
+    }
+    return NULL;
+}
+
+/* Takes snapshots and checks each sees a and b at the same round; errors
+ * counts torn or moving reads. */
+static void *snapshot_reader(void *arg) {
+    struct snapshot_arg *a = arg;
+    for (int round = 0; round < a->rounds; round++) {
+        struct db_snapshot *s = db_snapshot_create(a->db);
+        if (!s) {
+            a->errors++;
+            continue;
+        }
+        int64_t first = -1;
+        for (int i = 0; i < 50; i++) {
+            uint8_t x[64], y[64];
+            int64_t nx = db_get_at(s, (uint8_t *)"pair-a", 6, x, sizeof(x));
+            int64_t ny = db_get_at(s, (uint8_t *)"pair-b", 6, y, sizeof(y));
+            if (nx != ny || (nx > 0 && (x[0] != y[0] || (first >= 0 && x[0] != first))))
+                a->errors++;
+            if (nx > 0) first = x[0];
+        }
+        db_snapshot_release(s);
+    }
+    return NULL;
+}
+
+void test_snapshots(void) {
+    TEST("Snapshot reads");
+
+    const char *path = "test_snapshot.db";
+    unlink_db(path);
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    enum { KEYS = 200 };
+    static uint8_t big[3 * 4096];
+    char key[16], val[32];
+    for (int i = 0; i < KEYS; i++) {
+        int kl = snprintf(key, sizeof(key), "key%d", i);
+        int vl = snprintf(val, sizeof(val), "first-%d", i);
+        ASSERT(db_put(db, (uint8_t *)key, kl, (uint8_t *)val, vl) == 0, "Put failed");
+    }
+    memset(big, 'x', sizeof(big));
+    ASSERT(db_put(db, (uint8_t *)"big", 3, big, sizeof(big)) == 0, "Big put failed");
+
+    /* Overwrites, deletes and new keys after s1 leave what it reads alone. */
+    struct db_snapshot *s1 = db_snapshot_create(db);
+    ASSERT(s1 != NULL, "db_snapshot_create failed");
+    for (int i = 0; i < KEYS; i++) {
+        int kl = snprintf(key, sizeof(key), "key%d", i);
+        int vl = snprintf(val, sizeof(val), "second-%d", i);
+        if (i % 3 == 0) {
+            ASSERT(db_delete(db, (uint8_t *)key, kl) == 0, "Delete failed");
+        } else {
+            ASSERT(db_put(db, (uint8_t *)key, kl, (uint8_t *)val, vl) == 0, "Put failed");
+        }
+    }
+    memset(big, 'y', sizeof(big));
+    ASSERT(db_put(db, (uint8_t *)"big", 3, big, 100) == 0 &&
+           db_put(db, (uint8_t *)"fresh", 5, (uint8_t *)"new", 3) == 0, "Put failed");
+
+    struct db_snapshot *s2 = db_snapshot_create(db);
+    ASSERT(s2 != NULL, "db_snapshot_create failed");
+    ASSERT(db_put(db, (uint8_t *)"key1", 4, (uint8_t *)"third", 5) == 0 &&
+           db_delete(db, (uint8_t *)"fresh", 5) == 0, "Write failed");
+
+    uint8_t out[sizeof(big)];
+    for (int i = 0; i < KEYS; i++) {
+        int kl = snprintf(key, sizeof(key), "key%d", i);
+        int vl = snprintf(val, sizeof(val), "first-%d", i);
+        ASSERT(db_get_at(s1, (uint8_t *)key, kl, out, sizeof(out)) == vl &&
+               memcmp(out, val, vl) == 0, "s1 sees a later write");
+    }
+    ASSERT(db_get_at(s1, (uint8_t *)"big", 3, out, sizeof(out)) == sizeof(big) &&
+           out[0] == 'x' && out[sizeof(big) - 1] == 'x', "s1 lost the big value");
+    errno = 0;
+    ASSERT(db_get_at(s1, (uint8_t *)"fresh", 5, out, sizeof(out)) == -1 &&
+           errno == ENOENT, "s1 sees a key added later");
+    ASSERT(db_get_at(s2, (uint8_t *)"fresh", 5, out, sizeof(out)) == 3 &&
+           db_get_at(s2, (uint8_t *)"key1", 4, out, sizeof(out)) == 8 &&
+           memcmp(out, "second-1", 8) == 0, "s2 sees the wrong state");
+    errno = 0;
+    ASSERT(db_get_at(s2, (uint8_t *)"key3", 4, out, sizeof(out)) == -1 &&
+           errno == ENOENT, "s2 sees a deleted key");
+    ASSERT(db_get_into(db, (uint8_t *)"key1", 4, out, sizeof(out)) == 5,
+           "Current value changed");
+
+    /* Versions go once no open snapshot predates them. */
+    struct db_stats st;
+    ASSERT(db_stats(db, &st) == 0 && st.snapshots == 2 && st.version_bytes > sizeof(big),
+           "Versions not counted");
+    db_snapshot_release(s1);
+    ASSERT(db_stats(db, &st) == 0 && st.snapshots == 1 && st.version_bytes > 0 &&
+           st.version_bytes < sizeof(big), "s1's versions kept");
+    ASSERT(db_get_at(s2, (uint8_t *)"key1", 4, out, sizeof(out)) == 8,
+           "s2 lost its version");
+    db_snapshot_release(s2);
+    ASSERT(db_stats(db, &st) == 0 && st.snapshots == 0 && st.version_bytes == 0,
+           "Versions not freed");
+
+    /* A snapshot taken while batches run sees one of them whole, every time,
+     * with several readers taking and releasing theirs at once. */
+    enum { READERS = 3 };
+    struct snapshot_arg arg = {db, 3000, 0};
+    struct snapshot_arg readers[READERS];
+    pthread_t writer, reader_threads[READERS];
+    ASSERT(pthread_create(&writer, NULL, snapshot_writer, &arg) == 0,
+           "pthread_create failed");
+    for (int i = 0; i < READERS; i++) {
+        readers[i] = (struct snapshot_arg){db, 20, 0};
+        ASSERT(pthread_create(&reader_threads[i], NULL, snapshot_reader,
+                              &readers[i]) == 0, "pthread_create failed");
+    }
+    int torn = 0;
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(reader_threads[i], NULL);
+        torn += readers[i].errors;
+    }
+    pthread_join(writer, NULL);
+    ASSERT(arg.errors == 0, "Batch failed");
+    ASSERT(torn == 0, "Snapshot saw a torn or moving state");
+    ASSERT(db_stats(db, &st) == 0 && st.snapshots == 0 && st.version_bytes == 0,
+           "Versions left after the last release");
+    db_close(db);
+    unlink_db(path);
+
+    db = db_open_flags(path, DB_OPEN_LOG);
+    ASSERT(db != NULL, "Failed to open log database");
+    errno = 0;
+    ASSERT(db_snapshot_create(db) == NULL && errno == ENOTSUP,
+           "Log engine accepted a snapshot");
+    db_close(db);
+    unlink_log_db(path);
+
+    PASS();
+}
+
+struct change_log {
+    pthread_mutex_t lock;
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void collect_change(void *ctx, const void *records, size_t len) {
+    struct change_log *c = ctx;
+    pthread_mutex_lock(&c->lock);
+    if (c->len + len > c->cap) {
+        c->cap = 2 * (c->len + len);
+        c->buf = realloc(c->buf, c->cap);
+    }
+    memcpy(c->buf + c->len, records, len);
+    c->len += len;
+    pthread_mutex_unlock(&c->lock);
+}
+
+struct backup_arg {
+    struct db *db;
+    int errors;
+};
+
+/* Overwrites, deletes and batches over the keys test_backup loaded. */
+static void *backup_writer(void *arg) {
+    struct backup_arg *a = arg;
+    static uint8_t big[10000];
+    for (int i = 0; i < 3000; i++) {
+        char key[16], val[32];
+        int kl = snprintf(key, sizeof(key), "k%d", (i * 7) % 2000);
+        int vl = snprintf(val, sizeof(val), "round-%d", i);
+        if (i % 5 == 0) {
+            if (db_delete(a->db, (uint8_t *)key, kl) != 0 && errno != ENOENT) a->errors++;
+        } else if (i % 5 == 1) {
+            char other[16];
+            int ol = snprintf(other, sizeof(other), "n%d", i);
+            struct db_batch_op ops[2] = {
+                {DB_BATCH_PUT, (uint8_t *)key, (uint32_t)kl, (uint8_t *)val, (uint32_t)vl},
+                {DB_BATCH_PUT, (uint8_t *)other, (uint32_t)ol, (uint8_t *)val, (uint32_t)vl},
+            };
+            if (db_write_batch(a->db, ops, 2) != 0) a->errors++;
+        } else if (i % 50 == 2) {
+            memset(big, i & 0xff, sizeof(big));
+            if (db_put(a->db, (uint8_t *)key, kl, big, sizeof(big)) != 0) a->errors++;
+        } else if (db_put(a->db, (uint8_t *)key, kl, (uint8_t *)val, vl) != 0) {
+            a->errors++;
+        }
+    }
+    return NULL;
+}
+
+void test_backup(void) {
+    TEST("Online backup and change stream");
+
+    const char *path = "test_backup.db", *copy = "test_backup_copy.db";
+    unlink_db(path);
+    unlink_db(copy);
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    /* Enough pages that copying them takes a while. */
+    static uint8_t initial[1500];
+    for (int i = 0; i < 5000; i++) {
+        char key[16];
+        int kl = snprintf(key, sizeof(key), "k%d", i);
+        memset(initial, 'a' + i % 26, sizeof(initial));
+        ASSERT(db_put(db, (uint8_t *)key, kl, initial, sizeof(initial)) == 0, "Put failed");
+    }
+
+    /* Back up while writes run, with the hook catching every change. */
+    struct change_log log = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+    ASSERT(db_set_change_hook(db, collect_change, &log) == 0, "Hook not set");
+    struct backup_arg arg = {db, 0};
+    pthread_t writer;
+    ASSERT(pthread_create(&writer, NULL, backup_writer, &arg) == 0,
+           "pthread_create failed");
+    for (;;) {
+        pthread_mutex_lock(&log.lock);
+        size_t n = log.len;
+        pthread_mutex_unlock(&log.lock);
+        if (n > 4096) break;
+        sched_yield();
+    }
+    uint64_t lsn = 0;
+    ASSERT(db_backup(db, copy, &lsn) == 0 && lsn > 5000, "db_backup failed");
+    pthread_join(writer, NULL);
+    ASSERT(arg.errors == 0, "Write failed");
+    ASSERT(db_set_change_hook(db, NULL, NULL) == 0, "Hook not removed");
+
+    /* The copy plus the changes after its LSN is the leader. */
+    const uint8_t *p = log.buf, *end = log.buf + log.len;
+    while (p < end) {
+        struct wal_record_header h;
+        memcpy(&h, p, sizeof(h));
+        if (h.lsn > lsn) break;
+        p += sizeof(h) + h.key_len + h.val_len;
+    }
+    ASSERT(p < end, "Every change landed before the backup");
+    struct db *follower = db_open(copy);
+    ASSERT(follower != NULL, "Failed to open the backup");
+    ASSERT(db_apply_changes(follower, p, end - p) == 0, "db_apply_changes failed");
+    ASSERT(db_apply_changes(follower, p, sizeof(struct wal_record_header) - 1) == -1 &&
+           errno == EINVAL, "Accepted a torn record");
+
+    struct db_stats a, b;
+    ASSERT(db_stats(db, &a) == 0 && db_stats(follower, &b) == 0 && a.keys == b.keys,
+           "Key counts differ");
+    for (int i = 0; i < 8000; i++) {
+        char key[16];
+        uint8_t va[10000], vb[10000];
+        int kl = snprintf(key, sizeof(key), i < 5000 ? "k%d" : "n%d", i < 5000 ? i : i - 5000);
+        int64_t na = db_get_into(db, (uint8_t *)key, kl, va, sizeof(va));
+        int64_t nb = db_get_into(follower, (uint8_t *)key, kl, vb, sizeof(vb));
+        ASSERT(na == nb && (na < 0 || memcmp(va, vb, na) == 0), "Follower differs");
+    }
+    db_close(follower);
+    free(log.buf);
+    db_close(db);
+    unlink_db(path);
+    unlink_db(copy);
+
+    db = db_open_flags(path, DB_OPEN_LOG);
+    ASSERT(db != NULL, "Failed to open log database");
+    errno = 0;
+    ASSERT(db_backup(db, copy, NULL) == -1 && errno == ENOTSUP,
+           "Log engine accepted a backup");
+    db_close(db);
+    unlink_log_db(path);
+
+    PASS();
+}
+
+static int vacuum_check(struct db *db, int n, int step) {
+    for (int i = 0; i < n; i++) {
+        char key[16];
+        uint8_t val[6000];
+        int kl = snprintf(key, sizeof(key), "v%05d", i);
+        uint32_t len = i % 7 == 0 ? 5000 : 200;
+        int64_t got = db_get_into(db, (uint8_t *)key, kl, val, sizeof(val));
+        if (i % step != 0) {
+            if (got != -1) return 0;
+            continue;
+        }
+        if (got != len || val[0] != (uint8_t)i || val[len - 1] != (uint8_t)i) return 0;
+    }
+    return 1;
+}
+
+void test_vacuum(void) {
+    TEST("Vacuum shrinks the file");
+
+    const char *path = "test_vacuum.db";
+    const int n = 6000, step = 10;
+    for (int ordered = 0; ordered < 2; ordered++) {
+        unlink_db(path);
+        struct db *db = db_open_flags(path, ordered ? DB_OPEN_ORDERED : 0);
+        ASSERT(db != NULL, "Failed to open database");
+
+        /* Every seventh value goes to overflow pages. */
+        static uint8_t val[5000];
+        for (int i = 0; i < n; i++) {
+            char key[16];
+            int kl = snprintf(key, sizeof(key), "v%05d", i);
+            memset(val, (uint8_t)i, sizeof(val));
+            ASSERT(db_put(db, (uint8_t *)key, kl, val, i % 7 == 0 ? 5000 : 200) == 0,
+                   "Put failed");
+        }
+        ASSERT(db_checkpoint(db) == 0, "Checkpoint failed");
+        for (int i = 0; i < n; i++) {
+            char key[16];
+            int kl = snprintf(key, sizeof(key), "v%05d", i);
+            ASSERT(i % step == 0 || db_delete(db, (uint8_t *)key, kl) == 0, "Delete failed");
+        }
+
+        struct db_stats before, after;
+        struct stat st_before, st_after;
+        ASSERT(db_stats(db, &before) == 0 && stat(path, &st_before) == 0, "Stats failed");
+        /* A bounded, rate-limited pass moves a little; then the rest. */
+        ASSERT(db_vacuum(db, 8, 1000) >= 0, "Bounded vacuum failed");
+        int64_t cut = db_vacuum(db, 0, 0);
+        ASSERT(cut > 0, "Nothing was cut off");
+        ASSERT(db_stats(db, &after) == 0 && stat(path, &st_after) == 0, "Stats failed");
+        ASSERT(after.file_pages < before.file_pages / 2 &&
+               after.keys == before.keys && st_after.st_size < st_before.st_size / 2,
+               "File did not shrink");
+        ASSERT(vacuum_check(db, n, step), "Value lost in the vacuum");
+        ASSERT(db_verify(db) == 0, "Vacuum left a damaged page");
+        if (ordered) {
+            struct db_iter *it = db_iter_seek(db, NULL, 0);
+            ASSERT(it != NULL, "db_iter_seek failed");
+            const uint8_t *k, *v;
+            uint32_t kl, vl;
+            int count = 0, rc;
+            while ((rc = db_iter_next(it, &k, &kl, &v, &vl)) == 1) {
+                char want[16];
+                snprintf(want, sizeof(want), "v%05d", count++ * step);
+                ASSERT(kl == strlen(want) && memcmp(k, want, kl) == 0, "Iteration out of order");
+            }
+            db_iter_close(it);
+            ASSERT(rc == 0 && count == n / step, "Iteration lost keys");
+        }
+
+        /* Writes after the vacuum land in the shrunk file and survive reopening. */
+        memset(val, 0xEE, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)"after", 5, val, sizeof(val)) == 0, "Put failed");
+        db_close(db);
+        db = db_open_flags(path, ordered ? DB_OPEN_ORDERED : 0);
+        ASSERT(db != NULL, "Failed to reopen");
+        ASSERT(vacuum_check(db, n, step), "Value lost after reopening");
+        uint8_t buf[5000];
+        ASSERT(db_get_into(db, (uint8_t *)"after", 5, buf, sizeof(buf)) == 5000 &&
+               buf[4999] == 0xEE, "Write after vacuum lost");
+        db_close(db);
+        unlink_db(path);
+    }
+
+    struct db *db = db_open_flags(path, DB_OPEN_LOG);
+    ASSERT(db != NULL, "Failed to open log database");
+    errno = 0;
+    ASSERT(db_vacuum(db, 0, 0) == -1 && errno == ENOTSUP, "Log engine accepted a vacuum");
+    db_close(db);
+    unlink_log_db(path);
+
+    PASS();
+}
+
+/* Counts how many of the n keys with prefix are there, checking their values. */
+static int ttl_present(struct db *db, char prefix, int n) {
+    int present = 0;
+    for (int i = 0; i < n; i++) {
+        char key[16];
+        uint8_t val[6000];
+        int kl = snprintf(key, sizeof(key), "%c%05d", prefix, i);
+        int64_t got = db_get_into(db, (uint8_t *)key, kl, val, sizeof(val));
+        if (got > 0 && val[0] == (uint8_t)i && val[got - 1] == (uint8_t)i) {
+            present++;
+        } else if (got != -1 || errno != ENOENT) {
+            return -1;
+        }
+    }
+    return present;
+}
+
+void test_ttl(void) {
+    TEST("Keys with a TTL expire and are reclaimed");
+
+    const char *path = "test_ttl.db";
+    const int n = 1000;
+    const int modes[] = {0, DB_OPEN_ORDERED, DB_OPEN_COMPACT_INDEX | DB_OPEN_COMPRESS};
+    for (int m = 0; m < 3; m++) {
+        unlink_db(path);
+        struct db *db = db_open_flags(path, modes[m]);
+        ASSERT(db != NULL, "Failed to open database");
+
+        /* Short-lived keys, every tenth in overflow pages, next to keys that
+         * outlive the test and keys that never expire. */
+        static uint8_t val[5000];
+        for (int i = 0; i < n; i += 10) {
+            char key[16];
+            memset(val, (uint8_t)i, sizeof(val));
+            int kl = snprintf(key, sizeof(key), "l%05d", i);
+            ASSERT(db_put_ttl(db, (uint8_t *)key, kl, val, 200, 3600 * 1000) == 0,
+                   "TTL put failed");
+            kl = snprintf(key, sizeof(key), "p%05d", i);
+            ASSERT(db_put(db, (uint8_t *)key, kl, val, 200) == 0, "Put failed");
+        }
+        for (int i = 0; i < n; i++) {
+            char key[16];
+            memset(val, (uint8_t)i, sizeof(val));
+            int kl = snprintf(key, sizeof(key), "s%05d", i);
+            ASSERT(db_put_ttl(db, (uint8_t *)key, kl, val, i % 10 ? 200 : 5000, 100) == 0,
+                   "TTL put failed");
+        }
+        /* A plain put over a key with a TTL clears it. */
+        memset(val, 0, sizeof(val));
+        ASSERT(db_put(db, (uint8_t *)"s00000", 6, val, 200) == 0, "Put failed");
+        ASSERT(ttl_present(db, 'l', n) == n / 10, "Long-lived key missing");
+
+        /* The timers come back from the index snapshot. */
+        db_close(db);
+        db = db_open_flags(path, modes[m]);
+        ASSERT(db != NULL, "Failed to reopen");
+        usleep(150 * 1000);
+        ASSERT(ttl_present(db, 's', n) == 1, "Expired key still read");
+        ASSERT(ttl_present(db, 'l', n) == n / 10 && ttl_present(db, 'p', n) == n / 10,
+               "Unexpired key lost");
+        if (modes[m] & DB_OPEN_ORDERED) {
+            struct db_iter *it = db_iter_seek(db, (uint8_t *)"s", 1);
+            ASSERT(it != NULL, "db_iter_seek failed");
+            const uint8_t *k, *v;
+            uint32_t kl, vl;
+            ASSERT(db_iter_next(it, &k, &kl, &v, &vl) == 1 && kl == 6 &&
+                   memcmp(k, "s00000", 6) == 0, "Iteration saw an expired key");
+            ASSERT(db_iter_next(it, &k, &kl, &v, &vl) == 0, "Iteration saw an expired key");
+            db_iter_close(it);
+        }
+
+        struct db_stats before, after;
+        ASSERT(db_stats(db, &before) == 0, "Stats failed");
+        int64_t first = db_expire(db, 100);
+        ASSERT(first > 0 && first <= 100, "Bounded expire did not stop");
+        int64_t rest = db_expire(db, 0);
+        ASSERT(first + rest == n - 1, "Expire missed keys");
+        ASSERT(db_expire(db, 0) == 0, "Expire deleted twice");
+        ASSERT(db_stats(db, &after) == 0, "Stats failed");
+        ASSERT(after.keys == before.keys - (n - 1) &&
+               after.free_pages > before.free_pages,
+               "Expired pages not freed");
+        ASSERT(ttl_present(db, 'l', n) == n / 10 && db_verify(db) == 0,
+               "Expire damaged the store");
+        db_close(db);
+
+        /* After a crash the WAL replay sets the timers again. */
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) {
+            db = db_open_flags(path, modes[m]);
+            if (!db) _exit(1);
+            for (int i = 0; i < n; i += 10) {
+                char key[16];
+                int kl = snprintf(key, sizeof(key), "c%05d", i);
+                memset(val, (uint8_t)i, sizeof(val));
+                if (db_put_ttl(db, (uint8_t *)key, kl, val, 200, 100) != 0) _exit(1);
+            }
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+        db = db_open_flags(path, modes[m]);
+        ASSERT(db != NULL, "Failed to recover");
+        usleep(150 * 1000);
+        ASSERT(ttl_present(db, 'c', n) == 0, "Expired key came back");
+        ASSERT(db_expire(db, 0) == n / 10, "Recovered keys not expired");
+        ASSERT(ttl_present(db, 'l', n) == n / 10, "Unexpired key lost");
+        db_close(db);
+        unlink_db(path);
+    }
+
+    struct db *db = db_open_flags(path, DB_OPEN_LOG);
+    ASSERT(db != NULL, "Failed to open log database");
+    errno = 0;
+    ASSERT(db_put_ttl(db, (uint8_t *)"k", 1, (uint8_t *)"v", 1, 1000) == -1 &&
+           errno == ENOTSUP, "Log engine accepted a TTL");
+    ASSERT(db_put_ttl(db, (uint8_t *)"k", 1, (uint8_t *)"v", 1, 0) == 0, "Put failed");
+    errno = 0;
+    ASSERT(db_expire(db, 0) == -1 && errno == ENOTSUP, "Log engine accepted an expire");
+    db_close(db);
+    unlink_log_db(path);
+
+    PASS();
+}
+
+void test_ordered_iteration(void) {
+    TEST("Ordered iteration over the B+tree");
+
+    const char *path = "test_ordered.db";
+    unlink_db(path);
+
+    struct db *db = db_open_flags(path, DB_OPEN_ORDERED);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* Insert in a scrambled order so leaves split all over the tree. */
+    const uint32_t n = 20000;
+    for (uint32_t i = 0; i < n; i++) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "k%05u", (i * 7919) % n);
+        ASSERT(db_put(db, (uint8_t *)key, klen, (uint8_t *)key, klen) == 0, "db_put failed");
+    }
+    for (uint32_t i = 0; i < n; i += 3) {
+        char key[16];
+        int klen = snprintf(key, sizeof(key), "k%05u", i);
+        ASSERT(db_delete(db, (uint8_t *)key, klen) == 0, "db_delete failed");
+    }
+    uint32_t live = n - (n + 2) / 3;
+
+    ASSERT(iter_count(db, NULL, NULL) == (int)live, "Full scan wrong");
+    /* k01200..k01209 minus the multiples of 3. */
+    ASSERT(iter_count(db, "k0120", "k0120") == 6, "Prefix scan wrong");
+    ASSERT(iter_count(db, "k19999x", NULL) == 0, "Seek past the end not empty");
+
+    /* Writes while an iterator is open are seen or not, but nothing
+     * present throughout is skipped. */
+    struct db_iter *it = db_iter_seek(db, NULL, 0);
+    ASSERT(it != NULL, "db_iter_seek failed");
+    const uint8_t *key, *val;
+    uint32_t key_len, val_len;
+    uint32_t seen = 0;
+    while (db_iter_next(it, &key, &key_len, &val, &val_len) == 1) {
+        if (seen++ % 100 == 0) {
+            char extra[16];
+            int elen = snprintf(extra, sizeof(extra), "k%05ux", seen);
+            ASSERT(db_put(db, (uint8_t *)extra, elen, (uint8_t *)extra, elen) == 0, "db_put failed");
+        }
+    }
+    db_iter_close(it);
+    ASSERT(seen >= live, "Iterator skipped keys under concurrent writes");
+
+    uint32_t total = live + (live + 99) / 100;
+    db_close(db);
+
+    /* A clean close keeps the tree; a handle without the flag cannot
+     * iterate, and changes made through it are caught up on next open. */
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen failed");
+    ASSERT(db_iter_seek(db, NULL, 0) == NULL && errno == ENOTSUP, "Expected ENOTSUP");
+    ASSERT(db_put(db, (uint8_t *)"k00000", 6, (uint8_t *)"k00000", 6) == 0, "db_put failed");
+    db_close(db);
+
+    db = db_open_flags(path, DB_OPEN_ORDERED);
+    ASSERT(db != NULL, "Reopen failed");
+    ASSERT(iter_count(db, NULL, NULL) == (int)total + 1, "Tree not rebuilt after unordered writes");
+    ASSERT(iter_count(db, "k00000", "k00000") == 1, "Rebuilt tree lost keys");
+    uint8_t long_key[BTREE_MAX_KEY + 1] = { 0 };
+    ASSERT(db_put(db, long_key, sizeof(long_key), (uint8_t *)"v", 1) == -1 && errno == EFBIG,
+           "Over-long key accepted");
+    db_close(db);
+
+    db = db_open_flags(path, DB_OPEN_ORDERED);
+    ASSERT(db != NULL, "Reopen failed");
+    ASSERT(iter_count(db, NULL, NULL) == (int)total + 1, "Saved tree not reused intact");
+    db_close(db);
+
+    unlink_db(path);
+    PASS();
+}
+
+void test_ordered_crash(void) {
+    TEST("Ordered index is rebuilt after a crash");
+
+    const char *path = "test_ordered_crash.db";
+    unlink_db(path);
+
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        struct db *db = db_open_flags(path, DB_OPEN_ORDERED);
+        if (!db) _exit(1);
+        for (uint32_t i = 0; i < 3000; i++) {
+            char key[16];
+            int klen = snprintf(key, sizeof(key), "c%05u", (i * 37) % 3000);
+            if (db_put(db, (uint8_t *)key, klen, (uint8_t *)key, klen) != 0) _exit(1);
+            if (i == 1500 && db_checkpoint(db) != 0) _exit(1);
+        }
+        if (db_delete(db, (uint8_t *)"c00037", 6) != 0) _exit(1);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+
+    struct db *db = db_open_flags(path, DB_OPEN_ORDERED);
+    ASSERT(db != NULL, "Failed to recover");
+    ASSERT(iter_count(db, NULL, NULL) == 2999, "Recovered tree wrong");
+    ASSERT(iter_count(db, "c0003", "c0003") == 9, "Recovered prefix wrong");
+    db_close(db);
+
+    unlink_db(path);
+    PASS();
+}
+
+void test_log_engine(void) {
+    TEST("Log-structured engine");
+
+    const char *path = "test_log.db";
+    unlink_log_db(path);
+
+    struct db *db = db_open_flags(path, DB_OPEN_LOG);
+    ASSERT(db != NULL, "Failed to open database");
+    ASSERT(db_put(db, (uint8_t *)"a", 1, (uint8_t *)"one", 3) == 0, "db_put failed");
+    ASSERT(db_put(db, (uint8_t *)"b", 1, (uint8_t *)"two", 3) == 0, "db_put failed");
+    ASSERT(db_put(db, (uint8_t *)"a", 1, (uint8_t *)"uno!", 4) == 0, "Overwrite failed");
+    ASSERT(db_delete(db, (uint8_t *)"b", 1) == 0, "db_delete failed");
+    ASSERT(db_delete(db, (uint8_t *)"b", 1) == -1 && errno == ENOENT, "Double delete succeeded");
+
+    struct db_batch_op ops[] = {
+        { DB_BATCH_PUT, (uint8_t *)"c", 1, (uint8_t *)"three", 5 },
+        { DB_BATCH_PUT, (uint8_t *)"d", 1, (uint8_t *)"four", 4 },
+        { DB_BATCH_DELETE, (uint8_t *)"c", 1, NULL, 0 },
+    };
+    ASSERT(db_write_batch(db, ops, 3) == 0, "Batch failed");
+
+    uint8_t buf[16];
+    ASSERT(db_get_into(db, (uint8_t *)"a", 1, buf, sizeof(buf)) == 4 &&
+           memcmp(buf, "uno!", 4) == 0, "Wrong value");
+    ASSERT(db_get_range(db, (uint8_t *)"d", 1, 2, buf, sizeof(buf)) == 2 &&
+           memcmp(buf, "ur", 2) == 0, "Wrong range");
+    ASSERT(db_get_into(db, (uint8_t *)"c", 1, buf, sizeof(buf)) == -1 && errno == ENOENT,
+           "Batch delete lost");
+    struct db_ref ref;
+    ASSERT(db_get_ref(db, (uint8_t *)"a", 1, &ref) == -1 && errno == ENOTSUP, "Expected ENOTSUP");
+    db_close(db);
+
+    /* The engine is fixed when the file is created. */
+    ASSERT(db_open(path) == NULL && errno == EINVAL, "Opened a log file as pages");
+
+    /* Every write is durable once it returns, so a crash loses nothing. */
+    pid_t pid = fork();
+    ASSERT(pid >= 0, "fork failed");
+    if (pid == 0) {
+        db = db_open_flags(path, DB_OPEN_LOG);
+        if (!db) _exit(1);
+        if (db_put(db, (uint8_t *)"e", 1, (uint8_t *)"five", 4) != 0) _exit(1);
+        if (db_delete(db, (uint8_t *)"a", 1) != 0) _exit(1);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+
+    db = db_open_flags(path, DB_OPEN_LOG);
+    ASSERT(db != NULL, "Reopen failed");
+    uint32_t len;
+    uint8_t *val = db_get(db, (uint8_t *)"e", 1, &len);
+    ASSERT(val && len == 4 && memcmp(val, "five", 4) == 0, "Put lost in crash");
+    free(val);
+    ASSERT(db_get(db, (uint8_t *)"a", 1, &len) == NULL && errno == ENOENT, "Delete lost in crash");
+    ASSERT(db_get_into(db, (uint8_t *)"d", 1, buf, sizeof(buf)) == 4, "Batch lost on reopen");
+    db_close(db);
+
+    unlink_log_db(path);
+    PASS();
+}
+
+void test_log_compaction(void) {
+    TEST("Log compaction reclaims dead segments");
+
+    const char *path = "test_log_compact.db";
+    unlink_log_db(path);
+
+    struct db *db = db_open_flags(path, DB_OPEN_LOG);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* Write every key twice, each round filling more than a segment, so
+     * the first segments end up holding nothing live. */
+    enum { KEYS = 5000, BATCH = 250, VAL = 4000 };
+    uint8_t *vals = malloc((size_t)BATCH * VAL);
+    char (*keys)[16] = malloc(BATCH * sizeof(*keys));
+    struct db_batch_op *ops = malloc(BATCH * sizeof(*ops));
+    ASSERT(vals && keys && ops, "malloc failed");
+    for (uint32_t round = 0; round < 2; round++) {
+        for (uint32_t i = 0; i < KEYS; i += BATCH) {
+            for (uint32_t j = 0; j < BATCH; j++) {
+                ops[j].type = DB_BATCH_PUT;
+                ops[j].key = (uint8_t *)keys[j];
+                ops[j].key_len = snprintf(keys[j], sizeof(keys[j]), "k%u", i + j);
+                ops[j].val = vals + (size_t)j * VAL;
+                ops[j].val_len = VAL;
+                fill_pattern(vals + (size_t)j * VAL, VAL, (i + j) * 2 + round);
+            }
+            ASSERT(db_write_batch(db, ops, BATCH) == 0, "Batch failed");
+        }
+    }
+
+    char seg1[256];
+    snprintf(seg1, sizeof(seg1), "%s.seg.1", path);
+    struct stat st;
+    for (int i = 0; i < 100 && stat(seg1, &st) == 0; i++) {
+        usleep(100000);
+    }
+    ASSERT(stat(seg1, &st) != 0, "First segment never compacted");
+
+    uint8_t *out = malloc(VAL);
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < KEYS; i += 97) {
+            char key[16];
+            int klen = snprintf(key, sizeof(key), "k%u", i);
+            fill_pattern(vals, VAL, i * 2 + 1);
+            ASSERT(db_get_into(db, (uint8_t *)key, klen, out, VAL) == VAL &&
+                   memcmp(out, vals, VAL) == 0, "Value wrong after compaction");
+        }
+        db_close(db);
+        db = db_open_flags(path, DB_OPEN_LOG);
+        ASSERT(db != NULL, "Reopen failed");
+    }
+    db_close(db);
+
+    free(out);
+    free(vals);
+    free(keys);
+    free(ops);
+    unlink_log_db(path);
+    PASS();
+}
+
+void test_long_keys(void) {
+    TEST("Long keys reuse arena slots");
+
+    const char *path = "test_long_keys.db";
+    unlink_db(path);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+
+    /* Lengths from just past the inline limit to past the arena's largest
+     * slot, deleted and written again so freed slots get reused. */
+    enum { KEYS = 600 };
+    uint8_t key[2000];
+    for (int round = 0; round < 3; round++) {
+        for (uint32_t i = 0; i < KEYS; i++) {
+            uint32_t len = 17 + i * 3;
+            fill_pattern(key, len, i);
+            uint32_t v = i + round;
+            if (round == 1 && i % 2 == 0) {
+                ASSERT(db_delete(db, key, len) == 0, "db_delete failed");
+            } else {
+                ASSERT(db_put(db, key, len, (uint8_t *)&v, sizeof(v)) == 0, "db_put failed");
+            }
+        }
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < KEYS; i++) {
+            uint32_t len = 17 + i * 3;
+            fill_pattern(key, len, i);
+            uint32_t v, val_len;
+            uint8_t *val = db_get(db, key, len, &val_len);
+            v = i + 2;
+            ASSERT(val && val_len == sizeof(v) && memcmp(val, &v, sizeof(v)) == 0,
+                   "Long key lookup mismatch");
+            free(val);
+        }
+        db_close(db);
+        db = db_open(path);
+        ASSERT(db != NULL, "Reopen failed");
+    }
+    db_close(db);
+
+    unlink_db(path);
+    PASS();
+}
+
+/* Flips a byte in the middle of the first page of the given type, so a
+ * second call puts it back. Returns the page number, or 0 if none. */
+static uint64_t flip_page_byte(const char *path, uint32_t page_type) {
+    int fd = open(path, O_RDWR);
+    uint8_t page[DEFAULT_PAGE_SIZE];
+    uint64_t found = 0;
+    for (uint64_t p = 1; !found &&
+         pread(fd, page, DEFAULT_PAGE_SIZE, p * DEFAULT_PAGE_SIZE) == DEFAULT_PAGE_SIZE; p++) {
+        if (((struct page_header *)page)->page_type == page_type) {
+            page[DEFAULT_PAGE_SIZE / 2] ^= 0xff;
+            pwrite(fd, page, DEFAULT_PAGE_SIZE, p * DEFAULT_PAGE_SIZE);
+            found = p;
+        }
+    }
+    close(fd);
+    return found;
+}
+
+void test_page_checksums(void) {
+    TEST("Page checksums");
+
+    const char *path = "test_checksum.db";
+    unlink_db(path);
+
+    size_t big_len = 100000;
+    uint8_t *big = malloc(big_len);
+    uint8_t *out = malloc(big_len);
+    fill_pattern(big, big_len, 3);
+
+    struct db *db = db_open(path);
+    ASSERT(db != NULL, "Failed to open database");
+    ASSERT(db_put(db, (uint8_t *)"small", 5, (uint8_t *)"tiny", 4) == 0, "db_put failed");
+    ASSERT(db_put(db, (uint8_t *)"big", 3, big, big_len) == 0, "Large put failed");
+    ASSERT(db_checkpoint(db) == 0, "Checkpoint failed");
+    ASSERT(db_verify(db) == 0, "Clean file reported damage");
+    db_close(db);
+
+    /* A damaged overflow page fails the read and the scrub, and only
+     * ranges touching that page. */
+    ASSERT(flip_page_byte(path, PAGE_TYPE_OVERFLOW) != 0, "No overflow page");
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen failed");
+    ASSERT(db_verify(db) == 1, "Damaged overflow page not found");
+    errno = 0;
+    ASSERT(db_get_into(db, (uint8_t *)"big", 3, out, big_len) == -1 && errno == EIO,
+           "Damaged overflow page should fail with EIO");
+    ASSERT(db_get_range(db, (uint8_t *)"big", 3, big_len - 10, out, 10) == 10 &&
+           memcmp(out, big + big_len - 10, 10) == 0, "Undamaged range should read");
+    db_close(db);
+    flip_page_byte(path, PAGE_TYPE_OVERFLOW);
+
+    /* Likewise a data page, through the pool and through the mapping. */
+    ASSERT(flip_page_byte(path, PAGE_TYPE_DATA) != 0, "No data page");
+    for (int flags = 0; flags <= DB_OPEN_MMAP; flags += DB_OPEN_MMAP) {
+        db = db_open_flags(path, flags);
+        ASSERT(db != NULL, "Reopen failed");
+        ASSERT(db_verify(db) == 1, "Damaged data page not found");
+        uint32_t len;
+        errno = 0;
+        ASSERT(db_get(db, (uint8_t *)"small", 5, &len) == NULL && errno == EIO,
+               "Damaged data page should fail with EIO");
+        db_close(db);
+    }
+    flip_page_byte(path, PAGE_TYPE_DATA);
+
+    db = db_open(path);
+    ASSERT(db != NULL, "Reopen failed");
+    ASSERT(db_verify(db) == 0, "Restored file reported damage");
+    ASSERT(db_get_into(db, (uint8_t *)"big", 3, out, big_len) == (int64_t)big_len &&
+           memcmp(out, big, big_len) == 0, "Restored value mismatch");
+    db_close(db);
+
+    /* Without the index snapshot the scan skips a damaged page rather
+     * than failing the open, and what it held is lost. */
+    flip_page_byte(path, PAGE_TYPE_DATA);
+    unlink("test_checksum.db.idx");
+    db = db_open(path);
+    ASSERT(db != NULL, "Open with a damaged page should succeed");
+    struct db_stats st;
+    ASSERT(db_stats(db, &st) == 0 && st.recovery_scanned && st.recovery_bad_pages == 1,
+           "Damaged page not counted");
+    ASSERT(db_verify(db) == 1, "Damaged data page not found after the scan");
+    errno = 0;
+    ASSERT(db_get_into(db, (uint8_t *)"small", 5, out, big_len) == -1 && errno == ENOENT,
+           "Records on the damaged page should not be indexed");
+    db_close(db);
+
+    free(big);
+    free(out);
+    unlink_db(path);
+    PASS();
+}
+
+/* Reads back the keys test_open_options wrote: value i is i's size. */
+static int options_present(struct db *db, int n, int deleted, int extra) {
+    static uint8_t out[200000];
+    int found = 0;
+    for (int i = 0; i < n + extra; i++) {
+        char key[16];
+        int kl = snprintf(key, sizeof(key), "o%05d", i);
+        uint32_t want = i == 7 ? 150000 : i % 3 ? 100 : 9000;
+        int64_t got = db_get_into(db, (uint8_t *)key, kl, out, sizeof(out));
+        if (deleted && i < n && i % 4 == 0) {
+            if (got != -1 || errno != ENOENT) {
+                return -1;
+            }
+            continue;
+        }
+        if (got != (int64_t)want || out[0] != (uint8_t)i || out[want - 1] != (uint8_t)i) {
+            return -1;
+        }
+        found++;
+    }
+    return found;
+}
+
+void test_open_options(void) {
+    TEST("Open options set the page size, cache size and sync policy");
+
+    const char *path = "test_opts.db";
+    unlink_db(path);
+    const uint32_t bad_sizes[] = {2048, 3000, 65536};
+    for (int i = 0; i < 3; i++) {
+        struct db_options opts = { .page_size = bad_sizes[i] };
+        errno = 0;
+        ASSERT(db_open_opts(path, &opts) == NULL && errno == EINVAL,
+               "Bad page size accepted");
+    }
+    struct db_options bad_sync = { .sync = 7 };
+    errno = 0;
+    ASSERT(db_open_opts(path, &bad_sync) == NULL && errno == EINVAL, "Bad sync accepted");
+    ASSERT(db_open_opts(path, NULL) == NULL && errno == EINVAL, "NULL options accepted");
+
+    const struct db_options configs[] = {
+        { 0, 16384, 0, DB_SYNC_NONE },
+        { DB_OPEN_ORDERED, 32768, 64 * 32768, DB_SYNC_FULL },
+        { DB_OPEN_DIRECT, 8192, 64 * 8192, DB_SYNC_DATA },
+        { DB_OPEN_COMPRESS | DB_OPEN_COMPACT_INDEX, 32768, 0, DB_SYNC_DATA },
+    };
+    const int n = 2000;
+    static uint8_t val[150000];
+    for (int c = 0; c < 4; c++) {
+        const struct db_options *o = &configs[c];
+        unlink_db(path);
+        struct db *db = db_open_opts(path, o);
+        ASSERT(db != NULL, "Failed to open with options");
+        ASSERT(db->page_size == o->page_size && db->header.page_size == o->page_size,
+               "Page size not set");
+
+        /* Records too big for a 4K page stay inline in a larger one. */
+        for (int i = 0; i < n; i++) {
+            char key[16];
+            int kl = snprintf(key, sizeof(key), "o%05d", i);
+            uint32_t len = i == 7 ? 150000 : i % 3 ? 100 : 9000;
+            memset(val, (uint8_t)i, len);
+            ASSERT(db_put(db, (uint8_t *)key, kl, val, len) == 0, "Put failed");
+        }
+        for (int i = 0; i < n; i += 4) {
+            char key[16];
+            int kl = snprintf(key, sizeof(key), "o%05d", i);
+            ASSERT(db_delete(db, (uint8_t *)key, kl) == 0, "Delete failed");
+        }
+        struct db_stats st;
+        ASSERT(db_stats(db, &st) == 0, "db_stats failed");
+        ASSERT((st.wal_syncs == 0) == (o->sync == DB_SYNC_NONE), "Sync policy not applied");
+        if (o->page_size >= 16384) {
+            ASSERT(db->header.next_free_page < (uint64_t)n * 2 / 3,
+                   "Large records not kept inline");
+        }
+        ASSERT(options_present(db, n, 1, 0) == n - n / 4, "Value lost");
+        if (o->flags & DB_OPEN_ORDERED) {
+            struct db_iter *it = db_iter_seek(db, NULL, 0);
+            ASSERT(it != NULL, "Iterator failed");
+            const uint8_t *k, *v;
+            uint32_t kl, vl;
+            int count = 0;
+            while (db_iter_next(it, &k, &kl, &v, &vl) == 1) {
+                count++;
+            }
+            db_iter_close(it);
+            ASSERT(count == n - n / 4, "Iterator missed keys");
+        }
+        db_close(db);
+
+        /* The file keeps its page size; only a matching one may be asked
+         * for. */
+        struct db_options other = { .flags = o->flags, .page_size = DEFAULT_PAGE_SIZE };
+        errno = 0;
+        ASSERT(db_open_opts(path, &other) == NULL && errno == EINVAL,
+               "Opened with another page size");
+        db = db_open_flags(path, o->flags);
+        ASSERT(db != NULL && db->page_size == o->page_size, "Reopen lost the page size");
+        ASSERT(options_present(db, n, 1, 0) == n - n / 4, "Value lost after reopen");
+        ASSERT(db_verify(db) == 0, "Pages damaged");
+        db_close(db);
+
+        /* A crash is recovered from the WAL into the larger pages. */
+        pid_t pid = fork();
+        ASSERT(pid >= 0, "fork failed");
+        if (pid == 0) {
+            struct db *child = db_open_opts(path, o);
+            if (!child) _exit(1);
+            for (int i = n; i < n + 100; i++) {
+                char key[16];
+                int kl = snprintf(key, sizeof(key), "o%05d", i);
+                uint32_t len = i % 3 ? 100 : 9000;
+                memset(val, (uint8_t)i, len);
+                if (db_put(child, (uint8_t *)key, kl, val, len) != 0) _exit(1);
+            }
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Child failed");
+        db = db_open_opts(path, o);
+        ASSERT(db != NULL, "Failed to recover");
+        ASSERT(options_present(db, n, 1, 100) == n - n / 4 + 100, "Recovered writes lost");
+        db_close(db);
+        unlink_db(path);
+    }
 
     PASS();
 }
@@ -306,6 +3032,42 @@ int main(void) {
     test_delete();
     test_persistence();
     test_free_list_reuse();
+    test_free_map_reload();
+    test_small_records_share_page();
+    test_slot_space_reuse();
+    test_index_growth();
+    test_index_snapshot_reload();
+    test_stale_snapshot_rescan();
+    test_parallel_recovery_scan();
+    test_wal_crash_recovery();
+    test_write_batch();
+    test_write_batch_crash();
+    test_get_into();
+    test_get_ref();
+    test_pool_eviction();
+    test_pool_exhaustion();
+    test_mmap_reads();
+    test_concurrent_access();
+    test_large_values();
+    test_large_value_crash();
+    test_multi_get();
+    test_async_io();
+    test_direct_io();
+    test_stats();
+    test_compression();
+    test_compact_index();
+    test_key_hash();
+    test_snapshots();
+    test_backup();
+    test_vacuum();
+    test_ttl();
+    test_open_options();
+    test_ordered_iteration();
+    test_ordered_crash();
+    test_log_engine();
+    test_log_compaction();
+    test_page_checksums();
+    test_long_keys();
 
     printf("\n=== Results ===\n");
     printf(GREEN "Passed: %d" RESET "\n", tests_passed);
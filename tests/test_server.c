@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+#include "kvstore.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Tests for server/kvstore_server.c. The server is built into this program
+ * with its main renamed and run on a thread, listening on a Unix socket,
+ * and the store calls it makes are counted per shard on the way through. */
+
+/* ANSI color codes for output */
+#define GREEN "\033[32m"
+#define RED "\033[31m"
+#define RESET "\033[0m"
+
+static int tests_passed = 0;
+static int tests_failed = 0;
+
+#define TEST(name) \
+    printf("Running: %s ... ", name); \
+    fflush(stdout);
+
+#define PASS() \
+    do { \
+        printf(GREEN "PASS" RESET "\n"); \
+        tests_passed++; \
+    } while(0)
+
+#define FAIL(msg) \
+    do { \
+        printf(RED "FAIL" RESET ": %s\n", msg); \
+        tests_failed++; \
+    } while(0)
+
+#define ASSERT(cond, msg) \
+    if (!(cond)) { \
+        FAIL(msg); \
+        return; \
+    }
+
+/* Calls the server made into one shard's handle. */
+struct shard_calls {
+    struct db *db;
+    int multi_gets;
+    int write_batches;
+    int puts;
+};
+
+#define MAX_SHARDS 16
+
+static struct shard_calls calls[MAX_SHARDS];
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct shard_calls *calls_of(struct db *db) {
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        if (calls[i].db == db || !calls[i].db) {
+            calls[i].db = db;
+            return &calls[i];
+        }
+    }
+    abort();
+}
+
+static void calls_reset(void) {
+    pthread_mutex_lock(&calls_lock);
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        calls[i].multi_gets = calls[i].write_batches = calls[i].puts = 0;
+    }
+    pthread_mutex_unlock(&calls_lock);
+}
+
+static int64_t counted_multi_get(struct db *db, const struct db_key *keys,
+                                 size_t count, uint8_t *buf, size_t cap,
+                                 struct db_get_result *results) {
+    pthread_mutex_lock(&calls_lock);
+    calls_of(db)->multi_gets++;
+    pthread_mutex_unlock(&calls_lock);
+    return db_multi_get(db, keys, count, buf, cap, results);
+}
+
+static int counted_write_batch(struct db *db, const struct db_batch_op *ops,
+                               size_t count) {
+    pthread_mutex_lock(&calls_lock);
+    calls_of(db)->write_batches++;
+    pthread_mutex_unlock(&calls_lock);
+    return db_write_batch(db, ops, count);
+}
+
+static int counted_put(struct db *db, const uint8_t *key, uint32_t key_len,
+                       const uint8_t *val, uint32_t val_len) {
+    pthread_mutex_lock(&calls_lock);
+    calls_of(db)->puts++;
+    pthread_mutex_unlock(&calls_lock);
+    return db_put(db, key, key_len, val, val_len);
+}
+
+#define db_multi_get counted_multi_get
+#define db_write_batch counted_write_batch
+#define db_put counted_put
+#define main kvstore_server_main
+#include "../server/kvstore_server.c"
+#undef main
+#undef db_put
+#undef db_write_batch
+#undef db_multi_get
+
+#define SOCK_PATH "./test_server.sock"
+#define DB_PATH   "test_server.db"
+#define SHARDS    4
+
+static pthread_t server_thread;
+
+static void *server_run(void *arg) {
+    (void)arg;
+    char *argv[] = { "kvstore_server", "-d", DB_PATH, "-l", SOCK_PATH,
+                     "-t", "2", "-s", "4", "-y", "none", NULL };
+    optind = 1;
+    kvstore_server_main(11, argv);
+    return NULL;
+}
+
+static void unlink_shards(void) {
+    static const char *suffixes[] = { "", ".idx", ".idx.tmp", ".wal" };
+    char buf[256];
+    for (int i = 0; i <= SHARDS; i++) {
+        for (size_t j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); j++) {
+            snprintf(buf, sizeof(buf), "%s.%d%s", DB_PATH, i, suffixes[j]);
+            unlink(buf);
+        }
+    }
+    unlink(SOCK_PATH);
+}
+
+/* Starts the server and connects to it once it listens. */
+static int server_start(void) {
+    unlink_shards();
+    if (pthread_create(&server_thread, NULL, server_run, NULL) != 0) {
+        return -1;
+    }
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    strcpy(sun.sun_path, SOCK_PATH);
+    for (int tries = 0; tries < 5000; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(1000);
+    }
+    return -1;
+}
+
+static void server_stop(int fd) {
+    close(fd);
+    on_signal(SIGTERM);
+    pthread_join(server_thread, NULL);
+    unlink_shards();
+}
+
+/* Requests queued to go out in one write. */
+struct pipeline {
+    uint8_t data[1 << 16];
+    size_t len;
+};
+
+static void add_request(struct pipeline *p, uint32_t op, const char *key,
+                        uint32_t key_len, const char *val) {
+    struct request r = { op, key_len, val ? (uint32_t)strlen(val) : 0 };
+    memcpy(p->data + p->len, &r, sizeof(r));
+    memcpy(p->data + p->len + sizeof(r), key, key_len);
+    memcpy(p->data + p->len + sizeof(r) + key_len, val, r.val_len);
+    p->len += sizeof(r) + key_len + r.val_len;
+}
+
+static void add(struct pipeline *p, uint32_t op, const char *key, const char *val) {
+    add_request(p, op, key, (uint32_t)strlen(key), val);
+}
+
+static int send_all(int fd, const struct pipeline *p) {
+    for (size_t done = 0; done < p->len;) {
+        ssize_t n = write(fd, p->data + done, p->len - done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = read(fd, (uint8_t *)buf + done, len - done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/* Reads one response and checks its status and value (NULL for none). */
+static int expect(int fd, uint32_t status, const char *val) {
+    struct response r;
+    char got[256];
+    size_t want = val ? strlen(val) : 0;
+    if (read_all(fd, &r, sizeof(r)) != 0 || r.val_len > sizeof(got) ||
+        read_all(fd, got, r.val_len) != 0) {
+        return 0;
+    }
+    return r.status == status && r.val_len == want && memcmp(got, val, want) == 0;
+}
+
+static unsigned key_shard(const char *key, uint32_t key_len) {
+    struct server srv = { .nshards = SHARDS };
+    return shard_of(&srv, (const uint8_t *)key, key_len);
+}
+
+/* Handles with calls since the last reset, each made no more than max of
+ * the kind counted at offset field. */
+static int shards_called(size_t field, int max) {
+    int n = 0;
+    pthread_mutex_lock(&calls_lock);
+    for (int i = 0; i < MAX_SHARDS && calls[i].db; i++) {
+        int got = *(int *)((char *)&calls[i] + field);
+        if (got > max) {
+            n = -1;
+            break;
+        }
+        n += got > 0;
+    }
+    pthread_mutex_unlock(&calls_lock);
+    return n;
+}
+
+static int total_puts(void) {
+    int n = 0;
+    pthread_mutex_lock(&calls_lock);
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        n += calls[i].puts;
+    }
+    pthread_mutex_unlock(&calls_lock);
+    return n;
+}
+
+/* ============================================================================
+ * Test Cases
+ * ============================================================================
+ */
+
+void test_pipelined_order(int fd) {
+    TEST("Pipelined requests are answered in order");
+
+    struct pipeline p = { .len = 0 };
+    add(&p, REQ_PUT, "alpha", "1");
+    add(&p, REQ_PUT, "beta", "22");
+    add(&p, REQ_GET, "alpha", NULL);
+    add(&p, REQ_GET, "missing", NULL);
+    add(&p, REQ_DELETE, "alpha", NULL);
+    add(&p, REQ_GET, "alpha", NULL);
+    add(&p, REQ_DELETE, "alpha", NULL);
+    add(&p, REQ_PUT, "gamma", "333");
+    add(&p, REQ_GET, "beta", NULL);
+    add(&p, REQ_GET, "gamma", NULL);
+    ASSERT(send_all(fd, &p) == 0, "send failed");
+
+    ASSERT(expect(fd, ST_OK, NULL), "put alpha");
+    ASSERT(expect(fd, ST_OK, NULL), "put beta");
+    ASSERT(expect(fd, ST_OK, "1"), "get alpha");
+    ASSERT(expect(fd, ST_NOT_FOUND, NULL), "get missing");
+    ASSERT(expect(fd, ST_OK, NULL), "delete alpha");
+    ASSERT(expect(fd, ST_NOT_FOUND, NULL), "get deleted alpha");
+    ASSERT(expect(fd, ST_NOT_FOUND, NULL), "delete deleted alpha");
+    ASSERT(expect(fd, ST_OK, NULL), "put gamma");
+    ASSERT(expect(fd, ST_OK, "22"), "get beta");
+    ASSERT(expect(fd, ST_OK, "333"), "get gamma");
+
+    PASS();
+}
+
+void test_batched_puts(int fd) {
+    TEST("A run of puts is one db_write_batch per shard");
+
+    enum { KEYS = 64 };
+    struct pipeline p = { .len = 0 };
+    char key[16];
+    int touched[SHARDS] = { 0 }, nshards = 0;
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "put-%d", i);
+        add(&p, REQ_PUT, key, key);
+        unsigned s = key_shard(key, (uint32_t)strlen(key));
+        nshards += !touched[s];
+        touched[s] = 1;
+    }
+    calls_reset();
+    ASSERT(send_all(fd, &p) == 0, "send failed");
+    for (int i = 0; i < KEYS; i++) {
+        ASSERT(expect(fd, ST_OK, NULL), "put failed");
+    }
+    ASSERT(shards_called(offsetof(struct shard_calls, write_batches), 1) == nshards,
+           "Expected one batch on each shard written");
+    ASSERT(total_puts() == 0, "Puts should not fall back to db_put");
+
+    PASS();
+}
+
+void test_coalesced_gets(int fd) {
+    TEST("A run of gets is one db_multi_get per shard");
+
+    enum { KEYS = 64 };
+    struct pipeline p = { .len = 0 };
+    char key[16];
+    int touched[SHARDS] = { 0 }, nshards = 0;
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "put-%d", i);
+        add(&p, REQ_GET, key, NULL);
+        unsigned s = key_shard(key, (uint32_t)strlen(key));
+        nshards += !touched[s];
+        touched[s] = 1;
+    }
+    add(&p, REQ_GET, "put-missing", NULL);
+    calls_reset();
+    ASSERT(send_all(fd, &p) == 0, "send failed");
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "put-%d", i);
+        ASSERT(expect(fd, ST_OK, key), "Wrong value for a coalesced get");
+    }
+    ASSERT(expect(fd, ST_NOT_FOUND, NULL), "Missing key should be NOT_FOUND");
+    ASSERT(nshards == SHARDS, "Keys should cover every shard");
+    ASSERT(shards_called(offsetof(struct shard_calls, multi_gets), 1) == nshards,
+           "Expected one db_multi_get on each shard read");
+
+    PASS();
+}
+
+void test_put_too_big(int fd) {
+    TEST("A too big put fails alone, the batch falls back to db_put");
+
+    /* Three keys routed to one shard, so they share one batch. */
+    char good1[16], good2[16];
+    static char big[5000];
+    memset(big, 'b', sizeof(big));
+    unsigned shard = key_shard(big, sizeof(big));
+    int found = 0;
+    for (int i = 0; found < 2; i++) {
+        char *key = found == 0 ? good1 : good2;
+        snprintf(key, 16, "good-%d", i);
+        found += key_shard(key, (uint32_t)strlen(key)) == shard;
+    }
+
+    struct pipeline p = { .len = 0 };
+    add(&p, REQ_PUT, good1, "one");
+    add_request(&p, REQ_PUT, big, sizeof(big), "v");
+    add(&p, REQ_PUT, good2, "two");
+    calls_reset();
+    ASSERT(send_all(fd, &p) == 0, "send failed");
+    ASSERT(expect(fd, ST_OK, NULL), "First put should succeed");
+    ASSERT(expect(fd, ST_TOO_BIG, NULL), "Big key should be TOO_BIG");
+    ASSERT(expect(fd, ST_OK, NULL), "Last put should succeed");
+    ASSERT(shards_called(offsetof(struct shard_calls, write_batches), 1) == 1,
+           "Expected one batch");
+    ASSERT(total_puts() == 3, "Expected the batch retried a put at a time");
+
+    p.len = 0;
+    add(&p, REQ_GET, good1, NULL);
+    add(&p, REQ_GET, good2, NULL);
+    ASSERT(send_all(fd, &p) == 0, "send failed");
+    ASSERT(expect(fd, ST_OK, "one"), "First put lost");
+    ASSERT(expect(fd, ST_OK, "two"), "Last put lost");
+
+    PASS();
+}
+
+int main(void) {
+    printf("=== KVStore Server Test Suite ===\n\n");
+
+    int fd = server_start();
+    if (fd < 0) {
+        printf(RED "Server did not start" RESET "\n");
+        return 1;
+    }
+
+    test_pipelined_order(fd);
+    test_batched_puts(fd);
+    test_coalesced_gets(fd);
+    test_put_too_big(fd);
+
+    server_stop(fd);
+
+    printf("\n=== Results ===\n");
+    printf(GREEN "Passed: %d" RESET "\n", tests_passed);
+    if (tests_failed > 0) {
+        printf(RED "Failed: %d" RESET "\n", tests_failed);
+    }
+
+    return tests_failed > 0 ? 1 : 0;
+}